@@ -0,0 +1,823 @@
+#include "stdafx.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <chrono>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "checksum.h"
+#include "probe_cache.h"
+#include "libch341prog.h"
+
+/*
+ * Throughput of the transport and flash engine against the built-in
+ * emulator, and of the CPU kernels under them, as JSON. Every figure is
+ * the best of --repeat runs, the least noisy one to compare. The emulated
+ * chip takes typical page program and block erase times, so those figures
+ * are not noise around zero, and every run lasts long enough to be timed.
+ * With --compare a stored result is the baseline, any figure worse by
+ * more than --threshold percent is a regression, a result the baseline
+ * lacks is an error.
+ */
+
+#define BENCH_DEFAULT_SIZE			(1 << 20)
+#define BENCH_DEFAULT_REPEAT		3
+#define BENCH_DEFAULT_THRESHOLD		10.0
+#define BENCH_KERNEL_SIZE			(1 << 20)
+#define BENCH_KERNEL_MIN_US			200000		/* each kernel run lasts at least this long */
+#define BENCH_FLASH_MIN_US			500000		/* and each read or verify run this long */
+#define BENCH_PROG_US				PAGE_PROG_DEFAULT_US
+#define BENCH_ERASE_MS				50			/* per erase command, between a sector and a 64KiB block */
+#define BENCH_JSON_DEPTH			16
+#define BENCH_LOOKUPS				4096
+#define BENCH_MAX_RESULTS			16
+#define BENCH_NAME_LENGTH			32
+#define BENCH_SPEC_LENGTH			128
+#define BENCH_BLOCK_SIZE			0x10000
+
+typedef std::chrono::steady_clock bench_clock;
+
+typedef struct _bench_result
+{
+	char name[BENCH_NAME_LENGTH];
+	const char *unit;
+	double value;
+	double baseline;
+	bool has_baseline;
+	bool regression;
+} bench_result;
+
+typedef struct _bench_config
+{
+	unsigned int size;
+	unsigned int latency_us;
+	unsigned int repeat;
+	double threshold;
+	const char *output;
+	const char *baseline;
+} bench_config;
+
+static bench_result results[BENCH_MAX_RESULTS];
+static unsigned int result_count;
+
+/* Keeps the compiler from dropping kernels whose results are not used otherwise */
+static volatile unsigned int bench_sink;
+
+static void ShowUsage(void)
+{
+	puts(
+		"Usage: ch341bench [options]\n"
+		"\n"
+		"Options:\n"
+		"  --size <n>[K|M]       flash region read, programmed and erased, default 1M\n"
+		"  --latency <us>        time every emulated USB transfer takes, default 0\n"
+		"  --repeat <n>          runs of each benchmark, the best counts, default 3\n"
+		"  --output <file>       write the JSON result there instead of to stdout\n"
+		"  --compare <file>      flag results worse than this earlier output\n"
+		"  --threshold <percent> slowdown counted as a regression, default 10\n"
+		"\n"
+		"Exits with 1 on failure or if the baseline lacks a result, 2 if a result regressed.");
+}
+
+static unsigned long long BenchElapsedUs(bench_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - start).count();
+}
+
+static void BenchReport(const char *name, const char *unit, double value)
+{
+	bench_result *r;
+	unsigned int i;
+
+	for (i = 0; i < result_count; i++)
+		if (!strcmp(results[i].name, name))
+			break;
+
+	if (i == result_count)
+	{
+		if (result_count == BENCH_MAX_RESULTS)
+			return;
+
+		r = &results[result_count++];
+		snprintf(r->name, sizeof (r->name), "%s", name);
+		r->unit = unit;
+		r->value = value;
+		return;
+	}
+
+	if (value > results[i].value)
+		results[i].value = value;
+}
+
+static double BenchMiBps(unsigned long long bytes, unsigned long long us)
+{
+	return us ? (double) bytes / (1 << 20) / (us / 1e6) : 0;
+}
+
+static void BenchLog(int level, const char *msg, void *arg)
+{
+	if (level != CH341PROG_LOG_INFO)
+		fputs(msg, stderr);
+}
+
+static bool BenchFlashRun(ch341prog_session *s, const bench_config *cfg, const unsigned char *data, unsigned char *buf)
+{
+	bench_clock::time_point start;
+	unsigned long long bytes, us;
+	int ret;
+
+	start = bench_clock::now();
+	ret = Ch341ProgErase(s, 0, cfg->size);
+	if (ret)
+		goto fail;
+	BenchReport("erase", "MiB/s", BenchMiBps(cfg->size, BenchElapsedUs(start)));
+
+	start = bench_clock::now();
+	ret = Ch341ProgWrite(s, 0, data, cfg->size, 0);
+	if (ret)
+		goto fail;
+	BenchReport("program", "MiB/s", BenchMiBps(cfg->size, BenchElapsedUs(start)));
+
+	start = bench_clock::now();
+	bytes = 0;
+	do
+	{
+		ret = Ch341ProgRead(s, 0, buf, cfg->size);
+		if (ret)
+			goto fail;
+		bytes += cfg->size;
+	} while ((us = BenchElapsedUs(start)) < BENCH_FLASH_MIN_US);
+	BenchReport("read", "MiB/s", BenchMiBps(bytes, us));
+
+	if (memcmp(buf, data, cfg->size))
+	{
+		fprintf(stderr, "Error: data read back differs from what was programmed\n");
+		return false;
+	}
+
+	start = bench_clock::now();
+	bytes = 0;
+	do
+	{
+		ret = Ch341ProgVerify(s, 0, data, cfg->size, NULL);
+		if (ret)
+			goto fail;
+		bytes += cfg->size;
+	} while ((us = BenchElapsedUs(start)) < BENCH_FLASH_MIN_US);
+	BenchReport("verify", "MiB/s", BenchMiBps(bytes, us));
+
+	return true;
+
+fail:
+	fprintf(stderr, "Error: %s: %s\n", Ch341ProgStrError(ret), Ch341ProgLastError(s));
+	return false;
+}
+
+static bool BenchFlash(const bench_config *cfg)
+{
+	char spec[BENCH_SPEC_LENGTH];
+	unsigned char *data, *buf;
+	ch341prog_session *s;
+	unsigned int chip, i;
+	bool ret = true;
+	int err;
+
+	/* The emulated chip is a power of two of at least 1MiB */
+	for (chip = 1 << 20; chip < cfg->size; chip <<= 1)
+		;
+
+	snprintf(spec, sizeof (spec), "emu:size=%u,latency=%u,prog=%u,erase=%u", chip, cfg->latency_us, BENCH_PROG_US,
+		BENCH_ERASE_MS);
+
+	err = Ch341ProgOpen(&s, spec, 0);
+	if (err)
+	{
+		fprintf(stderr, "Error: unable to open %s: %s\n", spec, Ch341ProgLastError(NULL));
+		return false;
+	}
+
+	data = (unsigned char *) malloc(cfg->size);
+	buf = (unsigned char *) malloc(cfg->size);
+	if (!data || !buf)
+	{
+		fprintf(stderr, "Error: out of memory\n");
+		ret = false;
+		goto out;
+	}
+
+	/* Random enough that no page is left out as blank */
+	for (i = 0; i < cfg->size; i++)
+		data[i] = (unsigned char) ((i * 2654435761u) >> 24);
+
+	for (i = 0; ret && i < cfg->repeat; i++)
+		ret = BenchFlashRun(s, cfg, data, buf);
+
+out:
+	free(data);
+	free(buf);
+	Ch341ProgClose(s);
+
+	return ret;
+}
+
+static void BenchCrc32(const unsigned char *data, unsigned int len)
+{
+	bench_sink = Crc32Update(0, data, len);
+}
+
+static void BenchCrc32c(const unsigned char *data, unsigned int len)
+{
+	bench_sink = Crc32cUpdate(0, data, len);
+}
+
+static void BenchSha256(const unsigned char *data, unsigned int len)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	sha256_ctx ctx;
+
+	Sha256Init(&ctx);
+	Sha256Update(&ctx, data, len);
+	Sha256Final(&ctx, digest);
+
+	bench_sink = digest[0];
+}
+
+static unsigned char bench_out[(BENCH_KERNEL_SIZE / (CH341_PACKET_LENGTH - 1) + 1) * CH341_PACKET_LENGTH];
+
+static void BenchBitReverse(const unsigned char *data, unsigned int len)
+{
+	CH341EncodeSPI(data, bench_out, len);
+	bench_sink = bench_out[len - 1];
+}
+
+/* The packets of one bulk write each, as the transport sends a buffer */
+static void BenchFraming(const unsigned char *data, unsigned int len)
+{
+	unsigned int pos, out = 0;
+
+	for (pos = 0; pos < len; out += CH341_PACKET_LENGTH)
+		pos += CH341FrameSPI(data + pos, false, bench_out + out, len - pos);
+
+	bench_sink = bench_out[0];
+}
+
+static void BenchKernel(const char *name, const bench_config *cfg, const unsigned char *data,
+	void (*kernel)(const unsigned char *data, unsigned int len))
+{
+	bench_clock::time_point start;
+	unsigned long long bytes, us;
+	unsigned int i;
+
+	for (i = 0; i < cfg->repeat; i++)
+	{
+		start = bench_clock::now();
+		bytes = 0;
+
+		do
+		{
+			kernel(data, BENCH_KERNEL_SIZE);
+			bytes += BENCH_KERNEL_SIZE;
+		} while ((us = BenchElapsedUs(start)) < BENCH_KERNEL_MIN_US);
+
+		BenchReport(name, "MiB/s", BenchMiBps(bytes, us));
+	}
+}
+
+static void BenchIdLookup(const bench_config *cfg)
+{
+	/* Common parts, parts with an extended ID and IDs of nothing known */
+	static const unsigned int ids[] = {0xef4018, 0xef4017, 0xc22018, 0xc84016, 0x202016, 0x1f4701, 0xbf2541, 0x9d6017,
+		0x123456, 0xffffff, 0x000000, 0xef7019};
+	bench_clock::time_point start;
+	unsigned long long lookups, us;
+	unsigned int i, j, found;
+
+	/* The index is built on first use, not part of what is measured */
+	spi_flash_id_lookup(ids[0], 0);
+
+	for (i = 0; i < cfg->repeat; i++)
+	{
+		start = bench_clock::now();
+		lookups = 0;
+		found = 0;
+
+		do
+		{
+			for (j = 0; j < BENCH_LOOKUPS; j++)
+				found += spi_flash_id_lookup(ids[j % (sizeof (ids) / sizeof (ids[0]))], j & 1 ? 0 : 0x1234) != NULL;
+
+			lookups += BENCH_LOOKUPS;
+		} while ((us = BenchElapsedUs(start)) < BENCH_KERNEL_MIN_US);
+
+		bench_sink = found;
+		BenchReport("id_lookup", "Mlookup/s", us ? lookups / (double) us : 0);
+	}
+}
+
+static bool BenchKernels(const bench_config *cfg)
+{
+	unsigned char *data;
+	unsigned int i;
+
+	data = (unsigned char *) malloc(BENCH_KERNEL_SIZE);
+	if (!data)
+	{
+		fprintf(stderr, "Error: out of memory\n");
+		return false;
+	}
+
+	for (i = 0; i < BENCH_KERNEL_SIZE; i++)
+		data[i] = (unsigned char) ((i * 2654435761u) >> 24);
+
+	BenchKernel("checksum_crc32", cfg, data, BenchCrc32);
+	BenchKernel("checksum_crc32c", cfg, data, BenchCrc32c);
+	BenchKernel("checksum_sha256", cfg, data, BenchSha256);
+	BenchKernel("bit_reverse", cfg, data, BenchBitReverse);
+	BenchKernel("packet_framing", cfg, data, BenchFraming);
+	BenchIdLookup(cfg);
+
+	free(data);
+
+	return true;
+}
+
+static char *BenchLoadFile(const char *path)
+{
+	char *text;
+	long len;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "Error: unable to open %s! error %d\n", path, errno);
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	text = (char *) malloc(len + 1);
+	if (!text || fread(text, 1, len, f) != (size_t) len)
+	{
+		fprintf(stderr, "Error: failed to read %s\n", path);
+		free(text);
+		fclose(f);
+		return NULL;
+	}
+
+	text[len] = 0;
+	fclose(f);
+
+	return text;
+}
+
+/*
+ * A baseline is any JSON with the layout BenchWrite gives, however it was
+ * indented or reformatted since: config.size and config.latency_us, and
+ * results[] of objects with a name and a value. Everything else in it is
+ * parsed and skipped.
+ */
+enum bench_json_context
+{
+	BENCH_JSON_SKIP,
+	BENCH_JSON_TOP,
+	BENCH_JSON_CONFIG,
+	BENCH_JSON_RESULTS,
+	BENCH_JSON_RESULT,
+};
+
+typedef struct _bench_baseline
+{
+	const bench_config *cfg;
+	const char *p;
+	unsigned int size;
+	unsigned int latency_us;
+	bool has_size;
+	bool has_latency;
+	char name[BENCH_NAME_LENGTH];
+	double value;
+	bool has_name;
+	bool has_value;
+	unsigned int entries;
+} bench_baseline;
+
+static bool BenchJsonValue(bench_baseline *b, int ctx, unsigned int depth);
+
+static void BenchJsonSpace(bench_baseline *b)
+{
+	while (*b->p == ' ' || *b->p == '\t' || *b->p == '\r' || *b->p == '\n')
+		b->p++;
+}
+
+static bool BenchJsonIsNumber(bench_baseline *b)
+{
+	return *b->p == '-' || (*b->p >= '0' && *b->p <= '9');
+}
+
+/* Escapes are only skipped over, names of results do not need them */
+static bool BenchJsonString(bench_baseline *b, char *out, unsigned int size)
+{
+	unsigned int n = 0;
+	char c;
+
+	if (*b->p != '"')
+		return false;
+
+	for (b->p++; *b->p != '"'; )
+	{
+		c = *b->p++;
+
+		if ((unsigned char) c < 0x20)
+			return false;
+
+		if (c == '\\' && !(c = *b->p++))
+			return false;
+
+		if (out && n + 1 < size)
+			out[n++] = c;
+	}
+
+	b->p++;
+
+	if (out)
+		out[n] = 0;
+
+	return true;
+}
+
+static bool BenchJsonNumber(bench_baseline *b, double *value)
+{
+	char *end;
+
+	*value = strtod(b->p, &end);
+	if (end == b->p)
+		return false;
+
+	b->p = end;
+	return true;
+}
+
+static void BenchBaselineEntry(bench_baseline *b)
+{
+	bench_result *r;
+	unsigned int i;
+
+	b->entries++;
+
+	for (i = 0; i < result_count; i++)
+	{
+		r = &results[i];
+
+		if (strcmp(r->name, b->name))
+			continue;
+
+		r->baseline = b->value;
+		r->has_baseline = true;
+		r->regression = r->value < b->value * (1 - b->cfg->threshold / 100);
+	}
+}
+
+static bool BenchJsonMember(bench_baseline *b, int ctx, const char *key, unsigned int depth)
+{
+	double number;
+
+	if (ctx == BENCH_JSON_RESULT && !strcmp(key, "name") && *b->p == '"')
+		return b->has_name = BenchJsonString(b, b->name, sizeof (b->name));
+
+	if (ctx == BENCH_JSON_RESULT && !strcmp(key, "value") && BenchJsonIsNumber(b))
+		return b->has_value = BenchJsonNumber(b, &b->value);
+
+	if (ctx == BENCH_JSON_CONFIG && !strcmp(key, "size") && BenchJsonIsNumber(b))
+	{
+		if (!BenchJsonNumber(b, &number))
+			return false;
+
+		b->size = (unsigned int) number;
+		return b->has_size = true;
+	}
+
+	if (ctx == BENCH_JSON_CONFIG && !strcmp(key, "latency_us") && BenchJsonIsNumber(b))
+	{
+		if (!BenchJsonNumber(b, &number))
+			return false;
+
+		b->latency_us = (unsigned int) number;
+		return b->has_latency = true;
+	}
+
+	if (ctx == BENCH_JSON_TOP && !strcmp(key, "config"))
+		return BenchJsonValue(b, BENCH_JSON_CONFIG, depth + 1);
+
+	if (ctx == BENCH_JSON_TOP && !strcmp(key, "results"))
+		return BenchJsonValue(b, BENCH_JSON_RESULTS, depth + 1);
+
+	return BenchJsonValue(b, BENCH_JSON_SKIP, depth + 1);
+}
+
+static bool BenchJsonObject(bench_baseline *b, int ctx, unsigned int depth)
+{
+	char key[BENCH_NAME_LENGTH];
+
+	b->p++;
+
+	if (ctx == BENCH_JSON_RESULT)
+		b->has_name = b->has_value = false;
+
+	BenchJsonSpace(b);
+
+	if (*b->p == '}')
+		b->p++;
+	else
+	{
+		while (1)
+		{
+			BenchJsonSpace(b);
+			if (!BenchJsonString(b, key, sizeof (key)))
+				return false;
+
+			BenchJsonSpace(b);
+			if (*b->p++ != ':')
+				return false;
+
+			BenchJsonSpace(b);
+			if (!BenchJsonMember(b, ctx, key, depth))
+				return false;
+
+			BenchJsonSpace(b);
+			if (*b->p != ',')
+				break;
+
+			b->p++;
+		}
+
+		if (*b->p++ != '}')
+			return false;
+	}
+
+	if (ctx == BENCH_JSON_RESULT && b->has_name && b->has_value)
+		BenchBaselineEntry(b);
+
+	return true;
+}
+
+static bool BenchJsonArray(bench_baseline *b, int ctx, unsigned int depth)
+{
+	b->p++;
+	BenchJsonSpace(b);
+
+	if (*b->p == ']')
+	{
+		b->p++;
+		return true;
+	}
+
+	while (1)
+	{
+		if (!BenchJsonValue(b, ctx == BENCH_JSON_RESULTS ? BENCH_JSON_RESULT : BENCH_JSON_SKIP, depth + 1))
+			return false;
+
+		BenchJsonSpace(b);
+		if (*b->p != ',')
+			break;
+
+		b->p++;
+	}
+
+	return *b->p++ == ']';
+}
+
+static bool BenchJsonValue(bench_baseline *b, int ctx, unsigned int depth)
+{
+	static const char *const literals[] = {"true", "false", "null"};
+	double number;
+	unsigned int i;
+
+	if (depth > BENCH_JSON_DEPTH)
+		return false;
+
+	BenchJsonSpace(b);
+
+	if (*b->p == '{')
+		return BenchJsonObject(b, ctx, depth);
+
+	if (*b->p == '[')
+		return BenchJsonArray(b, ctx, depth);
+
+	if (*b->p == '"')
+		return BenchJsonString(b, NULL, 0);
+
+	for (i = 0; i < sizeof (literals) / sizeof (literals[0]); i++)
+	{
+		if (!strncmp(b->p, literals[i], strlen(literals[i])))
+		{
+			b->p += strlen(literals[i]);
+			return true;
+		}
+	}
+
+	return BenchJsonNumber(b, &number);
+}
+
+static bool BenchCompare(const bench_config *cfg)
+{
+	bench_baseline b;
+	char *text;
+	bool ok;
+
+	text = BenchLoadFile(cfg->baseline);
+	if (!text)
+		return false;
+
+	memset(&b, 0, sizeof (b));
+	b.cfg = cfg;
+	b.p = text;
+
+	ok = BenchJsonValue(&b, BENCH_JSON_TOP, 0);
+	if (ok)
+	{
+		BenchJsonSpace(&b);
+		ok = !*b.p;
+	}
+
+	if (!ok)
+		fprintf(stderr, "Error: %s is not valid JSON (at offset %ld)\n", cfg->baseline, (long) (b.p - text));
+	else if (!b.entries)
+	{
+		fprintf(stderr, "Error: %s holds no results\n", cfg->baseline);
+		ok = false;
+	}
+
+	free(text);
+
+	if (!ok)
+		return false;
+
+	if (b.has_size && b.size != cfg->size)
+		fprintf(stderr, "Warning: baseline was taken with size %u, not %u\n", b.size, cfg->size);
+
+	if (b.has_latency && b.latency_us != cfg->latency_us)
+		fprintf(stderr, "Warning: baseline was taken with latency %uus, not %uus\n", b.latency_us, cfg->latency_us);
+
+	return true;
+}
+
+static bool BenchWrite(const bench_config *cfg, FILE *f)
+{
+	const bench_result *r;
+	unsigned int i;
+
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"config\": {\"size\": %u, \"latency_us\": %u, \"repeat\": %u},\n", cfg->size, cfg->latency_us,
+		cfg->repeat);
+	fprintf(f, "\t\"results\": [\n");
+
+	for (i = 0; i < result_count; i++)
+	{
+		r = &results[i];
+
+		fprintf(f, "\t\t{\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f", r->name, r->unit, r->value);
+
+		if (r->has_baseline)
+			fprintf(f, ", \"baseline\": %.3f, \"change_percent\": %.1f, \"regression\": %s", r->baseline,
+				r->baseline ? (r->value / r->baseline - 1) * 100 : 0, r->regression ? "true" : "false");
+
+		fprintf(f, "}%s\n", i + 1 < result_count ? "," : "");
+	}
+
+	fprintf(f, "\t]\n}\n");
+
+	return !ferror(f);
+}
+
+static unsigned int BenchShowComparison(unsigned int *missing)
+{
+	const bench_result *r;
+	unsigned int i, regressions = 0;
+
+	*missing = 0;
+
+	for (i = 0; i < result_count; i++)
+	{
+		r = &results[i];
+
+		if (!r->has_baseline)
+		{
+			fprintf(stderr, "  %-16s %10.3f %-10s (no baseline)\n", r->name, r->value, r->unit);
+			(*missing)++;
+			continue;
+		}
+
+		fprintf(stderr, "  %-16s %10.3f %-10s %+6.1f%%%s\n", r->name, r->value, r->unit,
+			r->baseline ? (r->value / r->baseline - 1) * 100 : 0, r->regression ? "  REGRESSION" : "");
+
+		if (r->regression)
+			regressions++;
+	}
+
+	return regressions;
+}
+
+static bool BenchParseSize(const char *s, unsigned int *size)
+{
+	char *end;
+	unsigned long n = strtoul(s, &end, 0);
+
+	if (*end == 'K' || *end == 'k')
+		n <<= 10, end++;
+	else if (*end == 'M' || *end == 'm')
+		n <<= 20, end++;
+
+	*size = (unsigned int) n;
+	return !*end;
+}
+
+int main(int argc, char *argv[])
+{
+	bench_config cfg;
+	unsigned int regressions, missing;
+	FILE *f = stdout;
+	int i;
+
+	memset(&cfg, 0, sizeof (cfg));
+	cfg.size = BENCH_DEFAULT_SIZE;
+	cfg.repeat = BENCH_DEFAULT_REPEAT;
+	cfg.threshold = BENCH_DEFAULT_THRESHOLD;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--size") && i + 1 < argc)
+		{
+			if (!BenchParseSize(argv[++i], &cfg.size))
+				break;
+		}
+		else if (!strcmp(argv[i], "--latency") && i + 1 < argc)
+			cfg.latency_us = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--repeat") && i + 1 < argc)
+			cfg.repeat = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+			cfg.output = argv[++i];
+		else if (!strcmp(argv[i], "--compare") && i + 1 < argc)
+			cfg.baseline = argv[++i];
+		else if (!strcmp(argv[i], "--threshold") && i + 1 < argc)
+			cfg.threshold = strtod(argv[++i], NULL);
+		else
+			break;
+	}
+
+	if (i < argc || !cfg.repeat || !cfg.size || cfg.size % BENCH_BLOCK_SIZE || cfg.size > (32 << 20))
+	{
+		ShowUsage();
+		return 1;
+	}
+
+	Ch341ProgSetLog(BenchLog, NULL);
+
+	/* Every run probes the chip, as a fresh process on a station would */
+	ProbeCacheDisable();
+
+	if (!BenchFlash(&cfg) || !BenchKernels(&cfg))
+		return 1;
+
+	if (cfg.baseline && !BenchCompare(&cfg))
+		return 1;
+
+	if (cfg.output)
+	{
+		f = fopen(cfg.output, "w");
+		if (!f)
+		{
+			fprintf(stderr, "Error: unable to create %s! error %d\n", cfg.output, errno);
+			return 1;
+		}
+	}
+
+	if (!BenchWrite(&cfg, f) || (cfg.output && fclose(f)))
+	{
+		fprintf(stderr, "Error: failed to write the result\n");
+		return 1;
+	}
+
+	if (!cfg.baseline)
+		return 0;
+
+	regressions = BenchShowComparison(&missing);
+	if (regressions)
+		fprintf(stderr, "%u of %u results regressed by more than %.1f%%\n", regressions, result_count, cfg.threshold);
+
+	/* A gate which compares nothing must not pass */
+	if (missing)
+	{
+		fprintf(stderr, "Error: %u of %u results are not in %s\n", missing, result_count, cfg.baseline);
+		return 1;
+	}
+
+	if (regressions)
+		return 2;
+
+	return 0;
+}
@@ -0,0 +1,411 @@
+#include "stdafx.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <libusb-1.0/libusb.h>
+
+#include "capture.h"
+
+#define CAPTURE_PATH_LENGTH			1024
+#define CAPTURE_BUFFER_SIZE			(1 << 20)
+#define CAPTURE_VARINT_MAX			10
+
+typedef std::chrono::steady_clock capture_clock;
+
+struct _capture_writer
+{
+	FILE *f;
+	char path[CAPTURE_PATH_LENGTH];
+	capture_clock::time_point last;
+	unsigned long long records;
+	bool failed;
+};
+
+typedef struct _replay_record
+{
+	unsigned char kind;
+	int result;
+	unsigned long long delta_us;
+	unsigned long long latency_us;
+	unsigned int length;
+	unsigned int transferred;
+	size_t data;	/* offset of the bytes in replay_device.data */
+} replay_record;
+
+struct _replay_device
+{
+	char path[CAPTURE_PATH_LENGTH];
+	bool lenient;
+	bool realtime;
+
+	std::vector<unsigned char> data;
+	std::vector<replay_record> records;
+	size_t next;
+
+	unsigned long long mismatches;
+	size_t diverged;	/* index of the record the replay went off at, or records.size() + 1 */
+	char divergence[128];
+};
+
+static void CaptureWriteVarint(capture_writer *cw, unsigned long long v)
+{
+	unsigned char buf[CAPTURE_VARINT_MAX];
+	unsigned int len = 0;
+
+	do
+	{
+		buf[len] = v & 0x7f;
+		v >>= 7;
+
+		if (v)
+			buf[len] |= 0x80;
+
+		len++;
+	} while (v);
+
+	fwrite(buf, 1, len, cw->f);
+}
+
+static unsigned long long CaptureDelta(capture_writer *cw)
+{
+	capture_clock::time_point now = capture_clock::now();
+	unsigned long long delta;
+
+	delta = std::chrono::duration_cast<std::chrono::microseconds>(now - cw->last).count();
+	cw->last = now;
+
+	return delta;
+}
+
+capture_writer *CaptureOpen(const char *path, unsigned int version)
+{
+	unsigned char header[CAPTURE_HEADER_LENGTH];
+	capture_writer *cw;
+
+	cw = new capture_writer();
+
+	cw->f = fopen(path, "wb");
+	if (!cw->f)
+	{
+		Message(MSG_ERROR, "Error: unable to create capture %s! error %d\n", path, errno);
+		delete cw;
+		return NULL;
+	}
+
+	/* Transfers are small and many, don't turn each into a write() */
+	setvbuf(cw->f, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+	memset(header, 0, sizeof (header));
+	memcpy(header, CAPTURE_MAGIC, 8);
+	header[8] = CAPTURE_VERSION;
+	header[12] = version & 0xff;
+	header[13] = (version >> 8) & 0xff;
+	header[14] = (version >> 16) & 0xff;
+	header[15] = (version >> 24) & 0xff;
+
+	fwrite(header, 1, sizeof (header), cw->f);
+
+	snprintf(cw->path, sizeof (cw->path), "%s", path);
+	cw->last = capture_clock::now();
+
+	return cw;
+}
+
+void CaptureClose(capture_writer *cw)
+{
+	if (fclose(cw->f) || cw->failed)
+		Message(MSG_ERROR, "Error: failed to write capture %s! error %d\n", cw->path, errno);
+	else
+		Message(MSG_INFO, "Captured %llu USB records to %s\n", cw->records, cw->path);
+
+	delete cw;
+}
+
+void CaptureTransfer(capture_writer *cw, unsigned char endpoint, const unsigned char *data, int length, int transferred,
+	int result, unsigned long long latency_us)
+{
+	fputc(endpoint, cw->f);
+	CaptureWriteVarint(cw, ((unsigned int) result << 1) ^ (unsigned int) (result >> 31));
+	CaptureWriteVarint(cw, CaptureDelta(cw));
+	CaptureWriteVarint(cw, latency_us);
+	CaptureWriteVarint(cw, length);
+	CaptureWriteVarint(cw, transferred);
+
+	if (transferred > 0)
+		fwrite(data, 1, transferred, cw->f);
+
+	if (ferror(cw->f))
+		cw->failed = true;
+
+	cw->records++;
+}
+
+void CaptureEvent(capture_writer *cw, unsigned char kind)
+{
+	fputc(kind, cw->f);
+	CaptureWriteVarint(cw, CaptureDelta(cw));
+
+	cw->records++;
+}
+
+static bool ReplayReadVarint(const std::vector<unsigned char> &buf, size_t *pos, unsigned long long *v)
+{
+	unsigned int shift;
+
+	*v = 0;
+
+	for (shift = 0; shift < 7 * CAPTURE_VARINT_MAX; shift += 7)
+	{
+		if (*pos >= buf.size())
+			return false;
+
+		*v |= (unsigned long long) (buf[*pos] & 0x7f) << shift;
+
+		if (!(buf[(*pos)++] & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+static bool ReplayParse(replay_device *rd, unsigned int *version)
+{
+	const std::vector<unsigned char> &buf = rd->data;
+	unsigned long long result, length, transferred;
+	replay_record r;
+	size_t pos;
+
+	if (buf.size() < CAPTURE_HEADER_LENGTH || memcmp(&buf[0], CAPTURE_MAGIC, 8) || buf[8] != CAPTURE_VERSION)
+		return false;
+
+	*version = buf[12] | (buf[13] << 8) | (buf[14] << 16) | ((unsigned int) buf[15] << 24);
+
+	for (pos = CAPTURE_HEADER_LENGTH; pos < buf.size(); )
+	{
+		memset(&r, 0, sizeof (r));
+		r.kind = buf[pos++];
+
+		switch (r.kind)
+		{
+		case CAPTURE_EVENT_CLEAR_HALT:
+		case CAPTURE_EVENT_RESET:
+		case CAPTURE_EVENT_REOPEN:
+			if (!ReplayReadVarint(buf, &pos, &r.delta_us))
+				return false;
+			break;
+
+		case 0x02:
+		case 0x82:
+			if (!ReplayReadVarint(buf, &pos, &result) || !ReplayReadVarint(buf, &pos, &r.delta_us) ||
+				!ReplayReadVarint(buf, &pos, &r.latency_us) || !ReplayReadVarint(buf, &pos, &length) ||
+				!ReplayReadVarint(buf, &pos, &transferred) || transferred > buf.size() - pos)
+				return false;
+
+			r.result = (int) ((result >> 1) ^ (~(result & 1) + 1));
+			r.length = (unsigned int) length;
+			r.transferred = (unsigned int) transferred;
+			r.data = pos;
+			pos += r.transferred;
+			break;
+
+		default:
+			return false;
+		}
+
+		rd->records.push_back(r);
+	}
+
+	return true;
+}
+
+replay_device *ReplayOpen(const char *spec, unsigned int *version)
+{
+	replay_device *rd = new replay_device();
+	char opts[CAPTURE_PATH_LENGTH], *opt, *next;
+	unsigned char buf[65536];
+	size_t n;
+	FILE *f;
+
+	snprintf(opts, sizeof (opts), "%s", spec + 7);
+
+	next = opts + strcspn(opts, ",");
+	if (*next)
+		*next++ = 0;
+
+	snprintf(rd->path, sizeof (rd->path), "%s", opts);
+
+	for (opt = next; *opt; opt = next)
+	{
+		next = opt + strcspn(opt, ",");
+		if (*next)
+			*next++ = 0;
+
+		if (!strcmp(opt, "lenient"))
+			rd->lenient = true;
+		else if (!strcmp(opt, "realtime"))
+			rd->realtime = true;
+		else
+		{
+			Message(MSG_ERROR, "Error: invalid replay option '%s'\n", opt);
+			delete rd;
+			return NULL;
+		}
+	}
+
+	f = fopen(rd->path, "rb");
+	if (!f)
+	{
+		Message(MSG_ERROR, "Error: unable to open capture %s! error %d\n", rd->path, errno);
+		delete rd;
+		return NULL;
+	}
+
+	while ((n = fread(buf, 1, sizeof (buf), f)) > 0)
+		rd->data.insert(rd->data.end(), buf, buf + n);
+
+	fclose(f);
+
+	if (!ReplayParse(rd, version))
+	{
+		Message(MSG_ERROR, "Error: %s is not a valid capture\n", rd->path);
+		delete rd;
+		return NULL;
+	}
+
+	rd->diverged = rd->records.size() + 1;
+
+	Message(MSG_INFO, "Replaying %u USB records from %s.\n", (unsigned int) rd->records.size(), rd->path);
+
+	return rd;
+}
+
+void ReplayClose(replay_device *rd)
+{
+	if (rd->diverged <= rd->records.size())
+		Message(MSG_WARNING, "Warning: replay diverged at record %u of %u: %s\n", (unsigned int) rd->diverged,
+			(unsigned int) rd->records.size(), rd->divergence);
+	else if (rd->next < rd->records.size())
+		Message(MSG_INFO, "Replay: %u of %u records used, %u left over\n", (unsigned int) rd->next,
+			(unsigned int) rd->records.size(), (unsigned int) (rd->records.size() - rd->next));
+	else
+		Message(MSG_INFO, "Replay: all %u records used\n", (unsigned int) rd->records.size());
+
+	if (rd->mismatches)
+		Message(MSG_WARNING, "Warning: %llu transfers sent other data than captured\n", rd->mismatches);
+
+	delete rd;
+}
+
+/* Only the first divergence is reported, everything after it follows from it */
+static void ReplayDiverge(replay_device *rd, const char *what)
+{
+	if (rd->diverged <= rd->records.size())
+		return;
+
+	rd->diverged = rd->next;
+	snprintf(rd->divergence, sizeof (rd->divergence), "%s", what);
+
+	Message(MSG_ERROR, "Error: replay diverged at record %u: %s\n", (unsigned int) rd->next, what);
+}
+
+/* The next record, if it is of the given kind and the replay is still on track */
+static const replay_record *ReplayNext(replay_device *rd, unsigned char kind)
+{
+	const replay_record *r;
+	char what[96];
+
+	if (rd->diverged <= rd->records.size())
+		return NULL;
+
+	if (rd->next >= rd->records.size())
+	{
+		ReplayDiverge(rd, "ran past the end of the capture");
+		return NULL;
+	}
+
+	r = &rd->records[rd->next];
+
+	if (r->kind != kind)
+	{
+		snprintf(what, sizeof (what), "expected record %02x, captured %02x", kind, r->kind);
+		ReplayDiverge(rd, what);
+		return NULL;
+	}
+
+	if (rd->realtime && r->latency_us)
+		std::this_thread::sleep_for(std::chrono::microseconds(r->latency_us));
+
+	return r;
+}
+
+int ReplayBulkTransfer(replay_device *rd, unsigned char endpoint, unsigned char *data, int length, int *transferred)
+{
+	const replay_record *r = ReplayNext(rd, endpoint);
+	const unsigned char *captured;
+	char what[96];
+	unsigned int i, n;
+
+	*transferred = 0;
+
+	if (!r)
+		return LIBUSB_ERROR_IO;
+
+	captured = rd->data.data() + r->data;
+
+	if (endpoint & LIBUSB_ENDPOINT_IN)
+	{
+		/* As libusb does when the device sends more than asked for */
+		if (r->transferred > (unsigned int) length)
+		{
+			snprintf(what, sizeof (what), "IN of %d bytes, captured %u", length, r->transferred);
+			ReplayDiverge(rd, what);
+			return LIBUSB_ERROR_OVERFLOW;
+		}
+
+		memcpy(data, captured, r->transferred);
+	}
+	else
+	{
+		n = r->transferred < (unsigned int) length ? r->transferred : (unsigned int) length;
+
+		for (i = 0; i < n && data[i] == captured[i]; i++)
+			;
+
+		if ((unsigned int) length != r->length || i < n)
+		{
+			rd->mismatches++;
+
+			if (!rd->lenient)
+			{
+				if ((unsigned int) length != r->length)
+					snprintf(what, sizeof (what), "OUT of %d bytes, captured %u", length, r->length);
+				else
+					snprintf(what, sizeof (what), "OUT differs at byte %u (%02x, captured %02x)", i, data[i], captured[i]);
+
+				ReplayDiverge(rd, what);
+				return LIBUSB_ERROR_IO;
+			}
+		}
+	}
+
+	rd->next++;
+	*transferred = r->transferred;
+
+	return r->result;
+}
+
+int ReplayEvent(replay_device *rd, unsigned char kind)
+{
+	if (!ReplayNext(rd, kind))
+		return LIBUSB_ERROR_IO;
+
+	rd->next++;
+
+	return 0;
+}
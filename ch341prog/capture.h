@@ -0,0 +1,60 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <string.h>
+
+/*
+ * USB traffic captures: every bulk transfer with its data, result and
+ * timing, and the recovery steps taken in between, in the order the
+ * transport did them. File layout, integers little endian:
+ *
+ *   "CH341CAP", u8 version, 3 bytes reserved, u32 CH341 version
+ *   records of a u8 kind followed, for transfers (kind is the endpoint,
+ *   0x02 out or 0x82 in), by the varints result (zigzag), us since the
+ *   previous record, latency us, length asked for, bytes transferred,
+ *   and the bytes transferred themselves. Events have no payload.
+ *
+ * Varints are LEB128, 7 bits per byte, low first.
+ */
+#define CAPTURE_MAGIC				"CH341CAP"
+#define CAPTURE_VERSION				1
+#define CAPTURE_HEADER_LENGTH		16
+
+#define CAPTURE_EVENT_CLEAR_HALT	0x10
+#define CAPTURE_EVENT_RESET			0x11
+#define CAPTURE_EVENT_REOPEN		0x12
+
+typedef struct _capture_writer capture_writer;
+
+capture_writer *CaptureOpen(const char *path, unsigned int version);
+void CaptureClose(capture_writer *cw);
+void CaptureTransfer(capture_writer *cw, unsigned char endpoint, const unsigned char *data, int length, int transferred,
+	int result, unsigned long long latency_us);
+void CaptureEvent(capture_writer *cw, unsigned char kind);
+
+/*
+ * Replay of a capture in place of a programmer, selected by the device spec
+ *   replay:<file>[,<option>,...]
+ * with options
+ *   lenient            keep going when the data sent differs from the capture
+ *   realtime           take as long as each transfer took when captured
+ * Every transfer must be the next one in the capture, in direction and,
+ * unless lenient, in the data sent. Replies, failures included, are the
+ * captured ones. Once the sequence diverged every transfer fails. Close
+ * reports how far the replay got and where it diverged.
+ */
+typedef struct _replay_device replay_device;
+
+static inline bool ReplayIsSpec(const char *spec)
+{
+	return spec && !strncmp(spec, "replay:", 7);
+}
+
+replay_device *ReplayOpen(const char *spec, unsigned int *version);
+void ReplayClose(replay_device *rd);
+
+/* Same calling convention and error codes as their libusb counterparts */
+int ReplayBulkTransfer(replay_device *rd, unsigned char endpoint, unsigned char *data, int length, int *transferred);
+int ReplayEvent(replay_device *rd, unsigned char kind);
+
+#endif /* _CAPTURE_H_ */
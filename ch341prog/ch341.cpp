@@ -1,245 +1,1475 @@
-
-#include "stdafx.h"
-
-#include <memory.h>
-
-#include <libusb-1.0/libusb.h>
-
-#include "ch341.h"
-
-static struct libusb_device_handle *CH341DeviceHanlde;
-
-bool CH341DeviceInit(void)
-{
-	int ret;
-	unsigned char desc[0x12];
-
-	if (CH341DeviceHanlde)
-		return true;
-
-	if ((ret = libusb_init(NULL)))
-	{
-		fprintf(stderr, "Error: libusb_init failed: %d (%s)\n", ret, libusb_error_name(ret));
-		return false;
-	}
-
-	if (!(CH341DeviceHanlde = libusb_open_device_with_vid_pid(NULL, CH341_USB_VID, CH341_USB_PID)))
-	{
-		fprintf(stderr, "Error: CH341 device (%04x/%04x) not found\n", CH341_USB_VID, CH341_USB_PID);
-		return false;
-	}
-
-#if !defined(_MSC_VER) && !defined(MSYS) && !defined(CYGWIN) && !defined(WIN32) && !defined(MINGW) && !defined(MINGW32)
-	if (libusb_kernel_driver_active(CH341DeviceHanlde, 0))
-	{
-		if ((ret = libusb_detach_kernel_driver(CH341DeviceHanlde, 0)))
-		{
-			fprintf(stderr, "Error: libusb_detach_kernel_driver failed: %d (%s)\n", ret, libusb_error_name(ret));
-			goto cleanup;
-		}
-	}
-#endif
-
-	if ((ret = libusb_claim_interface(CH341DeviceHanlde, 0)))
-	{
-		fprintf(stderr, "Error: libusb_claim_interface failed: %d (%s)\n", ret, libusb_error_name(ret));
-		goto cleanup;
-	}
-
-	if (!(ret = libusb_get_descriptor(CH341DeviceHanlde, LIBUSB_DT_DEVICE, 0x00, desc, 0x12)))
-	{
-		fprintf(stderr, "Warning: libusb_get_descriptor failed: %d (%s)\n", ret, libusb_error_name(ret));
-	}
-
-	printf("CH341 %d.%02d found.\n\n", desc[12], desc[13]);
-
-	return true;
-
-cleanup:
-	libusb_close(CH341DeviceHanlde);
-	CH341DeviceHanlde = NULL;
-	return false;
-}
-
-void CH341DeviceRelease(void)
-{
-	if (!CH341DeviceHanlde)
-		return;
-
-	libusb_release_interface(CH341DeviceHanlde, 0);
-	libusb_close(CH341DeviceHanlde);
-	libusb_exit(NULL);
-
-	CH341DeviceHanlde = NULL;
-}
-
-static int CH341USBTransferPart(enum libusb_endpoint_direction dir, unsigned char *buff, unsigned int size)
-{
-	int ret, bytestransferred;
-
-	if (!CH341DeviceHanlde)
-		return 0;
-
-	if ((ret = libusb_bulk_transfer(CH341DeviceHanlde, CH341_USB_BULK_ENDPOINT | dir, buff, size, &bytestransferred, CH341_USB_TIMEOUT)))
-	{
-		fprintf(stderr, "Error: libusb_bulk_transfer for IN_EP failed: %d (%s)\n", ret, libusb_error_name(ret));
-		return -1;
-	}
-
-	return bytestransferred;
-}
-
-static bool CH341USBTransfer(enum libusb_endpoint_direction dir, unsigned char *buff, unsigned int size)
-{
-	int pos, bytestransferred;
-
-	pos = 0;
-
-	while (size)
-	{
-		bytestransferred = CH341USBTransferPart(dir, buff + pos, size);
-
-		if (bytestransferred <= 0)
-			return false;
-
-		pos += bytestransferred;
-		size -= bytestransferred;
-	}
-
-	return true;
-}
-
-#define CH341USBRead(buff, size) CH341USBTransfer(LIBUSB_ENDPOINT_IN, buff, size)
-#define CH341USBWrite(buff, size) CH341USBTransfer(LIBUSB_ENDPOINT_OUT, buff, size)
-
-
-
-bool CH341ChipSelect(unsigned int cs, bool enable)
-{
-	unsigned char pkt[4];
-
-	static const int csio[4] = {0x36, 0x35, 0x33, 0x27};
-
-	if (cs > 3)
-	{
-		fprintf(stderr, "Error: invalid CS pin %d, 0~3 are available\n", cs);
-		return false;
-	}
-
-	pkt[0] = CH341_CMD_UIO_STREAM;
-	if (enable)
-		pkt[1] = CH341_CMD_UIO_STM_OUT | csio[cs];
-	else
-		pkt[1] = CH341_CMD_UIO_STM_OUT | 0x37;
-	pkt[2] = CH341_CMD_UIO_STM_DIR | 0x3F;
-	pkt[3] = CH341_CMD_UIO_STM_END;
-
-	return CH341USBWrite(pkt, 4);
-}
-
-static int CH341TransferSPI(const unsigned char *in, unsigned char *out, unsigned int size)
-{
-	unsigned char pkt[CH341_PACKET_LENGTH];
-	unsigned int i;
-
-	if (!size)
-		return 0;
-
-	if (size > CH341_PACKET_LENGTH - 1)
-		size = CH341_PACKET_LENGTH - 1;
-
-	pkt[0] = CH341_CMD_SPI_STREAM;
-
-	for (i = 0; i < size; i++)
-		pkt[i + 1] = BitSwapTable[in[i]];
-
-	if (!CH341USBWrite(pkt, size + 1))
-	{
-		fprintf(stderr, "Error: failed to transfer data to CH341\n");
-		return -1;
-	}
-
-	if (!CH341USBRead(pkt, size))
-	{
-		fprintf(stderr, "Error: failed to transfer data from CH341\n");
-		return -1;
-	}
-
-	for (i = 0; i < size; i++)
-		out[i] = BitSwapTable[pkt[i]];
-
-	return size;
-}
-
-bool CH341StreamSPI(const unsigned char *in, unsigned char *out, unsigned int size)
-{
-	int pos, bytestransferred;
-
-	if (!size)
-		return true;
-
-	pos = 0;
-
-	while (size)
-	{
-		bytestransferred = CH341TransferSPI(in + pos, out + pos, size);
-
-		if (bytestransferred <= 0)
-			return false;
-
-		pos += bytestransferred;
-		size -= bytestransferred;
-	}
-
-	return true;
-}
-
-bool CH341ReadSPI(unsigned char *out, unsigned int size)
-{
-	int pos, bytestransferred;
-	unsigned char pkt[CH341_PACKET_LENGTH];
-
-	if (!size)
-		return true;
-
-	memset(pkt, 0, sizeof (pkt));
-
-	pos = 0;
-
-	while (size)
-	{
-		bytestransferred = CH341TransferSPI(pkt, out + pos, size);
-
-		if (bytestransferred <= 0)
-			return false;
-
-		pos += bytestransferred;
-		size -= bytestransferred;
-	}
-
-	return true;
-}
-
-bool CH341WriteSPI(const unsigned char *in, unsigned int size)
-{
-	int pos, bytestransferred;
-	unsigned char pkt[CH341_PACKET_LENGTH];
-
-	if (!size)
-		return true;
-
-	pos = 0;
-
-	while (size)
-	{
-		bytestransferred = CH341TransferSPI(in + pos, pkt, size);
-
-		if (bytestransferred <= 0)
-			return false;
-
-		pos += bytestransferred;
-		size -= bytestransferred;
-	}
-
-	return true;
-}
+
+#include "stdafx.h"
+
+#include <memory.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include <libusb-1.0/libusb.h>
+
+#include "ch341.h"
+#include "emu.h"
+#include "capture.h"
+#include "profile.h"
+#include "metrics.h"
+#include "probes.h"
+
+typedef std::chrono::steady_clock ch341_clock;
+
+static ch341_device CH341DefaultDeviceInst;
+
+static volatile sig_atomic_t CH341CancelFlag;
+
+#ifdef CH341PROG_SDT
+/* Counted up by a tracer attaching to the probe, see probes.h */
+#define PROBE_SEMAPHORE_DEFINE(name)	\
+	__attribute__((section(".probes"))) volatile unsigned short PROBE_SEMAPHORE(name) = 0
+
+PROBE_SEMAPHORE_DEFINE(usb_submit);
+PROBE_SEMAPHORE_DEFINE(usb_complete);
+PROBE_SEMAPHORE_DEFINE(cs_assert);
+PROBE_SEMAPHORE_DEFINE(cs_deassert);
+PROBE_SEMAPHORE_DEFINE(flash_poll);
+PROBE_SEMAPHORE_DEFINE(erase_start);
+PROBE_SEMAPHORE_DEFINE(erase_end);
+PROBE_SEMAPHORE_DEFINE(program_start);
+PROBE_SEMAPHORE_DEFINE(program_end);
+PROBE_SEMAPHORE_DEFINE(read_chunk);
+#endif
+
+/* Port path if libusb can tell it, it survives re-enumeration while the device address does not */
+static void CH341UsbLocation(libusb_device *usb_dev, char *buf, unsigned int size)
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+	unsigned char ports[8];
+	int i, n, len;
+
+	n = libusb_get_port_numbers(usb_dev, ports, sizeof (ports));
+	if (n > 0)
+	{
+		len = snprintf(buf, size, "usb%u-%u", libusb_get_bus_number(usb_dev), ports[0]);
+		for (i = 1; i < n && len > 0 && (unsigned int) len < size; i++)
+			len += snprintf(buf + len, size - len, ".%u", ports[i]);
+		return;
+	}
+#endif
+
+	snprintf(buf, size, "usb%u@%u", libusb_get_bus_number(usb_dev), libusb_get_device_address(usb_dev));
+}
+
+/* Claims an opened CH341 and reads its version */
+static bool CH341DeviceSetup(ch341_device *dev)
+{
+	int ret;
+	unsigned char desc[0x12];
+
+#if !defined(_MSC_VER) && !defined(MSYS) && !defined(CYGWIN) && !defined(WIN32) && !defined(MINGW) && !defined(MINGW32)
+	if (libusb_kernel_driver_active(dev->handle, 0))
+	{
+		if ((ret = libusb_detach_kernel_driver(dev->handle, 0)))
+		{
+			Message(MSG_ERROR, "Error: libusb_detach_kernel_driver failed: %d (%s)\n", ret, libusb_error_name(ret));
+			goto cleanup;
+		}
+	}
+#endif
+
+	if ((ret = libusb_claim_interface(dev->handle, 0)))
+	{
+		Message(MSG_ERROR, "Error: libusb_claim_interface failed: %d (%s)\n", ret, libusb_error_name(ret));
+		goto cleanup;
+	}
+
+	memset(desc, 0, sizeof (desc));
+
+	if (!(ret = libusb_get_descriptor(dev->handle, LIBUSB_DT_DEVICE, 0x00, desc, 0x12)))
+	{
+		Message(MSG_WARNING, "Warning: libusb_get_descriptor failed: %d (%s)\n", ret, libusb_error_name(ret));
+	}
+
+	dev->version = (desc[12] << 8) | desc[13];
+
+	/* Kept for finding the device again should it re-enumerate */
+	CH341UsbLocation(libusb_get_device(dev->handle), dev->location, sizeof (dev->location));
+
+	return true;
+
+cleanup:
+	libusb_close(dev->handle);
+	dev->handle = NULL;
+	return false;
+}
+
+static void CH341UsbSerial(libusb_device *usb_dev, const struct libusb_device_descriptor *desc, char *buf, unsigned int size)
+{
+	libusb_device_handle *handle;
+
+	buf[0] = 0;
+
+	/* Reading the string needs the device opened, skip that when there is none */
+	if (!desc->iSerialNumber || libusb_open(usb_dev, &handle))
+		return;
+
+	if (libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber, (unsigned char *) buf, size) < 0)
+		buf[0] = 0;
+
+	libusb_close(handle);
+}
+
+/*
+ * spec selects one of several programmers:
+ *   <n>               n-th CH341 in enumeration order
+ *   usb<bus>-<ports>  port path, e.g. usb1-1.4 (the "usb" prefix is optional)
+ *   usb<bus>@<addr>   bus and device address
+ *   serial:<string>   iSerialNumber string
+ */
+static bool CH341MatchSpec(libusb_device *usb_dev, const struct libusb_device_descriptor *desc, unsigned int index,
+	const char *spec)
+{
+	char buf[64];
+
+	if (!spec || !*spec)
+		return index == 0;
+
+	if (!strncmp(spec, "serial:", 7))
+	{
+		CH341UsbSerial(usb_dev, desc, buf, sizeof (buf));
+		return buf[0] && !strcmp(buf, spec + 7);
+	}
+
+	if (strspn(spec, "0123456789") == strlen(spec))
+		return index == strtoul(spec, NULL, 10);
+
+	CH341UsbLocation(usb_dev, buf, sizeof (buf));
+
+	return !strcmp(buf, spec) || !strcmp(buf + 3, spec);
+}
+
+static const char *CH341DefaultSpec;
+static const char *CH341DefaultCapture;
+
+void CH341SelectDevice(const char *spec)
+{
+	CH341DefaultSpec = spec;
+}
+
+void CH341SelectCapture(const char *path)
+{
+	CH341DefaultCapture = path;
+}
+
+/*
+ * Only the device list and its cached descriptors are walked, nothing but
+ * the selected programmer gets opened (serial matching aside). quiet keeps
+ * a programmer not (yet) there from being reported.
+ */
+static bool CH341DeviceDoOpen(ch341_device *dev, const char *spec, bool quiet)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	unsigned int index = 0;
+	ssize_t i, n;
+	int ret;
+
+	if (CH341DeviceIsOpen(dev))
+		return true;
+
+	if (EmuIsSpec(spec))
+	{
+		dev->emu = EmuOpen(spec);
+		if (!dev->emu)
+			return false;
+
+		dev->version = EMU_VERSION;
+		EmuGetLocation(dev->emu, dev->location, sizeof (dev->location));
+
+		if (!quiet)
+			Message(MSG_INFO, "Emulated CH341 %d.%02d.\n\n", dev->version >> 8, dev->version & 0xff);
+
+		return true;
+	}
+
+	if (ReplayIsSpec(spec))
+	{
+		dev->replay = ReplayOpen(spec, &dev->version);
+		if (!dev->replay)
+			return false;
+
+		snprintf(dev->location, sizeof (dev->location), "replay");
+
+		if (!quiet)
+			Message(MSG_INFO, "Replayed CH341 %d.%02d.\n\n", dev->version >> 8, dev->version & 0xff);
+
+		return true;
+	}
+
+	if ((ret = libusb_init(NULL)))
+	{
+		Message(MSG_ERROR, "Error: libusb_init failed: %d (%s)\n", ret, libusb_error_name(ret));
+		return false;
+	}
+
+	n = libusb_get_device_list(NULL, &list);
+	if (n < 0)
+	{
+		Message(MSG_ERROR, "Error: libusb_get_device_list failed: %d (%s)\n", (int) n, libusb_error_name((int) n));
+		libusb_exit(NULL);
+		return false;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (libusb_get_device_descriptor(list[i], &desc))
+			continue;
+
+		if (desc.idVendor != CH341_USB_VID || desc.idProduct != CH341_USB_PID)
+			continue;
+
+		if (CH341MatchSpec(list[i], &desc, index++, spec))
+		{
+			if ((ret = libusb_open(list[i], &dev->handle)))
+			{
+				Message(MSG_ERROR, "Error: libusb_open failed: %d (%s)\n", ret, libusb_error_name(ret));
+				dev->handle = NULL;
+			}
+			break;
+		}
+	}
+
+	libusb_free_device_list(list, 1);
+
+	if (!dev->handle)
+	{
+		if (i == n && !quiet)
+		{
+			if (spec && *spec)
+				Message(MSG_ERROR, "Error: CH341 device %s not found\n", spec);
+			else
+				Message(MSG_ERROR, "Error: CH341 device (%04x/%04x) not found\n", CH341_USB_VID, CH341_USB_PID);
+		}
+
+		libusb_exit(NULL);
+		return false;
+	}
+
+	if (!CH341DeviceSetup(dev))
+	{
+		libusb_exit(NULL);
+		return false;
+	}
+
+	if (!quiet)
+		Message(MSG_INFO, "CH341 %d.%02d found.\n\n", dev->version >> 8, dev->version & 0xff);
+
+	return true;
+}
+
+bool CH341DeviceOpenSpec(ch341_device *dev, const char *spec)
+{
+	return CH341DeviceDoOpen(dev, spec, false);
+}
+
+bool CH341DeviceOpen(ch341_device *dev)
+{
+	return CH341DeviceOpenSpec(dev, CH341DefaultSpec);
+}
+
+/* Opens every attached CH341, returns how many were opened */
+unsigned int CH341DeviceOpenAll(ch341_device *devs, unsigned int max)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	unsigned int count = 0;
+	ssize_t i, n;
+	int ret;
+
+	if ((ret = libusb_init(NULL)))
+	{
+		Message(MSG_ERROR, "Error: libusb_init failed: %d (%s)\n", ret, libusb_error_name(ret));
+		return 0;
+	}
+
+	n = libusb_get_device_list(NULL, &list);
+	if (n < 0)
+	{
+		Message(MSG_ERROR, "Error: libusb_get_device_list failed: %d (%s)\n", (int) n, libusb_error_name((int) n));
+		libusb_exit(NULL);
+		return 0;
+	}
+
+	for (i = 0; i < n && count < max; i++)
+	{
+		if (libusb_get_device_descriptor(list[i], &desc))
+			continue;
+
+		if (desc.idVendor != CH341_USB_VID || desc.idProduct != CH341_USB_PID)
+			continue;
+
+		memset(&devs[count], 0, sizeof (devs[count]));
+
+		if ((ret = libusb_open(list[i], &devs[count].handle)))
+		{
+			Message(MSG_ERROR, "Error: libusb_open failed: %d (%s)\n", ret, libusb_error_name(ret));
+			continue;
+		}
+
+		if (!CH341DeviceSetup(&devs[count]))
+			continue;
+
+		/* Every open device holds its own libusb reference, released in CH341DeviceClose */
+		libusb_init(NULL);
+		count++;
+	}
+
+	libusb_free_device_list(list, 1);
+	libusb_exit(NULL);
+
+	return count;
+}
+
+/* Lists attached CH341s without claiming any of them */
+unsigned int CH341DeviceList(ch341_device_info *infos, unsigned int max)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	unsigned int count = 0;
+	ssize_t i, n;
+	int ret;
+
+	if ((ret = libusb_init(NULL)))
+	{
+		Message(MSG_ERROR, "Error: libusb_init failed: %d (%s)\n", ret, libusb_error_name(ret));
+		return 0;
+	}
+
+	n = libusb_get_device_list(NULL, &list);
+	if (n < 0)
+	{
+		Message(MSG_ERROR, "Error: libusb_get_device_list failed: %d (%s)\n", (int) n, libusb_error_name((int) n));
+		libusb_exit(NULL);
+		return 0;
+	}
+
+	for (i = 0; i < n && count < max; i++)
+	{
+		if (libusb_get_device_descriptor(list[i], &desc))
+			continue;
+
+		if (desc.idVendor != CH341_USB_VID || desc.idProduct != CH341_USB_PID)
+			continue;
+
+		infos[count].index = count;
+		/* Same byte order as shown when opening a device */
+		infos[count].version = ((desc.bcdDevice & 0xff) << 8) | (desc.bcdDevice >> 8);
+		CH341UsbLocation(list[i], infos[count].location, sizeof (infos[count].location));
+		CH341UsbSerial(list[i], &desc, infos[count].serial, sizeof (infos[count].serial));
+		count++;
+	}
+
+	libusb_free_device_list(list, 1);
+	libusb_exit(NULL);
+
+	return count;
+}
+
+/* Identifies the USB position of the programmer, stable across runs while it stays plugged in */
+bool CH341DeviceGetLocation(ch341_device *dev, char *buf, unsigned int size)
+{
+	if (!CH341DeviceIsOpen(dev))
+		return false;
+
+	snprintf(buf, size, "%s", dev->location);
+
+	return true;
+}
+
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+static libusb_hotplug_callback_handle CH341HotplugHandle;
+static std::mutex CH341HotplugLock;
+/* Changed under the lock, but read by waiters and bumped from libusb's event handling without it */
+static std::atomic<unsigned int> CH341HotplugUsers;
+static std::atomic<unsigned int> CH341HotplugEvents;
+
+static int LIBUSB_CALL CH341HotplugCallback(libusb_context *ctx, libusb_device *usb_dev, libusb_hotplug_event event, void *arg)
+{
+	CH341HotplugEvents++;
+	return 0;
+}
+#endif
+
+bool CH341HotplugStart(void)
+{
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+	std::lock_guard<std::mutex> lock(CH341HotplugLock);
+	int ret;
+
+	if (CH341HotplugUsers)
+	{
+		CH341HotplugUsers++;
+		return true;
+	}
+
+	if (libusb_init(NULL))
+		return false;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{
+		libusb_exit(NULL);
+		return false;
+	}
+
+	ret = libusb_hotplug_register_callback(NULL,
+		(libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+		(libusb_hotplug_flag) 0, CH341_USB_VID, CH341_USB_PID, LIBUSB_HOTPLUG_MATCH_ANY,
+		CH341HotplugCallback, NULL, &CH341HotplugHandle);
+
+	if (ret)
+	{
+		Message(MSG_WARNING, "Warning: libusb_hotplug_register_callback failed: %d (%s)\n", ret, libusb_error_name(ret));
+		libusb_exit(NULL);
+		return false;
+	}
+
+	CH341HotplugUsers = 1;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void CH341HotplugStop(void)
+{
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+	std::lock_guard<std::mutex> lock(CH341HotplugLock);
+
+	if (!CH341HotplugUsers || --CH341HotplugUsers)
+		return;
+
+	libusb_hotplug_deregister_callback(NULL, CH341HotplugHandle);
+	libusb_exit(NULL);
+#endif
+}
+
+/* Returns true if a CH341 came or went within timeout_ms */
+bool CH341HotplugWait(unsigned int timeout_ms)
+{
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+	unsigned int events = CH341HotplugEvents;
+	struct timeval tv;
+
+	if (CH341HotplugUsers)
+	{
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+		libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+
+		return events != CH341HotplugEvents;
+	}
+#endif
+
+	SleepMs(timeout_ms);
+	return false;
+}
+
+void CH341DeviceClose(ch341_device *dev)
+{
+	if (dev->emu)
+	{
+		EmuClose(dev->emu);
+		dev->emu = NULL;
+	}
+
+	if (dev->replay)
+	{
+		ReplayClose(dev->replay);
+		dev->replay = NULL;
+	}
+
+	if (!dev->handle)
+		return;
+
+	libusb_release_interface(dev->handle, 0);
+	libusb_close(dev->handle);
+	libusb_exit(NULL);
+
+	dev->handle = NULL;
+}
+
+static int CH341DoBulkTransfer(ch341_device *dev, unsigned char endpoint, unsigned char *buff, unsigned int size,
+	int *transferred, unsigned int timeout)
+{
+	*transferred = 0;
+
+	if (dev->replay)
+		return ReplayBulkTransfer(dev->replay, endpoint, buff, size, transferred);
+
+	if (dev->emu)
+		return EmuBulkTransfer(dev->emu, endpoint, buff, size, transferred, timeout);
+
+	return libusb_bulk_transfer(dev->handle, endpoint, buff, size, transferred, timeout);
+}
+
+static int CH341BulkTransfer(ch341_device *dev, unsigned char endpoint, unsigned char *buff, unsigned int size,
+	int *transferred, unsigned int timeout)
+{
+	ch341_clock::time_point start;
+	int ret;
+
+	if (!dev->capture)
+		return CH341DoBulkTransfer(dev, endpoint, buff, size, transferred, timeout);
+
+	start = ch341_clock::now();
+	ret = CH341DoBulkTransfer(dev, endpoint, buff, size, transferred, timeout);
+
+	CaptureTransfer(dev->capture, endpoint, buff, size, *transferred, ret,
+		std::chrono::duration_cast<std::chrono::microseconds>(ch341_clock::now() - start).count());
+
+	return ret;
+}
+
+static void CH341CountError(ch341_device *dev, int err)
+{
+	unsigned int kind;
+
+	switch (err)
+	{
+	case LIBUSB_ERROR_TIMEOUT:
+		kind = CH341_USB_ERR_TIMEOUT;
+		break;
+	case LIBUSB_ERROR_PIPE:
+		kind = CH341_USB_ERR_PIPE;
+		break;
+	case LIBUSB_ERROR_IO:
+		kind = CH341_USB_ERR_IO;
+		break;
+	case LIBUSB_ERROR_NO_DEVICE:
+		kind = CH341_USB_ERR_NO_DEVICE;
+		break;
+	case LIBUSB_ERROR_OVERFLOW:
+		kind = CH341_USB_ERR_OVERFLOW;
+		break;
+	default:
+		kind = CH341_USB_ERR_OTHER;
+		break;
+	}
+
+	dev->stats.errors[kind]++;
+	MetricsUsbError(kind);
+	dev->last_error = err;
+}
+
+static void CH341DeviceClearHalt(ch341_device *dev)
+{
+	dev->stats.clear_halts++;
+
+	if (dev->capture)
+		CaptureEvent(dev->capture, CAPTURE_EVENT_CLEAR_HALT);
+
+	if (dev->replay)
+	{
+		ReplayEvent(dev->replay, CAPTURE_EVENT_CLEAR_HALT);
+		return;
+	}
+
+	if (dev->emu)
+	{
+		EmuClearHalt(dev->emu, CH341_USB_BULK_ENDPOINT | LIBUSB_ENDPOINT_OUT);
+		EmuClearHalt(dev->emu, CH341_USB_BULK_ENDPOINT | LIBUSB_ENDPOINT_IN);
+		return;
+	}
+
+	libusb_clear_halt(dev->handle, CH341_USB_BULK_ENDPOINT | LIBUSB_ENDPOINT_OUT);
+	libusb_clear_halt(dev->handle, CH341_USB_BULK_ENDPOINT | LIBUSB_ENDPOINT_IN);
+}
+
+/*
+ * Transfers take about the same time per packet, the timeout follows the
+ * measured round trip time the way TCP's retransmission timer does
+ * (smoothed time plus four mean deviations), so that a programmer which
+ * stopped answering is noticed within milliseconds instead of seconds.
+ * The floor comes from the measured jitter as well, rounded up to the
+ * millisecond libusb counts in and no more: a lost transfer costs its
+ * whole timeout, one which was only late costs a resend.
+ */
+static unsigned int CH341TransferTimeout(ch341_device *dev, unsigned int size)
+{
+	unsigned long long packets, timeout_us;
+	unsigned int timeout;
+
+	if (dev->rtt_samples < CH341_TIMEOUT_SAMPLES)
+		return CH341_TIMEOUT_INITIAL;
+
+	packets = (size + CH341_PACKET_LENGTH - 1) / CH341_PACKET_LENGTH;
+	timeout_us = (dev->rtt_us + 4ULL * dev->rtt_var_us) * packets + CH341_TIMEOUT_VAR_MARGIN * (unsigned long long) dev->rtt_var_us;
+	timeout = (unsigned int) ((timeout_us + 999) / 1000);
+
+	return timeout < CH341_USB_TIMEOUT ? timeout : CH341_USB_TIMEOUT;
+}
+
+static void CH341TransferTimed(ch341_device *dev, unsigned int size, ch341_clock::duration elapsed)
+{
+	unsigned int packets = (size + CH341_PACKET_LENGTH - 1) / CH341_PACKET_LENGTH;
+	int rtt, err;
+
+	rtt = (int) (std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / (packets ? packets : 1));
+
+	if (!dev->rtt_samples++)
+	{
+		dev->rtt_us = rtt;
+		dev->rtt_var_us = rtt / 2;
+		return;
+	}
+
+	/* Gains of 1/8 and 1/4 as in RFC 6298 */
+	err = rtt - (int) dev->rtt_us;
+	dev->rtt_us += err / 8;
+	dev->rtt_var_us += ((err < 0 ? -err : err) - (int) dev->rtt_var_us) / 4;
+}
+
+static unsigned int CH341LatencyBucket(unsigned long long us)
+{
+	unsigned int shift = 0;
+
+	while ((us >> shift) >= 2 * CH341_LATENCY_SUB)
+		shift++;
+
+	if (shift * CH341_LATENCY_SUB + (us >> shift) >= CH341_LATENCY_BUCKETS)
+		return CH341_LATENCY_BUCKETS - 1;
+
+	return shift * CH341_LATENCY_SUB + (unsigned int) (us >> shift);
+}
+
+/* Highest latency in the bucket, as HdrHistogram reports it */
+static unsigned long long CH341LatencyBucketMax(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < 2 * CH341_LATENCY_SUB)
+		return bucket;
+
+	shift = bucket / CH341_LATENCY_SUB - 1;
+
+	return ((unsigned long long) (bucket - shift * CH341_LATENCY_SUB + 1) << shift) - 1;
+}
+
+static void CH341TransferDone(ch341_device *dev, enum libusb_endpoint_direction dir, unsigned int size,
+	ch341_clock::duration elapsed)
+{
+	ch341_dir_stats *ds = &dev->stats.usb[dir == LIBUSB_ENDPOINT_IN ? CH341_DIR_IN : CH341_DIR_OUT];
+
+	ds->transfers++;
+	ds->wire_bytes += size;
+	ds->latency[CH341LatencyBucket(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count())]++;
+}
+
+static inline void CH341CountPayload(ch341_device *dev, unsigned int out_bytes, unsigned int in_bytes)
+{
+	dev->stats.usb[CH341_DIR_OUT].payload_bytes += out_bytes;
+	dev->stats.usb[CH341_DIR_IN].payload_bytes += in_bytes;
+}
+
+static int CH341USBTransferPart(ch341_device *dev, enum libusb_endpoint_direction dir, unsigned char *buff, unsigned int size)
+{
+	unsigned int resends = 0, timeout;
+	ch341_clock::time_point start;
+	ch341_clock::duration elapsed;
+	int ret, bytestransferred;
+
+	if (!CH341DeviceIsOpen(dev))
+		return 0;
+
+	profile_scope scope(dir == LIBUSB_ENDPOINT_IN ? PROF_USB_IN : PROF_USB_OUT);
+
+	dev->stats.transfers++;
+	dev->stats.op_transfers[dev->op]++;
+
+	timeout = CH341TransferTimeout(dev, size);
+	start = ch341_clock::now();
+
+	while (1)
+	{
+		PROBE3(usb_submit, dir == LIBUSB_ENDPOINT_IN, size, timeout);
+
+		ret = CH341BulkTransfer(dev, CH341_USB_BULK_ENDPOINT | dir, buff, size, &bytestransferred, timeout);
+
+		PROBE5(usb_complete, dir == LIBUSB_ENDPOINT_IN, size, bytestransferred, ret,
+			PROBE_ENABLED(usb_complete) ? std::chrono::duration_cast<std::chrono::microseconds>(ch341_clock::now() - start).count() : 0);
+
+		if (!ret)
+			break;
+
+		CH341CountError(dev, ret);
+
+		/*
+		 * Nothing got across on a timeout or stall without data, the same
+		 * transfer can go again as if nothing happened. Most timeouts are
+		 * one lost transfer, the first resend keeps the timeout close to
+		 * the round trip time, later ones get twice as long in case it was
+		 * too short. Stalls only for callers which retry themselves, to
+		 * others they are fatal.
+		 */
+		if (!bytestransferred && resends < CH341_RESEND_MAX && !CH341CancelFlag &&
+			(ret == LIBUSB_ERROR_TIMEOUT || (dev->retry_depth && ret == LIBUSB_ERROR_PIPE)))
+		{
+			if (ret == LIBUSB_ERROR_PIPE)
+				CH341DeviceClearHalt(dev);
+			else if (resends)
+				timeout = timeout * 2 < CH341_USB_TIMEOUT ? timeout * 2 : CH341_USB_TIMEOUT;
+
+			dev->stats.resends++;
+			dev->stats.transfers++;
+			dev->stats.op_transfers[dev->op]++;
+			resends++;
+			start = ch341_clock::now();
+			continue;
+		}
+
+		/* Unless provably nothing got across, a reply may be left over in the IN endpoint */
+		if (dir == LIBUSB_ENDPOINT_IN || bytestransferred || (ret != LIBUSB_ERROR_TIMEOUT && ret != LIBUSB_ERROR_PIPE))
+			dev->stale_in = true;
+
+		dev->stats.failures++;
+
+		if (!dev->retry_depth)
+			Message(MSG_ERROR, "Error: libusb_bulk_transfer for %s failed: %d (%s)\n",
+				dir == LIBUSB_ENDPOINT_IN ? "IN_EP" : "OUT_EP", ret, libusb_error_name(ret));
+		return -1;
+	}
+
+	elapsed = ch341_clock::now() - start;
+
+	CH341TransferTimed(dev, bytestransferred, elapsed);
+	CH341TransferDone(dev, dir, bytestransferred, elapsed);
+
+	return bytestransferred;
+}
+
+static bool CH341USBTransfer(ch341_device *dev, enum libusb_endpoint_direction dir, unsigned char *buff, unsigned int size)
+{
+	int pos, bytestransferred;
+
+	pos = 0;
+
+	while (size)
+	{
+		bytestransferred = CH341USBTransferPart(dev, dir, buff + pos, size);
+
+		if (bytestransferred <= 0)
+			return false;
+
+		pos += bytestransferred;
+		size -= bytestransferred;
+	}
+
+	return true;
+}
+
+#define CH341USBRead(dev, buff, size) CH341USBTransfer(dev, LIBUSB_ENDPOINT_IN, buff, size)
+#define CH341USBWrite(dev, buff, size) CH341USBTransfer(dev, LIBUSB_ENDPOINT_OUT, buff, size)
+
+/*
+ * Throws away what a failed exchange left in the IN endpoint, it would
+ * otherwise be taken for the reply to the next one. Only an empty endpoint
+ * timing out tells it is done, after as long as a packet takes to come in.
+ */
+static bool CH341DeviceDrain(ch341_device *dev)
+{
+	unsigned char buf[CH341_PACKET_LENGTH * 4];
+	unsigned int i, timeout;
+	int ret, n;
+
+	dev->stats.drains++;
+	timeout = CH341TransferTimeout(dev, CH341_PACKET_LENGTH);
+	timeout = timeout < CH341_DRAIN_TIMEOUT ? timeout : CH341_DRAIN_TIMEOUT;
+
+	for (i = 0; i < CH341_DRAIN_MAX; i++)
+	{
+		ret = CH341BulkTransfer(dev, CH341_USB_BULK_ENDPOINT | LIBUSB_ENDPOINT_IN, buf, sizeof (buf), &n, timeout);
+
+		if (ret == LIBUSB_ERROR_TIMEOUT && !n)
+		{
+			dev->stale_in = false;
+			return true;
+		}
+
+		if (ret)
+			CH341CountError(dev, ret);
+	}
+
+	return false;
+}
+
+/*
+ * The programmer re-enumerated, after a reset or because it lost power:
+ * waits for a CH341 to show up at the same port path and opens it into
+ * dev, claiming the interface again. Whatever was set up on the old
+ * handle is gone, CS is released by the next transfer which touches it.
+ */
+static bool CH341DeviceReconnect(ch341_device *dev, const char *why)
+{
+	char location[sizeof (dev->location)];
+	ch341_clock::time_point deadline;
+	long long left;
+	bool hotplug;
+
+	dev->stats.disconnects++;
+
+	snprintf(location, sizeof (location), "%s", dev->location);
+	Message(MSG_WARNING, "Warning: CH341 at %s %s, waiting for it to come back ...\n", location, why);
+
+	/* The stale handle is of no use any more, the emulator and a replay are reopened in place */
+	if (!dev->emu && !dev->replay)
+		CH341DeviceClose(dev);
+
+	hotplug = CH341HotplugStart();
+	deadline = ch341_clock::now() + std::chrono::milliseconds(CH341_RECONNECT_TIMEOUT_MS);
+
+	while (!(dev->replay ? !ReplayEvent(dev->replay, CAPTURE_EVENT_REOPEN) :
+		dev->emu ? !EmuReopen(dev->emu) : CH341DeviceDoOpen(dev, location, true)))
+	{
+		left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - ch341_clock::now()).count();
+
+		if (left <= 0 || CH341CancelFlag)
+		{
+			if (hotplug)
+				CH341HotplugStop();
+
+			/* Given up, further attempts fail right away instead of waiting again */
+			CH341DeviceClose(dev);
+
+			Message(MSG_ERROR, "Error: CH341 at %s did not come back\n", location);
+			return false;
+		}
+
+		/* Woken early by an arrival, but the new device may not be ready to open yet */
+		CH341HotplugWait(left < CH341_REOPEN_DELAY_MS ? (unsigned int) left : CH341_REOPEN_DELAY_MS);
+	}
+
+	if (hotplug)
+		CH341HotplugStop();
+
+	dev->stats.reopens++;
+	dev->stale_in = false;
+
+	if (dev->capture)
+		CaptureEvent(dev->capture, CAPTURE_EVENT_REOPEN);
+
+	Message(MSG_INFO, "CH341 at %s is back, continuing.\n", location);
+	return true;
+}
+
+static bool CH341DeviceReset(ch341_device *dev)
+{
+	int ret;
+
+	dev->stats.resets++;
+
+	if (dev->capture)
+		CaptureEvent(dev->capture, CAPTURE_EVENT_RESET);
+
+	if (dev->replay)
+		ret = ReplayEvent(dev->replay, CAPTURE_EVENT_RESET);
+	else if (dev->emu)
+		ret = EmuResetDevice(dev->emu);
+	else
+		ret = libusb_reset_device(dev->handle);
+
+	if (!ret)
+		return true;
+
+	/* It came back as a new device, look for it at the same place */
+	if (ret == LIBUSB_ERROR_NOT_FOUND || ret == LIBUSB_ERROR_NO_DEVICE)
+		return CH341DeviceReconnect(dev, "re-enumerated after reset");
+
+	Message(MSG_ERROR, "Error: libusb_reset_device failed: %d (%s)\n", ret, libusb_error_name(ret));
+	return false;
+}
+
+bool CH341DeviceRecover(ch341_device *dev, unsigned int attempt)
+{
+	unsigned int delay;
+
+	if (!CH341DeviceIsOpen(dev))
+		return false;
+
+	dev->stats.retries++;
+	MetricsRetry();
+
+	/* Gone from the bus, nothing but waiting for it to come back helps */
+	if (dev->last_error == LIBUSB_ERROR_NO_DEVICE)
+		return CH341DeviceReconnect(dev, "disconnected");
+
+	/* Most faults are one-offs, only the second attempt on waits */
+	if (attempt > 1)
+	{
+		delay = CH341_RETRY_BACKOFF_MS << (attempt - 2);
+		SleepMs(delay < CH341_RETRY_BACKOFF_MAX_MS ? delay : CH341_RETRY_BACKOFF_MAX_MS);
+	}
+
+	if (attempt >= CH341_RETRY_RESET_ATTEMPT)
+	{
+		if (!CH341DeviceReset(dev))
+			return false;
+	}
+	else if (dev->last_error == LIBUSB_ERROR_PIPE || attempt > 1)
+	{
+		/* A stall needs clearing at once, otherwise only when faults repeat */
+		CH341DeviceClearHalt(dev);
+	}
+
+	if (dev->stale_in)
+		return CH341DeviceDrain(dev);
+
+	return true;
+}
+
+void CH341Cancel(void)
+{
+	CH341CancelFlag = 1;
+}
+
+bool CH341Cancelled(void)
+{
+	return !!CH341CancelFlag;
+}
+
+void CH341CancelClear(void)
+{
+	CH341CancelFlag = 0;
+}
+
+/* Transfers which failed for good, those which went through when sent again don't count */
+unsigned int CH341DeviceErrorCount(const ch341_device *dev)
+{
+	return dev->stats.failures;
+}
+
+const char *CH341DeviceLastError(const ch341_device *dev)
+{
+	return libusb_error_name(dev->last_error);
+}
+
+/* Only says something if there were errors */
+void CH341DeviceShowStats(const ch341_device *dev)
+{
+	static const char *names[CH341_USB_ERR_KINDS] = { "timeout", "pipe", "io", "no device", "overflow", "other" };
+	const ch341_stats *st = &dev->stats;
+	unsigned int i, errors = 0;
+	char buf[256];
+	int len;
+
+	for (i = 0; i < CH341_USB_ERR_KINDS; i++)
+		errors += st->errors[i];
+
+	if (!errors)
+		return;
+
+	len = snprintf(buf, sizeof (buf), "USB: %u errors in %llu transfers (", errors, st->transfers);
+
+	for (i = 0; i < CH341_USB_ERR_KINDS; i++)
+		if (st->errors[i])
+			len += snprintf(buf + len, sizeof (buf) - len, "%s%s %u", buf[len - 1] == '(' ? "" : ", ", names[i], st->errors[i]);
+
+	Message(MSG_INFO, "%s), %u resent, %u failed, %u retries, %u halts cleared, %u resets, %u disconnects, %u reopens, "
+		"%u given up\n", buf, st->resends, st->failures, st->retries, st->clear_halts, st->resets, st->disconnects,
+		st->reopens, st->given_up);
+}
+
+void CH341DeviceOpBegin(ch341_device *dev, unsigned int kind)
+{
+	dev->op = kind < CH341_OP_KINDS ? kind : CH341_OP_OTHER;
+}
+
+void CH341DeviceOpEnd(ch341_device *dev, unsigned int bytes)
+{
+	dev->stats.ops[dev->op]++;
+	dev->stats.op_bytes[dev->op] += bytes;
+	dev->op = CH341_OP_OTHER;
+}
+
+/* Nearest rank, in us, 0 without any transfers */
+unsigned int CH341LatencyPercentile(const unsigned int *latency, double percent)
+{
+	unsigned long long total = 0, rank, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < CH341_LATENCY_BUCKETS; i++)
+		total += latency[i];
+
+	if (!total)
+		return 0;
+
+	rank = (unsigned long long) (total * percent / 100 + 0.999999);
+	if (!rank)
+		rank = 1;
+
+	for (i = 0; i < CH341_LATENCY_BUCKETS - 1; i++)
+	{
+		seen += latency[i];
+
+		if (seen >= rank)
+			break;
+	}
+
+	return (unsigned int) CH341LatencyBucketMax(i);
+}
+
+void CH341DeviceShowTransferStats(const ch341_device *dev)
+{
+	static const char *dir_names[2] = { "out", "in" };
+	static const char *op_names[CH341_OP_KINDS] = { "other", "read", "program", "erase" };
+	static const char *op_units[CH341_OP_KINDS] = { "", "chunks", "pages", "blocks" };
+	const ch341_stats *st = &dev->stats;
+	const ch341_dir_stats *ds;
+	unsigned int i;
+
+	Message(MSG_INFO, "\nUSB transfers:\n");
+
+	for (i = 0; i < 2; i++)
+	{
+		ds = &st->usb[i];
+
+		if (!ds->transfers)
+			continue;
+
+		Message(MSG_INFO, "  %-3s %10llu transfers, %llu bytes, %.1f%% payload, latency p50 %.3fms, p95 %.3fms, "
+			"p99 %.3fms\n", dir_names[i], ds->transfers, ds->wire_bytes,
+			ds->wire_bytes ? ds->payload_bytes * 100.0 / ds->wire_bytes : 0.0,
+			CH341LatencyPercentile(ds->latency, 50) / 1e3, CH341LatencyPercentile(ds->latency, 95) / 1e3,
+			CH341LatencyPercentile(ds->latency, 99) / 1e3);
+	}
+
+	Message(MSG_INFO, "Round trips:\n");
+
+	for (i = 0; i < CH341_OP_KINDS; i++)
+	{
+		if (!st->op_transfers[i])
+			continue;
+
+		if (i == CH341_OP_OTHER)
+		{
+			Message(MSG_INFO, "  %-7s %10llu\n", op_names[i], st->op_transfers[i]);
+			continue;
+		}
+
+		Message(MSG_INFO, "  %-7s %10llu in %u %s, %.1f each, %.2f per KiB\n", op_names[i], st->op_transfers[i],
+			st->ops[i], op_units[i], st->ops[i] ? (double) st->op_transfers[i] / st->ops[i] : 0.0,
+			st->op_bytes[i] ? st->op_transfers[i] * 1024.0 / st->op_bytes[i] : 0.0);
+	}
+}
+
+
+
+bool CH341DeviceChipSelect(ch341_device *dev, unsigned int cs, bool enable)
+{
+	unsigned char pkt[4];
+
+	static const int csio[4] = {0x36, 0x35, 0x33, 0x27};
+
+	if (cs > 3)
+	{
+		Message(MSG_ERROR, "Error: invalid CS pin %d, 0~3 are available\n", cs);
+		return false;
+	}
+
+	pkt[0] = CH341_CMD_UIO_STREAM;
+	if (enable)
+		pkt[1] = CH341_CMD_UIO_STM_OUT | csio[cs];
+	else
+		pkt[1] = CH341_CMD_UIO_STM_OUT | 0x37;
+	pkt[2] = CH341_CMD_UIO_STM_DIR | 0x3F;
+	pkt[3] = CH341_CMD_UIO_STM_END;
+
+	if (!CH341USBWrite(dev, pkt, 4))
+		return false;
+
+	if (enable)
+		PROBE1(cs_assert, cs);
+	else
+		PROBE1(cs_deassert, cs);
+
+	return true;
+}
+
+/*
+ * Starts a transaction with a fresh CS cycle: CS is raised and lowered
+ * again and the command clocked out, all in one bulk write. The command
+ * must fit into a packet.
+ */
+bool CH341DeviceSelectWrite(ch341_device *dev, unsigned int cs, const unsigned char *cmd, unsigned int len)
+{
+	static const int csio[4] = {0x36, 0x35, 0x33, 0x27};
+	unsigned char pkt[2 * CH341_PACKET_LENGTH];
+	unsigned int i;
+
+	if (cs > 3)
+	{
+		Message(MSG_ERROR, "Error: invalid CS pin %d, 0~3 are available\n", cs);
+		return false;
+	}
+
+	if (len > CH341_PACKET_LENGTH - 1)
+		return false;
+
+	memset(pkt, 0, sizeof (pkt));
+
+	pkt[0] = CH341_CMD_UIO_STREAM;
+	pkt[1] = CH341_CMD_UIO_STM_OUT | 0x37;
+	pkt[2] = CH341_CMD_UIO_STM_OUT | csio[cs];
+	pkt[3] = CH341_CMD_UIO_STM_DIR | 0x3F;
+	pkt[4] = CH341_CMD_UIO_STM_END;
+
+	pkt[CH341_PACKET_LENGTH] = CH341_CMD_SPI_STREAM;
+	for (i = 0; i < len; i++)
+		pkt[CH341_PACKET_LENGTH + 1 + i] = BitSwapTable[cmd[i]];
+
+	if (!CH341USBWrite(dev, pkt, CH341_PACKET_LENGTH + 1 + len))
+		return false;
+
+	/* Deasserted and asserted again within the write, only the new transaction is of interest */
+	PROBE1(cs_assert, cs);
+	CH341CountPayload(dev, len, 0);
+
+	/* What came back while the command went out is of no interest */
+	return CH341USBRead(dev, pkt, len);
+}
+
+/*
+ * Queue several short transactions in a single bulk write. Every command is
+ * padded to a whole packet so the CH341 executes them in order, the SPI
+ * bytes of all of them then come back in one read. Only for reads, as the
+ * padding clocks extra bytes before CS is released.
+ */
+static bool CH341DeviceDoBatchSPI(ch341_device *dev, unsigned int cs, const unsigned int *cs_list,
+	const ch341_spi_batch *ops, unsigned int count)
+{
+	static const int csio[4] = {0x36, 0x35, 0x33, 0x27};
+	unsigned char pkt[CH341_BATCH_MAX_OPS * 3 * CH341_PACKET_LENGTH], *p;
+	unsigned char in[CH341_BATCH_MAX_OPS * CH341_PACKET_LENGTH];
+	unsigned int i, j, n, pos, len;
+
+	while (count)
+	{
+		n = count > CH341_BATCH_MAX_OPS ? CH341_BATCH_MAX_OPS : count;
+
+		memset(pkt, 0, sizeof (pkt));
+		p = pkt;
+		len = 0;
+
+		for (i = 0; i < n; i++)
+		{
+			if (ops[i].cmd_len + ops[i].data_len > CH341_PACKET_LENGTH - 1)
+			{
+				Message(MSG_ERROR, "Error: batched SPI transaction too long\n");
+				return false;
+			}
+
+			if (cs_list)
+				cs = cs_list[i];
+
+			if (cs > 3)
+			{
+				Message(MSG_ERROR, "Error: invalid CS pin %d, 0~3 are available\n", cs);
+				return false;
+			}
+
+			p[0] = CH341_CMD_UIO_STREAM;
+			p[1] = CH341_CMD_UIO_STM_OUT | csio[cs];
+			p[2] = CH341_CMD_UIO_STM_DIR | 0x3F;
+			p[3] = CH341_CMD_UIO_STM_END;
+			p += CH341_PACKET_LENGTH;
+
+			p[0] = CH341_CMD_SPI_STREAM;
+			for (j = 0; j < ops[i].cmd_len; j++)
+				p[j + 1] = BitSwapTable[ops[i].cmd[j]];
+			p += CH341_PACKET_LENGTH;
+
+			p[0] = CH341_CMD_UIO_STREAM;
+			p[1] = CH341_CMD_UIO_STM_OUT | 0x37;
+			p[2] = CH341_CMD_UIO_STM_DIR | 0x3F;
+			p[3] = CH341_CMD_UIO_STM_END;
+			p += CH341_PACKET_LENGTH;
+
+			/* A padded SPI packet clocks all its bytes, the extra ones are discarded */
+			len += CH341_PACKET_LENGTH - 1;
+		}
+
+		/* The last packet need not be padded */
+		if (!CH341USBWrite(dev, pkt, (unsigned int) (p - pkt) - CH341_PACKET_LENGTH + 4))
+		{
+			if (!dev->retry_depth)
+				Message(MSG_ERROR, "Error: failed to transfer data to CH341\n");
+			return false;
+		}
+
+		if (!CH341USBRead(dev, in, len))
+		{
+			if (!dev->retry_depth)
+				Message(MSG_ERROR, "Error: failed to transfer data from CH341\n");
+			return false;
+		}
+
+		for (i = 0, pos = 0; i < n; i++, pos += CH341_PACKET_LENGTH - 1)
+		{
+			for (j = 0; j < ops[i].data_len; j++)
+				ops[i].data[j] = BitSwapTable[in[pos + ops[i].cmd_len + j]];
+
+			CH341CountPayload(dev, ops[i].cmd_len, ops[i].data_len);
+		}
+
+		ops += n;
+		count -= n;
+
+		if (cs_list)
+			cs_list += n;
+	}
+
+	return true;
+}
+
+bool CH341DeviceBatchSPI(ch341_device *dev, unsigned int cs, const ch341_spi_batch *ops, unsigned int count)
+{
+	return CH341DeviceDoBatchSPI(dev, cs, NULL, ops, count);
+}
+
+/* As CH341DeviceBatchSPI, but op i goes to chip select cs[i] */
+bool CH341DeviceBatchSPIMulti(ch341_device *dev, const unsigned int *cs, const ch341_spi_batch *ops, unsigned int count)
+{
+	return CH341DeviceDoBatchSPI(dev, 0, cs, ops, count);
+}
+
+/*
+ * in may already be bit-swapped (encoded), or NULL to clock out zeros when
+ * only reading, out may be NULL when the read back bytes are not wanted
+ */
+unsigned int CH341FrameSPI(const unsigned char *in, bool encoded, unsigned char *pkt, unsigned int size)
+{
+	unsigned int i;
+
+	if (size > CH341_PACKET_LENGTH - 1)
+		size = CH341_PACKET_LENGTH - 1;
+
+	pkt[0] = CH341_CMD_SPI_STREAM;
+
+	if (!in)
+		memset(pkt + 1, 0, size);
+	else if (encoded)
+		memcpy(pkt + 1, in, size);
+	else
+		for (i = 0; i < size; i++)
+			pkt[i + 1] = BitSwapTable[in[i]];
+
+	return size;
+}
+
+static int CH341TransferSPI(ch341_device *dev, const unsigned char *in, bool encoded, unsigned char *out, unsigned int size)
+{
+	unsigned char pkt[CH341_PACKET_LENGTH];
+	unsigned int i;
+
+	if (!size)
+		return 0;
+
+	size = CH341FrameSPI(in, encoded, pkt, size);
+
+	if (!CH341USBWrite(dev, pkt, size + 1))
+	{
+		if (!dev->retry_depth)
+			Message(MSG_ERROR, "Error: failed to transfer data to CH341\n");
+		return -1;
+	}
+
+	if (!CH341USBRead(dev, pkt, size))
+	{
+		if (!dev->retry_depth)
+			Message(MSG_ERROR, "Error: failed to transfer data from CH341\n");
+		return -1;
+	}
+
+	if (out)
+		for (i = 0; i < size; i++)
+			out[i] = BitSwapTable[pkt[i]];
+
+	CH341CountPayload(dev, in ? size : 0, out ? size : 0);
+
+	return size;
+}
+
+bool CH341DeviceStreamSPI(ch341_device *dev, const unsigned char *in, unsigned char *out, unsigned int size)
+{
+	int pos, bytestransferred;
+
+	if (!size)
+		return true;
+
+	pos = 0;
+
+	while (size)
+	{
+		bytestransferred = CH341TransferSPI(dev, in + pos, false, out + pos, size);
+
+		if (bytestransferred <= 0)
+			return false;
+
+		pos += bytestransferred;
+		size -= bytestransferred;
+	}
+
+	return true;
+}
+
+/* As CH341DeviceReadSPI, done tells how much arrived before a failure */
+bool CH341DeviceReadSPIPartial(ch341_device *dev, unsigned char *out, unsigned int size, unsigned int *done)
+{
+	int pos, bytestransferred;
+
+	*done = 0;
+
+	if (!size)
+		return true;
+
+	pos = 0;
+
+	while (size)
+	{
+		bytestransferred = CH341TransferSPI(dev, NULL, false, out + pos, size);
+
+		if (bytestransferred <= 0)
+			return false;
+
+		pos += bytestransferred;
+		size -= bytestransferred;
+		*done = pos;
+	}
+
+	return true;
+}
+
+bool CH341DeviceReadSPI(ch341_device *dev, unsigned char *out, unsigned int size)
+{
+	unsigned int done;
+
+	return CH341DeviceReadSPIPartial(dev, out, size, &done);
+}
+
+static bool CH341DeviceWriteSPIData(ch341_device *dev, const unsigned char *in, bool encoded, unsigned int size)
+{
+	int pos, bytestransferred;
+
+	if (!size)
+		return true;
+
+	pos = 0;
+
+	while (size)
+	{
+		bytestransferred = CH341TransferSPI(dev, in + pos, encoded, NULL, size);
+
+		if (bytestransferred <= 0)
+			return false;
+
+		pos += bytestransferred;
+		size -= bytestransferred;
+	}
+
+	return true;
+}
+
+bool CH341DeviceWriteSPI(ch341_device *dev, const unsigned char *in, unsigned int size)
+{
+	return CH341DeviceWriteSPIData(dev, in, false, size);
+}
+
+/* Same as CH341DeviceWriteSPI, for data already passed through CH341EncodeSPI */
+bool CH341DeviceWriteSPIEncoded(ch341_device *dev, const unsigned char *in, unsigned int size)
+{
+	return CH341DeviceWriteSPIData(dev, in, true, size);
+}
+
+bool CH341DeviceCaptureStart(ch341_device *dev, const char *path)
+{
+	if (dev->capture)
+		return true;
+
+	dev->capture = CaptureOpen(path, dev->version);
+
+	return dev->capture != NULL;
+}
+
+void CH341DeviceCaptureStop(ch341_device *dev)
+{
+	if (!dev->capture)
+		return;
+
+	CaptureClose(dev->capture);
+	dev->capture = NULL;
+}
+
+void CH341EncodeSPI(const unsigned char *in, unsigned char *out, unsigned int size)
+{
+	unsigned int i;
+
+	for (i = 0; i < size; i++)
+		out[i] = BitSwapTable[in[i]];
+}
+
+ch341_device *CH341DefaultDevice(void)
+{
+	return &CH341DefaultDeviceInst;
+}
+
+bool CH341DeviceInit(void)
+{
+	if (!CH341DeviceOpen(&CH341DefaultDeviceInst))
+		return false;
+
+	if (CH341DefaultCapture && !CH341DeviceCaptureStart(&CH341DefaultDeviceInst, CH341DefaultCapture))
+	{
+		CH341DeviceClose(&CH341DefaultDeviceInst);
+		return false;
+	}
+
+	return true;
+}
+
+void CH341DeviceRelease(void)
+{
+	CH341DeviceClose(&CH341DefaultDeviceInst);
+	CH341DeviceCaptureStop(&CH341DefaultDeviceInst);
+}
+
+bool CH341GetLocation(char *buf, unsigned int size)
+{
+	return CH341DeviceGetLocation(&CH341DefaultDeviceInst, buf, size);
+}
+
+bool CH341ChipSelect(unsigned int cs, bool enable)
+{
+	return CH341DeviceChipSelect(&CH341DefaultDeviceInst, cs, enable);
+}
+
+bool CH341BatchSPI(unsigned int cs, const ch341_spi_batch *ops, unsigned int count)
+{
+	return CH341DeviceBatchSPI(&CH341DefaultDeviceInst, cs, ops, count);
+}
+
+bool CH341StreamSPI(const unsigned char *in, unsigned char *out, unsigned int size)
+{
+	return CH341DeviceStreamSPI(&CH341DefaultDeviceInst, in, out, size);
+}
+
+bool CH341ReadSPI(unsigned char *out, unsigned int size)
+{
+	return CH341DeviceReadSPI(&CH341DefaultDeviceInst, out, size);
+}
+
+bool CH341WriteSPI(const unsigned char *in, unsigned int size)
+{
+	return CH341DeviceWriteSPI(&CH341DefaultDeviceInst, in, size);
+}
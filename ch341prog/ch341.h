@@ -1,57 +1,285 @@
-#ifndef _CH341_H_
-#define _CH341_H_
-
-#define CH341_USB_VID				0x1A86
-#define CH341_USB_PID				0x5512
-
-#define CH341_USB_BULK_ENDPOINT		0x02
-#define CH341_PACKET_LENGTH			0x20
-
-#define CH341_USB_TIMEOUT			15000
-
-#define CH341_CMD_SPI_STREAM		0xA8	//SPI command
-#define CH341_CMD_UIO_STREAM		0xAB	//UIO command
-
-#define	CH341_CMD_UIO_STM_IN		0x00	// UIO Interface In ( D0 ~ D7 )
-#define	CH341_CMD_UIO_STM_DIR		0x40	// UIO interface Dir( set dir of D0~D5 )
-#define	CH341_CMD_UIO_STM_OUT		0x80	// UIO Interface Output(D0~D5)
-#define	CH341_CMD_UIO_STM_END		0x20	// UIO Interface End Command
-
-bool CH341DeviceInit(void);
-void CH341DeviceRelease(void);
-
-bool CH341ChipSelect(unsigned int cs, bool enable);
-bool CH341StreamSPI(const unsigned char *in, unsigned char *out, unsigned int size);
-bool CH341ReadSPI(unsigned char *out, unsigned int size);
-bool CH341WriteSPI(const unsigned char *in, unsigned int size);
-
-static inline bool SPIWrite(const unsigned char *data, unsigned int size)
-{
-	if (!CH341ChipSelect(0, true))
-		return false;
-	if (!CH341WriteSPI(data, size))
-		return false;
-	return CH341ChipSelect(0, false);
-}
-
-static inline bool SPIRead(unsigned char *data, unsigned int size)
-{
-	if (!CH341ChipSelect(0, true))
-		return false;
-	if (!CH341ReadSPI(data, size))
-		return false;
-	return CH341ChipSelect(0, false);
-}
-
-static inline bool SPIWriteThenRead(const unsigned char *in, unsigned int in_size, unsigned char *out, unsigned int out_size)
-{
-	if (!CH341ChipSelect(0, true))
-		return false;
-	if (!CH341WriteSPI(in, in_size))
-		return false;
-	if (!CH341ReadSPI(out, out_size))
-		return false;
-	return CH341ChipSelect(0, false);
-}
-
-#endif /* _CH341_H_ */
+#ifndef _CH341_H_
+#define _CH341_H_
+
+#define CH341_USB_VID				0x1A86
+#define CH341_USB_PID				0x5512
+
+#define CH341_USB_BULK_ENDPOINT		0x02
+#define CH341_PACKET_LENGTH			0x20
+
+#define CH341_USB_TIMEOUT			15000	/* upper bound of the adaptive transfer timeout */
+#define CH341_TIMEOUT_INITIAL		1000	/* until the link has been measured */
+#define CH341_TIMEOUT_VAR_MARGIN	8	/* mean deviations of headroom per transfer, whatever its size */
+#define CH341_TIMEOUT_SAMPLES		8	/* transfers timed before the measured latency is trusted */
+
+#define CH341_RESEND_MAX			2	/* transfers which did not get across are sent again right away */
+#define CH341_RETRY_MAX				6	/* failed attempts in a row at one transaction before giving up */
+#define CH341_RETRY_BACKOFF_MS		1	/* wait before the second attempt, doubled for each further one */
+#define CH341_RETRY_BACKOFF_MAX_MS	256
+#define CH341_RETRY_RESET_ATTEMPT	4	/* from this attempt on the device is reset */
+#define CH341_DRAIN_TIMEOUT			5	/* at most, less once the link has been measured */
+#define CH341_DRAIN_MAX				16
+#define CH341_REOPEN_DELAY_MS		500	/* between attempts at opening a programmer which dropped off */
+#define CH341_RECONNECT_TIMEOUT_MS	10000
+
+#define CH341_BATCH_MAX_OPS			32
+#define CH341_MAX_CS				4
+
+#define CH341_CMD_SPI_STREAM		0xA8	//SPI command
+#define CH341_CMD_UIO_STREAM		0xAB	//UIO command
+
+#define	CH341_CMD_UIO_STM_IN		0x00	// UIO Interface In ( D0 ~ D7 )
+#define	CH341_CMD_UIO_STM_DIR		0x40	// UIO interface Dir( set dir of D0~D5 )
+#define	CH341_CMD_UIO_STM_OUT		0x80	// UIO Interface Output(D0~D5)
+#define	CH341_CMD_UIO_STM_END		0x20	// UIO Interface End Command
+
+/* One chip-select cycle: cmd is clocked out, then data_len bytes are read back */
+typedef struct _ch341_spi_batch
+{
+	const unsigned char *cmd;
+	unsigned int cmd_len;
+	unsigned char *data;
+	unsigned int data_len;
+} ch341_spi_batch;
+
+/* Kinds of failed transfers counted in ch341_stats */
+#define CH341_USB_ERR_TIMEOUT		0
+#define CH341_USB_ERR_PIPE			1
+#define CH341_USB_ERR_IO			2
+#define CH341_USB_ERR_NO_DEVICE		3
+#define CH341_USB_ERR_OVERFLOW		4
+#define CH341_USB_ERR_OTHER			5
+#define CH341_USB_ERR_KINDS			6
+
+/* Directions of ch341_stats.usb */
+#define CH341_DIR_OUT				0
+#define CH341_DIR_IN				1
+
+/*
+ * Transfer latency histogram in us, log-linear as in HdrHistogram: values
+ * below 16 each get a bucket, above that every power of two is split into
+ * 8, i.e. values are kept to within 12.5%, up to 16s.
+ */
+#define CH341_LATENCY_SUB			8
+#define CH341_LATENCY_BUCKETS		184
+
+/* Completed transfers in one direction */
+typedef struct _ch341_dir_stats
+{
+	unsigned long long transfers;
+	unsigned long long wire_bytes;
+	unsigned long long payload_bytes;	/* SPI bytes the caller sent or wanted back, the rest is framing and padding */
+	unsigned int latency[CH341_LATENCY_BUCKETS];
+} ch341_dir_stats;
+
+/* High-level operations transfers are attributed to, see CH341DeviceOpBegin */
+#define CH341_OP_OTHER				0	/* probe, status and mode changes outside the ones below */
+#define CH341_OP_READ				1	/* one read chunk */
+#define CH341_OP_PROGRAM			2	/* one page, including waiting for it */
+#define CH341_OP_ERASE				3	/* one erase block, including waiting for it */
+#define CH341_OP_KINDS				4
+
+/* Failed transfers and what it took to get going again, and what transfers cost */
+typedef struct _ch341_stats
+{
+	unsigned long long transfers;
+	unsigned int errors[CH341_USB_ERR_KINDS];
+	unsigned int failures;	/* transfers reported as failed, after resends */
+	unsigned int resends;
+	unsigned int retries;
+	unsigned int clear_halts;
+	unsigned int drains;
+	unsigned int resets;
+	unsigned int disconnects;
+	unsigned int reopens;
+	unsigned int given_up;
+
+	ch341_dir_stats usb[2];
+
+	unsigned int ops[CH341_OP_KINDS];
+	unsigned long long op_transfers[CH341_OP_KINDS];	/* round trips, failed attempts included */
+	unsigned long long op_bytes[CH341_OP_KINDS];
+} ch341_stats;
+
+struct libusb_device_handle;
+struct _emu_device;
+struct _replay_device;
+struct _capture_writer;
+
+/* One programmer, each thread may drive its own */
+typedef struct _ch341_device
+{
+	struct libusb_device_handle *handle;
+	struct _emu_device *emu;
+	struct _replay_device *replay;
+	struct _capture_writer *capture;
+	unsigned int version;
+	char location[32];
+
+	ch341_stats stats;
+	int last_error;
+	bool stale_in;
+
+	/* Smoothed round trip time of one packet and its mean deviation, in us */
+	unsigned int rtt_us;
+	unsigned int rtt_var_us;
+	unsigned int rtt_samples;
+
+	/* Non-zero while the caller retries failed transfers itself, they are then only counted */
+	unsigned int retry_depth;
+
+	/* What transfers are currently done for, CH341_OP_* */
+	unsigned int op;
+} ch341_device;
+
+typedef struct _ch341_device_info
+{
+	unsigned int index;
+	char location[32];
+	unsigned int version;
+	char serial[64];
+} ch341_device_info;
+
+bool CH341DeviceOpen(ch341_device *dev);
+bool CH341DeviceOpenSpec(ch341_device *dev, const char *spec);
+unsigned int CH341DeviceOpenAll(ch341_device *devs, unsigned int max);
+unsigned int CH341DeviceList(ch341_device_info *infos, unsigned int max);
+void CH341DeviceClose(ch341_device *dev);
+bool CH341DeviceGetLocation(ch341_device *dev, char *buf, unsigned int size);
+
+static inline bool CH341DeviceIsOpen(const ch341_device *dev)
+{
+	return dev->handle || dev->emu || dev->replay;
+}
+
+/*
+ * Retry support: after a failed transfer, Recover gets the programmer
+ * going again for the given attempt (1, 2, ...) of the failed transaction.
+ * Later attempts wait longer and escalate from clearing endpoint halts to
+ * resetting and reopening the device. A programmer which dropped off the
+ * bus is waited for at the same port and reopened in place, the handle in
+ * dev stays valid for the caller. CS is left in an unknown state.
+ */
+bool CH341DeviceRecover(ch341_device *dev, unsigned int attempt);
+unsigned int CH341DeviceErrorCount(const ch341_device *dev);
+const char *CH341DeviceLastError(const ch341_device *dev);
+void CH341DeviceShowStats(const ch341_device *dev);
+
+/*
+ * Transfers between Begin and End count as round trips of one operation
+ * of the given kind, moving bytes of flash data. Attempts which failed
+ * and were retried count too, End is only called once the operation
+ * went through.
+ */
+void CH341DeviceOpBegin(ch341_device *dev, unsigned int kind);
+void CH341DeviceOpEnd(ch341_device *dev, unsigned int bytes);
+
+/* Latency percentiles, payload efficiency and round trips per operation */
+void CH341DeviceShowTransferStats(const ch341_device *dev);
+unsigned int CH341LatencyPercentile(const unsigned int *latency, double percent);
+
+/*
+ * Interrupting a run: Cancel may be called from a signal handler, long
+ * operations then stop at their next chunk and leave the chip deselected
+ * and in 3-byte mode. Transfers keep working, for that cleanup.
+ */
+void CH341Cancel(void);
+bool CH341Cancelled(void);
+void CH341CancelClear(void);
+
+/*
+ * Attach/detach notification for programs waiting for programmers to come
+ * and go. Without libusb hotplug support Wait just sleeps and callers find
+ * out by polling. Start and Stop nest.
+ */
+bool CH341HotplugStart(void);
+void CH341HotplugStop(void);
+bool CH341HotplugWait(unsigned int timeout_ms);
+
+bool CH341DeviceChipSelect(ch341_device *dev, unsigned int cs, bool enable);
+bool CH341DeviceSelectWrite(ch341_device *dev, unsigned int cs, const unsigned char *cmd, unsigned int len);
+bool CH341DeviceBatchSPI(ch341_device *dev, unsigned int cs, const ch341_spi_batch *ops, unsigned int count);
+bool CH341DeviceBatchSPIMulti(ch341_device *dev, const unsigned int *cs, const ch341_spi_batch *ops, unsigned int count);
+bool CH341DeviceStreamSPI(ch341_device *dev, const unsigned char *in, unsigned char *out, unsigned int size);
+bool CH341DeviceReadSPI(ch341_device *dev, unsigned char *out, unsigned int size);
+bool CH341DeviceReadSPIPartial(ch341_device *dev, unsigned char *out, unsigned int size, unsigned int *done);
+bool CH341DeviceWriteSPI(ch341_device *dev, const unsigned char *in, unsigned int size);
+bool CH341DeviceWriteSPIEncoded(ch341_device *dev, const unsigned char *in, unsigned int size);
+
+/* Converts data to the CH341 wire bit order once, for data sent many times */
+void CH341EncodeSPI(const unsigned char *in, unsigned char *out, unsigned int size);
+
+/*
+ * Builds one SPI stream packet from up to CH341_PACKET_LENGTH - 1 bytes of
+ * in (encoded or not, NULL for zeros), returns how many bytes it took
+ */
+unsigned int CH341FrameSPI(const unsigned char *in, bool encoded, unsigned char *pkt, unsigned int size);
+
+static inline bool SPIDevWrite(ch341_device *dev, unsigned int cs, const unsigned char *data, unsigned int size)
+{
+	if (!CH341DeviceChipSelect(dev, cs, true))
+		return false;
+	if (!CH341DeviceWriteSPI(dev, data, size))
+		return false;
+	return CH341DeviceChipSelect(dev, cs, false);
+}
+
+static inline bool SPIDevRead(ch341_device *dev, unsigned int cs, unsigned char *data, unsigned int size)
+{
+	if (!CH341DeviceChipSelect(dev, cs, true))
+		return false;
+	if (!CH341DeviceReadSPI(dev, data, size))
+		return false;
+	return CH341DeviceChipSelect(dev, cs, false);
+}
+
+static inline bool SPIDevWriteThenRead(ch341_device *dev, unsigned int cs, const unsigned char *in, unsigned int in_size,
+	unsigned char *out, unsigned int out_size)
+{
+	if (!CH341DeviceChipSelect(dev, cs, true))
+		return false;
+	if (!CH341DeviceWriteSPI(dev, in, in_size))
+		return false;
+	if (!CH341DeviceReadSPI(dev, out, out_size))
+		return false;
+	return CH341DeviceChipSelect(dev, cs, false);
+}
+
+/*
+ * Records every transfer of dev to path until CaptureStop (see capture.h),
+ * a device reopened after dropping off keeps being recorded.
+ */
+bool CH341DeviceCaptureStart(ch341_device *dev, const char *path);
+void CH341DeviceCaptureStop(ch341_device *dev);
+
+/* Default programmer, for single-device callers */
+ch341_device *CH341DefaultDevice(void);
+void CH341SelectDevice(const char *spec);
+void CH341SelectCapture(const char *path);
+
+bool CH341DeviceInit(void);
+void CH341DeviceRelease(void);
+bool CH341GetLocation(char *buf, unsigned int size);
+
+bool CH341ChipSelect(unsigned int cs, bool enable);
+bool CH341BatchSPI(unsigned int cs, const ch341_spi_batch *ops, unsigned int count);
+bool CH341StreamSPI(const unsigned char *in, unsigned char *out, unsigned int size);
+bool CH341ReadSPI(unsigned char *out, unsigned int size);
+bool CH341WriteSPI(const unsigned char *in, unsigned int size);
+
+static inline bool SPIWrite(const unsigned char *data, unsigned int size)
+{
+	return SPIDevWrite(CH341DefaultDevice(), 0, data, size);
+}
+
+static inline bool SPIRead(unsigned char *data, unsigned int size)
+{
+	return SPIDevRead(CH341DefaultDevice(), 0, data, size);
+}
+
+static inline bool SPIWriteThenRead(const unsigned char *in, unsigned int in_size, unsigned char *out, unsigned int out_size)
+{
+	return SPIDevWriteThenRead(CH341DefaultDevice(), 0, in, in_size, out, out_size);
+}
+
+#endif /* _CH341_H_ */
@@ -0,0 +1,816 @@
+#include "stdafx.h"
+
+#include <string.h>
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "checksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#define TARGET(_isa)				__attribute__((target(_isa)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define CHECKSUM_X86
+#include <intrin.h>
+#include <immintrin.h>
+#define TARGET(_isa)
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHECKSUM_X86_64
+#endif
+
+#define CRC32_POLY					0xedb88320
+#define CRC32C_POLY					0x82f63b78
+
+#define CHECKSUM_RING_SIZE			(1 << 20)
+
+#define min(a, b) (((a) > (b)) ? (b) : (a))
+
+static unsigned int crc32_table[8][256];
+static unsigned int crc32c_table[8][256];
+
+static bool cpu_has_sse42;
+static bool cpu_has_pclmul;
+static bool cpu_has_sha;
+
+static const unsigned int sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void CrcTableInit(unsigned int table[8][256], unsigned int poly)
+{
+	unsigned int i, j, crc;
+
+	for (i = 0; i < 256; i++)
+	{
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+		table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+}
+
+static bool ChecksumSetup(void)
+{
+	CrcTableInit(crc32_table, CRC32_POLY);
+	CrcTableInit(crc32c_table, CRC32C_POLY);
+
+#if defined(CHECKSUM_X86) && defined(__GNUC__)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+	{
+		cpu_has_sse42 = !!(ecx & bit_SSE4_2);
+		cpu_has_pclmul = (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+		cpu_has_sha = !!(ecx & bit_SSE4_1);
+	}
+
+	if (!cpu_has_sha || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		cpu_has_sha = false;
+	else
+		cpu_has_sha = !!(ebx & (1 << 29));
+#elif defined(CHECKSUM_X86)
+	int regs[4];
+
+	__cpuid(regs, 1);
+	cpu_has_sse42 = !!(regs[2] & (1 << 20));
+	cpu_has_pclmul = (regs[2] & (1 << 1)) && (regs[2] & (1 << 19));
+	cpu_has_sha = !!(regs[2] & (1 << 19));
+
+	__cpuidex(regs, 7, 0);
+	cpu_has_sha = cpu_has_sha && (regs[1] & (1 << 29));
+#endif
+
+	return true;
+}
+
+static void ChecksumEnsureSetup(void)
+{
+	/* C++11 guarantees this runs exactly once, even with the worker thread */
+	static const bool ready = ChecksumSetup();
+
+	(void) ready;
+}
+
+static inline unsigned int Load32LE(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static unsigned int CrcSliceBy8(unsigned int table[8][256], unsigned int crc, const unsigned char *p, unsigned int len)
+{
+	unsigned int hi;
+
+	while (len >= 8)
+	{
+		crc ^= Load32LE(p);
+		hi = Load32LE(p + 4);
+
+		crc = table[7][crc & 0xff] ^ table[6][(crc >> 8) & 0xff] ^
+			table[5][(crc >> 16) & 0xff] ^ table[4][crc >> 24] ^
+			table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+			table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef CHECKSUM_X86
+/* CRC32 folding with carry-less multiply, see Intel's "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction".
+ * len must be at least 64 and a multiple of 16. */
+TARGET("pclmul,sse4.1")
+static unsigned int Crc32Pclmul(unsigned int crc, const unsigned char *p, unsigned int len)
+{
+	static const unsigned long long k1k2[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+	static const unsigned long long k3k4[2] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+	static const unsigned long long k5k0[2] = { 0x0163cd6124ULL, 0x0000000000ULL };
+	static const unsigned long long poly[2] = { 0x01db710641ULL, 0x01f7011641ULL };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *) (p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_loadu_si128((const __m128i *) k1k2);
+
+	p += 64;
+	len -= 64;
+
+	/* Fold four lanes of 128 bits in parallel */
+	while (len >= 64)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *) (p + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *) (p + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *) (p + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *) (p + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		p += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = _mm_loadu_si128((const __m128i *) k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16)
+	{
+		x2 = _mm_loadu_si128((const __m128i *) p);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		p += 16;
+		len -= 16;
+	}
+
+	/* 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_loadu_si128((const __m128i *) poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+TARGET("sse4.2")
+static unsigned int Crc32cSse42(unsigned int crc, const unsigned char *p, unsigned int len)
+{
+	while (len && ((size_t) p & 7))
+	{
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+
+#ifdef CHECKSUM_X86_64
+	unsigned long long crc64 = crc, val64;
+
+	while (len >= 8)
+	{
+		memcpy(&val64, p, 8);
+		crc64 = _mm_crc32_u64(crc64, val64);
+		p += 8;
+		len -= 8;
+	}
+
+	crc = (unsigned int) crc64;
+#endif
+
+	unsigned int val;
+
+	while (len >= 4)
+	{
+		memcpy(&val, p, 4);
+		crc = _mm_crc32_u32(crc, val);
+		p += 4;
+		len -= 4;
+	}
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+TARGET("sha,sse4.1")
+static void Sha256TransformShaNi(unsigned int state[8], const unsigned char *data, unsigned int blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef_save, cdgh_save, msg[4], tmp, m;
+	unsigned int g;
+
+	tmp = _mm_loadu_si128((const __m128i *) &state[0]);
+	state1 = _mm_loadu_si128((const __m128i *) &state[4]);
+
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);
+	state1 = _mm_shuffle_epi32(state1, 0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+	while (blocks--)
+	{
+		abef_save = state0;
+		cdgh_save = state1;
+
+		/* 16 groups of four rounds, the message schedule is kept in a 4-entry ring */
+		for (g = 0; g < 16; g++)
+		{
+			if (g < 4)
+			{
+				msg[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + g * 16)), mask);
+			}
+			else
+			{
+				tmp = _mm_sha256msg1_epu32(msg[g & 3], msg[(g + 1) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(g + 3) & 3], msg[(g + 2) & 3], 4));
+				msg[g & 3] = _mm_sha256msg2_epu32(tmp, msg[(g + 3) & 3]);
+			}
+
+			m = _mm_add_epi32(msg[g & 3], _mm_loadu_si128((const __m128i *) &sha256_k[g * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+			m = _mm_shuffle_epi32(m, 0x0e);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *) &state[0], state0);
+	_mm_storeu_si128((__m128i *) &state[4], state1);
+}
+#endif /* CHECKSUM_X86 */
+
+unsigned int Crc32Update(unsigned int crc, const unsigned char *data, unsigned int len)
+{
+	unsigned int bulk;
+
+	ChecksumEnsureSetup();
+
+	crc = ~crc;
+
+#ifdef CHECKSUM_X86
+	if (cpu_has_pclmul && len >= 64)
+	{
+		bulk = len & ~15;
+		crc = Crc32Pclmul(crc, data, bulk);
+		data += bulk;
+		len -= bulk;
+	}
+#else
+	(void) bulk;
+#endif
+
+	return ~CrcSliceBy8(crc32_table, crc, data, len);
+}
+
+unsigned int Crc32cUpdate(unsigned int crc, const unsigned char *data, unsigned int len)
+{
+	ChecksumEnsureSetup();
+
+#ifdef CHECKSUM_X86
+	if (cpu_has_sse42)
+		return ~Crc32cSse42(~crc, data, len);
+#endif
+
+	return ~CrcSliceBy8(crc32c_table, ~crc, data, len);
+}
+
+#define ROR32(_v, _n)				(((_v) >> (_n)) | ((_v) << (32 - (_n))))
+
+static void Sha256TransformGeneric(unsigned int state[8], const unsigned char *data, unsigned int blocks)
+{
+	unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+	unsigned int i;
+
+	while (blocks--)
+	{
+		for (i = 0; i < 16; i++)
+			w[i] = (data[i * 4] << 24) | (data[i * 4 + 1] << 16) | (data[i * 4 + 2] << 8) | data[i * 4 + 3];
+
+		for (i = 16; i < 64; i++)
+			w[i] = w[i - 16] + (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+				w[i - 7] + (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		for (i = 0; i < 64; i++)
+		{
+			t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+
+		data += 64;
+	}
+}
+
+static void Sha256Transform(unsigned int state[8], const unsigned char *data, unsigned int blocks)
+{
+#ifdef CHECKSUM_X86
+	if (cpu_has_sha)
+	{
+		Sha256TransformShaNi(state, data, blocks);
+		return;
+	}
+#endif
+
+	Sha256TransformGeneric(state, data, blocks);
+}
+
+void Sha256Init(sha256_ctx *ctx)
+{
+	static const unsigned int iv[8] =
+	{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	ChecksumEnsureSetup();
+
+	memcpy(ctx->state, iv, sizeof (iv));
+	ctx->length = 0;
+	ctx->block_len = 0;
+}
+
+void Sha256Update(sha256_ctx *ctx, const unsigned char *data, unsigned int len)
+{
+	unsigned int n;
+
+	ctx->length += len;
+
+	if (ctx->block_len)
+	{
+		n = min(len, 64 - ctx->block_len);
+		memcpy(ctx->block + ctx->block_len, data, n);
+		ctx->block_len += n;
+		data += n;
+		len -= n;
+
+		if (ctx->block_len < 64)
+			return;
+
+		Sha256Transform(ctx->state, ctx->block, 1);
+		ctx->block_len = 0;
+	}
+
+	if (len >= 64)
+	{
+		Sha256Transform(ctx->state, data, len / 64);
+		data += len & ~63;
+		len &= 63;
+	}
+
+	memcpy(ctx->block, data, len);
+	ctx->block_len = len;
+}
+
+void Sha256Final(sha256_ctx *ctx, unsigned char *digest)
+{
+	unsigned long long bits = ctx->length * 8;
+	unsigned int i;
+
+	ctx->block[ctx->block_len++] = 0x80;
+
+	if (ctx->block_len > 56)
+	{
+		memset(ctx->block + ctx->block_len, 0, 64 - ctx->block_len);
+		Sha256Transform(ctx->state, ctx->block, 1);
+		ctx->block_len = 0;
+	}
+
+	memset(ctx->block + ctx->block_len, 0, 56 - ctx->block_len);
+
+	for (i = 0; i < 8; i++)
+		ctx->block[56 + i] = (bits >> (56 - i * 8)) & 0xff;
+
+	Sha256Transform(ctx->state, ctx->block, 1);
+
+	for (i = 0; i < 8; i++)
+	{
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = (ctx->state[i] >> 16) & 0xff;
+		digest[i * 4 + 2] = (ctx->state[i] >> 8) & 0xff;
+		digest[i * 4 + 3] = ctx->state[i] & 0xff;
+	}
+}
+
+void ChecksumInit(checksum_ctx *ctx, unsigned int algos)
+{
+	ctx->algos = algos;
+	ctx->crc32 = 0;
+	ctx->crc32c = 0;
+
+	if (algos & CHECKSUM_SHA256)
+		Sha256Init(&ctx->sha256);
+}
+
+void ChecksumUpdate(checksum_ctx *ctx, const unsigned char *data, unsigned int len)
+{
+	if (ctx->algos & CHECKSUM_CRC32)
+		ctx->crc32 = Crc32Update(ctx->crc32, data, len);
+
+	if (ctx->algos & CHECKSUM_CRC32C)
+		ctx->crc32c = Crc32cUpdate(ctx->crc32c, data, len);
+
+	if (ctx->algos & CHECKSUM_SHA256)
+		Sha256Update(&ctx->sha256, data, len);
+}
+
+void ChecksumFinal(checksum_ctx *ctx, checksum_result *res)
+{
+	res->algos = ctx->algos;
+	res->crc32 = ctx->crc32;
+	res->crc32c = ctx->crc32c;
+
+	if (ctx->algos & CHECKSUM_SHA256)
+		Sha256Final(&ctx->sha256, res->sha256);
+	else
+		memset(res->sha256, 0, sizeof (res->sha256));
+}
+
+unsigned int ChecksumParseAlgos(const char *name)
+{
+	unsigned int algos = 0;
+	const char *end;
+	size_t len;
+
+	while (*name)
+	{
+		end = strchr(name, ',');
+		len = end ? (size_t) (end - name) : strlen(name);
+
+		if (len == 5 && !strncmp(name, "crc32", len))
+			algos |= CHECKSUM_CRC32;
+		else if (len == 6 && !strncmp(name, "crc32c", len))
+			algos |= CHECKSUM_CRC32C;
+		else if ((len == 6 && !strncmp(name, "sha256", len)) || (len == 7 && !strncmp(name, "sha-256", len)))
+			algos |= CHECKSUM_SHA256;
+		else if (len == 3 && !strncmp(name, "all", len))
+			algos |= CHECKSUM_ALL;
+		else
+			return 0;
+
+		name += len;
+		if (*name == ',')
+			name++;
+	}
+
+	return algos;
+}
+
+void ChecksumShowEngine(unsigned int algos)
+{
+	ChecksumEnsureSetup();
+
+	printf("Checksum engine:");
+
+	if (algos & CHECKSUM_CRC32)
+		printf(" CRC32 (%s)", cpu_has_pclmul ? "PCLMUL" : "slice-by-8");
+
+	if (algos & CHECKSUM_CRC32C)
+		printf(" CRC32C (%s)", cpu_has_sse42 ? "SSE4.2" : "slice-by-8");
+
+	if (algos & CHECKSUM_SHA256)
+		printf(" SHA-256 (%s)", cpu_has_sha ? "SHA-NI" : "generic");
+
+	printf("\n");
+}
+
+static void PrintHex(const unsigned char *data, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		printf("%02x", data[i]);
+}
+
+void ChecksumPrint(const checksum_result *res)
+{
+	if (res->algos & CHECKSUM_CRC32)
+		printf("CRC32:   %08x\n", res->crc32);
+
+	if (res->algos & CHECKSUM_CRC32C)
+		printf("CRC32C:  %08x\n", res->crc32c);
+
+	if (res->algos & CHECKSUM_SHA256)
+	{
+		printf("SHA-256: ");
+		PrintHex(res->sha256, sizeof (res->sha256));
+		printf("\n");
+	}
+}
+
+void ChecksumPrintRegion(const checksum_result *res)
+{
+	printf("%08x %08x", res->addr, res->size);
+
+	if (res->algos & CHECKSUM_CRC32)
+		printf(" crc32:%08x", res->crc32);
+
+	if (res->algos & CHECKSUM_CRC32C)
+		printf(" crc32c:%08x", res->crc32c);
+
+	if (res->algos & CHECKSUM_SHA256)
+	{
+		printf(" sha256:");
+		PrintHex(res->sha256, sizeof (res->sha256));
+	}
+
+	printf("\n");
+}
+
+struct _checksum_stream
+{
+	unsigned int algos;
+	unsigned int addr;
+	unsigned int len;
+	unsigned int region_size;
+
+	/* Byte ring between the flash reader and the hashing thread */
+	unsigned char *ring;
+	unsigned long long produced;
+	unsigned long long consumed;
+	bool finishing;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	std::thread worker;
+
+	checksum_ctx total;
+	checksum_ctx region;
+	unsigned int region_fill;
+
+	checksum_result *regions;
+	unsigned int num_regions;
+	unsigned int region_count;
+};
+
+static void ChecksumStreamRegionDone(checksum_stream *cs)
+{
+	checksum_result *res;
+
+	if (cs->region_count >= cs->num_regions)
+		return;
+
+	res = &cs->regions[cs->region_count];
+
+	ChecksumFinal(&cs->region, res);
+	res->addr = cs->addr + cs->region_count * cs->region_size;
+	res->size = cs->region_fill;
+
+	cs->region_count++;
+	cs->region_fill = 0;
+
+	ChecksumInit(&cs->region, cs->algos);
+}
+
+static void ChecksumStreamConsume(checksum_stream *cs, const unsigned char *data, unsigned int len)
+{
+	unsigned int n;
+
+	ChecksumUpdate(&cs->total, data, len);
+
+	if (!cs->region_size)
+		return;
+
+	while (len)
+	{
+		n = min(len, cs->region_size - cs->region_fill);
+
+		ChecksumUpdate(&cs->region, data, n);
+		cs->region_fill += n;
+
+		if (cs->region_fill == cs->region_size)
+			ChecksumStreamRegionDone(cs);
+
+		data += n;
+		len -= n;
+	}
+}
+
+static void ChecksumStreamWorker(checksum_stream *cs)
+{
+	unsigned int offset, n;
+
+	std::unique_lock<std::mutex> lk(cs->lock);
+
+	while (true)
+	{
+		cs->cond.wait(lk, [cs] { return cs->produced > cs->consumed || cs->finishing; });
+
+		if (cs->produced == cs->consumed)
+			break;
+
+		offset = (unsigned int) (cs->consumed % CHECKSUM_RING_SIZE);
+		n = (unsigned int) min(cs->produced - cs->consumed, (unsigned long long) (CHECKSUM_RING_SIZE - offset));
+
+		/* The producer never touches this span until consumed moves past it */
+		lk.unlock();
+		ChecksumStreamConsume(cs, cs->ring + offset, n);
+		lk.lock();
+
+		cs->consumed += n;
+		cs->cond.notify_all();
+	}
+
+	if (cs->region_fill)
+		ChecksumStreamRegionDone(cs);
+}
+
+checksum_stream *ChecksumStreamStart(unsigned int algos, unsigned int addr, unsigned int len, unsigned int region_size)
+{
+	checksum_stream *cs;
+
+	ChecksumEnsureSetup();
+
+	cs = new checksum_stream;
+
+	cs->algos = algos;
+	cs->addr = addr;
+	cs->len = len;
+	cs->region_size = region_size;
+
+	cs->ring = new unsigned char[CHECKSUM_RING_SIZE];
+	cs->produced = 0;
+	cs->consumed = 0;
+	cs->finishing = false;
+
+	ChecksumInit(&cs->total, algos);
+	ChecksumInit(&cs->region, algos);
+	cs->region_fill = 0;
+
+	cs->num_regions = region_size ? (len + region_size - 1) / region_size : 0;
+	cs->regions = cs->num_regions ? new checksum_result[cs->num_regions] : NULL;
+	cs->region_count = 0;
+
+	cs->worker = std::thread(ChecksumStreamWorker, cs);
+
+	return cs;
+}
+
+bool ChecksumStreamFeed(checksum_stream *cs, const unsigned char *data, unsigned int len)
+{
+	unsigned int offset, n;
+
+	if (!cs)
+		return false;
+
+	std::unique_lock<std::mutex> lk(cs->lock);
+
+	while (len)
+	{
+		cs->cond.wait(lk, [cs] { return cs->produced - cs->consumed < CHECKSUM_RING_SIZE; });
+
+		offset = (unsigned int) (cs->produced % CHECKSUM_RING_SIZE);
+		n = (unsigned int) (CHECKSUM_RING_SIZE - (cs->produced - cs->consumed));
+		n = min(n, CHECKSUM_RING_SIZE - offset);
+		n = min(n, len);
+
+		memcpy(cs->ring + offset, data, n);
+
+		cs->produced += n;
+		cs->cond.notify_all();
+
+		data += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+void ChecksumStreamFinish(checksum_stream *cs, checksum_result *total)
+{
+	{
+		std::lock_guard<std::mutex> lk(cs->lock);
+		cs->finishing = true;
+		cs->cond.notify_all();
+	}
+
+	if (cs->worker.joinable())
+		cs->worker.join();
+
+	if (total)
+	{
+		ChecksumFinal(&cs->total, total);
+		total->addr = cs->addr;
+		total->size = (unsigned int) cs->produced;
+	}
+}
+
+const checksum_result *ChecksumStreamRegions(checksum_stream *cs, unsigned int *count)
+{
+	*count = cs->region_count;
+	return cs->regions;
+}
+
+void ChecksumStreamFree(checksum_stream *cs)
+{
+	if (!cs)
+		return;
+
+	if (cs->worker.joinable())
+		ChecksumStreamFinish(cs, NULL);
+
+	delete[] cs->ring;
+	delete[] cs->regions;
+	delete cs;
+}
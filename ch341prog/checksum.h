@@ -0,0 +1,63 @@
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#define CHECKSUM_CRC32				0x1
+#define CHECKSUM_CRC32C				0x2
+#define CHECKSUM_SHA256				0x4
+
+#define CHECKSUM_ALL				(CHECKSUM_CRC32 | CHECKSUM_CRC32C | CHECKSUM_SHA256)
+
+#define SHA256_DIGEST_LENGTH		32
+
+typedef struct _sha256_ctx
+{
+	unsigned int state[8];
+	unsigned long long length;
+	unsigned char block[64];
+	unsigned int block_len;
+} sha256_ctx;
+
+typedef struct _checksum_ctx
+{
+	unsigned int algos;
+	unsigned int crc32;
+	unsigned int crc32c;
+	sha256_ctx sha256;
+} checksum_ctx;
+
+typedef struct _checksum_result
+{
+	unsigned int algos;
+	unsigned int addr;
+	unsigned int size;
+	unsigned int crc32;
+	unsigned int crc32c;
+	unsigned char sha256[SHA256_DIGEST_LENGTH];
+} checksum_result;
+
+typedef struct _checksum_stream checksum_stream;
+
+unsigned int Crc32Update(unsigned int crc, const unsigned char *data, unsigned int len);
+unsigned int Crc32cUpdate(unsigned int crc, const unsigned char *data, unsigned int len);
+
+void Sha256Init(sha256_ctx *ctx);
+void Sha256Update(sha256_ctx *ctx, const unsigned char *data, unsigned int len);
+void Sha256Final(sha256_ctx *ctx, unsigned char *digest);
+
+void ChecksumInit(checksum_ctx *ctx, unsigned int algos);
+void ChecksumUpdate(checksum_ctx *ctx, const unsigned char *data, unsigned int len);
+void ChecksumFinal(checksum_ctx *ctx, checksum_result *res);
+
+unsigned int ChecksumParseAlgos(const char *name);
+void ChecksumShowEngine(unsigned int algos);
+void ChecksumPrint(const checksum_result *res);
+void ChecksumPrintRegion(const checksum_result *res);
+
+/* Hashes a byte stream on a worker thread, optionally split into fixed-size regions */
+checksum_stream *ChecksumStreamStart(unsigned int algos, unsigned int addr, unsigned int len, unsigned int region_size);
+bool ChecksumStreamFeed(checksum_stream *cs, const unsigned char *data, unsigned int len);
+void ChecksumStreamFinish(checksum_stream *cs, checksum_result *total);
+const checksum_result *ChecksumStreamRegions(checksum_stream *cs, unsigned int *count);
+void ChecksumStreamFree(checksum_stream *cs);
+
+#endif /* _CHECKSUM_H_ */
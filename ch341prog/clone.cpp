@@ -0,0 +1,321 @@
+#include "stdafx.h"
+
+#include <string.h>
+#include <errno.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "clone.h"
+
+#define CLONE_PROGRESS_INTERVAL_MS	200
+
+typedef struct _clone_slot
+{
+	unsigned int addr;
+	unsigned int len;
+	unsigned char *data;
+} clone_slot;
+
+/* Chunks travel from the reader to the writer, in order, through a fixed set of slots */
+typedef struct _clone_ring
+{
+	std::mutex lock;
+	std::condition_variable cond;
+	clone_slot slots[CLONE_RING_SLOTS];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int filled;
+	bool eof;
+	bool failed;
+} clone_ring;
+
+typedef struct _clone_job
+{
+	spi_flash src;
+	spi_flash dst;
+	unsigned int addr;
+	unsigned int len;
+	unsigned int chunk;
+	bool verify;
+
+	clone_ring ring;
+	std::atomic<unsigned int> written;
+	std::atomic<bool> writer_done;
+	char error[96];
+} clone_job;
+
+static void CloneFail(clone_job *job, const char *fmt, unsigned int addr)
+{
+	std::lock_guard<std::mutex> lk(job->ring.lock);
+
+	if (!job->ring.failed)
+		snprintf(job->error, sizeof (job->error), fmt, addr);
+
+	job->ring.failed = true;
+	job->ring.cond.notify_all();
+}
+
+static void CloneReader(clone_job *job)
+{
+	clone_ring *ring = &job->ring;
+	clone_slot *slot;
+	unsigned int pos;
+
+	for (pos = 0; pos < job->len; pos += job->chunk)
+	{
+		{
+			std::unique_lock<std::mutex> lk(ring->lock);
+
+			ring->cond.wait(lk, [ring] { return ring->filled < CLONE_RING_SLOTS || ring->failed; });
+
+			if (ring->failed)
+				return;
+
+			slot = &ring->slots[ring->head];
+		}
+
+		/* The slot is not visible to the writer until filled is raised */
+		slot->addr = job->addr + pos;
+		slot->len = job->len - pos > job->chunk ? job->chunk : job->len - pos;
+
+		if (!SpiFlashRead(&job->src, slot->addr, slot->len, slot->data))
+		{
+			CloneFail(job, "source read failed at 0x%08x", slot->addr);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lk(ring->lock);
+		ring->head = (ring->head + 1) % CLONE_RING_SLOTS;
+		ring->filled++;
+		ring->cond.notify_all();
+	}
+
+	std::lock_guard<std::mutex> lk(ring->lock);
+	ring->eof = true;
+	ring->cond.notify_all();
+}
+
+static bool CloneIsBlank(const unsigned char *data, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		if (data[i] != 0xff)
+			return false;
+
+	return true;
+}
+
+static void CloneWriter(clone_job *job)
+{
+	clone_ring *ring = &job->ring;
+	clone_slot *slot;
+	unsigned char *readback = job->verify ? new unsigned char[job->chunk] : NULL;
+
+	while (1)
+	{
+		{
+			std::unique_lock<std::mutex> lk(ring->lock);
+
+			ring->cond.wait(lk, [ring] { return ring->filled || ring->eof || ring->failed; });
+
+			if (ring->failed || !ring->filled)
+				break;
+
+			slot = &ring->slots[ring->tail];
+		}
+
+		if (!SpiFlashErase(&job->dst, slot->addr, slot->len))
+		{
+			CloneFail(job, "erase failed at 0x%08x", slot->addr);
+			break;
+		}
+
+		/* An erased chunk already holds all ones */
+		if (!CloneIsBlank(slot->data, slot->len))
+		{
+			if (!SpiFlashWriteEx(&job->dst, slot->addr, slot->data, NULL, slot->len))
+			{
+				CloneFail(job, "write failed at 0x%08x", slot->addr);
+				break;
+			}
+		}
+
+		if (job->verify)
+		{
+			if (!SpiFlashRead(&job->dst, slot->addr, slot->len, readback))
+			{
+				CloneFail(job, "read back failed at 0x%08x", slot->addr);
+				break;
+			}
+
+			if (memcmp(readback, slot->data, slot->len))
+			{
+				CloneFail(job, "verify mismatch in chunk at 0x%08x", slot->addr);
+				break;
+			}
+		}
+
+		job->written += slot->len;
+
+		std::lock_guard<std::mutex> lk(ring->lock);
+		ring->tail = (ring->tail + 1) % CLONE_RING_SLOTS;
+		ring->filled--;
+		ring->cond.notify_all();
+	}
+
+	delete[] readback;
+	job->writer_done = true;
+}
+
+static bool CloneOpen(ch341_device *dev, spi_flash *flash, const char *spec, const char *role)
+{
+	printf("%s: ", role);
+
+	if (!CH341DeviceOpenSpec(dev, spec))
+		return false;
+
+	SpiFlashInit(flash, dev, 0);
+
+	if (!SpiFlashProbe(flash))
+		return false;
+
+	/* Both sessions run at once, the shared progress bar is driven from here */
+	flash->quiet = true;
+
+	return true;
+}
+
+int CloneFlash(const char *src_spec, const char *dst_spec, unsigned int addr, unsigned int size, bool need_verify)
+{
+	ch341_device src_dev, dst_dev;
+	char src_loc[32], dst_loc[32];
+	std::thread reader, writer;
+	std::chrono::steady_clock::time_point start;
+	clone_job *job;
+	unsigned int i, src_size, dst_size;
+	double seconds;
+	int ret = -EIO;
+
+	memset(&src_dev, 0, sizeof (src_dev));
+	memset(&dst_dev, 0, sizeof (dst_dev));
+
+	job = new clone_job;
+	job->written = 0;
+	job->writer_done = false;
+	job->error[0] = 0;
+	job->ring.head = job->ring.tail = job->ring.filled = 0;
+	job->ring.eof = job->ring.failed = false;
+
+	for (i = 0; i < CLONE_RING_SLOTS; i++)
+		job->ring.slots[i].data = NULL;
+
+	if (!CloneOpen(&src_dev, &job->src, src_spec, "Source") || !CloneOpen(&dst_dev, &job->dst, dst_spec, "Destination"))
+	{
+		ret = -ENODEV;
+		goto cleanup;
+	}
+
+	if (CH341DeviceGetLocation(&src_dev, src_loc, sizeof (src_loc)) &&
+		CH341DeviceGetLocation(&dst_dev, dst_loc, sizeof (dst_loc)) && !strcmp(src_loc, dst_loc))
+	{
+		fprintf(stderr, "Error: source and destination are the same programmer.\n");
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	src_size = SpiFlashGetSize(&job->src);
+	dst_size = SpiFlashGetSize(&job->dst);
+
+	if (addr >= src_size || addr >= dst_size)
+	{
+		fprintf(stderr, "Error: address 0x%x is beyond the flash capacity.\n", addr);
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	if (!size)
+	{
+		size = (src_size < dst_size ? src_size : dst_size) - addr;
+
+		if (src_size > dst_size)
+			fprintf(stderr, "Warning: source is %uKiB but destination only %uKiB, copying the first %uKiB.\n",
+				src_size >> 10, dst_size >> 10, dst_size >> 10);
+	}
+
+	if (size > src_size - addr || size > dst_size - addr)
+	{
+		fprintf(stderr, "Error: range exceeds flash capacity.\n");
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	/* Chunks are erased whole, so they follow the destination's erase geometry */
+	if (addr % job->dst.erase_size || size % job->dst.erase_size)
+	{
+		fprintf(stderr, "Error: range is not on %uKiB erase boundaries of the destination.\n",
+			job->dst.erase_size >> 10);
+		ret = -EINVAL;
+		goto cleanup;
+	}
+
+	job->addr = addr;
+	job->len = size;
+	job->verify = need_verify;
+	job->chunk = (CLONE_CHUNK_SIZE + job->dst.erase_size - 1) / job->dst.erase_size * job->dst.erase_size;
+
+	for (i = 0; i < CLONE_RING_SLOTS; i++)
+		job->ring.slots[i].data = new unsigned char[job->chunk];
+
+	printf("Cloning %s to %s, %xh bytes at %xh%s ...\n", job->src.id->model, job->dst.id->model, size, addr,
+		need_verify ? " with verify" : "");
+
+	start = std::chrono::steady_clock::now();
+
+	reader = std::thread(CloneReader, job);
+	writer = std::thread(CloneWriter, job);
+
+	ProgressInit();
+
+	while (!job->writer_done)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(CLONE_PROGRESS_INTERVAL_MS));
+		ProgressShow((int) ((unsigned long long) job->written * 100 / size));
+	}
+
+	reader.join();
+	writer.join();
+
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (job->ring.failed)
+	{
+		printf("\n");
+		fprintf(stderr, "Error: %s\n", job->error);
+		goto cleanup;
+	}
+
+	ProgressDone();
+
+	printf("Time used: %.2fs\n", seconds);
+	printf("Speed: %.2fKiB/s\n", seconds > 0 ? (double) size / 1024 / seconds : 0.0);
+
+	ret = 0;
+
+cleanup:
+	for (i = 0; i < CLONE_RING_SLOTS; i++)
+		delete[] job->ring.slots[i].data;
+
+	delete job;
+
+	CH341DeviceClose(&dst_dev);
+	CH341DeviceClose(&src_dev);
+
+	return ret;
+}
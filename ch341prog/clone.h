@@ -0,0 +1,15 @@
+#ifndef _CLONE_H_
+#define _CLONE_H_
+
+#define CLONE_CHUNK_SIZE			(64 << 10)
+#define CLONE_RING_SLOTS			4
+
+/*
+ * Copies the chip on the src programmer into the chip on the dst one.
+ * Reading the source and erasing/programming the destination run at the
+ * same time, with a few chunks buffered in between. size 0 means the
+ * smaller of the two chips.
+ */
+int CloneFlash(const char *src_spec, const char *dst_spec, unsigned int addr, unsigned int size, bool need_verify);
+
+#endif /* _CLONE_H_ */
@@ -0,0 +1,1070 @@
+#include "stdafx.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "daemon.h"
+
+#ifdef _WIN32
+
+void DaemonDefaultSocket(char *path, unsigned int size)
+{
+	snprintf(path, size, "%s", DAEMON_SOCKET_NAME);
+}
+
+int DaemonRun(const char *socket_path, char *specs[], unsigned int count)
+{
+	fprintf(stderr, "Error: daemon mode needs Unix domain sockets, not available on this platform.\n");
+	return -ENOSYS;
+}
+
+int DaemonSubmit(const char *socket_path, int priority, int device, int argc, char *argv[])
+{
+	fprintf(stderr, "Error: daemon mode needs Unix domain sockets, not available on this platform.\n");
+	return -ENOSYS;
+}
+
+#else
+
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "checksum.h"
+
+#define DAEMON_BACKLOG				16
+#define DAEMON_ACCEPT_POLL_MS		500
+#define DAEMON_REQUEST_TIMEOUT_S	5
+#define DAEMON_MAX_PENDING			32		/* connections still sending their request */
+#define DAEMON_PATH_LENGTH			1024
+#define DAEMON_REPLY_LENGTH			256
+#define DAEMON_ERROR_LENGTH			160
+
+typedef struct _daemon_job
+{
+	unsigned int id;
+	int priority;
+	int fd;
+	int last_percent;
+
+	char cwd[DAEMON_PATH_LENGTH];
+	int argc;
+	char *argv[DAEMON_MAX_ARGS];
+	char buf[DAEMON_REQUEST_LENGTH];
+
+	struct _daemon_job *next;
+} daemon_job;
+
+typedef struct _daemon_unit
+{
+	unsigned int index;
+	ch341_device dev;
+	spi_flash flash;
+	char location[32];
+
+	/* Jobs by descending priority, in arrival order within one priority */
+	std::mutex lock;
+	std::condition_variable cond;
+	daemon_job *queue;
+	unsigned int queued;
+	bool running;
+
+	std::thread worker;
+} daemon_unit;
+
+/* A connection whose request has not fully arrived yet */
+typedef struct _daemon_pending
+{
+	daemon_job *job;
+	unsigned int len;
+	std::chrono::steady_clock::time_point deadline;
+} daemon_pending;
+
+static std::atomic<bool> daemon_stop;
+static std::atomic<unsigned int> daemon_next_id;
+
+/* The job a worker is running, and the last error the flash code reported for it */
+static thread_local unsigned int daemon_job_id;
+static thread_local char daemon_error[DAEMON_ERROR_LENGTH];
+
+static void DaemonSignal(int sig)
+{
+	daemon_stop = true;
+}
+
+void DaemonDefaultSocket(char *path, unsigned int size)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	snprintf(path, size, "%s/%s", dir && *dir ? dir : "/tmp", DAEMON_SOCKET_NAME);
+}
+
+static bool DaemonSocketAddress(const char *socket_path, struct sockaddr_un *sa)
+{
+	if (strlen(socket_path) >= sizeof (sa->sun_path))
+	{
+		fprintf(stderr, "Error: socket path %s is too long\n", socket_path);
+		return false;
+	}
+
+	memset(sa, 0, sizeof (*sa));
+	sa->sun_family = AF_UNIX;
+	strcpy(sa->sun_path, socket_path);
+
+	return true;
+}
+
+/* Clients may go away at any time, replies to them are best effort */
+static void DaemonReply(int fd, const char *fmt, ...)
+{
+	char line[DAEMON_REPLY_LENGTH];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof (line) - 1, fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return;
+
+	if (len > (int) sizeof (line) - 2)
+		len = sizeof (line) - 2;
+
+	line[len++] = '\n';
+
+	send(fd, line, len, MSG_NOSIGNAL);
+}
+
+/*
+ * Everything the flash code reports goes to the daemon's stderr, tagged
+ * with the job it came from. Errors are also kept for the job's reply,
+ * the client would otherwise only learn that something failed.
+ */
+static void DaemonMessage(int level, const char *msg, void *arg)
+{
+	const char *p = msg;
+	size_t len, i;
+
+	if (daemon_job_id)
+		fprintf(stderr, "job %u: %s", daemon_job_id, msg);
+	else
+		fputs(msg, stderr);
+
+	if (level != MSG_ERROR || !daemon_job_id)
+		return;
+
+	if (!strncmp(p, "Error: ", 7))
+		p += 7;
+
+	len = strlen(p);
+	while (len && (p[len - 1] == '\n' || p[len - 1] == '\r'))
+		len--;
+
+	if (len >= sizeof (daemon_error))
+		len = sizeof (daemon_error) - 1;
+
+	/* Replies are one line each */
+	for (i = 0; i < len; i++)
+		daemon_error[i] = p[i] == '\n' || p[i] == '\r' ? ' ' : p[i];
+
+	daemon_error[len] = 0;
+}
+
+/* An operation on the chip failed, the reply says why if the flash code did */
+static void DaemonFail(daemon_job *job, const char *what)
+{
+	if (daemon_error[0])
+		DaemonReply(job->fd, "error %u %s: %s", job->id, what, daemon_error);
+	else
+		DaemonReply(job->fd, "error %u %s", job->id, what);
+}
+
+static bool DaemonProgress(int percentage, void *arg)
+{
+	daemon_job *job = (daemon_job *) arg;
+
+	if (percentage != job->last_percent)
+	{
+		job->last_percent = percentage;
+		DaemonReply(job->fd, "progress %u %d", job->id, percentage);
+	}
+
+	return true;
+}
+
+static void DaemonStage(daemon_job *job, const char *stage)
+{
+	job->last_percent = -1;
+	daemon_error[0] = 0;
+	DaemonReply(job->fd, "stage %u %s", job->id, stage);
+}
+
+static void DaemonJobPath(daemon_job *job, const char *name, char *path, unsigned int size)
+{
+	if (name[0] == '/' || !job->cwd[0])
+		snprintf(path, size, "%s", name);
+	else
+		snprintf(path, size, "%s/%s", job->cwd, name);
+}
+
+static bool DaemonNumber(daemon_job *job, int i, unsigned int *val)
+{
+	if (i >= job->argc)
+		return true;
+
+	if (!isdigit(job->argv[i][0]))
+	{
+		DaemonReply(job->fd, "error %u expected a number instead of \"%s\"", job->id, job->argv[i]);
+		return false;
+	}
+
+	*val = strtoul(job->argv[i], NULL, 0);
+
+	return true;
+}
+
+/* Takes up to size bytes of the flash from addr, checking both against the chip */
+static bool DaemonRange(daemon_job *job, spi_flash *flash, int i, unsigned int *addr, unsigned int *size)
+{
+	*addr = 0;
+
+	if (!DaemonNumber(job, i, addr))
+		return false;
+
+	if (*addr >= SpiFlashGetSize(flash))
+	{
+		DaemonReply(job->fd, "error %u start address exceeds the flash size", job->id);
+		return false;
+	}
+
+	if (!*size || *size > SpiFlashGetSize(flash) - *addr)
+		*size = SpiFlashGetSize(flash) - *addr;
+
+	if (i + 1 < job->argc)
+	{
+		if (!DaemonNumber(job, i + 1, size))
+			return false;
+
+		if (*addr + *size > SpiFlashGetSize(flash))
+		{
+			DaemonReply(job->fd, "error %u end address exceeds the flash size", job->id);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool DaemonJobRead(daemon_unit *u, daemon_job *job)
+{
+	char path[DAEMON_PATH_LENGTH + DAEMON_REQUEST_LENGTH];
+	unsigned int addr, size = 0;
+	unsigned char *buf;
+	bool ret;
+	FILE *f;
+
+	if (job->argc < 2)
+	{
+		DaemonReply(job->fd, "error %u usage: read <file> [addr] [size]", job->id);
+		return false;
+	}
+
+	if (!DaemonRange(job, &u->flash, 2, &addr, &size))
+		return false;
+
+	DaemonJobPath(job, job->argv[1], path, sizeof (path));
+
+	buf = new unsigned char[size];
+
+	DaemonStage(job, "read");
+
+	if (!SpiFlashRead(&u->flash, addr, size, buf))
+	{
+		delete[] buf;
+		DaemonFail(job, "read failed");
+		return false;
+	}
+
+	f = fopen(path, "wb");
+	ret = f && fwrite(buf, 1, size, f) == size;
+
+	if (f && fclose(f))
+		ret = false;
+
+	delete[] buf;
+
+	if (!ret)
+	{
+		DaemonReply(job->fd, "error %u unable to write %s, error %d", job->id, path, errno);
+		return false;
+	}
+
+	DaemonReply(job->fd, "ok %u %u bytes from 0x%x", job->id, size, addr);
+
+	return true;
+}
+
+typedef struct _daemon_verify
+{
+	const unsigned char *image;
+	unsigned int addr;
+} daemon_verify;
+
+static bool DaemonVerifyChunk(unsigned int addr, const unsigned char *data, unsigned int len, void *arg)
+{
+	daemon_verify *v = (daemon_verify *) arg;
+
+	return !memcmp(data, v->image + (addr - v->addr), len);
+}
+
+static bool DaemonVerify(daemon_unit *u, daemon_job *job, unsigned int addr, const unsigned char *image,
+	unsigned int len)
+{
+	daemon_verify v;
+
+	v.image = image;
+	v.addr = addr;
+
+	DaemonStage(job, "verify");
+
+	if (!SpiFlashReadEx(&u->flash, addr, len, NULL, DaemonVerifyChunk, &v))
+	{
+		DaemonFail(job, "verify failed");
+		return false;
+	}
+
+	return true;
+}
+
+/* write [erase] [verify] <file> [addr] [size], or verify <file> [addr] [size] */
+static bool DaemonJobWrite(daemon_unit *u, daemon_job *job, bool write)
+{
+	char path[DAEMON_PATH_LENGTH + DAEMON_REQUEST_LENGTH];
+	bool need_erase = false, need_verify = !write;
+	unsigned int addr = 0, size = 0;
+	unsigned char *image;
+	int i = 1;
+
+	if (write && i < job->argc && !strcmp(job->argv[i], "erase"))
+	{
+		need_erase = true;
+		i++;
+	}
+
+	if (write && i < job->argc && !strcmp(job->argv[i], "verify"))
+	{
+		need_verify = true;
+		i++;
+	}
+
+	if (i >= job->argc)
+	{
+		DaemonReply(job->fd, "error %u usage: %s <file> [addr] [size]", job->id,
+			write ? "write [erase] [verify]" : "verify");
+		return false;
+	}
+
+	DaemonJobPath(job, job->argv[i], path, sizeof (path));
+
+	if (!DaemonNumber(job, i + 1, &addr) || !DaemonNumber(job, i + 2, &size))
+		return false;
+
+	image = LoadImageFile(path, &size);
+	if (!image)
+	{
+		DaemonReply(job->fd, "error %u unable to read %s", job->id, path);
+		return false;
+	}
+
+	if (!size || addr + size > SpiFlashGetSize(&u->flash))
+	{
+		delete[] image;
+		DaemonReply(job->fd, "error %u image does not fit the flash", job->id);
+		return false;
+	}
+
+	if (need_erase)
+	{
+		DaemonStage(job, "erase");
+
+		if (!SpiFlashErase(&u->flash, addr, size))
+		{
+			delete[] image;
+			DaemonFail(job, "erase failed");
+			return false;
+		}
+	}
+
+	if (write)
+	{
+		DaemonStage(job, "write");
+
+		if (!SpiFlashWriteEx(&u->flash, addr, image, NULL, size))
+		{
+			delete[] image;
+			DaemonFail(job, "write failed");
+			return false;
+		}
+	}
+
+	if (need_verify && !DaemonVerify(u, job, addr, image, size))
+	{
+		delete[] image;
+		return false;
+	}
+
+	delete[] image;
+
+	DaemonReply(job->fd, "ok %u %u bytes at 0x%x", job->id, size, addr);
+
+	return true;
+}
+
+static bool DaemonJobErase(daemon_unit *u, daemon_job *job)
+{
+	unsigned int addr, size = 0;
+
+	DaemonStage(job, "erase");
+
+	if (job->argc == 2 && !strcmp(job->argv[1], "chip"))
+	{
+		if (!SpiFlashChipErase(&u->flash))
+		{
+			DaemonFail(job, "chip erase failed");
+			return false;
+		}
+
+		DaemonReply(job->fd, "ok %u chip erased", job->id);
+		return true;
+	}
+
+	if (job->argc != 3)
+	{
+		DaemonReply(job->fd, "error %u usage: erase chip | erase <addr> <size>", job->id);
+		return false;
+	}
+
+	if (!DaemonRange(job, &u->flash, 1, &addr, &size))
+		return false;
+
+	if (!SpiFlashErase(&u->flash, addr, size))
+	{
+		DaemonFail(job, "erase failed");
+		return false;
+	}
+
+	DaemonReply(job->fd, "ok %u %u bytes erased at 0x%x", job->id, size, addr);
+
+	return true;
+}
+
+static bool DaemonChecksumChunk(unsigned int addr, const unsigned char *data, unsigned int len, void *arg)
+{
+	ChecksumUpdate((checksum_ctx *) arg, data, len);
+	return true;
+}
+
+static bool DaemonJobChecksum(daemon_unit *u, daemon_job *job)
+{
+	char result[DAEMON_REPLY_LENGTH];
+	unsigned int addr, size = 0, algos = CHECKSUM_ALL, i, len = 0;
+	checksum_result res;
+	checksum_ctx ctx;
+	int arg = 1;
+
+	if (arg < job->argc && ChecksumParseAlgos(job->argv[arg]))
+		algos = ChecksumParseAlgos(job->argv[arg++]);
+
+	if (!DaemonRange(job, &u->flash, arg, &addr, &size))
+		return false;
+
+	DaemonStage(job, "checksum");
+
+	ChecksumInit(&ctx, algos);
+
+	if (!SpiFlashReadEx(&u->flash, addr, size, NULL, DaemonChecksumChunk, &ctx))
+	{
+		DaemonFail(job, "read failed");
+		return false;
+	}
+
+	ChecksumFinal(&ctx, &res);
+
+	result[0] = 0;
+
+	if (algos & CHECKSUM_CRC32)
+		len += sprintf(result + len, " crc32=%08x", res.crc32);
+
+	if (algos & CHECKSUM_CRC32C)
+		len += sprintf(result + len, " crc32c=%08x", res.crc32c);
+
+	if (algos & CHECKSUM_SHA256)
+	{
+		len += sprintf(result + len, " sha256=");
+
+		for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+			len += sprintf(result + len, "%02x", res.sha256[i]);
+	}
+
+	DaemonReply(job->fd, "ok %u%s", job->id, result);
+
+	return true;
+}
+
+static void DaemonRunJob(daemon_unit *u, daemon_job *job)
+{
+	const char *cmd = job->argv[0];
+	bool ret;
+
+	u->flash.progress = DaemonProgress;
+	u->flash.progress_arg = job;
+
+	daemon_job_id = job->id;
+	daemon_error[0] = 0;
+
+	if (!SpiFlashProbe(&u->flash))
+	{
+		DaemonFail(job, "no flash found");
+		daemon_job_id = 0;
+		return;
+	}
+
+	if (!strcmp(cmd, "read"))
+		ret = DaemonJobRead(u, job);
+	else if (!strcmp(cmd, "write"))
+		ret = DaemonJobWrite(u, job, true);
+	else if (!strcmp(cmd, "verify"))
+		ret = DaemonJobWrite(u, job, false);
+	else if (!strcmp(cmd, "erase"))
+		ret = DaemonJobErase(u, job);
+	else
+		ret = DaemonJobChecksum(u, job);
+
+	/* The chip may have been swapped, look at it again before the next job */
+	if (!ret)
+	{
+		SpiFlashInit(&u->flash, &u->dev, 0);
+		u->flash.quiet = true;
+	}
+
+	daemon_job_id = 0;
+}
+
+static void DaemonWorker(daemon_unit *u)
+{
+	daemon_job *job;
+
+	while (1)
+	{
+		{
+			std::unique_lock<std::mutex> lk(u->lock);
+
+			u->cond.wait(lk, [u] { return u->queue || daemon_stop; });
+
+			if (daemon_stop)
+				break;
+
+			job = u->queue;
+			u->queue = job->next;
+			u->queued--;
+			u->running = true;
+		}
+
+		DaemonRunJob(u, job);
+
+		close(job->fd);
+		delete job;
+
+		std::lock_guard<std::mutex> lk(u->lock);
+		u->running = false;
+	}
+
+	/* Whatever is left is refused */
+	std::lock_guard<std::mutex> lk(u->lock);
+
+	while ((job = u->queue))
+	{
+		u->queue = job->next;
+		DaemonReply(job->fd, "error %u daemon shutting down", job->id);
+		close(job->fd);
+		delete job;
+	}
+}
+
+static void DaemonEnqueue(daemon_unit *u, daemon_job *job)
+{
+	daemon_job **pp;
+	unsigned int pos = 0;
+
+	std::lock_guard<std::mutex> lk(u->lock);
+
+	for (pp = &u->queue; *pp && (*pp)->priority >= job->priority; pp = &(*pp)->next)
+		pos++;
+
+	/* Sent before the worker can see the job, so it precedes any of its progress */
+	DaemonReply(job->fd, "queued %u %u %u", job->id, u->index, pos + u->running);
+
+	job->next = *pp;
+	*pp = job;
+	u->queued++;
+	u->cond.notify_one();
+}
+
+/*
+ * Takes what the client sent so far, without waiting for more. Returns 1
+ * once the request is complete (up to the empty line ending it), 0 while
+ * more is to come and -1 if it never will be.
+ */
+static int DaemonReadRequest(int fd, char *buf, unsigned int size, unsigned int *len)
+{
+	ssize_t n;
+
+	n = recv(fd, buf + *len, size - 1 - *len, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+
+	if (n <= 0)
+		return -1;
+
+	*len += n;
+	buf[*len] = 0;
+
+	if (!strcmp(buf, "status\n") || strstr(buf, "\n\n"))
+		return 1;
+
+	return *len < size - 1 ? 0 : -1;
+}
+
+static void DaemonStatus(int fd, daemon_unit *units, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+	{
+		std::lock_guard<std::mutex> lk(units[i].lock);
+
+		DaemonReply(fd, "device %u %s %s queued=%u", i, units[i].location,
+			units[i].running ? "busy" : "idle", units[i].queued);
+	}
+}
+
+static void DaemonRefuse(daemon_job *job)
+{
+	close(job->fd);
+	delete job;
+}
+
+/* Acts on a complete request, the job is queued or refused */
+static void DaemonHandle(daemon_job *job, daemon_unit *units, unsigned int count)
+{
+	static const char *const commands[] = { "read", "write", "verify", "erase", "checksum" };
+	daemon_unit *u = NULL;
+	char *line, *next;
+	unsigned int i;
+	int device = -1, fd = job->fd;
+
+	if (!strcmp(job->buf, "status\n"))
+	{
+		DaemonStatus(fd, units, count);
+		goto refuse;
+	}
+
+	for (line = job->buf; *line && *line != '\n'; line = next)
+	{
+		next = strchr(line, '\n');
+		*next++ = 0;
+
+		if (!strncmp(line, "cwd ", 4))
+			snprintf(job->cwd, sizeof (job->cwd), "%s", line + 4);
+		else if (!strncmp(line, "priority ", 9))
+			job->priority = atoi(line + 9);
+		else if (!strncmp(line, "device ", 7))
+			device = atoi(line + 7);
+		else if (!strncmp(line, "arg ", 4) && job->argc < DAEMON_MAX_ARGS)
+			job->argv[job->argc++] = line + 4;
+		else
+		{
+			DaemonReply(fd, "error %u bad request line \"%s\"", job->id, line);
+			goto refuse;
+		}
+	}
+
+	for (i = 0; job->argc && i < sizeof (commands) / sizeof (commands[0]); i++)
+		if (!strcmp(job->argv[0], commands[i]))
+			break;
+
+	if (!job->argc || i == sizeof (commands) / sizeof (commands[0]))
+	{
+		DaemonReply(fd, "error %u unknown job, use read, write, verify, erase or checksum", job->id);
+		goto refuse;
+	}
+
+	if (device >= (int) count)
+	{
+		DaemonReply(fd, "error %u no device %d", job->id, device);
+		goto refuse;
+	}
+
+	if (device >= 0)
+	{
+		u = &units[device];
+	}
+	else
+	{
+		/* Any device will do, take the least loaded */
+		for (i = 0; i < count; i++)
+		{
+			std::lock_guard<std::mutex> lk(units[i].lock);
+
+			if (!u || units[i].queued + units[i].running < u->queued + u->running)
+				u = &units[i];
+		}
+	}
+
+	DaemonEnqueue(u, job);
+
+	return;
+
+refuse:
+	DaemonRefuse(job);
+}
+
+static void DaemonAccept(int fd, daemon_pending *pending, unsigned int *count)
+{
+	daemon_job *job;
+	int client;
+
+	client = accept(fd, NULL, NULL);
+	if (client < 0)
+		return;
+
+	job = new daemon_job;
+	memset(job, 0, sizeof (*job));
+	job->fd = client;
+	job->id = ++daemon_next_id;
+
+	if (*count == DAEMON_MAX_PENDING)
+	{
+		DaemonReply(client, "error %u too many clients sending requests", job->id);
+		DaemonRefuse(job);
+		return;
+	}
+
+	pending[*count].job = job;
+	pending[*count].len = 0;
+	pending[*count].deadline = std::chrono::steady_clock::now() + std::chrono::seconds(DAEMON_REQUEST_TIMEOUT_S);
+	(*count)++;
+}
+
+/*
+ * One poll covers the listening socket and every connection still sending
+ * its request, a slow or idle client only ever holds up itself
+ */
+static void DaemonServe(int fd, daemon_unit *units, unsigned int count)
+{
+	daemon_pending pending[DAEMON_MAX_PENDING];
+	struct pollfd pfds[DAEMON_MAX_PENDING + 1];
+	std::chrono::steady_clock::time_point now;
+	unsigned int i, n, npending = 0;
+	long long timeout, ms;
+	int ret;
+
+	while (!daemon_stop)
+	{
+		now = std::chrono::steady_clock::now();
+		timeout = DAEMON_ACCEPT_POLL_MS;
+
+		pfds[0].fd = fd;
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+
+		for (i = 0; i < npending; i++)
+		{
+			pfds[i + 1].fd = pending[i].job->fd;
+			pfds[i + 1].events = POLLIN;
+			pfds[i + 1].revents = 0;
+
+			ms = std::chrono::duration_cast<std::chrono::milliseconds>(pending[i].deadline - now).count() + 1;
+			if (ms < timeout)
+				timeout = ms > 0 ? ms : 0;
+		}
+
+		if (poll(pfds, npending + 1, (int) timeout) < 0)
+			continue;
+
+		now = std::chrono::steady_clock::now();
+
+		for (i = 0, n = 0; i < npending; i++)
+		{
+			ret = 0;
+
+			if (pfds[i + 1].revents)
+				ret = DaemonReadRequest(pending[i].job->fd, pending[i].job->buf, sizeof (pending[i].job->buf),
+					&pending[i].len);
+
+			if (!ret && now >= pending[i].deadline)
+				ret = -1;
+
+			if (ret > 0)
+				DaemonHandle(pending[i].job, units, count);
+			else if (ret < 0)
+			{
+				DaemonReply(pending[i].job->fd, "error %u incomplete request", pending[i].job->id);
+				DaemonRefuse(pending[i].job);
+			}
+			else
+				pending[n++] = pending[i];
+		}
+
+		npending = n;
+
+		if (pfds[0].revents & POLLIN)
+			DaemonAccept(fd, pending, &npending);
+	}
+
+	for (i = 0; i < npending; i++)
+		DaemonRefuse(pending[i].job);
+}
+
+static int DaemonListen(const char *socket_path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	if (!DaemonSocketAddress(socket_path, &sa))
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error: unable to create socket, error %d\n", errno);
+		return -1;
+	}
+
+	/* A socket left behind by a daemon that did not exit cleanly */
+	if (connect(fd, (struct sockaddr *) &sa, sizeof (sa)) == 0)
+	{
+		fprintf(stderr, "Error: a daemon is already listening on %s\n", socket_path);
+		close(fd);
+		return -1;
+	}
+
+	unlink(socket_path);
+
+	if (bind(fd, (struct sockaddr *) &sa, sizeof (sa)) || listen(fd, DAEMON_BACKLOG))
+	{
+		fprintf(stderr, "Error: unable to listen on %s, error %d\n", socket_path, errno);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int DaemonRun(const char *socket_path, char *specs[], unsigned int count)
+{
+	ch341_device devs[DAEMON_MAX_DEVICES];
+	daemon_unit *units;
+	unsigned int i;
+	int fd;
+
+	memset(devs, 0, sizeof (devs));
+
+	if (count > DAEMON_MAX_DEVICES)
+		count = DAEMON_MAX_DEVICES;
+
+	if (count)
+	{
+		for (i = 0; i < count; i++)
+		{
+			if (!CH341DeviceOpenSpec(&devs[i], specs[i]))
+			{
+				while (i--)
+					CH341DeviceClose(&devs[i]);
+				return -ENODEV;
+			}
+		}
+	}
+	else
+	{
+		count = CH341DeviceOpenAll(devs, DAEMON_MAX_DEVICES);
+		if (!count)
+		{
+			fprintf(stderr, "Error: no CH341 device found\n");
+			return -ENODEV;
+		}
+	}
+
+	fd = DaemonListen(socket_path);
+	if (fd < 0)
+	{
+		for (i = 0; i < count; i++)
+			CH341DeviceClose(&devs[i]);
+		return -EIO;
+	}
+
+	signal(SIGINT, DaemonSignal);
+	signal(SIGTERM, DaemonSignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	MessageSetHandler(DaemonMessage, NULL);
+
+	units = new daemon_unit[count];
+
+	for (i = 0; i < count; i++)
+	{
+		units[i].index = i;
+		units[i].dev = devs[i];
+		units[i].queue = NULL;
+		units[i].queued = 0;
+		units[i].running = false;
+
+		if (!CH341DeviceGetLocation(&units[i].dev, units[i].location, sizeof (units[i].location)))
+			strcpy(units[i].location, "?");
+
+		SpiFlashInit(&units[i].flash, &units[i].dev, 0);
+		units[i].flash.quiet = true;
+
+		units[i].worker = std::thread(DaemonWorker, &units[i]);
+
+		fprintf(stderr, "Device %u: %s\n", i, units[i].location);
+	}
+
+	fprintf(stderr, "Listening on %s\n", socket_path);
+
+	DaemonServe(fd, units, count);
+
+	fprintf(stderr, "Shutting down ...\n");
+
+	close(fd);
+	unlink(socket_path);
+
+	for (i = 0; i < count; i++)
+	{
+		{
+			std::lock_guard<std::mutex> lk(units[i].lock);
+			units[i].cond.notify_all();
+		}
+
+		/* A running job is finished first */
+		units[i].worker.join();
+		CH341DeviceClose(&units[i].dev);
+	}
+
+	MessageSetHandler(NULL, NULL);
+
+	delete[] units;
+
+	return 0;
+}
+
+static bool DaemonSendLine(int fd, const char *key, const char *value)
+{
+	char line[DAEMON_PATH_LENGTH + 16];
+	int len;
+
+	len = snprintf(line, sizeof (line), "%s %s\n", key, value);
+	if (len < 0 || len >= (int) sizeof (line) || strchr(value, '\n'))
+		return false;
+
+	return send(fd, line, len, MSG_NOSIGNAL) == len;
+}
+
+int DaemonSubmit(const char *socket_path, int priority, int device, int argc, char *argv[])
+{
+	char buf[DAEMON_REPLY_LENGTH * 4], cwd[DAEMON_PATH_LENGTH], num[16];
+	struct sockaddr_un sa;
+	bool ok = false, sent = true;
+	unsigned int len = 0;
+	char *line, *eol;
+	ssize_t n;
+	int fd, i;
+
+	if (!DaemonSocketAddress(socket_path, &sa))
+		return -EINVAL;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &sa, sizeof (sa)))
+	{
+		fprintf(stderr, "Error: unable to connect to %s, error %d\n", socket_path, errno);
+		if (fd >= 0)
+			close(fd);
+		return -ECONNREFUSED;
+	}
+
+	if (argc == 1 && !strcmp(argv[0], "status"))
+	{
+		sent = send(fd, "status\n", 7, MSG_NOSIGNAL) == 7;
+		ok = true;
+	}
+	else
+	{
+		if (getcwd(cwd, sizeof (cwd)))
+			sent = DaemonSendLine(fd, "cwd", cwd);
+
+		snprintf(num, sizeof (num), "%d", priority);
+		sent = sent && DaemonSendLine(fd, "priority", num);
+
+		if (device >= 0)
+		{
+			snprintf(num, sizeof (num), "%d", device);
+			sent = sent && DaemonSendLine(fd, "device", num);
+		}
+
+		for (i = 0; i < argc; i++)
+			sent = sent && DaemonSendLine(fd, "arg", argv[i]);
+
+		sent = sent && send(fd, "\n", 1, MSG_NOSIGNAL) == 1;
+	}
+
+	if (!sent)
+	{
+		fprintf(stderr, "Error: failed to send the job\n");
+		close(fd);
+		return -EIO;
+	}
+
+	/* Replies are relayed line by line as they come */
+	while ((n = recv(fd, buf + len, sizeof (buf) - 1 - len, 0)) > 0)
+	{
+		len += n;
+		buf[len] = 0;
+
+		for (line = buf; (eol = strchr(line, '\n')); line = eol + 1)
+		{
+			*eol = 0;
+			printf("%s\n", line);
+
+			if (!strncmp(line, "ok ", 3))
+				ok = true;
+		}
+
+		len = strlen(line);
+		memmove(buf, line, len + 1);
+
+		if (len == sizeof (buf) - 1)
+			len = 0;
+
+		fflush(stdout);
+	}
+
+	close(fd);
+
+	return ok ? 0 : -EFAULT;
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#define DAEMON_MAX_DEVICES			16
+#define DAEMON_MAX_ARGS				16
+#define DAEMON_REQUEST_LENGTH		4096
+#define DAEMON_SOCKET_NAME			"ch341prog.sock"
+
+/*
+ * Request, one field per line, ended by an empty line:
+ *   cwd <dir>          relative file names are taken from here
+ *   priority <n>       higher runs first, default 0
+ *   device <n>         index into the daemon's devices, default any
+ *   arg <word>         job words, e.g. "write", "erase", "fw.bin"
+ * or a single "status" line.
+ *
+ * Replies, one per line until the connection closes:
+ *   queued <id> <device> <position>
+ *   stage <id> <erase|write|verify|read|checksum>
+ *   progress <id> <percent>
+ *   ok <id> [result]
+ *   error <id> <message>[: <error reported by the flash code>]
+ * The daemon's own log, job errors included, goes to its stderr.
+ */
+
+void DaemonDefaultSocket(char *path, unsigned int size);
+
+/* Holds the given programmers (all attached ones if none) open and serves jobs until SIGINT/SIGTERM */
+int DaemonRun(const char *socket_path, char *specs[], unsigned int count);
+
+/* Submits one job and prints the replies, returns 0 if it succeeded */
+int DaemonSubmit(const char *socket_path, int priority, int device, int argc, char *argv[]);
+
+#endif /* _DAEMON_H_ */
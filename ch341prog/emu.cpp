@@ -0,0 +1,620 @@
+#include "stdafx.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <libusb-1.0/libusb.h>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "emu.h"
+
+#define EMU_MIN_SIZE				SIZE_1MB
+#define EMU_MAX_SIZE				SIZE_32MB
+#define EMU_JEDEC_W25Q				0xef4000	/* low byte is log2 of the size */
+#define EMU_UID_DUMMY				4
+#define EMU_REPLUG_MS				1000
+
+typedef std::chrono::steady_clock emu_clock;
+
+typedef struct _emu_flash
+{
+	unsigned char *mem;
+	unsigned int size;
+	unsigned int jedec_id;
+
+	unsigned char sr;
+	bool wel;
+	bool addr4;
+	unsigned char ear;
+	emu_clock::time_point busy_until;
+
+	/* The CS cycle in progress */
+	bool selected;
+	unsigned int pos;
+	unsigned char op;
+	unsigned int addr;
+	unsigned char arg;
+	unsigned char page[PAGE_SIZE];
+	unsigned int page_len;
+	unsigned int erase_size;
+} emu_flash;
+
+struct _emu_device
+{
+	emu_flash flash;
+
+	unsigned char in[EMU_QUEUE_SIZE];
+	unsigned int in_len;
+	bool halted[2];
+
+	unsigned int latency_us;
+	double fail;
+	unsigned long long transfers;
+	unsigned long long hang;	/* transfers answered before the device stops responding, 0 never */
+	unsigned long long unplug;	/* transfers before the device drops off the bus, 0 never */
+	unsigned int replug_ms;
+	bool gone;
+	emu_clock::time_point back_at;
+	unsigned long long rng;
+	unsigned int prog_us;
+	unsigned int erase_ms;
+
+	char image[1024];
+};
+
+/* xorshift64*, the same faults come at the same transfers on every run */
+static double EmuRandom(emu_device *emu)
+{
+	emu->rng ^= emu->rng >> 12;
+	emu->rng ^= emu->rng << 25;
+	emu->rng ^= emu->rng >> 27;
+
+	return ((emu->rng * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+static bool EmuFlashBusy(emu_flash *f)
+{
+	return emu_clock::now() < f->busy_until;
+}
+
+static unsigned int EmuAddrWidth(emu_flash *f)
+{
+	switch (f->op)
+	{
+	case SPI_CMD_READ_4B:
+	case SPI_CMD_PAGE_PROG_4B:
+	case SPI_CMD_SECTOR_ERASE_4B:
+	case SPI_CMD_64KB_BLOCK_ERASE_4B:
+	case 0x0c:	/* fast read, 4-byte address */
+	case 0x5c:	/* 32KiB erase, 4-byte address */
+		return 4;
+	case SPI_CMD_READ_SFDP:
+		return 3;
+	}
+
+	return f->addr4 ? 4 : 3;
+}
+
+static unsigned int EmuFlashAddr(emu_flash *f, unsigned int addr)
+{
+	/* The extended address register supplies the top byte in 3-byte mode */
+	if (EmuAddrWidth(f) == 3 && f->op != SPI_CMD_READ_SFDP)
+		addr |= f->ear << 24;
+
+	return addr % f->size;
+}
+
+static void EmuFlashBegin(emu_flash *f)
+{
+	f->pos = 0;
+	f->page_len = 0;
+	f->erase_size = 0;
+}
+
+/* Raising CS is what starts programming, erasing and register writes */
+static void EmuFlashEnd(emu_device *emu, emu_flash *f)
+{
+	unsigned int i, a;
+
+	if (!f->pos || EmuFlashBusy(f))
+		return;
+
+	switch (f->op)
+	{
+	case SPI_CMD_PAGE_PROG:
+	case SPI_CMD_PAGE_PROG_4B:
+		if (!f->wel || !f->page_len)
+			break;
+
+		/* Addresses wrap around within the page, bits only go from 1 to 0 */
+		for (i = 0; i < f->page_len; i++)
+		{
+			a = (f->addr & ~(PAGE_SIZE - 1)) | ((f->addr + i) & (PAGE_SIZE - 1));
+			f->mem[a % f->size] &= f->page[i];
+		}
+
+		f->wel = false;
+		f->busy_until = emu_clock::now() + std::chrono::microseconds(emu->prog_us);
+		break;
+
+	case SPI_CMD_CHIP_ERASE:
+	case 0x60:	/* chip erase, alternative opcode */
+		f->addr = 0;
+		f->erase_size = f->size;
+		/* fall through */
+	case SPI_CMD_SECTOR_ERASE:
+	case SPI_CMD_SECTOR_ERASE_4B:
+	case SPI_CMD_32KB_BLOCK_ERASE:
+	case 0x5c:
+	case SPI_CMD_64KB_BLOCK_ERASE:
+	case SPI_CMD_64KB_BLOCK_ERASE_4B:
+		if (!f->wel || !f->erase_size)
+			break;
+
+		memset(f->mem + (f->addr & ~(f->erase_size - 1)), 0xff, f->erase_size);
+
+		f->wel = false;
+		f->busy_until = emu_clock::now() + std::chrono::milliseconds(emu->erase_ms);
+		break;
+
+	case SPI_CMD_WRSR:
+		if (f->wel && f->pos > 1)
+			f->sr = f->arg & 0xfc;
+
+		f->wel = false;
+		break;
+
+	case SPI_CMD_WREAR:
+		if (f->wel && f->pos > 1)
+			f->ear = f->arg;
+
+		f->wel = false;
+		break;
+	}
+}
+
+/* One byte in each direction, in the chip's own bit order */
+static unsigned char EmuFlashClock(emu_flash *f, unsigned char b)
+{
+	unsigned int n = f->pos++, aw;
+
+	if (!n)
+		f->op = b;
+
+	/* A busy chip only answers status reads */
+	if (EmuFlashBusy(f) && f->op != SPI_CMD_RDSR)
+		return 0xff;
+
+	if (!n)
+	{
+		switch (b)
+		{
+		case SPI_CMD_WREN:
+			f->wel = true;
+			break;
+		case SPI_CMD_WRDI:
+			f->wel = false;
+			break;
+		case SPI_CMD_ENTER_4B_MODE:
+			f->addr4 = true;
+			break;
+		case SPI_CMD_EXIT_4B_MODE:
+			f->addr4 = false;
+			break;
+		}
+
+		return 0xff;
+	}
+
+	switch (f->op)
+	{
+	case SPI_CMD_RDID:
+		return n <= 3 ? (f->jedec_id >> (8 * (3 - n))) & 0xff : 0;
+
+	case SPI_CMD_RDSR:
+		return (EmuFlashBusy(f) ? 1 : 0) | (f->wel ? 2 : 0) | f->sr;
+
+	case SPI_CMD_WRSR:
+	case SPI_CMD_WREAR:
+		if (n == 1)
+			f->arg = b;
+		return 0xff;
+
+	case SPI_CMD_READ_UID:
+		return n > EMU_UID_DUMMY ? (unsigned char) (0xa0 + n) : 0xff;
+	}
+
+	aw = EmuAddrWidth(f);
+
+	if (n <= aw)
+	{
+		f->addr = (n == 1 ? 0 : f->addr << 8) | b;
+
+		if (n < aw)
+			return 0xff;
+
+		f->addr = EmuFlashAddr(f, f->addr);
+
+		switch (f->op)
+		{
+		case SPI_CMD_SECTOR_ERASE:
+		case SPI_CMD_SECTOR_ERASE_4B:
+			f->erase_size = SECTOR_4KB;
+			break;
+		case SPI_CMD_32KB_BLOCK_ERASE:
+		case 0x5c:
+			f->erase_size = SECTOR_32KB;
+			break;
+		case SPI_CMD_64KB_BLOCK_ERASE:
+		case SPI_CMD_64KB_BLOCK_ERASE_4B:
+			f->erase_size = SECTOR_64KB;
+			break;
+		}
+
+		return 0xff;
+	}
+
+	switch (f->op)
+	{
+	case 0x0b:	/* fast read */
+	case 0x0c:
+		if (n == aw + 1)
+			return 0xff;
+		/* fall through */
+	case SPI_CMD_READ:
+	case SPI_CMD_READ_4B:
+		return f->mem[f->addr++ % f->size];
+
+	case SPI_CMD_PAGE_PROG:
+	case SPI_CMD_PAGE_PROG_4B:
+		/* Only the last page worth of data is kept, as on the real part */
+		f->page[f->page_len % PAGE_SIZE] = b;
+		if (f->page_len < PAGE_SIZE)
+			f->page_len++;
+		return 0xff;
+	}
+
+	/* No SFDP, the chip is taken from the table by its JEDEC ID */
+	return 0xff;
+}
+
+static void EmuQueue(emu_device *emu, unsigned char b)
+{
+	if (emu->in_len < EMU_QUEUE_SIZE)
+		emu->in[emu->in_len++] = b;
+}
+
+/* Runs one OUT packet through the CH341: UIO commands drive CS, SPI streams clock the chip */
+static void EmuPacket(emu_device *emu, const unsigned char *pkt, unsigned int len)
+{
+	emu_flash *f = &emu->flash;
+	unsigned int i;
+	bool selected;
+
+	switch (pkt[0])
+	{
+	case CH341_CMD_UIO_STREAM:
+		for (i = 1; i < len && pkt[i] != CH341_CMD_UIO_STM_END; i++)
+		{
+			if ((pkt[i] & 0xc0) != CH341_CMD_UIO_STM_OUT)
+				continue;
+
+			/* CS0 is D0, active low */
+			selected = !(pkt[i] & 1);
+
+			if (selected && !f->selected)
+				EmuFlashBegin(f);
+			else if (!selected && f->selected)
+				EmuFlashEnd(emu, f);
+
+			f->selected = selected;
+		}
+		break;
+
+	case CH341_CMD_SPI_STREAM:
+		for (i = 1; i < len; i++)
+			EmuQueue(emu, BitSwapTable[f->selected ? EmuFlashClock(f, BitSwapTable[pkt[i]]) : 0xff]);
+		break;
+	}
+}
+
+/* A transfer the device does not answer takes the whole timeout, as with libusb */
+static int EmuTimeout(unsigned int timeout)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+	return LIBUSB_ERROR_TIMEOUT;
+}
+
+/*
+ * Fails a transfer the way a flaky link does: a timeout or stall moves
+ * no data at all, an I/O error loses IN data on the way. OUT data never
+ * arrives.
+ */
+static int EmuFault(emu_device *emu, unsigned char endpoint, int length, unsigned int timeout)
+{
+	unsigned int lost;
+	double r = EmuRandom(emu);
+
+	if (r < 0.34)
+		return EmuTimeout(timeout);
+
+	if (r < 0.67)
+	{
+		emu->halted[!!(endpoint & LIBUSB_ENDPOINT_IN)] = true;
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	if (endpoint & LIBUSB_ENDPOINT_IN)
+	{
+		lost = (unsigned int) length < emu->in_len ? (unsigned int) length : emu->in_len;
+		memmove(emu->in, emu->in + lost, emu->in_len - lost);
+		emu->in_len -= lost;
+	}
+
+	return LIBUSB_ERROR_IO;
+}
+
+int EmuBulkTransfer(emu_device *emu, unsigned char endpoint, unsigned char *data, int length, int *transferred,
+	unsigned int timeout)
+{
+	unsigned int n;
+	int pos;
+
+	*transferred = 0;
+
+	if (emu->latency_us)
+		std::this_thread::sleep_for(std::chrono::microseconds(emu->latency_us));
+
+	emu->transfers++;
+
+	if (emu->unplug && emu->transfers == emu->unplug)
+	{
+		emu->gone = true;
+		emu->back_at = emu_clock::now() + std::chrono::milliseconds(emu->replug_ms);
+	}
+
+	if (emu->gone)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (emu->hang && emu->transfers > emu->hang)
+		return EmuTimeout(timeout);
+
+	if (emu->halted[!!(endpoint & LIBUSB_ENDPOINT_IN)])
+		return LIBUSB_ERROR_PIPE;
+
+	if (emu->fail > 0 && EmuRandom(emu) < emu->fail)
+		return EmuFault(emu, endpoint, length, timeout);
+
+	if (endpoint & LIBUSB_ENDPOINT_IN)
+	{
+		/* Nothing clocked means nothing to read, the CH341 just NAKs */
+		if (!emu->in_len)
+			return EmuTimeout(timeout);
+
+		n = (unsigned int) length < emu->in_len ? (unsigned int) length : emu->in_len;
+		memcpy(data, emu->in, n);
+		memmove(emu->in, emu->in + n, emu->in_len - n);
+		emu->in_len -= n;
+
+		*transferred = n;
+		return 0;
+	}
+
+	for (pos = 0; pos < length; pos += CH341_PACKET_LENGTH)
+		EmuPacket(emu, data + pos, length - pos < CH341_PACKET_LENGTH ? length - pos : CH341_PACKET_LENGTH);
+
+	*transferred = length;
+	return 0;
+}
+
+int EmuClearHalt(emu_device *emu, unsigned char endpoint)
+{
+	if (emu->gone)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	emu->halted[!!(endpoint & LIBUSB_ENDPOINT_IN)] = false;
+	return 0;
+}
+
+/* The CH341 starts over with CS released, the flash keeps its state */
+int EmuResetDevice(emu_device *emu)
+{
+	/* As libusb says of a device which re-enumerated */
+	if (emu->gone)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	emu->halted[0] = false;
+	emu->halted[1] = false;
+	emu->in_len = 0;
+
+	if (emu->flash.selected)
+		EmuFlashEnd(emu, &emu->flash);
+
+	emu->flash.selected = false;
+
+	return 0;
+}
+
+/*
+ * Once it is back on the bus after an unplug, the programmer comes up
+ * fresh and so does the flash, as after a brown-out: out of 4-byte mode,
+ * write enable cleared, a program or erase in progress cut short.
+ */
+int EmuReopen(emu_device *emu)
+{
+	if (!emu->gone)
+		return 0;
+
+	if (emu_clock::now() < emu->back_at)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	emu->gone = false;
+	emu->halted[0] = false;
+	emu->halted[1] = false;
+	emu->in_len = 0;
+
+	emu->flash.selected = false;
+	emu->flash.addr4 = false;
+	emu->flash.ear = 0;
+	emu->flash.wel = false;
+	emu->flash.busy_until = emu_clock::time_point();
+
+	return 0;
+}
+
+static bool EmuParseSize(const char *s, unsigned int *size)
+{
+	char *end;
+	unsigned long n = strtoul(s, &end, 0);
+
+	if (*end == 'K' || *end == 'k')
+		n <<= 10, end++;
+	else if (*end == 'M' || *end == 'm')
+		n <<= 20, end++;
+
+	*size = (unsigned int) n;
+	return !*end;
+}
+
+static bool EmuParseOption(emu_device *emu, char *opt)
+{
+	char *val = strchr(opt, '=');
+
+	if (!val)
+		return false;
+
+	*val++ = 0;
+
+	if (!strcmp(opt, "size"))
+		return EmuParseSize(val, &emu->flash.size);
+
+	if (!strcmp(opt, "image"))
+	{
+		snprintf(emu->image, sizeof (emu->image), "%s", val);
+		return true;
+	}
+
+	if (!strcmp(opt, "latency"))
+		emu->latency_us = strtoul(val, NULL, 0);
+	else if (!strcmp(opt, "fail"))
+		emu->fail = strtod(val, NULL) / 100;
+	else if (!strcmp(opt, "hang"))
+		emu->hang = strtoull(val, NULL, 0);
+	else if (!strcmp(opt, "unplug"))
+		emu->unplug = strtoull(val, NULL, 0);
+	else if (!strcmp(opt, "replug"))
+		emu->replug_ms = strtoul(val, NULL, 0);
+	else if (!strcmp(opt, "seed"))
+		emu->rng = strtoull(val, NULL, 0);
+	else if (!strcmp(opt, "prog"))
+		emu->prog_us = strtoul(val, NULL, 0);
+	else if (!strcmp(opt, "erase"))
+		emu->erase_ms = strtoul(val, NULL, 0);
+	else
+		return false;
+
+	return true;
+}
+
+emu_device *EmuOpen(const char *spec)
+{
+	emu_device *emu = new emu_device();
+	char opts[1024], *opt, *next;
+	unsigned int bits;
+	FILE *f;
+
+	emu->flash.size = EMU_DEFAULT_SIZE;
+	emu->rng = 1;
+	emu->replug_ms = EMU_REPLUG_MS;
+
+	snprintf(opts, sizeof (opts), "%s", spec[3] ? spec + 4 : "");
+
+	for (opt = opts; *opt; opt = next)
+	{
+		next = opt + strcspn(opt, ",");
+		if (*next)
+			*next++ = 0;
+
+		if (!EmuParseOption(emu, opt))
+		{
+			Message(MSG_ERROR, "Error: invalid emulator option '%s'\n", opt);
+			delete emu;
+			return NULL;
+		}
+	}
+
+	for (bits = 0; (1u << bits) < emu->flash.size; bits++)
+		;
+
+	if (emu->flash.size < EMU_MIN_SIZE || emu->flash.size > EMU_MAX_SIZE || (1u << bits) != emu->flash.size)
+	{
+		Message(MSG_ERROR, "Error: emulated flash size must be a power of 2 from %uMiB to %uMiB\n",
+			EMU_MIN_SIZE >> 20, EMU_MAX_SIZE >> 20);
+		delete emu;
+		return NULL;
+	}
+
+	/* xorshift never leaves 0 */
+	if (!emu->rng)
+		emu->rng = 1;
+
+	emu->flash.jedec_id = EMU_JEDEC_W25Q | bits;
+	emu->flash.mem = new unsigned char[emu->flash.size];
+	memset(emu->flash.mem, 0xff, emu->flash.size);
+
+	if (emu->image[0] && (f = fopen(emu->image, "rb")))
+	{
+		if (fread(emu->flash.mem, 1, emu->flash.size, f) == 0 && ferror(f))
+			Message(MSG_WARNING, "Warning: failed to read emulator image %s\n", emu->image);
+
+		fclose(f);
+	}
+
+	return emu;
+}
+
+/*
+ * Emulators backed by the same image are the same device, as two handles on
+ * one programmer would be. Those without one are each a device of their own.
+ */
+void EmuGetLocation(emu_device *emu, char *buf, unsigned int size)
+{
+	static std::atomic<unsigned int> instances;
+	unsigned int hash = 0x811c9dc5, i;
+
+	if (!emu->image[0])
+	{
+		snprintf(buf, size, "emu%u", instances++);
+		return;
+	}
+
+	/* FNV-1a, the path itself does not fit a location */
+	for (i = 0; emu->image[i]; i++)
+		hash = (hash ^ (unsigned char) emu->image[i]) * 0x01000193;
+
+	snprintf(buf, size, "emu-%08x", hash);
+}
+
+void EmuClose(emu_device *emu)
+{
+	FILE *f;
+
+	if (emu->image[0])
+	{
+		f = fopen(emu->image, "wb");
+
+		if (!f || fwrite(emu->flash.mem, 1, emu->flash.size, f) != emu->flash.size)
+			Message(MSG_ERROR, "Error: failed to save emulator image %s\n", emu->image);
+
+		if (f)
+			fclose(f);
+	}
+
+	delete[] emu->flash.mem;
+	delete emu;
+}
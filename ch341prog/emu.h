@@ -0,0 +1,51 @@
+#ifndef _EMU_H_
+#define _EMU_H_
+
+#include <string.h>
+
+#define EMU_DEFAULT_SIZE			(4 << 20)
+#define EMU_VERSION					0x0304
+#define EMU_QUEUE_SIZE				4096	/* SPI bytes waiting to be read back */
+
+typedef struct _emu_device emu_device;
+
+/*
+ * In-process CH341 with a Winbond W25Qxx on CS0, for trying out and
+ * measuring the transport and flash engine without hardware. It speaks
+ * the CH341 bulk protocol, so everything above the USB transfers runs as
+ * it does with a real programmer. Selected by the device spec
+ *   emu[:<option>,...]
+ * with options
+ *   size=<n>[K|M]      flash size, 1M to 32M (default 4M)
+ *   image=<file>       initial flash contents, written back on close
+ *   latency=<us>       time every USB transfer takes
+ *   fail=<percent>     share of transfers failing with a USB error, a timeout
+ *                      takes the caller's whole timeout as it would on the bus
+ *   seed=<n>           start of the fault sequence, runs are repeatable
+ *   hang=<n>           stop answering after n transfers, every later one times out
+ *   unplug=<n>         drop off the bus at the n-th transfer, as on a brown-out
+ *   replug=<ms>        time until it is back and can be reopened (default 1000)
+ *   prog=<us>          page program time
+ *   erase=<ms>         block erase time
+ */
+static inline bool EmuIsSpec(const char *spec)
+{
+	return spec && !strncmp(spec, "emu", 3) && (!spec[3] || spec[3] == ':');
+}
+
+emu_device *EmuOpen(const char *spec);
+void EmuClose(emu_device *emu);
+
+/* Location of the emulated programmer, distinct for every image and every instance without one */
+void EmuGetLocation(emu_device *emu, char *buf, unsigned int size);
+
+/* Same calling convention and error codes as their libusb counterparts */
+int EmuBulkTransfer(emu_device *emu, unsigned char endpoint, unsigned char *data, int length, int *transferred,
+	unsigned int timeout);
+int EmuClearHalt(emu_device *emu, unsigned char endpoint);
+int EmuResetDevice(emu_device *emu);
+
+/* Opening the device again after it dropped off, LIBUSB_ERROR_NO_DEVICE until it is back */
+int EmuReopen(emu_device *emu);
+
+#endif /* _EMU_H_ */
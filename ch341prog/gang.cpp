@@ -0,0 +1,283 @@
+#include "stdafx.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "gang.h"
+
+#define GANG_STATUS_INTERVAL_MS		500
+
+enum gang_phase
+{
+	GANG_PROBE,
+	GANG_ERASE,
+	GANG_WRITE,
+	GANG_VERIFY,
+	GANG_DONE,
+};
+
+static const char gang_phase_tag[] = { 'P', 'E', 'W', 'V', '-' };
+
+/* Shared by all units, never written once the workers run */
+typedef struct _gang_job
+{
+	const unsigned char *image;
+	const unsigned char *encoded;
+	unsigned int addr;
+	unsigned int len;
+	bool erase;
+	bool verify;
+} gang_job;
+
+typedef struct _gang_unit
+{
+	unsigned int index;
+	const gang_job *job;
+
+	ch341_device dev;
+	spi_flash flash;
+	char location[32];
+
+	std::thread worker;
+	std::atomic<int> phase;
+	std::atomic<int> percent;
+
+	bool passed;
+	char error[96];
+	unsigned int mismatch_addr;
+	double seconds;
+} gang_unit;
+
+static bool GangProgress(int percentage, void *arg)
+{
+	gang_unit *u = (gang_unit *) arg;
+
+	u->percent = percentage;
+	return true;
+}
+
+static bool GangVerifyChunk(unsigned int addr, const unsigned char *data, unsigned int len, void *arg)
+{
+	gang_unit *u = (gang_unit *) arg;
+	const unsigned char *expected = u->job->image + (addr - u->job->addr);
+	unsigned int i;
+
+	u->percent = (int) ((unsigned long long) (addr - u->job->addr + len) * 100 / u->job->len);
+
+	if (!memcmp(data, expected, len))
+		return true;
+
+	for (i = 0; data[i] == expected[i]; i++)
+		;
+
+	u->mismatch_addr = addr + i;
+	snprintf(u->error, sizeof (u->error), "verify mismatch at 0x%08x", addr + i);
+
+	return false;
+}
+
+static void GangFail(gang_unit *u, const char *what)
+{
+	if (!u->error[0])
+		snprintf(u->error, sizeof (u->error), CH341Cancelled() ? "%s interrupted" : "%s failed", what);
+}
+
+static void GangWorker(gang_unit *u)
+{
+	const gang_job *job = u->job;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	SpiFlashInit(&u->flash, &u->dev, 0);
+	u->flash.quiet = true;
+	u->flash.progress = GangProgress;
+	u->flash.progress_arg = u;
+
+	u->phase = GANG_PROBE;
+
+	if (!SpiFlashProbe(&u->flash))
+	{
+		GangFail(u, "probe");
+		goto out;
+	}
+
+	if (job->addr + job->len > SpiFlashGetSize(&u->flash))
+	{
+		snprintf(u->error, sizeof (u->error), "image exceeds %uKiB flash", SpiFlashGetSize(&u->flash) >> 10);
+		goto out;
+	}
+
+	if (job->erase)
+	{
+		u->phase = GANG_ERASE;
+		u->percent = 0;
+
+		if (!SpiFlashErase(&u->flash, job->addr, job->len))
+		{
+			GangFail(u, "erase");
+			goto out;
+		}
+	}
+
+	u->phase = GANG_WRITE;
+	u->percent = 0;
+
+	if (!SpiFlashWriteEx(&u->flash, job->addr, job->image, job->encoded, job->len))
+	{
+		GangFail(u, "write");
+		goto out;
+	}
+
+	if (job->verify)
+	{
+		u->phase = GANG_VERIFY;
+		u->percent = 0;
+
+		if (!SpiFlashReadEx(&u->flash, job->addr, job->len, NULL, GangVerifyChunk, u))
+		{
+			GangFail(u, "read");
+			goto out;
+		}
+	}
+
+	u->passed = true;
+
+out:
+	u->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	u->phase = GANG_DONE;
+}
+
+static void GangShowStatus(gang_unit *units, unsigned int count)
+{
+	unsigned int i;
+	int phase;
+
+	printf("\r");
+
+	for (i = 0; i < count; i++)
+	{
+		phase = units[i].phase;
+
+		if (phase == GANG_DONE)
+			printf("[%u] %-4s ", i, units[i].passed ? "ok" : "FAIL");
+		else
+			printf("[%u] %c%3d%% ", i, gang_phase_tag[phase], (int) units[i].percent);
+	}
+
+	fflush(stdout);
+}
+
+int GangProgram(const char *filename, unsigned int addr, unsigned int size, bool need_erase, bool need_verify)
+{
+	gang_unit *units;
+	gang_job job;
+	unsigned char *image, *encoded;
+	ch341_device devs[GANG_MAX_DEVICES];
+	unsigned int i, count, done, passed = 0;
+	double wall;
+	std::chrono::steady_clock::time_point start;
+
+	printf("Reading file %s ...\n", filename);
+
+	image = LoadImageFile(filename, &size);
+	if (!image)
+		return -EIO;
+
+	if (!size)
+	{
+		fprintf(stderr, "Error: nothing to write.\n");
+		delete[] image;
+		return -EINVAL;
+	}
+
+	/* Converted to wire bit order once for all programmers */
+	encoded = new unsigned char[size];
+	CH341EncodeSPI(image, encoded, size);
+
+	job.image = image;
+	job.encoded = encoded;
+	job.addr = addr;
+	job.len = size;
+	job.erase = need_erase;
+	job.verify = need_verify;
+
+	printf("Done.\n\n");
+
+	count = CH341DeviceOpenAll(devs, GANG_MAX_DEVICES);
+	if (!count)
+	{
+		fprintf(stderr, "Error: no CH341 device found\n");
+		delete[] encoded;
+		delete[] image;
+		return -ENODEV;
+	}
+
+	printf("%u programmer(s) found, %s%swriting %xh bytes at %xh ...\n", count,
+		need_erase ? "erasing, " : "", need_verify ? "verifying, " : "", size, addr);
+
+	units = new gang_unit[count];
+
+	start = std::chrono::steady_clock::now();
+
+	for (i = 0; i < count; i++)
+	{
+		units[i].index = i;
+		units[i].job = &job;
+		units[i].dev = devs[i];
+		units[i].phase = GANG_PROBE;
+		units[i].percent = 0;
+		units[i].passed = false;
+		units[i].error[0] = 0;
+		units[i].seconds = 0;
+
+		if (!CH341DeviceGetLocation(&units[i].dev, units[i].location, sizeof (units[i].location)))
+			strcpy(units[i].location, "?");
+
+		units[i].worker = std::thread(GangWorker, &units[i]);
+	}
+
+	/* Each unit runs on its own, a slow or failing one holds up nobody */
+	do
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(GANG_STATUS_INTERVAL_MS));
+
+		for (i = 0, done = 0; i < count; i++)
+			if (units[i].phase == GANG_DONE)
+				done++;
+
+		GangShowStatus(units, count);
+	} while (done < count);
+
+	wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("\n\n");
+
+	for (i = 0; i < count; i++)
+	{
+		units[i].worker.join();
+
+		printf("[%u] %-12s %-24s %-4s %7.2fs  %s\n", i, units[i].location,
+			units[i].flash.id ? units[i].flash.id->model : "-", units[i].passed ? "PASS" : "FAIL",
+			units[i].seconds, units[i].error);
+
+		if (units[i].passed)
+			passed++;
+
+		CH341DeviceClose(&units[i].dev);
+	}
+
+	printf("\n%u/%u passed, %.2fs total, %.2fKiB/s aggregate\n", passed, count, wall,
+		wall > 0 ? (double) size * passed / 1024 / wall : 0.0);
+
+	delete[] units;
+	delete[] encoded;
+	delete[] image;
+
+	return passed == count ? 0 : -EFAULT;
+}
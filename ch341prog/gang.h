@@ -0,0 +1,9 @@
+#ifndef _GANG_H_
+#define _GANG_H_
+
+#define GANG_MAX_DEVICES			32
+
+/* Programs the same image into the chips on every attached CH341 at once */
+int GangProgram(const char *filename, unsigned int addr, unsigned int size, bool need_erase, bool need_verify);
+
+#endif /* _GANG_H_ */
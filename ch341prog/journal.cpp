@@ -0,0 +1,467 @@
+#include "stdafx.h"
+
+#include <string.h>
+#include <errno.h>
+
+#include <chrono>
+
+#include "spi_flash.h"
+#include "checksum.h"
+#include "journal.h"
+#include "profile.h"
+
+typedef struct _journal
+{
+	FILE *f;
+	char path[1024];
+	unsigned int units;
+	unsigned int *crc;
+	bool *done;
+	unsigned int unflushed;
+} journal;
+
+/*
+ * The first line describes the operation, a journal is only taken up by
+ * the very same one. Each further line is "done <unit> <crc32>", a torn
+ * last line from a crash is ignored.
+ */
+static bool JournalOpen(journal *j, const char *filename, const char *header, unsigned int units, bool resume)
+{
+	char line[256];
+	unsigned int i, crc;
+	bool torn = false, resumed = false;
+	FILE *f;
+
+	snprintf(j->path, sizeof (j->path), "%s%s", filename, JOURNAL_SUFFIX);
+	j->units = units;
+	j->crc = new unsigned int[units]();
+	j->done = new bool[units]();
+	j->unflushed = 0;
+	j->f = NULL;
+
+	f = fopen(j->path, "r");
+
+	if (f && resume)
+	{
+		if (!fgets(line, sizeof (line), f) || strcmp(line, header))
+		{
+			Message(MSG_ERROR, "Error: %s belongs to a different operation, remove it to start over.\n", j->path);
+			fclose(f);
+			return false;
+		}
+
+		while (fgets(line, sizeof (line), f))
+		{
+			torn = !strchr(line, '\n');
+
+			if (!torn && sscanf(line, "done %u %x", &i, &crc) == 2 && i < units)
+			{
+				j->done[i] = true;
+				j->crc[i] = crc;
+			}
+		}
+
+		fclose(f);
+		resumed = true;
+
+		j->f = fopen(j->path, "a");
+		if (j->f && torn)
+			fputs("\n", j->f);
+	}
+	else
+	{
+		if (f)
+		{
+			fclose(f);
+			printf("Discarding %s of an earlier run, use --resume to continue it instead.\n", j->path);
+		}
+		else if (resume)
+		{
+			printf("No journal found, starting from the beginning.\n");
+		}
+
+		j->f = fopen(j->path, "w");
+		if (j->f)
+			fputs(header, j->f);
+	}
+
+	if (!j->f && resumed)
+	{
+		Message(MSG_ERROR, "Error: unable to open journal %s! error %d\n", j->path, errno);
+		return false;
+	}
+
+	/* E.g. next to an image on read-only media, the operation itself still works */
+	if (!j->f)
+	{
+		Message(MSG_WARNING, "Warning: unable to create journal %s (error %d), going on without one.\n", j->path, errno);
+		return true;
+	}
+
+	fflush(j->f);
+
+	return true;
+}
+
+static void JournalMark(journal *j, unsigned int unit, unsigned int crc)
+{
+	profile_scope scope(PROF_FILE_IO);
+
+	j->done[unit] = true;
+	j->crc[unit] = crc;
+
+	if (!j->f)
+		return;
+
+	fprintf(j->f, "done %u %08x\n", unit, crc);
+
+	if (++j->unflushed >= JOURNAL_FLUSH_UNITS)
+	{
+		fflush(j->f);
+		j->unflushed = 0;
+	}
+}
+
+static unsigned int JournalDoneCount(const journal *j)
+{
+	unsigned int i, count = 0;
+
+	for (i = 0; i < j->units; i++)
+		if (j->done[i])
+			count++;
+
+	return count;
+}
+
+static const char *JournalResumeHint(const journal *j)
+{
+	return j->f ? "run the same command with --resume to continue" : "no journal was kept, start over";
+}
+
+/* A finished operation needs no journal any more, an interrupted one keeps it for --resume */
+static void JournalClose(journal *j, bool finished)
+{
+	if (j->f)
+	{
+		fclose(j->f);
+
+		if (finished)
+			remove(j->path);
+	}
+
+	delete[] j->crc;
+	delete[] j->done;
+}
+
+/* Unit i of the image file, flushed so the journal never runs ahead of it */
+static bool JournalWriteUnit(FILE *f, unsigned int i, unsigned int unit, const unsigned char *buf, unsigned int n)
+{
+	profile_scope scope(PROF_FILE_IO);
+
+	return !fseek(f, (long) i * unit, SEEK_SET) && fwrite(buf, 1, n, f) == n && !fflush(f);
+}
+
+static bool JournalReadUnit(FILE *f, unsigned int i, unsigned int unit, unsigned char *buf, unsigned int n)
+{
+	profile_scope scope(PROF_FILE_IO);
+
+	return !fseek(f, (long) i * unit, SEEK_SET) && fread(buf, 1, n, f) == n;
+}
+
+static void JournalShowSpeed(std::chrono::steady_clock::time_point start, unsigned int len)
+{
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("Time used: %.2fs\n", seconds);
+
+	if (seconds > 0)
+		printf("Speed: %.2fKiB/s\n", len / 1024.0 / seconds);
+}
+
+int JournalRead(spi_flash *flash, const char *filename, unsigned int addr, unsigned int size, bool resume)
+{
+	std::chrono::steady_clock::time_point start;
+	unsigned int unit = JOURNAL_UNIT_SIZE, units, i, n, done, todo, redo = 0;
+	unsigned char *buf;
+	char header[128];
+	bool quiet = flash->quiet;
+	journal j;
+	FILE *f = NULL;
+	int ret = 0;
+
+	units = (size + unit - 1) / unit;
+
+	snprintf(header, sizeof (header), "ch341prog-journal %u read %06x %x %x %x\n", JOURNAL_VERSION,
+		flash->id->jedec_id, addr, size, unit);
+
+	if (!JournalOpen(&j, filename, header, units, resume))
+	{
+		JournalClose(&j, false);
+		return -EINVAL;
+	}
+
+	buf = new unsigned char[unit];
+
+	/* Units already read count only if they are still in the file as they came from the chip */
+	if (JournalDoneCount(&j))
+		f = fopen(filename, "r+b");
+
+	for (i = 0; i < units; i++)
+	{
+		if (!j.done[i])
+			continue;
+
+		n = size - i * unit < unit ? size - i * unit : unit;
+
+		if (!f || !JournalReadUnit(f, i, unit, buf, n) || Crc32Update(0, buf, n) != j.crc[i])
+		{
+			j.done[i] = false;
+			redo++;
+		}
+	}
+
+	if (!f)
+		f = fopen(filename, "wb");
+
+	if (!f)
+	{
+		fprintf(stderr, "Error: unable to open/create file! error %d\n", errno);
+		ret = -errno;
+		goto out;
+	}
+
+	done = JournalDoneCount(&j);
+	todo = units - done;
+
+	if (done || redo)
+		printf("Resuming: %u of %u units already read, %u to read again.\n", done, units, redo);
+
+	printf("Reading flash from %xh, size %xh into %s ...\n", addr, size, filename);
+
+	if (!SpiFlashBegin(flash))
+	{
+		ret = -EIO;
+		goto out;
+	}
+
+	flash->quiet = true;
+
+	ProgressInit();
+	start = std::chrono::steady_clock::now();
+
+	for (i = 0, done = 0; i < units; i++)
+	{
+		if (j.done[i])
+			continue;
+
+		n = size - i * unit < unit ? size - i * unit : unit;
+
+		if (!SpiFlashRead(flash, addr + i * unit, n, buf))
+		{
+			printf("\n");
+			Message(MSG_ERROR, "Error: interrupted at %xh, %u of %u units left, %s.\n", addr + i * unit, todo - done, units,
+				JournalResumeHint(&j));
+			ret = -EIO;
+			break;
+		}
+
+		/* Data first, so the journal never runs ahead of the file */
+		if (!JournalWriteUnit(f, i, unit, buf, n))
+		{
+			printf("\n");
+			fprintf(stderr, "Error: failed to write to file! error %d\n", errno);
+			ret = -errno;
+			break;
+		}
+
+		JournalMark(&j, i, Crc32Update(0, buf, n));
+
+		ProgressShow(++done * 100 / todo);
+	}
+
+	if (!ret)
+	{
+		ProgressDone();
+		JournalShowSpeed(start, size);
+	}
+
+	flash->quiet = quiet;
+	SpiFlashEnd(flash);
+
+out:
+	if (f)
+		fclose(f);
+
+	JournalClose(&j, !ret);
+	delete[] buf;
+
+	return ret;
+}
+
+static int JournalVerifyUnit(spi_flash *flash, unsigned int addr, const unsigned char *expected, unsigned char *buf,
+	unsigned int len)
+{
+	unsigned int i;
+	int ret = 0;
+
+	if (!SpiFlashRead(flash, addr, len, buf))
+		return -EIO;
+
+	if (!memcmp(buf, expected, len))
+		return 0;
+
+	printf("\n");
+
+	for (i = 0; i < len; i++)
+	{
+		if (buf[i] != expected[i])
+		{
+			printf("Difference at 0x%08x, read 0x%02x, expected 0x%02x\n", addr + i, buf[i], expected[i]);
+			ret = -EFAULT;
+		}
+	}
+
+	return ret;
+}
+
+int JournalWrite(spi_flash *flash, const char *filename, const unsigned char *image, unsigned int addr, unsigned int size,
+	bool need_erase, bool need_verify, bool resume)
+{
+	std::chrono::steady_clock::time_point start;
+	unsigned int unit, units, i, n, a, end, done, todo, redo = 0;
+	unsigned char *buf;
+	char header[128];
+	bool quiet = flash->quiet;
+	journal j;
+	int ret = 0;
+
+	if (need_erase && addr % flash->erase_size)
+	{
+		Message(MSG_ERROR, "Error: start address is not on erase boundary.\n");
+		return -EINVAL;
+	}
+
+	/* Whole erase blocks per unit, so redoing a unit never touches its neighbours */
+	unit = flash->erase_size > JOURNAL_UNIT_SIZE ? flash->erase_size : JOURNAL_UNIT_SIZE;
+	units = (size + unit - 1) / unit;
+
+	snprintf(header, sizeof (header), "ch341prog-journal %u write %06x %x %x %x %08x %c%c\n", JOURNAL_VERSION,
+		flash->id->jedec_id, addr, size, unit, Crc32Update(0, image, size), need_erase ? 'e' : '-', need_verify ? 'v' : '-');
+
+	if (!JournalOpen(&j, filename, header, units, resume))
+	{
+		JournalClose(&j, false);
+		return -EINVAL;
+	}
+
+	buf = new unsigned char[unit];
+
+	if (!SpiFlashBegin(flash))
+	{
+		ret = -EIO;
+		goto out;
+	}
+
+	flash->quiet = true;
+
+	/* Units recorded as written count only if the chip still holds them */
+	if (JournalDoneCount(&j))
+	{
+		printf("Checking %u written unit(s) against the chip ...\n", JournalDoneCount(&j));
+
+		for (i = 0; i < units; i++)
+		{
+			if (!j.done[i])
+				continue;
+
+			n = size - i * unit < unit ? size - i * unit : unit;
+
+			if (!SpiFlashRead(flash, addr + i * unit, n, buf))
+			{
+				Message(MSG_ERROR, "Error: interrupted while checking, run the same command with --resume to try again.\n");
+				ret = -EIO;
+				goto end;
+			}
+
+			if (Crc32Update(0, buf, n) != j.crc[i])
+			{
+				j.done[i] = false;
+				redo++;
+			}
+		}
+
+		printf("Resuming: %u of %u units already written, %u to write again.\n", JournalDoneCount(&j), units, redo);
+	}
+
+	done = JournalDoneCount(&j);
+	todo = units - done;
+
+	printf("%s flash at %xh, size %xh ...\n", need_erase ? (need_verify ? "Erasing, writing and verifying" : "Erasing and writing") :
+		(need_verify ? "Writing and verifying" : "Writing"), addr, size);
+
+	ProgressInit();
+	start = std::chrono::steady_clock::now();
+
+	for (i = 0, done = 0; i < units; i++)
+	{
+		if (j.done[i])
+			continue;
+
+		a = addr + i * unit;
+		n = size - i * unit < unit ? size - i * unit : unit;
+
+		if (need_erase)
+		{
+			/* The last unit is erased up to the next boundary */
+			end = (a + n + flash->erase_size - 1) / flash->erase_size * flash->erase_size;
+
+			if (!SpiFlashErase(flash, a, end - a))
+				goto interrupted;
+		}
+
+		if (!SpiFlashWriteEx(flash, a, image + i * unit, NULL, n))
+			goto interrupted;
+
+		if (need_verify)
+		{
+			ret = JournalVerifyUnit(flash, a, image + i * unit, buf, n);
+
+			if (ret == -EIO)
+				goto interrupted;
+
+			if (ret)
+			{
+				printf("Verify failed.\n");
+				goto end;
+			}
+		}
+
+		JournalMark(&j, i, Crc32Update(0, image + i * unit, n));
+
+		ProgressShow(++done * 100 / todo);
+	}
+
+	ProgressDone();
+	JournalShowSpeed(start, size);
+
+	if (need_verify)
+		printf("Verify passed.\n");
+
+	goto end;
+
+interrupted:
+	printf("\n");
+	Message(MSG_ERROR, "Error: interrupted at %xh, %u of %u units left, %s.\n", a, todo - done, units,
+		JournalResumeHint(&j));
+	ret = -EIO;
+
+end:
+	flash->quiet = quiet;
+	SpiFlashEnd(flash);
+
+out:
+	JournalClose(&j, !ret);
+	delete[] buf;
+
+	return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "spi_flash.h"
+
+#define JOURNAL_VERSION				1
+#define JOURNAL_UNIT_SIZE			(64 << 10)
+#define JOURNAL_FLUSH_UNITS			8	/* completed units between journal flushes */
+#define JOURNAL_SUFFIX				".journal"
+
+/*
+ * Long reads and writes are done in units, each finished unit is recorded
+ * with its CRC32 in <file>.journal. After an interruption, running the same
+ * command with resume checks the recorded units against the chip (write) or
+ * the output file (read) and carries on with the rest. The journal is
+ * removed once the operation completes.
+ */
+int JournalRead(spi_flash *flash, const char *filename, unsigned int addr, unsigned int size, bool resume);
+int JournalWrite(spi_flash *flash, const char *filename, const unsigned char *image, unsigned int addr, unsigned int size,
+	bool need_erase, bool need_verify, bool resume);
+
+#endif /* _JOURNAL_H_ */
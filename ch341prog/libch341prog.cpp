@@ -0,0 +1,579 @@
+#include "stdafx.h"
+
+#include <string.h>
+#include <new>
+#include <atomic>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "metrics.h"
+#include "libch341prog.h"
+
+#define LIB_STREAM_CHUNK			(64 << 10)
+
+struct _ch341prog_session
+{
+	ch341_device dev;
+	spi_flash flash;
+
+	ch341prog_progress_cb progress;
+	void *progress_arg;
+	std::atomic<bool> cancel;
+
+	/* The running SpiFlash* call covers [span_base, span_base + span_len) of total */
+	int stage;
+	unsigned int span_base;
+	unsigned int span_len;
+	unsigned int total;
+	int last_stage;
+	int last_percent;
+
+	char error[256];
+};
+
+static ch341prog_log_cb lib_log;
+static void *lib_log_arg;
+
+/* Messages are global, errors are kept per thread and picked up by the session that ran into them */
+static thread_local char lib_error[256];
+
+static void LibMessage(int level, const char *msg, void *arg)
+{
+	const char *p = msg;
+	size_t len;
+
+	if (lib_log)
+		lib_log(level, msg, lib_log_arg);
+
+	if (level != MSG_ERROR)
+		return;
+
+	if (!strncmp(p, "Error: ", 7))
+		p += 7;
+
+	len = strlen(p);
+	while (len && (p[len - 1] == '\n' || p[len - 1] == '\r'))
+		len--;
+
+	if (len >= sizeof (lib_error))
+		len = sizeof (lib_error) - 1;
+
+	memcpy(lib_error, p, len);
+	lib_error[len] = 0;
+}
+
+static bool LibProgress(int percentage, void *arg)
+{
+	ch341prog_session *s = (ch341prog_session *) arg;
+	unsigned int done;
+	int overall;
+
+	if (s->cancel)
+		return false;
+
+	if (!s->progress)
+		return true;
+
+	done = s->span_base + (unsigned int) ((unsigned long long) s->span_len * percentage / 100);
+	overall = s->total ? (int) ((unsigned long long) done * 100 / s->total) : 100;
+
+	if (overall == s->last_percent && s->stage == s->last_stage)
+		return true;
+
+	s->last_percent = overall;
+	s->last_stage = s->stage;
+
+	if (s->progress(s->stage, done, s->total, s->progress_arg))
+	{
+		s->cancel = true;
+		return false;
+	}
+
+	return true;
+}
+
+static void LibSpan(ch341prog_session *s, int stage, unsigned int base, unsigned int len)
+{
+	s->stage = stage;
+	s->span_base = base;
+	s->span_len = len;
+}
+
+static void LibStart(ch341prog_session *s, int stage, unsigned int total)
+{
+	lib_error[0] = 0;
+	s->error[0] = 0;
+	s->cancel = false;
+	s->total = total;
+	s->last_stage = -1;
+	s->last_percent = -1;
+
+	LibSpan(s, stage, 0, total);
+}
+
+/* Records the detail of a failure in the session and passes err through */
+static int LibFinish(ch341prog_session *s, int err)
+{
+	if (err == CH341PROG_ERR_IO && s->cancel)
+		err = CH341PROG_ERR_CANCELLED;
+
+	if (err && !lib_error[0])
+		strcpy(lib_error, Ch341ProgStrError(err));
+
+	if (err)
+		strcpy(s->error, lib_error);
+
+	return err;
+}
+
+static int LibProbe(ch341prog_session *s)
+{
+	if (!s->flash.probed && !SpiFlashProbe(&s->flash))
+		return CH341PROG_ERR_NOCHIP;
+
+	return CH341PROG_OK;
+}
+
+static int LibCheckRange(ch341prog_session *s, unsigned int addr, unsigned int len)
+{
+	int err;
+
+	if ((err = LibProbe(s)))
+		return err;
+
+	if (addr > SpiFlashGetSize(&s->flash) || len > SpiFlashGetSize(&s->flash) - addr)
+	{
+		Message(MSG_ERROR, "Error: range %xh+%xh exceeds the flash size.\n", addr, len);
+		return CH341PROG_ERR_INVAL;
+	}
+
+	return CH341PROG_OK;
+}
+
+int Ch341ProgOpen(ch341prog_session **session, const char *device, unsigned int cs)
+{
+	ch341prog_session *s;
+
+	*session = NULL;
+	lib_error[0] = 0;
+
+	MessageSetHandler(LibMessage, NULL);
+
+	if (cs >= CH341_MAX_CS)
+	{
+		Message(MSG_ERROR, "Error: invalid CS pin %u, 0~3 are available\n", cs);
+		return CH341PROG_ERR_INVAL;
+	}
+
+	s = new (std::nothrow) ch341prog_session();
+	if (!s)
+		return CH341PROG_ERR_NOMEM;
+
+	if (!CH341DeviceOpenSpec(&s->dev, device))
+	{
+		delete s;
+		return CH341PROG_ERR_NODEV;
+	}
+
+	SpiFlashInit(&s->flash, &s->dev, cs);
+	s->flash.quiet = true;
+	s->flash.progress = LibProgress;
+	s->flash.progress_arg = s;
+
+	*session = s;
+
+	return CH341PROG_OK;
+}
+
+void Ch341ProgClose(ch341prog_session *session)
+{
+	if (!session)
+		return;
+
+	CH341DeviceClose(&session->dev);
+	delete session;
+}
+
+void Ch341ProgSetProgress(ch341prog_session *session, ch341prog_progress_cb cb, void *arg)
+{
+	session->progress = cb;
+	session->progress_arg = arg;
+}
+
+void Ch341ProgSetLog(ch341prog_log_cb cb, void *arg)
+{
+	lib_log = cb;
+	lib_log_arg = arg;
+}
+
+void Ch341ProgCancel(ch341prog_session *session)
+{
+	session->cancel = true;
+}
+
+int Ch341ProgProbe(ch341prog_session *session, ch341prog_chip_info *info)
+{
+	spi_flash *flash = &session->flash;
+	int err;
+
+	LibStart(session, CH341PROG_STAGE_READ, 0);
+
+	if ((err = LibProbe(session)))
+		return LibFinish(session, err);
+
+	if (info)
+	{
+		memset(info, 0, sizeof (*info));
+		strncpy(info->model, flash->id->model, sizeof (info->model) - 1);
+		info->jedec_id = flash->id->jedec_id;
+		info->size = flash->id->size;
+		info->erase_size = flash->erase_size;
+		info->page_size = flash->page_size;
+	}
+
+	return CH341PROG_OK;
+}
+
+int Ch341ProgRead(ch341prog_session *session, unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	int err;
+
+	LibStart(session, CH341PROG_STAGE_READ, len);
+
+	if ((err = LibCheckRange(session, addr, len)))
+		return LibFinish(session, err);
+
+	if (!SpiFlashRead(&session->flash, addr, len, buf))
+		return LibFinish(session, CH341PROG_ERR_IO);
+
+	return CH341PROG_OK;
+}
+
+typedef struct _lib_sink
+{
+	ch341prog_sink_cb sink;
+	void *arg;
+	bool failed;
+} lib_sink;
+
+static bool LibSinkChunk(unsigned int addr, const unsigned char *data, unsigned int len, void *arg)
+{
+	lib_sink *ls = (lib_sink *) arg;
+
+	if (ls->sink(addr, data, len, ls->arg))
+	{
+		ls->failed = true;
+		return false;
+	}
+
+	return true;
+}
+
+static int LibReadStream(ch341prog_session *s, unsigned int addr, unsigned int len, ch341prog_sink_cb sink, void *arg)
+{
+	lib_sink ls = { sink, arg, false };
+
+	if (SpiFlashReadEx(&s->flash, addr, len, NULL, LibSinkChunk, &ls))
+		return CH341PROG_OK;
+
+	if (ls.failed)
+	{
+		if (!lib_error[0])
+			Message(MSG_ERROR, "Error: sink aborted the read at %xh.\n", addr);
+
+		return CH341PROG_ERR_STREAM;
+	}
+
+	return CH341PROG_ERR_IO;
+}
+
+int Ch341ProgReadStream(ch341prog_session *session, unsigned int addr, unsigned int len, ch341prog_sink_cb sink, void *arg)
+{
+	int err;
+
+	LibStart(session, CH341PROG_STAGE_READ, len);
+
+	if ((err = LibCheckRange(session, addr, len)))
+		return LibFinish(session, err);
+
+	return LibFinish(session, LibReadStream(session, addr, len, sink, arg));
+}
+
+int Ch341ProgErase(ch341prog_session *session, unsigned int addr, unsigned int len)
+{
+	int err;
+
+	LibStart(session, CH341PROG_STAGE_ERASE, len);
+
+	if ((err = LibCheckRange(session, addr, len)))
+		return LibFinish(session, err);
+
+	if (addr % session->flash.erase_size || len % session->flash.erase_size)
+	{
+		Message(MSG_ERROR, "Error: %xh+%xh is not on %xh erase boundaries.\n", addr, len, session->flash.erase_size);
+		return LibFinish(session, CH341PROG_ERR_INVAL);
+	}
+
+	if (!SpiFlashErase(&session->flash, addr, len))
+		return LibFinish(session, CH341PROG_ERR_IO);
+
+	return CH341PROG_OK;
+}
+
+int Ch341ProgChipErase(ch341prog_session *session)
+{
+	int err;
+
+	LibStart(session, CH341PROG_STAGE_ERASE, 0);
+
+	if ((err = LibProbe(session)))
+		return LibFinish(session, err);
+
+	if (!SpiFlashChipErase(&session->flash))
+		return LibFinish(session, CH341PROG_ERR_IO);
+
+	return CH341PROG_OK;
+}
+
+typedef struct _lib_verify
+{
+	const unsigned char *expected;
+	unsigned int addr;
+	bool mismatch;
+	unsigned int mismatch_addr;
+} lib_verify;
+
+static int LibVerifyChunk(unsigned int addr, const unsigned char *data, unsigned int len, void *arg)
+{
+	lib_verify *lv = (lib_verify *) arg;
+	const unsigned char *expected = lv->expected + (addr - lv->addr);
+	unsigned int i;
+
+	if (!memcmp(data, expected, len))
+		return 0;
+
+	for (i = 0; data[i] == expected[i]; i++)
+		;
+
+	lv->mismatch = true;
+	lv->mismatch_addr = addr + i;
+
+	Message(MSG_ERROR, "Error: difference at 0x%08x, read 0x%02x, expected 0x%02x\n", addr + i, data[i], expected[i]);
+
+	return 1;
+}
+
+static int LibVerify(ch341prog_session *s, unsigned int addr, const unsigned char *buf, unsigned int len,
+	unsigned int *mismatch_addr)
+{
+	lib_verify lv = { buf, addr, false, 0 };
+	int err;
+
+	err = LibReadStream(s, addr, len, LibVerifyChunk, &lv);
+
+	if (err == CH341PROG_ERR_STREAM && lv.mismatch)
+	{
+		if (mismatch_addr)
+			*mismatch_addr = lv.mismatch_addr;
+
+		return CH341PROG_ERR_VERIFY;
+	}
+
+	return err;
+}
+
+int Ch341ProgVerify(ch341prog_session *session, unsigned int addr, const unsigned char *buf, unsigned int len,
+	unsigned int *mismatch_addr)
+{
+	int err;
+
+	LibStart(session, CH341PROG_STAGE_VERIFY, len);
+
+	if ((err = LibCheckRange(session, addr, len)))
+		return LibFinish(session, err);
+
+	return LibFinish(session, LibVerify(session, addr, buf, len, mismatch_addr));
+}
+
+/*
+ * Erases, programs and verifies chunk by chunk as the data arrives, so the
+ * image never has to be held in memory as a whole.
+ */
+static int LibWriteStream(ch341prog_session *s, unsigned int addr, unsigned int len, ch341prog_source_cb source, void *arg,
+	unsigned int flags)
+{
+	spi_flash *flash = &s->flash;
+	unsigned int chunk_size, done, n, got, end;
+	unsigned char *chunk;
+	int r, err = CH341PROG_OK;
+
+	chunk_size = LIB_STREAM_CHUNK;
+
+	if (flags & CH341PROG_WRITE_ERASE)
+	{
+		if (addr % flash->erase_size)
+		{
+			Message(MSG_ERROR, "Error: start address %xh is not on an erase boundary.\n", addr);
+			return CH341PROG_ERR_INVAL;
+		}
+
+		chunk_size = (chunk_size + flash->erase_size - 1) / flash->erase_size * flash->erase_size;
+	}
+
+	chunk = new (std::nothrow) unsigned char[chunk_size];
+	if (!chunk)
+		return CH341PROG_ERR_NOMEM;
+
+	if (!SpiFlashBegin(flash))
+	{
+		delete[] chunk;
+		return CH341PROG_ERR_IO;
+	}
+
+	for (done = 0; done < len && !err; done += n)
+	{
+		n = len - done < chunk_size ? len - done : chunk_size;
+
+		for (got = 0; got < n; got += r)
+		{
+			if ((r = source(chunk + got, n - got, arg)) <= 0)
+			{
+				Message(MSG_ERROR, "Error: source ended at %xh of %xh bytes.\n", done + got, len);
+				err = CH341PROG_ERR_STREAM;
+				break;
+			}
+		}
+
+		if (err)
+			break;
+
+		if (s->cancel)
+		{
+			err = CH341PROG_ERR_CANCELLED;
+			break;
+		}
+
+		if (flags & CH341PROG_WRITE_ERASE)
+		{
+			end = addr + done + n;
+			end = (end + flash->erase_size - 1) / flash->erase_size * flash->erase_size;
+
+			LibSpan(s, CH341PROG_STAGE_ERASE, done, n);
+
+			if (!SpiFlashErase(flash, addr + done, end - (addr + done)))
+			{
+				err = CH341PROG_ERR_IO;
+				break;
+			}
+		}
+
+		LibSpan(s, CH341PROG_STAGE_WRITE, done, n);
+
+		if (!SpiFlashWriteEx(flash, addr + done, chunk, NULL, n))
+		{
+			err = CH341PROG_ERR_IO;
+			break;
+		}
+
+		if (flags & CH341PROG_WRITE_VERIFY)
+		{
+			LibSpan(s, CH341PROG_STAGE_VERIFY, done, n);
+			err = LibVerify(s, addr + done, chunk, n, NULL);
+		}
+	}
+
+	SpiFlashEnd(flash);
+	delete[] chunk;
+
+	return err;
+}
+
+int Ch341ProgWriteStream(ch341prog_session *session, unsigned int addr, unsigned int len, ch341prog_source_cb source, void *arg,
+	unsigned int flags)
+{
+	int err;
+
+	LibStart(session, CH341PROG_STAGE_WRITE, len);
+
+	if ((err = LibCheckRange(session, addr, len)))
+		return LibFinish(session, err);
+
+	return LibFinish(session, LibWriteStream(session, addr, len, source, arg, flags));
+}
+
+typedef struct _lib_buffer
+{
+	const unsigned char *data;
+	unsigned int left;
+} lib_buffer;
+
+static int LibBufferSource(unsigned char *buf, unsigned int len, void *arg)
+{
+	lib_buffer *lb = (lib_buffer *) arg;
+
+	if (len > lb->left)
+		len = lb->left;
+
+	memcpy(buf, lb->data, len);
+	lb->data += len;
+	lb->left -= len;
+
+	return (int) len;
+}
+
+int Ch341ProgWrite(ch341prog_session *session, unsigned int addr, const unsigned char *buf, unsigned int len, unsigned int flags)
+{
+	lib_buffer lb = { buf, len };
+
+	return Ch341ProgWriteStream(session, addr, len, LibBufferSource, &lb, flags);
+}
+
+int Ch341ProgMetricsStart(const char *textfile, unsigned int interval_ms, unsigned int http_port)
+{
+	if (!textfile && !http_port)
+		return CH341PROG_ERR_INVAL;
+
+	return MetricsStart(textfile, interval_ms, http_port) ? CH341PROG_OK : CH341PROG_ERR_IO;
+}
+
+void Ch341ProgMetricsStop(void)
+{
+	MetricsStop();
+}
+
+unsigned int Ch341ProgMetricsFormat(char *buf, unsigned int size)
+{
+	return MetricsFormat(buf, size);
+}
+
+const char *Ch341ProgLastError(ch341prog_session *session)
+{
+	return session ? session->error : lib_error;
+}
+
+const char *Ch341ProgStrError(int err)
+{
+	switch (err)
+	{
+	case CH341PROG_OK:
+		return "success";
+	case CH341PROG_ERR_INVAL:
+		return "invalid argument";
+	case CH341PROG_ERR_NODEV:
+		return "programmer not found";
+	case CH341PROG_ERR_NOCHIP:
+		return "no supported flash found";
+	case CH341PROG_ERR_IO:
+		return "I/O error";
+	case CH341PROG_ERR_VERIFY:
+		return "verification failed";
+	case CH341PROG_ERR_CANCELLED:
+		return "cancelled";
+	case CH341PROG_ERR_NOMEM:
+		return "out of memory";
+	case CH341PROG_ERR_STREAM:
+		return "source or sink failed";
+	default:
+		return "unknown error";
+	}
+}
@@ -0,0 +1,112 @@
+#ifndef _LIBCH341PROG_H_
+#define _LIBCH341PROG_H_
+
+/*
+ * Programming API for embedding, e.g. in a test executive. Nothing is
+ * printed: failures are returned as CH341PROG_ERR_* codes with the detail
+ * in Ch341ProgLastError, progress goes to the session's callback.
+ *
+ * A session is one chip on one programmer. Sessions on different
+ * programmers may be driven from different threads, a single session must
+ * not be used from two threads at once (Ch341ProgCancel excepted).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CH341PROG_OK				0
+#define CH341PROG_ERR_INVAL			-1	/* bad argument, or range outside the chip */
+#define CH341PROG_ERR_NODEV			-2	/* programmer not found or busy */
+#define CH341PROG_ERR_NOCHIP		-3	/* no known flash answered */
+#define CH341PROG_ERR_IO			-4	/* USB transfer or chip operation failed */
+#define CH341PROG_ERR_VERIFY		-5	/* read back data differs */
+#define CH341PROG_ERR_CANCELLED		-6
+#define CH341PROG_ERR_NOMEM			-7
+#define CH341PROG_ERR_STREAM		-8	/* source or sink callback failed */
+
+#define CH341PROG_STAGE_READ		0
+#define CH341PROG_STAGE_ERASE		1
+#define CH341PROG_STAGE_WRITE		2
+#define CH341PROG_STAGE_VERIFY		3
+
+/* Flags of Ch341ProgWrite/Ch341ProgWriteStream */
+#define CH341PROG_WRITE_ERASE		0x1	/* erase first, up to the next erase boundary */
+#define CH341PROG_WRITE_VERIFY		0x2
+
+#define CH341PROG_LOG_ERROR			0
+#define CH341PROG_LOG_WARNING		1
+#define CH341PROG_LOG_INFO			2
+
+typedef struct _ch341prog_session ch341prog_session;
+
+typedef struct _ch341prog_chip_info
+{
+	char model[32];
+	unsigned int jedec_id;
+	unsigned int size;
+	unsigned int erase_size;
+	unsigned int page_size;
+} ch341prog_chip_info;
+
+/*
+ * done/total are bytes of the whole call. Called on the calling thread about
+ * once per percent, keep it short. Return non-zero to cancel.
+ */
+typedef int (*ch341prog_progress_cb)(int stage, unsigned int done, unsigned int total, void *arg);
+
+/* Fills buf with up to len bytes, returns how many, 0 at the end or < 0 on error */
+typedef int (*ch341prog_source_cb)(unsigned char *buf, unsigned int len, void *arg);
+
+/* Takes len bytes read from addr, returns non-zero to abort */
+typedef int (*ch341prog_sink_cb)(unsigned int addr, const unsigned char *data, unsigned int len, void *arg);
+
+/* Every message of every session, for callers which keep a log */
+typedef void (*ch341prog_log_cb)(int level, const char *msg, void *arg);
+
+/* device: NULL for the first programmer, or an index, usb<bus>-<port>, usb<bus>@<addr>, serial:<string> */
+int Ch341ProgOpen(ch341prog_session **session, const char *device, unsigned int cs);
+void Ch341ProgClose(ch341prog_session *session);
+
+void Ch341ProgSetProgress(ch341prog_session *session, ch341prog_progress_cb cb, void *arg);
+void Ch341ProgSetLog(ch341prog_log_cb cb, void *arg);
+
+/* Safe from any thread, the running operation stops at its next progress step */
+void Ch341ProgCancel(ch341prog_session *session);
+
+int Ch341ProgProbe(ch341prog_session *session, ch341prog_chip_info *info);
+
+int Ch341ProgRead(ch341prog_session *session, unsigned int addr, unsigned char *buf, unsigned int len);
+int Ch341ProgReadStream(ch341prog_session *session, unsigned int addr, unsigned int len, ch341prog_sink_cb sink, void *arg);
+
+/* addr and len must be on erase boundaries */
+int Ch341ProgErase(ch341prog_session *session, unsigned int addr, unsigned int len);
+int Ch341ProgChipErase(ch341prog_session *session);
+
+int Ch341ProgWrite(ch341prog_session *session, unsigned int addr, const unsigned char *buf, unsigned int len, unsigned int flags);
+int Ch341ProgWriteStream(ch341prog_session *session, unsigned int addr, unsigned int len, ch341prog_source_cb source, void *arg,
+	unsigned int flags);
+
+/* mismatch_addr, if given, receives the first differing address on CH341PROG_ERR_VERIFY */
+int Ch341ProgVerify(ch341prog_session *session, unsigned int addr, const unsigned char *buf, unsigned int len,
+	unsigned int *mismatch_addr);
+
+/*
+ * Counters of every session in the process, in Prometheus text format.
+ * Start keeps them in textfile (if given, replaced atomically every
+ * interval_ms) and/or serves them on 127.0.0.1:http_port (if non-zero)
+ * until Stop. Format returns the length written to buf.
+ */
+int Ch341ProgMetricsStart(const char *textfile, unsigned int interval_ms, unsigned int http_port);
+void Ch341ProgMetricsStop(void);
+unsigned int Ch341ProgMetricsFormat(char *buf, unsigned int size);
+
+/* Detail of the session's last failure, "" if none. NULL gives the calling thread's last failed Open */
+const char *Ch341ProgLastError(ch341prog_session *session);
+const char *Ch341ProgStrError(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBCH341PROG_H_ */
@@ -0,0 +1,411 @@
+#include "stdafx.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "line.h"
+
+typedef std::chrono::steady_clock line_clock;
+
+typedef struct _line_job
+{
+	const unsigned char *image;
+	const unsigned char *encoded;
+	unsigned int addr;
+	unsigned int len;
+	bool erase;
+	bool verify;
+} line_job;
+
+typedef struct _line_unit
+{
+	unsigned int number;
+	unsigned int jedec_id;
+	const char *stage;
+	bool passed;
+	char error[96];
+	double seconds;
+	double cycle;
+} line_unit;
+
+typedef struct _line_stats
+{
+	std::vector<double> cycles;
+	unsigned int units;
+	unsigned int passed;
+	line_clock::time_point first_start;
+	line_clock::time_point last_start;
+} line_stats;
+
+typedef struct _line_verify
+{
+	const line_job *job;
+	line_unit *unit;
+} line_verify;
+
+static std::atomic<bool> line_stop;
+
+static void LineSignal(int sig)
+{
+	line_stop = true;
+}
+
+static void LineDiscardMessage(int level, const char *msg, void *arg)
+{
+}
+
+/*
+ * Two RDIDs in one USB transfer, equal and neither all-0 nor all-1 bits
+ * means a chip is seated. Returns false if the programmer stopped answering.
+ */
+static bool LineReadId(ch341_device *dev, unsigned int *jedec_id)
+{
+	static const unsigned char op = SPI_CMD_RDID;
+	ch341_spi_batch ops[2];
+	unsigned char id[2][3];
+	unsigned int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		ops[i].cmd = &op;
+		ops[i].cmd_len = 1;
+		ops[i].data = id[i];
+		ops[i].data_len = 3;
+	}
+
+	if (!CH341DeviceBatchSPI(dev, 0, ops, 2))
+		return false;
+
+	*jedec_id = (id[0][0] << 16) | (id[0][1] << 8) | id[0][2];
+
+	if (memcmp(id[0], id[1], 3) || *jedec_id == 0xffffff)
+		*jedec_id = 0;
+
+	return true;
+}
+
+/*
+ * Waits until LINE_SETTLE_POLLS polls in a row agree on a chip being there
+ * (present) or gone (!present). Returns false if the programmer went away
+ * or the line is stopped.
+ */
+static bool LineWaitChip(ch341_device *dev, bool present, unsigned int *jedec_id)
+{
+	unsigned int id, last = 0, same = 0;
+
+	while (!line_stop)
+	{
+		if (!LineReadId(dev, &id))
+			return false;
+
+		if (!!id == present && id == last)
+			same++;
+		else
+			same = !!id == present;
+
+		last = id;
+
+		if (same >= LINE_SETTLE_POLLS)
+		{
+			*jedec_id = id;
+			return true;
+		}
+
+		/* A detach shows up as a failed transfer on the next poll */
+		CH341HotplugWait(LINE_CHIP_POLL_MS);
+	}
+
+	return false;
+}
+
+static bool LineWaitDevice(ch341_device *dev)
+{
+	bool first = true;
+
+	printf("Waiting for programmer ...\n");
+
+	while (!line_stop)
+	{
+		/* Only the first attempt tells why opening fails, the rest would repeat it every second */
+		if (!first)
+			MessageSetHandler(LineDiscardMessage, NULL);
+
+		CH341DeviceOpen(dev);
+
+		if (!first)
+			MessageSetHandler(NULL, NULL);
+
+		if (CH341DeviceIsOpen(dev))
+			return true;
+
+		first = false;
+		CH341HotplugWait(LINE_DEVICE_POLL_MS);
+	}
+
+	return false;
+}
+
+static bool LineVerifyChunk(unsigned int addr, const unsigned char *data, unsigned int len, void *arg)
+{
+	line_verify *lv = (line_verify *) arg;
+	const unsigned char *expected = lv->job->image + (addr - lv->job->addr);
+	unsigned int i;
+
+	if (!memcmp(data, expected, len))
+		return true;
+
+	for (i = 0; data[i] == expected[i]; i++)
+		;
+
+	snprintf(lv->unit->error, sizeof (lv->unit->error), "verify mismatch at 0x%08x", addr + i);
+
+	return false;
+}
+
+static bool LineProgram(ch341_device *dev, const line_job *job, line_unit *u)
+{
+	spi_flash flash;
+	unsigned int end;
+	line_verify lv = { job, u };
+
+	SpiFlashInit(&flash, dev, 0);
+
+	u->stage = "probe";
+	if (!SpiFlashProbe(&flash))
+		return false;
+
+	if (job->addr + job->len > SpiFlashGetSize(&flash))
+	{
+		snprintf(u->error, sizeof (u->error), "image exceeds %uKiB flash", SpiFlashGetSize(&flash) >> 10);
+		return false;
+	}
+
+	if (job->erase)
+	{
+		u->stage = "erase";
+
+		/* Up to the next erase boundary, the rest of the last block is blank afterwards */
+		end = job->addr + job->len;
+		end = (end + flash.erase_size - 1) / flash.erase_size * flash.erase_size;
+
+		printf("Erasing flash from %xh, size %xh ...\n", job->addr, end - job->addr);
+
+		if (!SpiFlashErase(&flash, job->addr, end - job->addr))
+			return false;
+	}
+
+	u->stage = "write";
+	printf("Writing flash at %xh, size %xh ...\n", job->addr, job->len);
+
+	if (!SpiFlashWriteEx(&flash, job->addr, job->image, job->encoded, job->len))
+		return false;
+
+	if (job->verify)
+	{
+		u->stage = "verify";
+		printf("Verifying ...\n");
+
+		if (!SpiFlashReadEx(&flash, job->addr, job->len, NULL, LineVerifyChunk, &lv))
+			return false;
+	}
+
+	u->stage = "done";
+	return true;
+}
+
+static void LineLog(FILE *log, const line_unit *u)
+{
+	char stamp[32];
+	time_t now = time(NULL);
+
+	strftime(stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+	fprintf(log, "%s unit=%u jedec=%06x result=%s time=%.2f", stamp, u->number, u->jedec_id,
+		u->passed ? "pass" : "fail", u->seconds);
+
+	if (u->cycle > 0)
+		fprintf(log, " cycle=%.2f", u->cycle);
+
+	if (!u->passed)
+		fprintf(log, " stage=%s error=\"%s\"", u->stage, u->error);
+
+	fprintf(log, "\n");
+	fflush(log);
+}
+
+static void LineShowStats(const line_stats *stats)
+{
+	std::vector<double> sorted(stats->cycles);
+	double mean = 0, p95 = 0, hours;
+	size_t i;
+
+	hours = std::chrono::duration<double>(stats->last_start - stats->first_start).count() / 3600;
+
+	printf("Units: %u, passed: %u, failed: %u", stats->units, stats->passed, stats->units - stats->passed);
+
+	if (sorted.empty())
+	{
+		printf("\n");
+		return;
+	}
+
+	/* Nearest rank, p95 of few cycles is simply the slowest */
+	std::sort(sorted.begin(), sorted.end());
+
+	for (i = 0; i < sorted.size(); i++)
+		mean += sorted[i];
+
+	mean /= sorted.size();
+	p95 = sorted[(sorted.size() * 95 + 99) / 100 - 1];
+
+	/* Throughput between the first and the last unit's start, i.e. over the measured cycles */
+	printf(", cycle mean %.2fs, p95 %.2fs, %.0f units/h\n", mean, p95, hours > 0 ? sorted.size() / hours : 0.0);
+}
+
+int LineRun(const char *filename, unsigned int addr, bool need_erase, bool need_verify, const char *log_path)
+{
+	ch341_device dev;
+	line_job job;
+	line_unit u;
+	line_stats stats;
+	line_clock::time_point start;
+	unsigned char *image, *encoded;
+	unsigned int size = 0, jedec_id;
+	FILE *log;
+
+	printf("Reading file %s ...\n", filename);
+
+	image = LoadImageFile(filename, &size);
+	if (!image)
+		return -EIO;
+
+	if (!size)
+	{
+		fprintf(stderr, "Error: nothing to write.\n");
+		delete[] image;
+		return -EINVAL;
+	}
+
+	log = fopen(log_path, "a");
+	if (!log)
+	{
+		fprintf(stderr, "Error: unable to open log %s! error %d\n", log_path, errno);
+		delete[] image;
+		return -errno;
+	}
+
+	/* Sent again for every unit, convert to wire bit order only once */
+	encoded = new unsigned char[size];
+	CH341EncodeSPI(image, encoded, size);
+
+	job.image = image;
+	job.encoded = encoded;
+	job.addr = addr;
+	job.len = size;
+	job.erase = need_erase;
+	job.verify = need_verify;
+
+	printf("Done.\n\n");
+
+	memset(&dev, 0, sizeof (dev));
+	stats.units = 0;
+	stats.passed = 0;
+
+	line_stop = false;
+	signal(SIGINT, LineSignal);
+	signal(SIGTERM, LineSignal);
+
+	if (!CH341HotplugStart())
+		printf("USB hotplug not available, polling for the programmer.\n");
+
+	printf("Line running, logging to %s, Ctrl-C stops after the current unit.\n\n", log_path);
+
+	while (!line_stop)
+	{
+		if (!CH341DeviceIsOpen(&dev) && !LineWaitDevice(&dev))
+			break;
+
+		printf("Waiting for chip ...\n");
+
+		if (!LineWaitChip(&dev, true, &jedec_id))
+		{
+			if (!line_stop)
+				printf("Programmer gone.\n\n");
+
+			CH341DeviceClose(&dev);
+			continue;
+		}
+
+		memset(&u, 0, sizeof (u));
+		u.number = stats.units + 1;
+		u.jedec_id = jedec_id;
+
+		start = line_clock::now();
+
+		if (stats.units)
+			u.cycle = std::chrono::duration<double>(start - stats.last_start).count();
+		else
+			stats.first_start = start;
+
+		stats.last_start = start;
+
+		printf("Unit %u: chip %06x found\n", u.number, jedec_id);
+
+		u.passed = LineProgram(&dev, &job, &u);
+		u.seconds = std::chrono::duration<double>(line_clock::now() - start).count();
+
+		if (!u.passed && !u.error[0])
+			snprintf(u.error, sizeof (u.error), "%s failed", u.stage);
+
+		stats.units++;
+
+		if (u.passed)
+			stats.passed++;
+
+		if (u.cycle > 0)
+			stats.cycles.push_back(u.cycle);
+
+		LineLog(log, &u);
+
+		printf("Unit %u: %s in %.2fs%s%s\n", u.number, u.passed ? "PASS" : "FAIL", u.seconds,
+			u.passed ? "" : ", ", u.passed ? "" : u.error);
+		LineShowStats(&stats);
+
+		printf("\nRemove the chip ...\n");
+
+		if (!LineWaitChip(&dev, false, &jedec_id))
+		{
+			if (!line_stop)
+				printf("Programmer gone.\n\n");
+
+			CH341DeviceClose(&dev);
+		}
+
+		printf("\n");
+	}
+
+	printf("\nLine stopped.\n");
+	LineShowStats(&stats);
+
+	CH341HotplugStop();
+	CH341DeviceClose(&dev);
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	fclose(log);
+	delete[] encoded;
+	delete[] image;
+
+	return 0;
+}
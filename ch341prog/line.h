@@ -0,0 +1,17 @@
+#ifndef _LINE_H_
+#define _LINE_H_
+
+#define LINE_CHIP_POLL_MS			200
+#define LINE_DEVICE_POLL_MS			1000
+#define LINE_SETTLE_POLLS			2	/* equal RDID polls needed to take a chip as inserted or removed */
+#define LINE_DEFAULT_LOG			"ch341prog-line.log"
+
+/*
+ * Production line: waits for the programmer to be plugged in, then for a
+ * chip to show up on it, programs it, waits for it to be taken out and
+ * starts over, until SIGINT/SIGTERM. Every unit is appended to log_path,
+ * cycle time statistics are printed as it goes.
+ */
+int LineRun(const char *filename, unsigned int addr, bool need_erase, bool need_verify, const char *log_path);
+
+#endif /* _LINE_H_ */
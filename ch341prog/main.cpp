@@ -1,462 +1,1391 @@
-
-#include "stdafx.h"
-
-#include <ctype.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <string.h>
-
-#include "ch341.h"
-#include "spi_flash.h"
-
-static void ShowUsage(void)
-{
-	puts(
-		"Usage:\n"
-		"  probe\n"
-		"  read <file> [<addr> [size]]\n"
-		"  erase [chip | <addr> <size>]\n"
-		"  write [erase] [verify] <file> [addr] [size]\n");
-}
-
-static int DoFlashRead(int argc, char *argv[])
-{
-	unsigned int addr = 0, size;
-	const char *filename;
-	unsigned char *buff;
-	FILE *f;
-
-	if (!FlashProbe())
-		return -ENODEV;
-
-	size = FlashGetSize();
-
-	if (!argc)
-	{
-		fprintf(stderr, "Error: please specify a filename.\n");
-		return -EINVAL;
-	}
-
-	filename = argv[0];
-
-	argc--;
-	argv++;
-
-	if (argc)
-	{
-		if (!isdigit(argv[0][0]))
-		{
-			fprintf(stderr, "Please input a numeric flash address!\n");
-			return -EINVAL;
-		}
-
-		addr = strtoul(argv[0], NULL, 0);
-
-		if (addr >= FlashGetSize())
-		{
-			fprintf(stderr, "Error: start address exceeds the flash size!\n");
-			return -EINVAL;
-		}
-
-		argc--;
-		argv++;
-
-		if (!argc)
-			size = FlashGetSize() - addr;
-	}
-
-	if (argc)
-	{
-		if (!isdigit(argv[0][0]))
-		{
-			fprintf(stderr, "Please input a numeric size!\n");
-			return -EINVAL;
-		}
-
-		size = strtoul(argv[0], NULL, 0);
-
-		if (addr + size > FlashGetSize())
-		{
-			fprintf(stderr, "Error: end address exceeds the flash size!\n");
-			return -EINVAL;
-		}
-	}
-
-	buff = new unsigned char[size];
-	if (!buff)
-	{
-		fprintf(stderr, "Error: unable to allocate memory!\n");
-		return -ENOMEM;
-	}
-
-	printf("Reading flash from %xh, size %xh ...\n", addr, size);
-
-	if (!FlashRead(addr, size, buff))
-	{
-		printf("Operation failed.\n");
-		delete[] buff;
-		return -EFAULT;
-	}
-
-	printf("Saving to file %s ...\n", filename);
-
-	f = fopen(filename, "wb");
-	if (!f)
-	{
-		fprintf(stderr, "Error: unable to open/create file! error %d\n", errno);
-		delete[] buff;
-		return -errno;
-	}
-
-	if (fwrite(buff, 1, size, f) != size)
-	{
-		fprintf(stderr, "Error: failed to write to file! error %d\n", errno);
-		delete[] buff;
-		return -errno;
-	}
-
-	fclose(f);
-
-	printf("Done.\n");
-
-	return 0;
-}
-
-static int DoFlashChipErase(int argc, char *argv[])
-{
-	if (!FlashProbe())
-		return -ENODEV;
-
-	printf("Erasing entire flash, please wait ...\n");
-
-	if (!FlashChipErase())
-	{
-		printf("Operation failed.\n");
-		return -EFAULT;
-	}
-
-	printf("Done.\n");
-
-	return 0;
-}
-
-static int DoFlashErase(int argc, char *argv[])
-{
-	unsigned int addr = 0, size;
-
-	if (!FlashProbe())
-		return -ENODEV;
-
-	size = FlashGetSize();
-
-	if (!isdigit(argv[0][0]))
-	{
-		fprintf(stderr, "Please input a numeric flash address!\n");
-		return -EINVAL;
-	}
-
-	addr = strtoul(argv[0], NULL, 0);
-
-	if (addr >= FlashGetSize())
-	{
-		fprintf(stderr, "Error: start address exceeds the flash size!\n");
-		return -EINVAL;
-	}
-
-	if (!isdigit(argv[1][0]))
-	{
-		fprintf(stderr, "Please input a numeric size!\n");
-		return -EINVAL;
-	}
-
-	size = strtoul(argv[1], NULL, 0);
-
-	if (addr + size > FlashGetSize())
-	{
-		fprintf(stderr, "Error: end address exceeds the flash size!\n");
-		return -EINVAL;
-	}
-
-	printf("Erasing flash from %xh, size %xh ...\n", addr, size);
-
-	if (!FlashErase(addr, size))
-	{
-		printf("Operation failed.\n");
-		return -EFAULT;
-	}
-
-	printf("Done.\n");
-
-	return 0;
-}
-
-static int DoFlashWrite(int argc, char *argv[])
-{
-	int need_erase = 0, need_verify = 0, size_set = 0, pass = 1;
-	unsigned int addr = 0, size, filelen, i;
-	const char *filename;
-	unsigned char *buff, *buff_check;
-	FILE *f;
-
-	if (!FlashProbe())
-		return -ENODEV;
-
-	size = FlashGetSize();
-
-	if (!argc)
-	{
-_insufficinet_param:
-		fprintf(stderr, "Error: please specify a filename.\n");
-		return -EINVAL;
-	}
-
-	if (!strcmp(argv[0], "erase"))
-	{
-		need_erase = 1;
-		argc--;
-		argv++;
-	}
-
-	if (!argc)
-		goto _insufficinet_param;
-
-	if (!strcmp(argv[0], "verify"))
-	{
-		need_verify = 1;
-		argc--;
-		argv++;
-	}
-
-	if (!argc)
-		goto _insufficinet_param;
-
-	filename = argv[0];
-
-	argc--;
-	argv++;
-
-	if (argc)
-	{
-		if (!isdigit(argv[0][0]))
-		{
-			fprintf(stderr, "Please input a numeric flash address!\n");
-			return -EINVAL;
-		}
-
-		addr = strtoul(argv[0], NULL, 0);
-
-		if (addr >= FlashGetSize())
-		{
-			fprintf(stderr, "Error: start address exceeds the flash size!\n");
-			return -EINVAL;
-		}
-
-		argc--;
-		argv++;
-
-		if (!argc)
-			size = FlashGetSize() - addr;
-	}
-
-	if (argc)
-	{
-		if (!isdigit(argv[0][0]))
-		{
-			fprintf(stderr, "Please input a numeric size!\n");
-			return -EINVAL;
-		}
-
-		size = strtoul(argv[0], NULL, 0);
-
-		if (addr + size > FlashGetSize())
-		{
-			fprintf(stderr, "Error: end address exceeds the flash size!\n");
-			return -EINVAL;
-		}
-
-		size_set = 1;
-	}
-
-	printf("Reading file %s ...\n", filename);
-
-	f = fopen(filename, "rb");
-	if (!f)
-	{
-		fprintf(stderr, "Error: unable to open file! error %d\n", errno);
-		return -errno;
-	}
-
-	fseek(f, 0, SEEK_END);
-	filelen = ftell(f);
-
-	fseek(f, 0, SEEK_SET);
-
-	if (filelen > size)
-	{
-		fprintf(stderr, "Warning: file size is larger than write size.\n");
-	}
-	else if (filelen < size)
-	{
-		if (size_set)
-			fprintf(stderr, "Warning: write size is larger than file size, write size truncated to 0x%x.\n", filelen);
-		size = filelen;
-	}
-
-	buff = new unsigned char[size];
-	if (!buff)
-	{
-		fprintf(stderr, "Error: unable to allocate memory!\n");
-		return -ENOMEM;
-	}
-
-	if (fread(buff, 1, size, f) != size)
-	{
-		fprintf(stderr, "Error: failed to read file! error %d\n", errno);
-		delete[] buff;
-		return -errno;
-	}
-
-	fclose(f);
-
-	printf("Done.\n\n");
-
-	if (need_erase)
-	{
-		printf("Erasing flash from %xh, size %xh ...\n", addr, size);
-
-		if (!FlashErase(addr, size))
-		{
-			printf("Operation aborted.\n");
-			delete[] buff;
-			return -EFAULT;
-		}
-
-		printf("Done.\n\n");
-	}
-
-	printf("Writing flash at %xh, size %xh ...\n", addr, size);
-
-	if (!FlashWrite(addr, buff, size))
-	{
-		printf("Operation aborted.\n");
-		delete[] buff;
-		return -EFAULT;
-	}
-
-	printf("Done.\n");
-
-	if (need_verify)
-	{
-		printf("\n");
-
-		buff_check = new unsigned char[size];
-		if (!buff_check)
-		{
-			fprintf(stderr, "Error: unable to allocate memory!\n");
-			return -ENOMEM;
-		}
-
-		printf("Reading flash from %xh, size %xh ...\n", addr, size);
-
-		if (!FlashRead(addr, size, buff_check))
-		{
-			printf("Operation failed.\n");
-			delete[] buff;
-			delete[] buff_check;
-			return -EFAULT;
-		}
-
-		printf("Done.\n\n");
-
-		printf("Verifying ...\n");
-
-		for (i = 0; i < size; i++)
-		{
-			if (buff[i] != buff_check[i])
-			{
-				printf("Difference at 0x%08x, read 0x%02x, expected 0x%02x\n", addr + i, buff_check[i], buff[i]);
-				pass = 0;
-			}
-		}
-
-		if (pass)
-			printf("Passed.\n");
-	}
-
-	return 0;
-}
-
-int main(int argc, char *argv[])
-{
-	int argv_c = argc - 1, argv_p = 1;
-	int ret = 0;
-
-	printf("Simple CH341 SPI Flash Programmer\nBy HackPascal <hackpascal@gmail.com>\n\n");
-
-	CH341DeviceInit();
-
-	if (argc == 1)
-	{
-	_show_usage:
-		ShowUsage();
-		goto cleanup;
-	}
-
-	if (!strcmp(argv[argv_p], "probe"))
-	{
-		FlashProbe();
-		goto cleanup;
-	}
-
-	if (!strcmp(argv[argv_p], "read"))
-	{
-		argv_c--;
-		argv_p++;
-
-		if (argv_c < 1)
-			goto _show_usage;
-
-		ret = DoFlashRead(argv_c, argv + argv_p);
-		goto cleanup;
-	}
-
-	if (!strcmp(argv[argv_p], "erase"))
-	{
-		argv_c--;
-		argv_p++;
-
-		if (argv_c < 1)
-			goto _show_usage;
-
-		if (!strcmp(argv[argv_p], "chip"))
-		{
-			ret = DoFlashChipErase(argv_c, argv + argv_p);
-			goto cleanup;
-		}
-
-		if (argv_c < 2)
-			goto _show_usage;
-
-		ret = DoFlashErase(argv_c, argv + argv_p);
-		goto cleanup;
-	}
-
-	if (!strcmp(argv[argv_p], "write"))
-	{
-		argv_c--;
-		argv_p++;
-
-		if (argv_c < 1)
-			goto _show_usage;
-
-		ret = DoFlashWrite(argv_c, argv + argv_p);
-		goto cleanup;
-	}
-
-	goto _show_usage;
-
-cleanup:
-	CH341DeviceRelease();
-
-    return ret;
-}
+
+#include "stdafx.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "checksum.h"
+#include "probe_cache.h"
+#include "gang.h"
+#include "multi_cs.h"
+#include "clone.h"
+#include "daemon.h"
+#include "serprog.h"
+#include "line.h"
+#include "journal.h"
+#include "profile.h"
+#include "metrics.h"
+
+#define IMAGE_CACHE_ENTRIES			8
+#define SCRIPT_LINE_LENGTH			1024
+#define SCRIPT_MAX_ARGS				16
+
+static bool resume_journal;
+static bool profile;
+static bool show_stats;
+static const char *metrics_file;
+static unsigned int metrics_interval_ms = METRICS_DEFAULT_INTERVAL_MS;
+static unsigned int metrics_port;
+static const char *trace_path;
+
+typedef struct _image_cache_entry {
+	char *filename;
+	unsigned char *data;
+	unsigned int len;
+} image_cache_entry;
+
+/*
+ * The first Ctrl-C lets the running operation stop at its next chunk and
+ * put the chip back in order, a second one ends the program right away.
+ */
+static void MainSignal(int sig)
+{
+	CH341Cancel();
+	signal(sig, SIG_DFL);
+}
+
+static void ShowUsage(void)
+{
+	puts(
+		"Usage: ch341prog [options] <command>\n"
+		"\n"
+		"Options:\n"
+		"  --chipdb <file>    load extra chip definitions (also CH341PROG_CHIPDB)\n"
+		"  --no-cache         always probe the chip, ignore cached results\n"
+		"  --resume           continue an interrupted read/write from its <file>.journal\n"
+		"  --profile          show where the time went, per phase, at the end\n"
+		"  --trace <file>     also write every timed span as a Chrome trace (for Perfetto)\n"
+		"  --stats            show USB latency percentiles, payload share and round trips at the end\n"
+		"  --metrics-file <file>\n"
+		"                     keep Prometheus metrics in <file>, for node_exporter's textfile collector\n"
+		"  --metrics-interval <seconds>\n"
+		"                     how often the metrics are updated, default 10\n"
+		"  --metrics-port <port>\n"
+		"                     serve the metrics on http://127.0.0.1:<port>/metrics, e.g. for the daemon\n"
+		"  --device <spec>    programmer to use: <index>, usb<bus>-<port>[.<port>...],\n"
+		"                     usb<bus>@<addr>, serial:<string>, emu[:<option>,...] for\n"
+		"                     the built-in emulator or replay:<file>[,lenient][,realtime]\n"
+		"                     to play back a capture (also CH341PROG_DEVICE)\n"
+		"  --capture <file>   record all USB traffic of the programmer to <file>\n"
+		"\n"
+		"Commands:\n"
+		"  list\n"
+		"  probe\n"
+		"  read [--hash <crc32|crc32c|sha256|all>] <file> [<addr> [size]]\n"
+		"  erase [chip | <addr> <size>]\n"
+		"  write [erase] [verify] <file> [addr] [size]\n"
+		"  verify <file> [addr] [size]\n"
+		"  checksum [crc32|crc32c|sha256|all] [region <size>] [<addr> [size]]\n"
+		"  gang [erase] [verify] <file> [addr] [size]\n"
+		"  multi [erase] [verify] [<cs0 file|-> [<cs1 file|-> ...]] [@addr]\n"
+		"  line [--log <file>] [erase] [verify] <file> [addr]\n"
+		"  clone [verify] <source device> <destination device> [addr] [size]\n"
+		"  daemon [--socket <path>] [device ...]\n"
+		"  submit [--socket <path>] [--priority <n>] [--device <n>] <read|write|verify|erase|checksum ...>\n"
+		"  submit [--socket <path>] status\n"
+		"  serprog <unix:path | tcp:port>\n"
+		"  script <file | ->  one command per line, \"try <command>\" or \"onerror continue\"\n"
+		"                     keep going after a failed step\n");
+}
+
+static bool ChecksumFeedChunk(unsigned int addr, const unsigned char *data, unsigned int len, void *arg)
+{
+	return ChecksumStreamFeed((checksum_stream *) arg, data, len);
+}
+
+static void ShowChecksumResult(checksum_stream *cs)
+{
+	const checksum_result *regions;
+	checksum_result total;
+	unsigned int i, count;
+
+	ChecksumStreamFinish(cs, &total);
+
+	printf("\n");
+	ChecksumPrint(&total);
+
+	regions = ChecksumStreamRegions(cs, &count);
+
+	if (count)
+	{
+		printf("\nRegions:\n");
+
+		for (i = 0; i < count; i++)
+			ChecksumPrintRegion(&regions[i]);
+	}
+}
+
+/* Images loaded by write/verify, kept so a script reads each file only once */
+static image_cache_entry image_cache[IMAGE_CACHE_ENTRIES];
+
+static unsigned char *ImageGet(const char *filename, unsigned int *len)
+{
+	image_cache_entry *e;
+	unsigned int i;
+
+	for (i = 0; i < IMAGE_CACHE_ENTRIES; i++)
+	{
+		e = &image_cache[i];
+
+		if (e->filename && !strcmp(e->filename, filename))
+		{
+			*len = e->len;
+			return e->data;
+		}
+	}
+
+	for (i = 0; i < IMAGE_CACHE_ENTRIES - 1 && image_cache[i].filename; i++)
+		;
+
+	e = &image_cache[i];
+
+	if (e->filename)
+	{
+		free(e->filename);
+		delete[] e->data;
+		e->filename = NULL;
+	}
+
+	printf("Reading file %s ...\n", filename);
+
+	*len = 0;
+	e->data = LoadImageFile(filename, len);
+	if (!e->data)
+		return NULL;
+
+	e->filename = strdup(filename);
+	e->len = *len;
+
+	printf("Done.\n\n");
+
+	return e->data;
+}
+
+/* Drops a cached image, e.g. after the file has been overwritten by read */
+static void ImageForget(const char *filename)
+{
+	unsigned int i;
+
+	for (i = 0; i < IMAGE_CACHE_ENTRIES; i++)
+	{
+		if (image_cache[i].filename && !strcmp(image_cache[i].filename, filename))
+		{
+			free(image_cache[i].filename);
+			delete[] image_cache[i].data;
+			image_cache[i].filename = NULL;
+		}
+	}
+}
+
+static void ImageCacheFree(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < IMAGE_CACHE_ENTRIES; i++)
+	{
+		if (image_cache[i].filename)
+			ImageForget(image_cache[i].filename);
+	}
+}
+
+static int VerifyImage(unsigned int addr, const unsigned char *image, unsigned int size)
+{
+	unsigned char *buff_check;
+	unsigned int i;
+	int pass = 1;
+
+	buff_check = new unsigned char[size ? size : 1];
+
+	printf("Reading flash from %xh, size %xh ...\n", addr, size);
+
+	if (!FlashRead(addr, size, buff_check))
+	{
+		printf("Operation failed.\n");
+		delete[] buff_check;
+		return -EFAULT;
+	}
+
+	printf("Done.\n\n");
+
+	printf("Verifying ...\n");
+
+	for (i = 0; i < size; i++)
+	{
+		if (image[i] != buff_check[i])
+		{
+			printf("Difference at 0x%08x, read 0x%02x, expected 0x%02x\n", addr + i, buff_check[i], image[i]);
+			pass = 0;
+		}
+	}
+
+	delete[] buff_check;
+
+	if (!pass)
+	{
+		printf("Failed.\n");
+		return -EFAULT;
+	}
+
+	printf("Passed.\n");
+
+	return 0;
+}
+
+static int DoFlashRead(int argc, char *argv[])
+{
+	unsigned int addr = 0, size, hash_algos = 0;
+	const char *filename;
+	unsigned char *buff;
+	checksum_stream *cs = NULL;
+	profile_span span;
+	bool ret;
+	FILE *f;
+
+	if (!FlashProbe())
+		return -ENODEV;
+
+	size = FlashGetSize();
+
+	if (argc && !strcmp(argv[0], "--hash"))
+	{
+		if (argc < 2 || !(hash_algos = ChecksumParseAlgos(argv[1])))
+		{
+			fprintf(stderr, "Error: please specify a valid hash algorithm.\n");
+			return -EINVAL;
+		}
+
+		/* The hash has to see the image in one stream, a resumed read would not */
+		if (resume_journal)
+		{
+			fprintf(stderr, "Error: --resume cannot be used with a hashed read.\n");
+			return -EINVAL;
+		}
+
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (!argc)
+	{
+		fprintf(stderr, "Error: please specify a filename.\n");
+		return -EINVAL;
+	}
+
+	filename = argv[0];
+
+	argc--;
+	argv++;
+
+	if (argc)
+	{
+		if (!isdigit(argv[0][0]))
+		{
+			fprintf(stderr, "Please input a numeric flash address!\n");
+			return -EINVAL;
+		}
+
+		addr = strtoul(argv[0], NULL, 0);
+
+		if (addr >= FlashGetSize())
+		{
+			fprintf(stderr, "Error: start address exceeds the flash size!\n");
+			return -EINVAL;
+		}
+
+		argc--;
+		argv++;
+
+		if (!argc)
+			size = FlashGetSize() - addr;
+	}
+
+	if (argc)
+	{
+		if (!isdigit(argv[0][0]))
+		{
+			fprintf(stderr, "Please input a numeric size!\n");
+			return -EINVAL;
+		}
+
+		size = strtoul(argv[0], NULL, 0);
+
+		if (addr + size > FlashGetSize())
+		{
+			fprintf(stderr, "Error: end address exceeds the flash size!\n");
+			return -EINVAL;
+		}
+	}
+
+	/* Plain reads go through the journal, hashing needs the data in one stream */
+	if (!hash_algos)
+	{
+		ret = JournalRead(FlashDefault(), filename, addr, size, resume_journal) == 0;
+		ImageForget(filename);
+
+		if (ret)
+			printf("Done.\n");
+
+		return ret ? 0 : -EIO;
+	}
+
+	buff = new unsigned char[size];
+	if (!buff)
+	{
+		fprintf(stderr, "Error: unable to allocate memory!\n");
+		return -ENOMEM;
+	}
+
+	printf("Reading flash from %xh, size %xh ...\n", addr, size);
+
+	ChecksumShowEngine(hash_algos);
+	cs = ChecksumStreamStart(hash_algos, addr, size, 0);
+	ret = FlashReadEx(addr, size, buff, ChecksumFeedChunk, cs);
+
+	if (!ret)
+	{
+		printf("Operation failed.\n");
+		ChecksumStreamFree(cs);
+		delete[] buff;
+		return -EFAULT;
+	}
+
+	if (cs)
+	{
+		ShowChecksumResult(cs);
+		ChecksumStreamFree(cs);
+		printf("\n");
+	}
+
+	printf("Saving to file %s ...\n", filename);
+
+	ProfileBegin(&span, PROF_FILE_IO);
+
+	f = fopen(filename, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Error: unable to open/create file! error %d\n", errno);
+		delete[] buff;
+		return -errno;
+	}
+
+	if (fwrite(buff, 1, size, f) != size)
+	{
+		fprintf(stderr, "Error: failed to write to file! error %d\n", errno);
+		delete[] buff;
+		return -errno;
+	}
+
+	fclose(f);
+	delete[] buff;
+
+	ProfileEnd(&span);
+
+	ImageForget(filename);
+
+	printf("Done.\n");
+
+	return 0;
+}
+
+static int DoFlashChecksum(int argc, char *argv[])
+{
+	unsigned int addr = 0, size, region_size = 0, algos = CHECKSUM_ALL;
+	checksum_stream *cs;
+
+	if (!FlashProbe())
+		return -ENODEV;
+
+	size = FlashGetSize();
+
+	if (argc && ChecksumParseAlgos(argv[0]))
+	{
+		algos = ChecksumParseAlgos(argv[0]);
+		argc--;
+		argv++;
+	}
+
+	if (argc && !strcmp(argv[0], "region"))
+	{
+		if (argc < 2 || !isdigit(argv[1][0]) || !(region_size = strtoul(argv[1], NULL, 0)))
+		{
+			fprintf(stderr, "Please input a numeric region size!\n");
+			return -EINVAL;
+		}
+
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc)
+	{
+		if (!isdigit(argv[0][0]))
+		{
+			fprintf(stderr, "Please input a numeric flash address!\n");
+			return -EINVAL;
+		}
+
+		addr = strtoul(argv[0], NULL, 0);
+
+		if (addr >= FlashGetSize())
+		{
+			fprintf(stderr, "Error: start address exceeds the flash size!\n");
+			return -EINVAL;
+		}
+
+		argc--;
+		argv++;
+
+		if (!argc)
+			size = FlashGetSize() - addr;
+	}
+
+	if (argc)
+	{
+		if (!isdigit(argv[0][0]))
+		{
+			fprintf(stderr, "Please input a numeric size!\n");
+			return -EINVAL;
+		}
+
+		size = strtoul(argv[0], NULL, 0);
+
+		if (addr + size > FlashGetSize())
+		{
+			fprintf(stderr, "Error: end address exceeds the flash size!\n");
+			return -EINVAL;
+		}
+	}
+
+	printf("Calculating checksum of flash from %xh, size %xh ...\n", addr, size);
+	ChecksumShowEngine(algos);
+
+	cs = ChecksumStreamStart(algos, addr, size, region_size);
+
+	if (!FlashReadEx(addr, size, NULL, ChecksumFeedChunk, cs))
+	{
+		printf("Operation failed.\n");
+		ChecksumStreamFree(cs);
+		return -EFAULT;
+	}
+
+	ShowChecksumResult(cs);
+	ChecksumStreamFree(cs);
+
+	return 0;
+}
+
+static int DoFlashChipErase(int argc, char *argv[])
+{
+	if (!FlashProbe())
+		return -ENODEV;
+
+	printf("Erasing entire flash, please wait ...\n");
+
+	if (!FlashChipErase())
+	{
+		printf("Operation failed.\n");
+		return -EFAULT;
+	}
+
+	printf("Done.\n");
+
+	return 0;
+}
+
+static int DoFlashErase(int argc, char *argv[])
+{
+	unsigned int addr = 0, size;
+
+	if (!FlashProbe())
+		return -ENODEV;
+
+	size = FlashGetSize();
+
+	if (!isdigit(argv[0][0]))
+	{
+		fprintf(stderr, "Please input a numeric flash address!\n");
+		return -EINVAL;
+	}
+
+	addr = strtoul(argv[0], NULL, 0);
+
+	if (addr >= FlashGetSize())
+	{
+		fprintf(stderr, "Error: start address exceeds the flash size!\n");
+		return -EINVAL;
+	}
+
+	if (!isdigit(argv[1][0]))
+	{
+		fprintf(stderr, "Please input a numeric size!\n");
+		return -EINVAL;
+	}
+
+	size = strtoul(argv[1], NULL, 0);
+
+	if (addr + size > FlashGetSize())
+	{
+		fprintf(stderr, "Error: end address exceeds the flash size!\n");
+		return -EINVAL;
+	}
+
+	printf("Erasing flash from %xh, size %xh ...\n", addr, size);
+
+	if (!FlashErase(addr, size))
+	{
+		printf("Operation failed.\n");
+		return -EFAULT;
+	}
+
+	printf("Done.\n");
+
+	return 0;
+}
+
+static int DoFlashWrite(int argc, char *argv[])
+{
+	int need_erase = 0, need_verify = 0, size_set = 0;
+	unsigned int addr = 0, size, filelen;
+	const char *filename;
+	unsigned char *image;
+
+	if (!FlashProbe())
+		return -ENODEV;
+
+	size = FlashGetSize();
+
+	if (!argc)
+	{
+_insufficinet_param:
+		fprintf(stderr, "Error: please specify a filename.\n");
+		return -EINVAL;
+	}
+
+	if (!strcmp(argv[0], "erase"))
+	{
+		need_erase = 1;
+		argc--;
+		argv++;
+	}
+
+	if (!argc)
+		goto _insufficinet_param;
+
+	if (!strcmp(argv[0], "verify"))
+	{
+		need_verify = 1;
+		argc--;
+		argv++;
+	}
+
+	if (!argc)
+		goto _insufficinet_param;
+
+	filename = argv[0];
+
+	argc--;
+	argv++;
+
+	if (argc)
+	{
+		if (!isdigit(argv[0][0]))
+		{
+			fprintf(stderr, "Please input a numeric flash address!\n");
+			return -EINVAL;
+		}
+
+		addr = strtoul(argv[0], NULL, 0);
+
+		if (addr >= FlashGetSize())
+		{
+			fprintf(stderr, "Error: start address exceeds the flash size!\n");
+			return -EINVAL;
+		}
+
+		argc--;
+		argv++;
+
+		if (!argc)
+			size = FlashGetSize() - addr;
+	}
+
+	if (argc)
+	{
+		if (!isdigit(argv[0][0]))
+		{
+			fprintf(stderr, "Please input a numeric size!\n");
+			return -EINVAL;
+		}
+
+		size = strtoul(argv[0], NULL, 0);
+
+		if (addr + size > FlashGetSize())
+		{
+			fprintf(stderr, "Error: end address exceeds the flash size!\n");
+			return -EINVAL;
+		}
+
+		size_set = 1;
+	}
+
+	image = ImageGet(filename, &filelen);
+	if (!image)
+		return -EIO;
+
+	if (filelen > size)
+	{
+		fprintf(stderr, "Warning: file size is larger than write size.\n");
+	}
+	else if (filelen < size)
+	{
+		if (size_set)
+			fprintf(stderr, "Warning: write size is larger than file size, write size truncated to 0x%x.\n", filelen);
+		size = filelen;
+	}
+
+	return JournalWrite(FlashDefault(), filename, image, addr, size, need_erase, need_verify, resume_journal);
+}
+
+static int DoFlashVerify(int argc, char *argv[])
+{
+	unsigned int addr = 0, size, filelen;
+	const char *filename;
+	unsigned char *image;
+
+	if (!FlashProbe())
+		return -ENODEV;
+
+	filename = argv[0];
+
+	argc--;
+	argv++;
+
+	if (argc)
+	{
+		if (!isdigit(argv[0][0]))
+		{
+			fprintf(stderr, "Please input a numeric flash address!\n");
+			return -EINVAL;
+		}
+
+		addr = strtoul(argv[0], NULL, 0);
+
+		if (addr >= FlashGetSize())
+		{
+			fprintf(stderr, "Error: start address exceeds the flash size!\n");
+			return -EINVAL;
+		}
+
+		argc--;
+		argv++;
+	}
+
+	size = FlashGetSize() - addr;
+
+	if (argc)
+	{
+		if (!isdigit(argv[0][0]))
+		{
+			fprintf(stderr, "Please input a numeric size!\n");
+			return -EINVAL;
+		}
+
+		size = strtoul(argv[0], NULL, 0);
+
+		if (addr + size > FlashGetSize())
+		{
+			fprintf(stderr, "Error: end address exceeds the flash size!\n");
+			return -EINVAL;
+		}
+	}
+
+	image = ImageGet(filename, &filelen);
+	if (!image)
+		return -EIO;
+
+	if (filelen < size)
+		size = filelen;
+
+	return VerifyImage(addr, image, size);
+}
+
+static int DoFlashGang(int argc, char *argv[])
+{
+	int need_erase = 0, need_verify = 0;
+	unsigned int addr = 0, size = 0;
+	const char *filename;
+
+	if (argc && !strcmp(argv[0], "erase"))
+	{
+		need_erase = 1;
+		argc--;
+		argv++;
+	}
+
+	if (argc && !strcmp(argv[0], "verify"))
+	{
+		need_verify = 1;
+		argc--;
+		argv++;
+	}
+
+	if (!argc)
+	{
+		fprintf(stderr, "Error: please specify a filename.\n");
+		return -EINVAL;
+	}
+
+	filename = argv[0];
+
+	argc--;
+	argv++;
+
+	if (argc)
+	{
+		if (!isdigit(argv[0][0]))
+		{
+			fprintf(stderr, "Please input a numeric flash address!\n");
+			return -EINVAL;
+		}
+
+		addr = strtoul(argv[0], NULL, 0);
+
+		argc--;
+		argv++;
+	}
+
+	if (argc)
+	{
+		if (!isdigit(argv[0][0]))
+		{
+			fprintf(stderr, "Please input a numeric size!\n");
+			return -EINVAL;
+		}
+
+		size = strtoul(argv[0], NULL, 0);
+	}
+
+	return GangProgram(filename, addr, size, need_erase, need_verify);
+}
+
+static int DoFlashLine(int argc, char *argv[])
+{
+	bool need_erase = false, need_verify = false;
+	const char *log_path = LINE_DEFAULT_LOG;
+	unsigned int addr = 0;
+
+	if (argc >= 2 && !strcmp(argv[0], "--log"))
+	{
+		log_path = argv[1];
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc && !strcmp(argv[0], "erase"))
+	{
+		need_erase = true;
+		argc--;
+		argv++;
+	}
+
+	if (argc && !strcmp(argv[0], "verify"))
+	{
+		need_verify = true;
+		argc--;
+		argv++;
+	}
+
+	if (!argc)
+	{
+		fprintf(stderr, "Error: please specify a filename.\n");
+		return -EINVAL;
+	}
+
+	if (argc > 1)
+	{
+		if (!isdigit(argv[1][0]))
+		{
+			fprintf(stderr, "Please input a numeric flash address!\n");
+			return -EINVAL;
+		}
+
+		addr = strtoul(argv[1], NULL, 0);
+	}
+
+	return LineRun(argv[0], addr, need_erase, need_verify, log_path);
+}
+
+static int DoFlashClone(int argc, char *argv[])
+{
+	bool need_verify = false;
+	unsigned int addr = 0, size = 0;
+
+	if (argc && !strcmp(argv[0], "verify"))
+	{
+		need_verify = true;
+		argc--;
+		argv++;
+	}
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "Error: please specify source and destination programmers.\n");
+		return -EINVAL;
+	}
+
+	if (argc > 2)
+	{
+		if (!isdigit(argv[2][0]))
+		{
+			fprintf(stderr, "Please input a numeric flash address!\n");
+			return -EINVAL;
+		}
+
+		addr = strtoul(argv[2], NULL, 0);
+	}
+
+	if (argc > 3)
+	{
+		if (!isdigit(argv[3][0]))
+		{
+			fprintf(stderr, "Please input a numeric size!\n");
+			return -EINVAL;
+		}
+
+		size = strtoul(argv[3], NULL, 0);
+	}
+
+	return CloneFlash(argv[0], argv[1], addr, size, need_verify);
+}
+
+static int DoDaemon(int argc, char *argv[])
+{
+	char socket_path[256];
+
+	DaemonDefaultSocket(socket_path, sizeof (socket_path));
+
+	if (argc >= 2 && !strcmp(argv[0], "--socket"))
+	{
+		snprintf(socket_path, sizeof (socket_path), "%s", argv[1]);
+		argc -= 2;
+		argv += 2;
+	}
+
+	return DaemonRun(socket_path, argv, argc);
+}
+
+static int DoSubmit(int argc, char *argv[])
+{
+	char socket_path[256];
+	int priority = 0, device = -1;
+
+	DaemonDefaultSocket(socket_path, sizeof (socket_path));
+
+	while (argc >= 2 && !strncmp(argv[0], "--", 2))
+	{
+		if (!strcmp(argv[0], "--socket"))
+			snprintf(socket_path, sizeof (socket_path), "%s", argv[1]);
+		else if (!strcmp(argv[0], "--priority"))
+			priority = atoi(argv[1]);
+		else if (!strcmp(argv[0], "--device"))
+			device = atoi(argv[1]);
+		else
+			break;
+
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (!argc)
+	{
+		fprintf(stderr, "Error: please specify a job.\n");
+		return -EINVAL;
+	}
+
+	return DaemonSubmit(socket_path, priority, device, argc, argv);
+}
+
+static int DoDeviceList(void)
+{
+	ch341_device_info infos[GANG_MAX_DEVICES];
+	unsigned int i, count;
+
+	count = CH341DeviceList(infos, GANG_MAX_DEVICES);
+	if (!count)
+	{
+		printf("No CH341 device found.\n");
+		return -ENODEV;
+	}
+
+	printf("Index  Location      Version  Serial\n");
+
+	for (i = 0; i < count; i++)
+		printf("%5u  %-12s  %4d.%02d  %s\n", infos[i].index, infos[i].location,
+			infos[i].version >> 8, infos[i].version & 0xff, infos[i].serial[0] ? infos[i].serial : "-");
+
+	return 0;
+}
+
+static int DoFlashMulti(int argc, char *argv[])
+{
+	const char *filenames[CH341_MAX_CS] = { NULL };
+	bool need_erase = false, need_verify = false;
+	unsigned int cs, addr = 0;
+
+	if (argc && !strcmp(argv[0], "erase"))
+	{
+		need_erase = true;
+		argc--;
+		argv++;
+	}
+
+	if (argc && !strcmp(argv[0], "verify"))
+	{
+		need_verify = true;
+		argc--;
+		argv++;
+	}
+
+	/* No files: show what sits on each CS line */
+	if (!argc)
+		return MultiCsList(CH341DefaultDevice());
+
+	for (cs = 0; argc; argc--, argv++)
+	{
+		if (argv[0][0] == '@')
+		{
+			if (!isdigit(argv[0][1]))
+			{
+				fprintf(stderr, "Please input a numeric flash address!\n");
+				return -EINVAL;
+			}
+
+			addr = strtoul(argv[0] + 1, NULL, 0);
+			continue;
+		}
+
+		if (cs >= CH341_MAX_CS)
+		{
+			fprintf(stderr, "Error: only %d CS lines are available.\n", CH341_MAX_CS);
+			return -EINVAL;
+		}
+
+		if (strcmp(argv[0], "-"))
+			filenames[cs] = argv[0];
+
+		cs++;
+	}
+
+	return MultiCsProgram(CH341DefaultDevice(), filenames, addr, need_erase, need_verify);
+}
+
+/* Commands on the default programmer, for the command line and scripts alike. -ENOSYS means bad usage. */
+static int RunCommand(int argc, char *argv[])
+{
+	if (!strcmp(argv[0], "probe"))
+		return FlashProbe() ? 0 : -ENODEV;
+
+	if (!strcmp(argv[0], "read"))
+	{
+		if (argc < 2)
+			return -ENOSYS;
+
+		return DoFlashRead(argc - 1, argv + 1);
+	}
+
+	if (!strcmp(argv[0], "erase"))
+	{
+		if (argc == 2 && !strcmp(argv[1], "chip"))
+			return DoFlashChipErase(argc - 1, argv + 1);
+
+		if (argc < 3)
+			return -ENOSYS;
+
+		return DoFlashErase(argc - 1, argv + 1);
+	}
+
+	if (!strcmp(argv[0], "write"))
+	{
+		if (argc < 2)
+			return -ENOSYS;
+
+		return DoFlashWrite(argc - 1, argv + 1);
+	}
+
+	if (!strcmp(argv[0], "verify"))
+	{
+		if (argc < 2)
+			return -ENOSYS;
+
+		return DoFlashVerify(argc - 1, argv + 1);
+	}
+
+	if (!strcmp(argv[0], "checksum"))
+		return DoFlashChecksum(argc - 1, argv + 1);
+
+	if (!strcmp(argv[0], "multi"))
+		return DoFlashMulti(argc - 1, argv + 1);
+
+	return -ENOSYS;
+}
+
+/* Splits a script line into words, "..." keeps spaces, # starts a comment */
+static int ScriptSplit(char *line, char *argv[], int max)
+{
+	int argc = 0;
+	char *p = line;
+
+	while (*p)
+	{
+		while (isspace((unsigned char) *p))
+			p++;
+
+		if (!*p || *p == '#')
+			break;
+
+		if (argc == max)
+			return -1;
+
+		if (*p == '"')
+		{
+			argv[argc++] = ++p;
+
+			while (*p && *p != '"')
+				p++;
+
+			if (!*p)
+				return -1;
+		}
+		else
+		{
+			argv[argc++] = p;
+
+			while (*p && !isspace((unsigned char) *p))
+				p++;
+		}
+
+		if (*p)
+			*p++ = 0;
+	}
+
+	return argc;
+}
+
+/*
+ * Runs one command per line in a single session: the chip is probed once,
+ * kept in its address mode and images are read only once. A step stops the
+ * script on failure unless it is prefixed with "try", "onerror continue"
+ * or "onerror stop" changes the default for the steps after it.
+ */
+static int DoScript(const char *filename)
+{
+	char line[SCRIPT_LINE_LENGTH], *args[SCRIPT_MAX_ARGS], **argv;
+	unsigned int lineno = 0, steps = 0, failed = 0;
+	bool keep_going = false, step_keep_going, held;
+	int argc, ret = 0;
+	FILE *f;
+
+	if (!strcmp(filename, "-"))
+		f = stdin;
+	else if (!(f = fopen(filename, "r")))
+	{
+		fprintf(stderr, "Error: unable to open script %s! error %d\n", filename, errno);
+		return -errno;
+	}
+
+	held = FlashProbe() && SpiFlashBegin(FlashDefault());
+
+	while (fgets(line, sizeof (line), f))
+	{
+		lineno++;
+
+		argc = ScriptSplit(line, args, SCRIPT_MAX_ARGS);
+		argv = args;
+
+		if (argc < 0)
+		{
+			fprintf(stderr, "Error: line %u: unterminated quote or too many words\n", lineno);
+			ret = -EINVAL;
+			break;
+		}
+
+		if (!argc)
+			continue;
+
+		if (!strcmp(argv[0], "onerror") && argc == 2 && (!strcmp(argv[1], "stop") || !strcmp(argv[1], "continue")))
+		{
+			keep_going = !strcmp(argv[1], "continue");
+			continue;
+		}
+
+		step_keep_going = keep_going;
+
+		if (!strcmp(argv[0], "try") && argc > 1)
+		{
+			step_keep_going = true;
+			argc--;
+			argv++;
+		}
+
+		printf("\n>>> %u: %s", lineno, argv[0]);
+		for (int i = 1; i < argc; i++)
+			printf(" %s", argv[i]);
+		printf("\n");
+
+		steps++;
+		ret = RunCommand(argc, argv);
+
+		if (ret == -ENOSYS)
+			fprintf(stderr, "Error: line %u: unknown command or missing arguments\n", lineno);
+
+		if (!ret)
+			continue;
+
+		failed++;
+
+		if (CH341Cancelled())
+		{
+			printf("Interrupted at line %u, stopping.\n", lineno);
+			break;
+		}
+
+		if (!step_keep_going)
+		{
+			printf("Step at line %u failed, stopping.\n", lineno);
+			break;
+		}
+
+		printf("Step at line %u failed, continuing.\n", lineno);
+		ret = 0;
+	}
+
+	if (f != stdin)
+		fclose(f);
+
+	if (held)
+		SpiFlashEnd(FlashDefault());
+
+	printf("\nScript finished: %u step(s), %u failed.\n", steps, failed);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int argv_c = argc - 1, argv_p = 1;
+	int ret = 0;
+
+	printf("Simple CH341 SPI Flash Programmer\nBy HackPascal <hackpascal@gmail.com>\n\n");
+
+	if (getenv("CH341PROG_CHIPDB") && spi_flash_db_load(getenv("CH341PROG_CHIPDB")) < 0)
+		return 1;
+
+	if (getenv("CH341PROG_DEVICE"))
+		CH341SelectDevice(getenv("CH341PROG_DEVICE"));
+
+	while (argv_c && !strncmp(argv[argv_p], "--", 2))
+	{
+		if (!strcmp(argv[argv_p], "--chipdb") && argv_c >= 2)
+		{
+			if (spi_flash_db_load(argv[argv_p + 1]) < 0)
+				return 1;
+
+			argv_c -= 2;
+			argv_p += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[argv_p], "--device") && argv_c >= 2)
+		{
+			CH341SelectDevice(argv[argv_p + 1]);
+			argv_c -= 2;
+			argv_p += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[argv_p], "--capture") && argv_c >= 2)
+		{
+			CH341SelectCapture(argv[argv_p + 1]);
+			argv_c -= 2;
+			argv_p += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[argv_p], "--resume"))
+		{
+			resume_journal = true;
+			argv_c--;
+			argv_p++;
+			continue;
+		}
+
+		if (!strcmp(argv[argv_p], "--metrics-file") && argv_c >= 2)
+		{
+			metrics_file = argv[argv_p + 1];
+			argv_c -= 2;
+			argv_p += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[argv_p], "--metrics-interval") && argv_c >= 2)
+		{
+			metrics_interval_ms = (unsigned int) (strtod(argv[argv_p + 1], NULL) * 1000);
+			argv_c -= 2;
+			argv_p += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[argv_p], "--metrics-port") && argv_c >= 2)
+		{
+			metrics_port = strtoul(argv[argv_p + 1], NULL, 0);
+			argv_c -= 2;
+			argv_p += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[argv_p], "--stats"))
+		{
+			show_stats = true;
+			argv_c--;
+			argv_p++;
+			continue;
+		}
+
+		if (!strcmp(argv[argv_p], "--profile"))
+		{
+			profile = true;
+			argv_c--;
+			argv_p++;
+			continue;
+		}
+
+		if (!strcmp(argv[argv_p], "--trace") && argv_c >= 2)
+		{
+			profile = true;
+			trace_path = argv[argv_p + 1];
+			argv_c -= 2;
+			argv_p += 2;
+			continue;
+		}
+
+		if (!strcmp(argv[argv_p], "--no-cache"))
+		{
+			ProbeCacheDisable();
+			argv_c--;
+			argv_p++;
+			continue;
+		}
+
+		ShowUsage();
+		return 1;
+	}
+
+	/* Line, daemon and serprog install their own handlers, they stop between jobs */
+	signal(SIGINT, MainSignal);
+	signal(SIGTERM, MainSignal);
+
+	/* Listing only reads descriptors, nothing gets claimed */
+	if (argv_c && !strcmp(argv[argv_p], "list"))
+		return DoDeviceList() ? 1 : 0;
+
+	if (argv_c && !strcmp(argv[argv_p], "submit"))
+		return DoSubmit(argv_c - 1, argv + argv_p + 1) ? 1 : 0;
+
+	if ((metrics_file || metrics_port) && !MetricsStart(metrics_file, metrics_interval_ms, metrics_port))
+		return 1;
+
+	/* The daemon holds its programmers itself */
+	if (argv_c && !strcmp(argv[argv_p], "daemon"))
+	{
+		ret = DoDaemon(argv_c - 1, argv + argv_p + 1) ? 1 : 0;
+		goto done;
+	}
+
+	if (profile && !ProfileStart(trace_path))
+	{
+		ret = 1;
+		goto done;
+	}
+
+	/* Cloning opens its two programmers itself */
+	if (argv_c && !strcmp(argv[argv_p], "clone"))
+	{
+		ret = DoFlashClone(argv_c - 1, argv + argv_p + 1) ? 1 : 0;
+		goto done;
+	}
+
+	/* Gang mode opens every programmer itself */
+	if (argv_c && !strcmp(argv[argv_p], "gang"))
+	{
+		ret = DoFlashGang(argv_c - 1, argv + argv_p + 1);
+		goto done;
+	}
+
+	/* The line waits for its programmer to be plugged in and opens it itself */
+	if (argv_c && !strcmp(argv[argv_p], "line"))
+	{
+		ret = DoFlashLine(argv_c - 1, argv + argv_p + 1) ? 1 : 0;
+		goto done;
+	}
+
+	CH341DeviceInit();
+
+	if (!argv_c)
+	{
+		ShowUsage();
+		goto cleanup;
+	}
+
+	if (!strcmp(argv[argv_p], "serprog"))
+	{
+		if (argv_c < 2)
+		{
+			ShowUsage();
+			goto cleanup;
+		}
+
+		ret = SerprogServe(CH341DefaultDevice(), argv[argv_p + 1]);
+		goto cleanup;
+	}
+
+	if (!strcmp(argv[argv_p], "script"))
+	{
+		ret = DoScript(argv_c > 1 ? argv[argv_p + 1] : "-");
+		goto cleanup;
+	}
+
+	ret = RunCommand(argv_c, argv + argv_p);
+	if (ret == -ENOSYS)
+		ShowUsage();
+
+cleanup:
+	ImageCacheFree();
+
+	if (CH341Cancelled())
+	{
+		printf("Interrupted, releasing the chip ...\n");
+
+		if (CH341DeviceIsOpen(CH341DefaultDevice()))
+			SpiFlashRelease(FlashDefault());
+
+		ret = -EINTR;
+	}
+
+	CH341DeviceShowStats(CH341DefaultDevice());
+
+	if (show_stats)
+		CH341DeviceShowTransferStats(CH341DefaultDevice());
+
+	CH341DeviceRelease();
+
+done:
+	ProfileStop();
+	MetricsStop();
+
+    return ret;
+}
@@ -0,0 +1,469 @@
+#include "stdafx.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL				0
+#endif
+#endif
+
+#include "ch341.h"
+#include "metrics.h"
+
+#define METRICS_PATH_LENGTH			1024
+#define METRICS_POLL_MS				500	/* longest a Stop waits for the exporter with HTTP on */
+#define METRICS_REQUEST_LENGTH		1024
+#define METRICS_REQUEST_TIMEOUT_S	2
+
+typedef std::chrono::steady_clock metrics_clock;
+
+static const char *metrics_op_names[METRIC_OPS] = { "probe", "read", "erase", "write" };
+static const char *metrics_result_names[METRIC_RESULTS] = { "ok", "failed", "cancelled" };
+static const char *metrics_usb_error_names[CH341_USB_ERR_KINDS] = { "timeout", "pipe", "io", "no_device", "overflow", "other" };
+
+static std::atomic<unsigned long long> metrics_bytes[METRIC_OPS];
+static std::atomic<unsigned long long> metrics_ops[METRIC_OPS][METRIC_RESULTS];
+static std::atomic<unsigned int> metrics_running[METRIC_OPS];
+static std::atomic<unsigned long long> metrics_duration_us[METRIC_OPS];
+static std::atomic<unsigned long long> metrics_last_us[METRIC_OPS];
+static std::atomic<unsigned long long> metrics_retries;
+static std::atomic<unsigned long long> metrics_usb_errors[CH341_USB_ERR_KINDS];
+
+/* Bytes per second over the last export interval, updated by the exporter */
+static std::atomic<double> metrics_rate[METRIC_OPS];
+
+static std::thread metrics_thread;
+static std::mutex metrics_lock;
+static std::condition_variable metrics_cond;
+static bool metrics_stop;
+static bool metrics_started;
+static char metrics_textfile[METRICS_PATH_LENGTH];
+static unsigned int metrics_interval_ms;
+static int metrics_http_fd = -1;
+
+static unsigned long long MetricsNowUs(void)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(metrics_clock::now().time_since_epoch()).count();
+}
+
+unsigned long long MetricsOperationBegin(unsigned int op)
+{
+	metrics_running[op]++;
+
+	return MetricsNowUs();
+}
+
+void MetricsOperationEnd(unsigned int op, unsigned long long start_us, unsigned int result)
+{
+	unsigned long long us = MetricsNowUs() - start_us;
+
+	metrics_running[op]--;
+	metrics_ops[op][result]++;
+	metrics_duration_us[op] += us;
+	metrics_last_us[op] = us;
+}
+
+void MetricsAddBytes(unsigned int op, unsigned int bytes)
+{
+	metrics_bytes[op] += bytes;
+}
+
+void MetricsRetry(void)
+{
+	metrics_retries++;
+}
+
+void MetricsUsbError(unsigned int kind)
+{
+	metrics_usb_errors[kind]++;
+}
+
+static void MetricsAppend(char *buf, unsigned int size, unsigned int *len, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	if (*len >= size)
+		return;
+
+	va_start(args, fmt);
+	n = vsnprintf(buf + *len, size - *len, fmt, args);
+	va_end(args);
+
+	if (n > 0)
+		*len = *len + n < size ? *len + n : size - 1;
+}
+
+unsigned int MetricsFormat(char *buf, unsigned int size)
+{
+	unsigned int len = 0, i, j;
+
+	if (!size)
+		return 0;
+
+	buf[0] = 0;
+
+	MetricsAppend(buf, size, &len, "# HELP ch341prog_bytes_total Flash bytes read, written and erased.\n"
+		"# TYPE ch341prog_bytes_total counter\n");
+	for (i = METRIC_OP_READ; i < METRIC_OPS; i++)
+		MetricsAppend(buf, size, &len, "ch341prog_bytes_total{op=\"%s\"} %llu\n", metrics_op_names[i],
+			(unsigned long long) metrics_bytes[i]);
+
+	MetricsAppend(buf, size, &len, "# HELP ch341prog_throughput_bytes_per_second Flash bytes per second over the last "
+		"export interval.\n# TYPE ch341prog_throughput_bytes_per_second gauge\n");
+	for (i = METRIC_OP_READ; i < METRIC_OPS; i++)
+		MetricsAppend(buf, size, &len, "ch341prog_throughput_bytes_per_second{op=\"%s\"} %.0f\n", metrics_op_names[i],
+			(double) metrics_rate[i]);
+
+	MetricsAppend(buf, size, &len, "# HELP ch341prog_operations_total Flash operations finished, by result.\n"
+		"# TYPE ch341prog_operations_total counter\n");
+	for (i = 0; i < METRIC_OPS; i++)
+		for (j = 0; j < METRIC_RESULTS; j++)
+			MetricsAppend(buf, size, &len, "ch341prog_operations_total{op=\"%s\",result=\"%s\"} %llu\n",
+				metrics_op_names[i], metrics_result_names[j], (unsigned long long) metrics_ops[i][j]);
+
+	MetricsAppend(buf, size, &len, "# HELP ch341prog_operations_in_progress Flash operations running right now.\n"
+		"# TYPE ch341prog_operations_in_progress gauge\n");
+	for (i = 0; i < METRIC_OPS; i++)
+		MetricsAppend(buf, size, &len, "ch341prog_operations_in_progress{op=\"%s\"} %u\n", metrics_op_names[i],
+			(unsigned int) metrics_running[i]);
+
+	MetricsAppend(buf, size, &len, "# HELP ch341prog_operation_duration_seconds Time spent in flash operations.\n"
+		"# TYPE ch341prog_operation_duration_seconds summary\n");
+	for (i = 0; i < METRIC_OPS; i++)
+	{
+		unsigned long long count = 0;
+
+		for (j = 0; j < METRIC_RESULTS; j++)
+			count += metrics_ops[i][j];
+
+		MetricsAppend(buf, size, &len, "ch341prog_operation_duration_seconds_sum{op=\"%s\"} %.6f\n"
+			"ch341prog_operation_duration_seconds_count{op=\"%s\"} %llu\n", metrics_op_names[i],
+			metrics_duration_us[i] / 1e6, metrics_op_names[i], count);
+	}
+
+	MetricsAppend(buf, size, &len, "# HELP ch341prog_operation_last_duration_seconds Duration of the last finished "
+		"flash operation.\n# TYPE ch341prog_operation_last_duration_seconds gauge\n");
+	for (i = 0; i < METRIC_OPS; i++)
+		MetricsAppend(buf, size, &len, "ch341prog_operation_last_duration_seconds{op=\"%s\"} %.6f\n",
+			metrics_op_names[i], metrics_last_us[i] / 1e6);
+
+	MetricsAppend(buf, size, &len, "# HELP ch341prog_retries_total Failed transactions tried again after "
+		"recovering the programmer.\n# TYPE ch341prog_retries_total counter\n"
+		"ch341prog_retries_total %llu\n", (unsigned long long) metrics_retries);
+
+	MetricsAppend(buf, size, &len, "# HELP ch341prog_usb_errors_total Failed USB transfers, resent ones included.\n"
+		"# TYPE ch341prog_usb_errors_total counter\n");
+	for (i = 0; i < CH341_USB_ERR_KINDS; i++)
+		MetricsAppend(buf, size, &len, "ch341prog_usb_errors_total{kind=\"%s\"} %llu\n", metrics_usb_error_names[i],
+			(unsigned long long) metrics_usb_errors[i]);
+
+	return len;
+}
+
+/* Written next to it and renamed, the collector never sees half a file */
+static bool MetricsWriteTextfile(const char *path)
+{
+	char tmp_path[METRICS_PATH_LENGTH + 8];
+	char *text;
+	unsigned int len;
+	FILE *f;
+	bool ret = false;
+
+	snprintf(tmp_path, sizeof (tmp_path), "%s.tmp", path);
+
+	text = new char[METRICS_TEXT_LENGTH];
+	len = MetricsFormat(text, METRICS_TEXT_LENGTH);
+
+	f = fopen(tmp_path, "w");
+	if (!f)
+		goto _out;
+
+	if (fwrite(text, 1, len, f) != len)
+	{
+		fclose(f);
+		remove(tmp_path);
+		goto _out;
+	}
+
+	if (fclose(f))
+	{
+		remove(tmp_path);
+		goto _out;
+	}
+
+#ifdef _WIN32
+	remove(path);
+#endif
+
+	if (rename(tmp_path, path))
+	{
+		remove(tmp_path);
+		goto _out;
+	}
+
+	ret = true;
+
+_out:
+	delete[] text;
+	return ret;
+}
+
+#ifndef _WIN32
+static int MetricsListen(unsigned int port)
+{
+	struct sockaddr_in sa;
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		Message(MSG_ERROR, "Error: unable to create socket, error %d\n", errno);
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
+	/* Scrapers on the station itself only, nothing is exposed to the network */
+	memset(&sa, 0, sizeof (sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons((unsigned short) port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr *) &sa, sizeof (sa)) || listen(fd, 4))
+	{
+		Message(MSG_ERROR, "Error: unable to listen on 127.0.0.1:%u, error %d\n", port, errno);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void MetricsSend(int fd, const char *data, unsigned int len)
+{
+	ssize_t n;
+
+	while (len)
+	{
+		n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return;
+
+		data += n;
+		len -= n;
+	}
+}
+
+/* Just enough HTTP for a scraper: GET /metrics, one request per connection */
+static void MetricsServe(int fd)
+{
+	char req[METRICS_REQUEST_LENGTH], head[128], *text;
+	unsigned int len = 0, text_len;
+	struct timeval tv;
+	ssize_t n;
+
+	tv.tv_sec = METRICS_REQUEST_TIMEOUT_S;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+	/* The request line is all that matters, headers are read only to be polite */
+	while (len < sizeof (req) - 1)
+	{
+		n = recv(fd, req + len, sizeof (req) - 1 - len, 0);
+		if (n <= 0)
+			break;
+
+		len += n;
+		req[len] = 0;
+
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	req[len] = 0;
+
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6))
+	{
+		static const char not_found[] = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\n"
+			"Connection: close\r\n\r\nnot found\n";
+
+		MetricsSend(fd, not_found, sizeof (not_found) - 1);
+		return;
+	}
+
+	text = new char[METRICS_TEXT_LENGTH];
+	text_len = MetricsFormat(text, METRICS_TEXT_LENGTH);
+
+	len = snprintf(head, sizeof (head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %u\r\nConnection: close\r\n\r\n", text_len);
+
+	MetricsSend(fd, head, len);
+	MetricsSend(fd, text, text_len);
+
+	delete[] text;
+}
+#endif
+
+static void MetricsSample(unsigned long long *last_bytes, metrics_clock::time_point *last)
+{
+	metrics_clock::time_point now = metrics_clock::now();
+	double secs = std::chrono::duration<double>(now - *last).count();
+	unsigned long long bytes;
+	unsigned int i;
+
+	for (i = 0; i < METRIC_OPS; i++)
+	{
+		bytes = metrics_bytes[i];
+		metrics_rate[i] = secs > 0 ? (bytes - last_bytes[i]) / secs : 0.0;
+		last_bytes[i] = bytes;
+	}
+
+	*last = now;
+}
+
+static void MetricsExporter(void)
+{
+	unsigned long long last_bytes[METRIC_OPS];
+	metrics_clock::time_point last, next;
+	unsigned int i;
+	bool failed = false;
+
+	for (i = 0; i < METRIC_OPS; i++)
+		last_bytes[i] = metrics_bytes[i];
+
+	last = metrics_clock::now();
+	next = last + std::chrono::milliseconds(metrics_interval_ms);
+
+	while (1)
+	{
+#ifndef _WIN32
+		if (metrics_http_fd >= 0)
+		{
+			struct pollfd pfd;
+			long long wait;
+			int client;
+
+			{
+				std::lock_guard<std::mutex> lk(metrics_lock);
+
+				if (metrics_stop)
+					break;
+			}
+
+			wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - metrics_clock::now()).count();
+
+			pfd.fd = metrics_http_fd;
+			pfd.events = POLLIN;
+
+			if (wait > 0 && poll(&pfd, 1, wait < METRICS_POLL_MS ? (int) wait : METRICS_POLL_MS) > 0)
+			{
+				client = accept(metrics_http_fd, NULL, NULL);
+				if (client >= 0)
+				{
+					MetricsServe(client);
+					close(client);
+				}
+			}
+		}
+		else
+#endif
+		{
+			std::unique_lock<std::mutex> lk(metrics_lock);
+
+			if (metrics_cond.wait_until(lk, next, [] { return metrics_stop; }))
+				break;
+		}
+
+		if (metrics_clock::now() < next)
+			continue;
+
+		MetricsSample(last_bytes, &last);
+		next += std::chrono::milliseconds(metrics_interval_ms);
+
+		/* Only said once, a full disk would otherwise fill the console */
+		if (metrics_textfile[0] && !MetricsWriteTextfile(metrics_textfile) && !failed)
+		{
+			Message(MSG_WARNING, "Warning: unable to write metrics to %s, error %d\n", metrics_textfile, errno);
+			failed = true;
+		}
+	}
+
+	MetricsSample(last_bytes, &last);
+}
+
+bool MetricsStart(const char *textfile, unsigned int interval_ms, unsigned int http_port)
+{
+	if (metrics_started)
+		return true;
+
+	snprintf(metrics_textfile, sizeof (metrics_textfile), "%s", textfile ? textfile : "");
+	metrics_interval_ms = interval_ms < METRICS_MIN_INTERVAL_MS ? METRICS_MIN_INTERVAL_MS : interval_ms;
+
+	/* Better to find out now than at the first interval */
+	if (metrics_textfile[0] && !MetricsWriteTextfile(metrics_textfile))
+	{
+		Message(MSG_ERROR, "Error: unable to write metrics to %s, error %d\n", metrics_textfile, errno);
+		return false;
+	}
+
+	if (http_port)
+	{
+#ifdef _WIN32
+		Message(MSG_ERROR, "Error: the metrics HTTP endpoint is not available on this platform.\n");
+		return false;
+#else
+		metrics_http_fd = MetricsListen(http_port);
+		if (metrics_http_fd < 0)
+			return false;
+#endif
+	}
+
+	metrics_stop = false;
+	metrics_thread = std::thread(MetricsExporter);
+	metrics_started = true;
+
+	return true;
+}
+
+void MetricsStop(void)
+{
+	if (!metrics_started)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lk(metrics_lock);
+		metrics_stop = true;
+		metrics_cond.notify_all();
+	}
+
+	metrics_thread.join();
+	metrics_started = false;
+
+#ifndef _WIN32
+	if (metrics_http_fd >= 0)
+	{
+		close(metrics_http_fd);
+		metrics_http_fd = -1;
+	}
+#endif
+
+	if (metrics_textfile[0] && !MetricsWriteTextfile(metrics_textfile))
+		Message(MSG_WARNING, "Warning: unable to write metrics to %s, error %d\n", metrics_textfile, errno);
+}
@@ -0,0 +1,44 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+/* Operations of the flash engine, the op label of the exported metrics */
+#define METRIC_OP_PROBE				0
+#define METRIC_OP_READ				1
+#define METRIC_OP_ERASE				2
+#define METRIC_OP_WRITE				3
+#define METRIC_OPS					4
+
+#define METRIC_RESULT_OK			0
+#define METRIC_RESULT_FAILED		1
+#define METRIC_RESULT_CANCELLED		2
+#define METRIC_RESULTS				3
+
+#define METRICS_DEFAULT_INTERVAL_MS	10000
+#define METRICS_MIN_INTERVAL_MS		100
+#define METRICS_TEXT_LENGTH			16384
+
+/*
+ * Hooks of the flash engine and the USB layer, process wide and safe from
+ * any thread. They only add to counters, whether or not anything is
+ * exported.
+ */
+unsigned long long MetricsOperationBegin(unsigned int op);
+void MetricsOperationEnd(unsigned int op, unsigned long long start_us, unsigned int result);
+void MetricsAddBytes(unsigned int op, unsigned int bytes);
+void MetricsRetry(void);
+void MetricsUsbError(unsigned int kind);
+
+/* Prometheus text exposition format, returns its length */
+unsigned int MetricsFormat(char *buf, unsigned int size);
+
+/*
+ * Exports the metrics until Stop: every interval_ms textfile (if given) is
+ * replaced atomically, for node_exporter's textfile collector, and the
+ * throughput gauges are updated. With http_port the same text is served
+ * on 127.0.0.1:http_port (not on Windows). Stop writes the textfile once
+ * more, with the final counts.
+ */
+bool MetricsStart(const char *textfile, unsigned int interval_ms, unsigned int http_port);
+void MetricsStop(void);
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,473 @@
+#include "stdafx.h"
+
+#include <string.h>
+#include <errno.h>
+
+#include <chrono>
+#include <thread>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "multi_cs.h"
+
+#define MULTI_CS_VERIFY_LENGTH		0x1000
+#define MULTI_CS_STATUS_INTERVAL_MS	500
+#define MULTI_CS_MIN_REPOLL_US		50		/* status reads of a busy chip, at most this often */
+
+typedef std::chrono::steady_clock multi_cs_clock;
+
+enum multi_cs_phase
+{
+	MULTI_CS_ERASE,
+	MULTI_CS_WRITE,
+	MULTI_CS_VERIFY,
+	MULTI_CS_DONE,
+};
+
+static const char multi_cs_phase_tag[] = { 'E', 'W', 'V', '-' };
+
+typedef struct _multi_cs_unit
+{
+	spi_flash flash;
+	const char *filename;
+	unsigned char *image;
+	unsigned char *encoded;
+	unsigned int addr;
+	unsigned int len;
+	bool erase;
+	bool verify;
+
+	int phase;
+	unsigned int pos;
+
+	/* An erase or program is running, its status is next read at poll_at */
+	bool busy;
+	unsigned int repoll_us;
+	multi_cs_clock::time_point poll_at;
+
+	bool passed;
+	char error[96];
+	double seconds;
+} multi_cs_unit;
+
+unsigned int MultiCsDetect(ch341_device *dev, unsigned int jedec_ids[CH341_MAX_CS])
+{
+	static const unsigned char rdid = SPI_CMD_RDID;
+	ch341_spi_batch ops[CH341_MAX_CS];
+	unsigned char id[CH341_MAX_CS][3];
+	unsigned int cs_list[CH341_MAX_CS];
+	unsigned int cs, mask = 0;
+
+	for (cs = 0; cs < CH341_MAX_CS; cs++)
+	{
+		cs_list[cs] = cs;
+		ops[cs].cmd = &rdid;
+		ops[cs].cmd_len = 1;
+		ops[cs].data = id[cs];
+		ops[cs].data_len = sizeof (id[cs]);
+	}
+
+	if (!CH341DeviceBatchSPIMulti(dev, cs_list, ops, CH341_MAX_CS))
+		return 0;
+
+	for (cs = 0; cs < CH341_MAX_CS; cs++)
+	{
+		jedec_ids[cs] = id[cs][0] << 16 | id[cs][1] << 8 | id[cs][2];
+
+		/* Floating MISO reads back all ones, a grounded one all zeros */
+		if (jedec_ids[cs] && jedec_ids[cs] != 0xffffff)
+			mask |= 1 << cs;
+		else
+			jedec_ids[cs] = 0;
+	}
+
+	return mask;
+}
+
+int MultiCsList(ch341_device *dev)
+{
+	unsigned int jedec_ids[CH341_MAX_CS];
+	unsigned int cs, mask;
+	spi_flash flash;
+
+	mask = MultiCsDetect(dev, jedec_ids);
+	if (!mask)
+	{
+		fprintf(stderr, "Error: no flash found on any CS line.\n");
+		return -ENODEV;
+	}
+
+	for (cs = 0; cs < CH341_MAX_CS; cs++)
+	{
+		if (!(mask & (1 << cs)))
+		{
+			printf("CS%u: -\n", cs);
+			continue;
+		}
+
+		SpiFlashInit(&flash, dev, cs);
+		flash.quiet = true;
+
+		if (!SpiFlashProbe(&flash))
+		{
+			printf("CS%u: %06x, probe failed\n", cs, jedec_ids[cs]);
+			continue;
+		}
+
+		printf("CS%u: %06x %s, %uKiB\n", cs, jedec_ids[cs], flash.id->model, SpiFlashGetSize(&flash) >> 10);
+	}
+
+	return 0;
+}
+
+static void MultiCsWaitFor(multi_cs_unit *u, unsigned int first_us, unsigned int repoll_us)
+{
+	u->busy = true;
+	u->repoll_us = repoll_us > MULTI_CS_MIN_REPOLL_US ? repoll_us : MULTI_CS_MIN_REPOLL_US;
+	u->poll_at = multi_cs_clock::now() + std::chrono::microseconds(first_us);
+}
+
+static void MultiCsFinish(multi_cs_unit *u, multi_cs_clock::time_point start)
+{
+	/* A failed chip may be left in 4-byte address mode */
+	if (!u->passed)
+		SpiFlashEnd(&u->flash);
+
+	u->seconds = std::chrono::duration<double>(multi_cs_clock::now() - start).count();
+	u->phase = MULTI_CS_DONE;
+}
+
+/* Issues the next step of a unit, returns false on failure */
+static bool MultiCsStep(multi_cs_unit *u)
+{
+	unsigned char buf[MULTI_CS_VERIFY_LENGTH];
+	const flash_erase_type *et;
+	unsigned int len, i, typ_us;
+
+	/* Only reached with the chip idle, stopping here leaves nothing half done */
+	if (CH341Cancelled())
+	{
+		snprintf(u->error, sizeof (u->error), "interrupted");
+		return false;
+	}
+
+	switch (u->phase)
+	{
+	case MULTI_CS_ERASE:
+		if (u->pos >= u->len)
+			break;
+
+		et = SpiFlashPlanErase(&u->flash, u->addr + u->pos, u->addr + u->len);
+
+		if (!SpiFlashEraseStart(&u->flash, u->addr + u->pos, et))
+		{
+			snprintf(u->error, sizeof (u->error), "erase failed at 0x%08x", u->addr + u->pos);
+			return false;
+		}
+
+		/* Same pacing as a lone erase: nothing finishes before half the typical time */
+		MultiCsWaitFor(u, et->typ_ms * 500, et->typ_ms * 1000 / 16);
+		u->pos += et->size;
+		return true;
+
+	case MULTI_CS_WRITE:
+		if (u->pos >= u->len)
+			break;
+
+		/* AAI programming is a tight byte pair loop, nothing worth interleaving */
+		if (u->flash.sst_write)
+		{
+			if (!SpiFlashWriteEx(&u->flash, u->addr, u->image, u->encoded, u->len))
+			{
+				snprintf(u->error, sizeof (u->error), "write failed");
+				return false;
+			}
+
+			u->pos = u->len;
+			return true;
+		}
+
+		len = u->flash.page_size - (u->addr + u->pos) % u->flash.page_size;
+		if (len > u->len - u->pos)
+			len = u->len - u->pos;
+
+		if (!SpiFlashProgramStart(&u->flash, u->addr + u->pos, u->image + u->pos, u->encoded + u->pos, len))
+		{
+			snprintf(u->error, sizeof (u->error), "write failed at 0x%08x", u->addr + u->pos);
+			return false;
+		}
+
+		typ_us = u->flash.page_prog_us;
+		MultiCsWaitFor(u, typ_us / 2, typ_us / 8);
+		u->pos += len;
+		return true;
+
+	case MULTI_CS_VERIFY:
+		if (u->pos >= u->len)
+			break;
+
+		len = u->len - u->pos > MULTI_CS_VERIFY_LENGTH ? MULTI_CS_VERIFY_LENGTH : u->len - u->pos;
+
+		if (!SpiFlashRead(&u->flash, u->addr + u->pos, len, buf))
+		{
+			snprintf(u->error, sizeof (u->error), "read failed at 0x%08x", u->addr + u->pos);
+			return false;
+		}
+
+		if (memcmp(buf, u->image + u->pos, len))
+		{
+			for (i = 0; buf[i] == u->image[u->pos + i]; i++)
+				;
+
+			snprintf(u->error, sizeof (u->error), "verify mismatch at 0x%08x", u->addr + u->pos + i);
+			return false;
+		}
+
+		u->pos += len;
+		return true;
+	}
+
+	/* Current phase is complete, move on to the next one that is wanted */
+	u->pos = 0;
+
+	if (u->phase == MULTI_CS_ERASE)
+	{
+		u->phase = MULTI_CS_WRITE;
+		return true;
+	}
+
+	if (!SpiFlashEnd(&u->flash))
+	{
+		snprintf(u->error, sizeof (u->error), "failed to restore address mode");
+		return false;
+	}
+
+	if (u->phase == MULTI_CS_WRITE && u->verify)
+	{
+		u->phase = MULTI_CS_VERIFY;
+		return true;
+	}
+
+	u->passed = true;
+	u->phase = MULTI_CS_DONE;
+
+	return true;
+}
+
+static void MultiCsShowStatus(multi_cs_unit *units, unsigned int count)
+{
+	unsigned int i;
+
+	printf("\r");
+
+	for (i = 0; i < count; i++)
+	{
+		if (units[i].phase == MULTI_CS_DONE)
+			printf("[CS%u] %-4s ", units[i].flash.cs, units[i].passed ? "ok" : "FAIL");
+		else
+			printf("[CS%u] %c%3d%% ", units[i].flash.cs, multi_cs_phase_tag[units[i].phase],
+				(int) ((unsigned long long) units[i].pos * 100 / units[i].len));
+	}
+
+	fflush(stdout);
+}
+
+static bool MultiCsPrepare(multi_cs_unit *u, ch341_device *dev, unsigned int cs)
+{
+	SpiFlashInit(&u->flash, dev, cs);
+	u->flash.quiet = true;
+
+	if (!SpiFlashProbe(&u->flash))
+	{
+		snprintf(u->error, sizeof (u->error), "probe failed");
+		return false;
+	}
+
+	u->image = LoadImageFile(u->filename, &u->len);
+	if (!u->image)
+	{
+		snprintf(u->error, sizeof (u->error), "unable to read %s", u->filename);
+		return false;
+	}
+
+	if (!u->len)
+	{
+		snprintf(u->error, sizeof (u->error), "nothing to write");
+		return false;
+	}
+
+	if (u->addr + u->len > SpiFlashGetSize(&u->flash))
+	{
+		snprintf(u->error, sizeof (u->error), "image exceeds %uKiB flash", SpiFlashGetSize(&u->flash) >> 10);
+		return false;
+	}
+
+	if (u->erase && (u->addr % u->flash.erase_size || (u->addr + u->len) % u->flash.erase_size))
+	{
+		snprintf(u->error, sizeof (u->error), "image is not on erase boundaries");
+		return false;
+	}
+
+	u->encoded = new unsigned char[u->len];
+	CH341EncodeSPI(u->image, u->encoded, u->len);
+
+	if (!SpiFlashBegin(&u->flash))
+	{
+		snprintf(u->error, sizeof (u->error), "failed to set address mode");
+		return false;
+	}
+
+	u->phase = u->erase ? MULTI_CS_ERASE : MULTI_CS_WRITE;
+
+	return true;
+}
+
+int MultiCsProgram(ch341_device *dev, const char *const filenames[CH341_MAX_CS], unsigned int addr, bool need_erase,
+	bool need_verify)
+{
+	multi_cs_unit units[CH341_MAX_CS];
+	unsigned int jedec_ids[CH341_MAX_CS];
+	unsigned int i, cs, mask, count = 0, active, passed = 0;
+	unsigned long long bytes = 0;
+	multi_cs_clock::time_point start, now, wake, last_status;
+	bool issued, busy;
+	double wall;
+
+	mask = MultiCsDetect(dev, jedec_ids);
+
+	for (cs = 0; cs < CH341_MAX_CS; cs++)
+	{
+		if (!filenames[cs])
+			continue;
+
+		multi_cs_unit *u = &units[count++];
+
+		memset(u->error, 0, sizeof (u->error));
+		u->filename = filenames[cs];
+		u->image = NULL;
+		u->encoded = NULL;
+		u->addr = addr;
+		u->len = 0;
+		u->erase = need_erase;
+		u->verify = need_verify;
+		u->phase = MULTI_CS_DONE;
+		u->pos = 0;
+		u->busy = false;
+		u->passed = false;
+		u->seconds = 0;
+
+		if (!(mask & (1 << cs)))
+		{
+			SpiFlashInit(&u->flash, dev, cs);
+			snprintf(u->error, sizeof (u->error), "no flash found");
+			continue;
+		}
+
+		MultiCsPrepare(u, dev, cs);
+	}
+
+	if (!count)
+	{
+		fprintf(stderr, "Error: please specify a file for at least one CS line.\n");
+		return -EINVAL;
+	}
+
+	printf("%u chip(s), %s%swriting at %xh ...\n", count, need_erase ? "erasing, " : "", need_verify ? "verifying, " : "",
+		addr);
+
+	start = last_status = multi_cs_clock::now();
+
+	/*
+	 * One thread drives all chips, the USB link carries a single transfer
+	 * at a time anyway. Any chip which is not busy gets its next step, busy
+	 * ones are polled once their step may have finished, and only when all
+	 * of them are still busy does the loop sleep.
+	 */
+	do
+	{
+		active = 0;
+		issued = false;
+		wake = multi_cs_clock::time_point::max();
+
+		for (i = 0; i < count; i++)
+		{
+			multi_cs_unit *u = &units[i];
+
+			if (u->phase == MULTI_CS_DONE)
+				continue;
+
+			active++;
+			now = multi_cs_clock::now();
+
+			if (u->busy)
+			{
+				if (now < u->poll_at)
+				{
+					if (u->poll_at < wake)
+						wake = u->poll_at;
+					continue;
+				}
+
+				if (!SpiFlashIsBusy(&u->flash, &busy))
+				{
+					snprintf(u->error, sizeof (u->error), "failed to read status");
+					MultiCsFinish(u, start);
+					continue;
+				}
+
+				if (busy)
+				{
+					u->poll_at = now + std::chrono::microseconds(u->repoll_us);
+					if (u->poll_at < wake)
+						wake = u->poll_at;
+					continue;
+				}
+
+				u->busy = false;
+			}
+
+			issued = true;
+
+			if (!MultiCsStep(u) || u->phase == MULTI_CS_DONE)
+				MultiCsFinish(u, start);
+		}
+
+		now = multi_cs_clock::now();
+
+		if (now - last_status >= std::chrono::milliseconds(MULTI_CS_STATUS_INTERVAL_MS))
+		{
+			MultiCsShowStatus(units, count);
+			last_status = now;
+		}
+
+		if (active && !issued && wake > now && wake != multi_cs_clock::time_point::max())
+			std::this_thread::sleep_until(wake);
+	} while (active);
+
+	wall = std::chrono::duration<double>(multi_cs_clock::now() - start).count();
+
+	MultiCsShowStatus(units, count);
+	printf("\n\n");
+
+	for (i = 0; i < count; i++)
+	{
+		multi_cs_unit *u = &units[i];
+
+		printf("[CS%u] %-24s %-4s %7.2fs  %s\n", u->flash.cs, u->flash.id ? u->flash.id->model : "-",
+			u->passed ? "PASS" : "FAIL", u->seconds, u->error);
+
+		if (u->passed)
+		{
+			passed++;
+			bytes += u->len;
+		}
+
+		delete[] u->encoded;
+		delete[] u->image;
+	}
+
+	printf("\n%u/%u passed, %.2fs total, %.2fKiB/s aggregate\n", passed, count, wall,
+		wall > 0 ? (double) bytes / 1024 / wall : 0.0);
+
+	return passed == count ? 0 : -EFAULT;
+}
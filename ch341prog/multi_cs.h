@@ -0,0 +1,20 @@
+#ifndef _MULTI_CS_H_
+#define _MULTI_CS_H_
+
+#include "ch341.h"
+
+/* RDID of every CS line in one batched transfer, returns a mask of the lines with a chip */
+unsigned int MultiCsDetect(ch341_device *dev, unsigned int jedec_ids[CH341_MAX_CS]);
+
+/* Probes and lists the chips on all CS lines */
+int MultiCsList(ch341_device *dev);
+
+/*
+ * Programs filenames[cs] into the chip on each CS line, NULL skips a line.
+ * Erases and page programs of the chips are interleaved: while one chip is
+ * busy the others are served, instead of waiting for each in turn.
+ */
+int MultiCsProgram(ch341_device *dev, const char *const filenames[CH341_MAX_CS], unsigned int addr, bool need_erase,
+	bool need_verify);
+
+#endif /* _MULTI_CS_H_ */
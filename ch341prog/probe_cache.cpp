@@ -0,0 +1,272 @@
+#include "stdafx.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <mutex>
+
+#if defined(_MSC_VER) || defined(_WIN32)
+#include <direct.h>
+#define mkdir(_path, _mode)			_mkdir(_path)
+#define PATH_SEPARATOR				'\\'
+#else
+#define PATH_SEPARATOR				'/'
+#endif
+
+#include "probe_cache.h"
+
+/*
+ * One entry per line:
+ *   <location> <jedec> <ext> <uid|-> <db_hash> "<model>" <size> <flags> <sfdp> <page> <pp> <ce>
+ *   <addr_width> <4b> <read_op> <program_op> <addr4b_enter> <n> <size>:<opcode>:<typ_ms> ...
+ * Lines are rewritten as a whole on every store, most recent first.
+ */
+#define PROBE_CACHE_LINE_LENGTH		512
+#define PROBE_CACHE_PATH_LENGTH		1024
+
+static bool probe_cache_disabled;
+static std::mutex probe_cache_lock;
+
+void ProbeCacheDisable(void)
+{
+	probe_cache_disabled = true;
+}
+
+bool ProbeCacheEnabled(void)
+{
+	return !probe_cache_disabled && !getenv("CH341PROG_NO_CACHE");
+}
+
+static bool ProbeCacheDir(char *path, unsigned int size)
+{
+	const char *base;
+
+#ifdef _WIN32
+	if (!(base = getenv("LOCALAPPDATA")))
+		return false;
+
+	snprintf(path, size, "%s\\ch341prog", base);
+#else
+	if ((base = getenv("XDG_CACHE_HOME")) && *base)
+		snprintf(path, size, "%s/ch341prog", base);
+	else if ((base = getenv("HOME")) && *base)
+		snprintf(path, size, "%s/.cache/ch341prog", base);
+	else
+		return false;
+#endif
+
+	return true;
+}
+
+static bool ProbeCachePath(char *path, unsigned int size)
+{
+	char dir[PROBE_CACHE_PATH_LENGTH - 16];
+
+	if (!ProbeCacheEnabled())
+		return false;
+
+	if (!ProbeCacheDir(dir, sizeof (dir)))
+		return false;
+
+	snprintf(path, size, "%s/probe-v%d", dir, PROBE_CACHE_VERSION);
+
+	return true;
+}
+
+static void ProbeCacheFormatUid(const probe_cache_entry *entry, char *str)
+{
+	unsigned int i;
+
+	if (!entry->uid_len)
+	{
+		strcpy(str, "-");
+		return;
+	}
+
+	for (i = 0; i < entry->uid_len; i++)
+		sprintf(str + i * 2, "%02x", entry->uid[i]);
+}
+
+static bool ProbeCacheSameKey(const probe_cache_entry *a, const probe_cache_entry *b)
+{
+	return !strcmp(a->location, b->location) && a->jedec_id == b->jedec_id && a->ext_id == b->ext_id &&
+		a->uid_len == b->uid_len && !memcmp(a->uid, b->uid, a->uid_len) && a->db_hash == b->db_hash;
+}
+
+static bool ProbeCacheParseLine(char *line, probe_cache_entry *entry)
+{
+	char uid[UNIQUE_ID_LENGTH * 2 + 2];
+	unsigned int i, val, read_op, program_op, addr_width, use_4b, opcode;
+	int n;
+
+	memset(entry, 0, sizeof (*entry));
+
+	if (sscanf(line, "%31s %x %x %17s %x \"%31[^\"]\" %u %x %u %u %u %u %u %u %x %x %x %u%n",
+		entry->location, &entry->jedec_id, &entry->ext_id, uid, &entry->db_hash, entry->model,
+		&entry->id.size, &entry->id.flags, &entry->sfdp, &entry->page_size, &entry->id.page_prog_us,
+		&entry->chip_erase_ms, &addr_width, &use_4b, &read_op, &program_op, &entry->addr4b_enter,
+		&entry->num_erase_types, &n) != 18)
+		return false;
+
+	line += n;
+
+	if (strcmp(uid, "-"))
+	{
+		for (i = 0; uid[i * 2] && i < UNIQUE_ID_LENGTH; i++)
+		{
+			if (sscanf(uid + i * 2, "%2x", &val) != 1)
+				return false;
+			entry->uid[i] = val;
+		}
+
+		entry->uid_len = i;
+	}
+
+	if (!entry->num_erase_types || entry->num_erase_types > PROBE_CACHE_MAX_ERASE_TYPES)
+		return false;
+
+	for (i = 0; i < entry->num_erase_types; i++)
+	{
+		if (sscanf(line, " %u:%x:%u%n", &entry->erase[i].size, &opcode, &entry->erase[i].typ_ms, &n) != 3)
+			return false;
+
+		entry->erase[i].opcode = opcode;
+		line += n;
+	}
+
+	if (addr_width != 3 && addr_width != 4)
+		return false;
+
+	entry->addr_width = addr_width;
+	entry->use_4b_opcodes = use_4b;
+	entry->read_op = read_op;
+	entry->program_op = program_op;
+
+	entry->id.model = entry->model;
+	entry->id.jedec_id = entry->jedec_id;
+	entry->id.ext_id = entry->ext_id;
+	entry->id.page_size = entry->page_size;
+	entry->id.chip_erase_ms = entry->chip_erase_ms;
+
+	return true;
+}
+
+static void ProbeCacheWriteLine(FILE *f, const probe_cache_entry *entry)
+{
+	char uid[UNIQUE_ID_LENGTH * 2 + 1];
+	unsigned int i;
+
+	ProbeCacheFormatUid(entry, uid);
+
+	fprintf(f, "%s %06x %04x %s %08x \"%s\" %u %x %u %u %u %u %u %u %02x %02x %x %u",
+		entry->location, entry->jedec_id, entry->ext_id, uid, entry->db_hash, entry->model,
+		entry->id.size, entry->id.flags, entry->sfdp, entry->page_size, entry->id.page_prog_us,
+		entry->chip_erase_ms, entry->addr_width, entry->use_4b_opcodes, entry->read_op, entry->program_op,
+		entry->addr4b_enter, entry->num_erase_types);
+
+	for (i = 0; i < entry->num_erase_types; i++)
+		fprintf(f, " %u:%02x:%u", entry->erase[i].size, entry->erase[i].opcode, entry->erase[i].typ_ms);
+
+	fprintf(f, "\n");
+}
+
+bool ProbeCacheLookup(probe_cache_entry *entry)
+{
+	char path[PROBE_CACHE_PATH_LENGTH], line[PROBE_CACHE_LINE_LENGTH];
+	probe_cache_entry tmp;
+	FILE *f;
+
+	if (!ProbeCachePath(path, sizeof (path)))
+		return false;
+
+	std::lock_guard<std::mutex> lk(probe_cache_lock);
+
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+
+	while (fgets(line, sizeof (line), f))
+	{
+		if (!ProbeCacheParseLine(line, &tmp))
+			continue;
+
+		if (ProbeCacheSameKey(&tmp, entry))
+		{
+			fclose(f);
+			*entry = tmp;
+			entry->id.model = entry->model;
+			return true;
+		}
+	}
+
+	fclose(f);
+
+	return false;
+}
+
+bool ProbeCacheStore(const probe_cache_entry *entry)
+{
+	char path[PROBE_CACHE_PATH_LENGTH], tmp_path[PROBE_CACHE_PATH_LENGTH + 8];
+	char line[PROBE_CACHE_LINE_LENGTH], dir[PROBE_CACHE_PATH_LENGTH], *sep;
+	probe_cache_entry old;
+	unsigned int kept = 1;
+	FILE *f, *out;
+
+	if (!ProbeCachePath(path, sizeof (path)))
+		return false;
+
+	std::lock_guard<std::mutex> lk(probe_cache_lock);
+
+	/* A missing cache directory is created once, other failures just skip caching */
+	ProbeCacheDir(dir, sizeof (dir));
+	if (mkdir(dir, 0700) && errno == ENOENT && (sep = strrchr(dir, PATH_SEPARATOR)))
+	{
+		*sep = 0;
+		mkdir(dir, 0700);
+		*sep = PATH_SEPARATOR;
+		mkdir(dir, 0700);
+	}
+
+	snprintf(tmp_path, sizeof (tmp_path), "%s.tmp", path);
+
+	out = fopen(tmp_path, "w");
+	if (!out)
+		return false;
+
+	ProbeCacheWriteLine(out, entry);
+
+	f = fopen(path, "r");
+	if (f)
+	{
+		while (fgets(line, sizeof (line), f) && kept < PROBE_CACHE_MAX_ENTRIES)
+		{
+			if (!ProbeCacheParseLine(line, &old) || ProbeCacheSameKey(&old, entry))
+				continue;
+
+			ProbeCacheWriteLine(out, &old);
+			kept++;
+		}
+
+		fclose(f);
+	}
+
+	if (fclose(out))
+	{
+		remove(tmp_path);
+		return false;
+	}
+
+#ifdef _WIN32
+	remove(path);
+#endif
+
+	if (rename(tmp_path, path))
+	{
+		remove(tmp_path);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,53 @@
+#ifndef _PROBE_CACHE_H_
+#define _PROBE_CACHE_H_
+
+#include "spi_flash.h"
+
+#define PROBE_CACHE_VERSION			3
+#define PROBE_CACHE_MAX_ENTRIES		64
+#define PROBE_CACHE_MAX_ERASE_TYPES	4
+
+#define UNIQUE_ID_LENGTH			8
+
+typedef struct _probe_cache_erase
+{
+	unsigned int size;
+	unsigned char opcode;
+	unsigned int typ_ms;
+} probe_cache_erase;
+
+typedef struct _probe_cache_entry
+{
+	/* Key: where the programmer sits and which chip is on it */
+	char location[32];
+	unsigned int jedec_id;
+	unsigned int ext_id;
+	unsigned char uid[UNIQUE_ID_LENGTH];
+	unsigned int uid_len;
+	unsigned int db_hash;			/* of the chip definitions loaded, see spi_flash_db_hash */
+
+	/* Resolved chip description, id.model points into model[] */
+	spi_flash_id id;
+	char model[32];
+	unsigned int sfdp;
+
+	unsigned int page_size;
+	unsigned int chip_erase_ms;
+	unsigned char addr_width;
+	unsigned char use_4b_opcodes;
+	unsigned char read_op;
+	unsigned char program_op;
+	unsigned int addr4b_enter;
+
+	unsigned int num_erase_types;
+	probe_cache_erase erase[PROBE_CACHE_MAX_ERASE_TYPES];
+} probe_cache_entry;
+
+void ProbeCacheDisable(void);
+bool ProbeCacheEnabled(void);
+
+/* Fills the entry in if one matches its key fields */
+bool ProbeCacheLookup(probe_cache_entry *entry);
+bool ProbeCacheStore(const probe_cache_entry *entry);
+
+#endif /* _PROBE_CACHE_H_ */
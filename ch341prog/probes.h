@@ -0,0 +1,78 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * USDT probes, provider ch341prog, for bpftrace or perf, e.g.
+ *
+ *   bpftrace -e 'usdt:./ch341prog:ch341prog:usb_complete { @us[arg0] = hist(arg4); }'
+ *
+ * Built in where <sys/sdt.h> is found (systemtap-sdt-dev), each is then a
+ * nop until a tracer attaches. Elsewhere, or with CH341PROG_NO_SDT, they
+ * are left out and their arguments are not even evaluated. Every probe has
+ * a semaphore the tracer counts up while attached, latencies are only
+ * timed while PROBE_ENABLED says one is listening.
+ *
+ *   usb_submit     dir (0 out, 1 in), len, timeout ms
+ *   usb_complete   dir, len, transferred, libusb result, latency us
+ *   cs_assert      cs
+ *   cs_deassert    cs
+ *   flash_poll     status register, poll number within the wait
+ *   erase_start    addr, len
+ *   erase_end      addr, len, ok, latency us
+ *   program_start  addr, len
+ *   program_end    addr, len, ok, latency us
+ *   read_chunk     addr, len, latency us
+ */
+
+#if !defined(CH341PROG_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES			1
+#include <sys/sdt.h>
+#define CH341PROG_SDT				1
+#endif
+#endif
+
+#ifdef CH341PROG_SDT
+
+#include "profile.h"
+
+#define PROBE_SEMAPHORE(name)						ch341prog_##name##_semaphore
+#define PROBE_ENABLED(name)							__builtin_expect(PROBE_SEMAPHORE(name), 0)
+/* Starts timing a latency for the probe, 0 while nothing listens */
+#define PROBE_START(name)							(PROBE_ENABLED(name) ? ProfileNowUs() : 0ULL)
+#define PROBE_SINCE(start)							((start) ? ProfileNowUs() - (start) : 0ULL)
+
+extern "C"
+{
+extern volatile unsigned short ch341prog_usb_submit_semaphore;
+extern volatile unsigned short ch341prog_usb_complete_semaphore;
+extern volatile unsigned short ch341prog_cs_assert_semaphore;
+extern volatile unsigned short ch341prog_cs_deassert_semaphore;
+extern volatile unsigned short ch341prog_flash_poll_semaphore;
+extern volatile unsigned short ch341prog_erase_start_semaphore;
+extern volatile unsigned short ch341prog_erase_end_semaphore;
+extern volatile unsigned short ch341prog_program_start_semaphore;
+extern volatile unsigned short ch341prog_program_end_semaphore;
+extern volatile unsigned short ch341prog_read_chunk_semaphore;
+}
+
+#define PROBE1(name, a)								DTRACE_PROBE1(ch341prog, name, a)
+#define PROBE2(name, a, b)							DTRACE_PROBE2(ch341prog, name, a, b)
+#define PROBE3(name, a, b, c)						DTRACE_PROBE3(ch341prog, name, a, b, c)
+#define PROBE4(name, a, b, c, d)					DTRACE_PROBE4(ch341prog, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e)					DTRACE_PROBE5(ch341prog, name, a, b, c, d, e)
+
+#else
+
+#define PROBE_ENABLED(name)							0
+#define PROBE_START(name)							0ULL
+#define PROBE_SINCE(start)							((void) (start), 0ULL)
+#define PROBE1(name, a)								do { if (0) { (void) (a); } } while (0)
+#define PROBE2(name, a, b)							do { if (0) { (void) (a); (void) (b); } } while (0)
+#define PROBE3(name, a, b, c)						do { if (0) { (void) (a); (void) (b); (void) (c); } } while (0)
+#define PROBE4(name, a, b, c, d)					do { if (0) { (void) (a); (void) (b); (void) (c); (void) (d); } } while (0)
+#define PROBE5(name, a, b, c, d, e)					do { if (0) { (void) (a); (void) (b); (void) (c); (void) (d); (void) (e); } } while (0)
+
+#endif
+
+#endif /* _PROBES_H_ */
@@ -0,0 +1,207 @@
+#include "stdafx.h"
+
+#include <string.h>
+#include <errno.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "profile.h"
+
+#define PROFILE_PATH_LENGTH			1024
+
+typedef struct _profile_event
+{
+	unsigned long long start;
+	unsigned int dur;
+	unsigned short phase;
+	unsigned short tid;
+} profile_event;
+
+static const char *profile_names[PROF_PHASES] =
+{
+	"probe", "addr_mode", "erase", "program", "read", "poll", "usb_out", "usb_in", "file_io"
+};
+
+static const char *profile_categories[PROF_PHASES] =
+{
+	"flash", "flash", "flash", "flash", "flash", "flash", "usb", "usb", "file"
+};
+
+static std::atomic<bool> profile_active;
+static unsigned long long profile_start;
+static char profile_trace_path[PROFILE_PATH_LENGTH];
+
+static std::atomic<unsigned long long> profile_count[PROF_PHASES];
+static std::atomic<unsigned long long> profile_total[PROF_PHASES];
+
+/* Spans for the trace, only kept when one was asked for */
+static std::mutex profile_lock;
+static std::vector<profile_event> profile_events;
+static unsigned long long profile_dropped;
+
+static std::atomic<unsigned int> profile_threads;
+static thread_local unsigned int profile_tid;
+
+unsigned long long ProfileNowUs(void)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool ProfileStart(const char *trace_path)
+{
+	unsigned int i;
+	FILE *f;
+
+	/* Better to find out now than after a long run */
+	if (trace_path)
+	{
+		f = fopen(trace_path, "w");
+		if (!f)
+		{
+			Message(MSG_ERROR, "Error: unable to create trace %s! error %d\n", trace_path, errno);
+			return false;
+		}
+
+		fclose(f);
+	}
+
+	snprintf(profile_trace_path, sizeof (profile_trace_path), "%s", trace_path ? trace_path : "");
+
+	for (i = 0; i < PROF_PHASES; i++)
+	{
+		profile_count[i] = 0;
+		profile_total[i] = 0;
+	}
+
+	profile_events.clear();
+	profile_dropped = 0;
+
+	profile_start = ProfileNowUs();
+	profile_active = true;
+
+	return true;
+}
+
+void ProfileBegin(profile_span *span, unsigned int phase)
+{
+	if (!profile_active)
+	{
+		span->phase = PROF_PHASES;
+		return;
+	}
+
+	span->phase = phase;
+	span->start = ProfileNowUs();
+}
+
+void ProfileEnd(profile_span *span)
+{
+	profile_event ev;
+	unsigned long long dur;
+
+	if (span->phase >= PROF_PHASES || !profile_active)
+		return;
+
+	dur = ProfileNowUs() - span->start;
+
+	profile_count[span->phase]++;
+	profile_total[span->phase] += dur;
+
+	if (!profile_trace_path[0])
+		return;
+
+	/* Trace viewers tell threads apart by number, keep them small */
+	if (!profile_tid)
+		profile_tid = ++profile_threads;
+
+	ev.start = span->start - profile_start;
+	ev.dur = (unsigned int) dur;
+	ev.phase = (unsigned short) span->phase;
+	ev.tid = (unsigned short) profile_tid;
+
+	std::lock_guard<std::mutex> lock(profile_lock);
+
+	if (profile_events.size() < PROFILE_TRACE_MAX_EVENTS)
+		profile_events.push_back(ev);
+	else
+		profile_dropped++;
+}
+
+/* Chrome trace event format, complete ("X") events with microsecond timestamps */
+static bool ProfileWriteTrace(const char *path)
+{
+	size_t i;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f)
+	{
+		Message(MSG_ERROR, "Error: unable to create trace %s! error %d\n", path, errno);
+		return false;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ch341prog\"}}");
+
+	for (i = 0; i < profile_events.size(); i++)
+	{
+		const profile_event *ev = &profile_events[i];
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%u}",
+			profile_names[ev->phase], profile_categories[ev->phase], ev->tid, ev->start, ev->dur);
+	}
+
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f))
+	{
+		Message(MSG_ERROR, "Error: failed to write trace %s! error %d\n", path, errno);
+		return false;
+	}
+
+	Message(MSG_INFO, "Trace of %u spans written to %s\n", (unsigned int) profile_events.size(), path);
+
+	if (profile_dropped)
+		Message(MSG_WARNING, "Warning: trace full, %llu later spans are only in the totals\n", profile_dropped);
+
+	return true;
+}
+
+void ProfileStop(void)
+{
+	unsigned long long wall, count, total;
+	unsigned int i;
+
+	if (!profile_active)
+		return;
+
+	profile_active = false;
+	wall = ProfileNowUs() - profile_start;
+
+	Message(MSG_INFO, "\nProfile, %.2fs wall time:\n", wall / 1e6);
+	Message(MSG_INFO, "  %-10s %10s %11s %11s %7s\n", "phase", "spans", "total", "mean", "wall");
+
+	for (i = 0; i < PROF_PHASES; i++)
+	{
+		count = profile_count[i];
+		total = profile_total[i];
+
+		if (!count)
+			continue;
+
+		Message(MSG_INFO, "  %-10s %10llu %10.3fs %9.3fms %6.1f%%\n", profile_names[i], count, total / 1e6,
+			total / 1e3 / count, wall ? total * 100.0 / wall : 0.0);
+	}
+
+	Message(MSG_INFO, "Spans nest: USB and poll time is also part of the erase, program or read around it.\n");
+
+	if (profile_trace_path[0])
+		ProfileWriteTrace(profile_trace_path);
+
+	profile_events.clear();
+	profile_events.shrink_to_fit();
+}
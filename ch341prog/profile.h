@@ -0,0 +1,55 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+/* Phases of a run timed by the profiler, spans nest (USB transfers within a page program, ...) */
+#define PROF_PROBE					0
+#define PROF_ADDR_MODE				1	/* 3/4-byte address mode switch */
+#define PROF_ERASE					2	/* one erase block, command and wait */
+#define PROF_PROGRAM				3	/* one page, command and wait */
+#define PROF_READ					4	/* one read chunk */
+#define PROF_POLL					5	/* waiting for a program or erase to finish */
+#define PROF_USB_OUT				6
+#define PROF_USB_IN					7
+#define PROF_FILE_IO				8
+#define PROF_PHASES					9
+
+#define PROFILE_TRACE_MAX_EVENTS	(2 << 20)	/* later spans are only added up */
+
+/* Monotonic wall clock in microseconds, from an arbitrary start */
+unsigned long long ProfileNowUs(void);
+
+/*
+ * Spans are only recorded between Start and Stop, elsewhere they cost a
+ * flag test. Stop prints the totals per phase and, if Start was given a
+ * trace path, writes every span there in Chrome trace event format (for
+ * chrome://tracing or Perfetto).
+ */
+bool ProfileStart(const char *trace_path);
+void ProfileStop(void);
+
+typedef struct _profile_span
+{
+	unsigned int phase;
+	unsigned long long start;
+} profile_span;
+
+void ProfileBegin(profile_span *span, unsigned int phase);
+void ProfileEnd(profile_span *span);
+
+/* Times the enclosing block, however it is left */
+struct profile_scope
+{
+	profile_span span;
+
+	profile_scope(unsigned int phase)
+	{
+		ProfileBegin(&span, phase);
+	}
+
+	~profile_scope()
+	{
+		ProfileEnd(&span);
+	}
+};
+
+#endif /* _PROFILE_H_ */
@@ -0,0 +1,531 @@
+#include "stdafx.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "serprog.h"
+
+#ifdef _WIN32
+
+int SerprogServe(ch341_device *dev, const char *address)
+{
+	fprintf(stderr, "Error: serprog server is not available on this platform.\n");
+	return -ENOSYS;
+}
+
+#else
+
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+
+#define SERPROG_PGMNAME				"ch341prog"
+#define SERPROG_POLL_MS				500
+
+/* Largest O_SPIOP payload each way, the whole op has to fit in the buffers */
+#define SERPROG_MAX_LENGTH			(SERPROG_BUFFER_SIZE - 16)
+
+#define SPIOP_HEADER_LENGTH			7
+
+typedef struct _serprog_session
+{
+	ch341_device *dev;
+	int fd;
+	unsigned int cs;
+
+	unsigned char in[SERPROG_BUFFER_SIZE];
+	unsigned int in_len;
+	unsigned int in_pos;
+
+	/* Replies are collected and only sent once the client has nothing more queued */
+	unsigned char out[SERPROG_BUFFER_SIZE];
+	unsigned int out_len;
+
+	unsigned long long ops;
+	unsigned long long batched;
+} serprog_session;
+
+static std::atomic<bool> serprog_stop;
+
+static void SerprogSignal(int sig)
+{
+	serprog_stop = true;
+}
+
+static inline unsigned int SerprogGet24(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16;
+}
+
+static bool SerprogFlush(serprog_session *s)
+{
+	unsigned int pos = 0;
+	ssize_t n;
+
+	while (pos < s->out_len)
+	{
+		n = send(s->fd, s->out + pos, s->out_len - pos, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+
+		pos += n;
+	}
+
+	s->out_len = 0;
+
+	return true;
+}
+
+/* Room for len more reply bytes, flushing what is pending if needed */
+static bool SerprogReserve(serprog_session *s, unsigned int len)
+{
+	if (s->out_len + len <= sizeof (s->out))
+		return true;
+
+	return SerprogFlush(s);
+}
+
+static void SerprogPut(serprog_session *s, const void *data, unsigned int len)
+{
+	memcpy(s->out + s->out_len, data, len);
+	s->out_len += len;
+}
+
+static void SerprogPutByte(serprog_session *s, unsigned char val)
+{
+	s->out[s->out_len++] = val;
+}
+
+static void SerprogPutLE(serprog_session *s, unsigned int val, unsigned int bytes)
+{
+	while (bytes--)
+	{
+		SerprogPutByte(s, val & 0xff);
+		val >>= 8;
+	}
+}
+
+/* Full length of the command at p, 0 if not all of it has arrived yet */
+static unsigned int SerprogCommandLength(const unsigned char *p, unsigned int avail)
+{
+	if (!avail)
+		return 0;
+
+	switch (p[0])
+	{
+	case S_CMD_S_BUSTYPE:
+	case S_CMD_S_SPI_CS:
+		return avail >= 2 ? 2 : 0;
+
+	case S_CMD_O_SPIOP:
+		if (avail < SPIOP_HEADER_LENGTH)
+			return 0;
+
+		/* Never completes, the session gives up on it */
+		if (SerprogGet24(p + 1) > SERPROG_MAX_LENGTH)
+			return SPIOP_HEADER_LENGTH;
+
+		return avail >= SPIOP_HEADER_LENGTH + SerprogGet24(p + 1) ? SPIOP_HEADER_LENGTH + SerprogGet24(p + 1) : 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Ops which only read are safe to run as a batch: a batched op clocks a
+ * whole packet while CS is held, and the extra bytes merely read on.
+ */
+static bool SerprogBatchable(const unsigned char *p)
+{
+	unsigned int slen = SerprogGet24(p + 1), rlen = SerprogGet24(p + 4);
+
+	if (!slen || slen + rlen > CH341_PACKET_LENGTH - 1)
+		return false;
+
+	switch (p[SPIOP_HEADER_LENGTH])
+	{
+	case 0x03:	/* READ */
+	case 0x0b:	/* FAST_READ */
+	case 0x05:	/* RDSR */
+	case 0x15:	/* RDSR3 */
+	case 0x35:	/* RDSR2 */
+	case 0x4b:	/* READ_UID */
+	case 0x5a:	/* READ_SFDP */
+	case 0x90:	/* REMS */
+	case 0x9f:	/* RDID */
+		return true;
+	}
+
+	return false;
+}
+
+static void SerprogSpiOpBatch(serprog_session *s)
+{
+	ch341_spi_batch ops[CH341_BATCH_MAX_OPS];
+	unsigned char data[CH341_BATCH_MAX_OPS][CH341_PACKET_LENGTH];
+	unsigned int n = 0, len, i;
+	unsigned char *p;
+
+	if (!SerprogReserve(s, CH341_BATCH_MAX_OPS * CH341_PACKET_LENGTH))
+		return;
+
+	/* Gather the batchable ops which follow back to back in what has arrived */
+	while (n < CH341_BATCH_MAX_OPS)
+	{
+		p = s->in + s->in_pos;
+		len = SerprogCommandLength(p, s->in_len - s->in_pos);
+
+		if (!len || p[0] != S_CMD_O_SPIOP || !SerprogBatchable(p))
+			break;
+
+		ops[n].cmd = p + SPIOP_HEADER_LENGTH;
+		ops[n].cmd_len = SerprogGet24(p + 1);
+		ops[n].data = data[n];
+		ops[n].data_len = SerprogGet24(p + 4);
+
+		s->in_pos += len;
+		n++;
+	}
+
+	s->ops += n;
+	if (n > 1)
+		s->batched += n;
+
+	if (!CH341DeviceBatchSPI(s->dev, s->cs, ops, n))
+	{
+		for (i = 0; i < n; i++)
+			SerprogPutByte(s, S_NAK);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		SerprogPutByte(s, S_ACK);
+		SerprogPut(s, ops[i].data, ops[i].data_len);
+	}
+}
+
+static void SerprogSpiOp(serprog_session *s, const unsigned char *p)
+{
+	unsigned int slen = SerprogGet24(p + 1), rlen = SerprogGet24(p + 4);
+
+	s->ops++;
+
+	if (rlen > SERPROG_MAX_LENGTH || !SerprogReserve(s, 1 + rlen))
+	{
+		SerprogPutByte(s, S_NAK);
+		return;
+	}
+
+	if (!CH341DeviceChipSelect(s->dev, s->cs, true))
+		goto failed;
+
+	if (slen && !CH341DeviceWriteSPI(s->dev, p + SPIOP_HEADER_LENGTH, slen))
+		goto failed;
+
+	if (rlen && !CH341DeviceReadSPI(s->dev, s->out + s->out_len + 1, rlen))
+		goto failed;
+
+	if (!CH341DeviceChipSelect(s->dev, s->cs, false))
+		goto failed;
+
+	SerprogPutByte(s, S_ACK);
+	s->out_len += rlen;
+	return;
+
+failed:
+	CH341DeviceChipSelect(s->dev, s->cs, false);
+	SerprogPutByte(s, S_NAK);
+}
+
+static void SerprogCommand(serprog_session *s, const unsigned char *p)
+{
+	unsigned char cmdmap[32], name[16];
+
+	switch (p[0])
+	{
+	case S_CMD_NOP:
+		SerprogPutByte(s, S_ACK);
+		break;
+
+	case S_CMD_Q_IFACE:
+		SerprogPutByte(s, S_ACK);
+		SerprogPutLE(s, SERPROG_IFACE_VERSION, 2);
+		break;
+
+	case S_CMD_Q_CMDMAP:
+		memset(cmdmap, 0, sizeof (cmdmap));
+		cmdmap[S_CMD_NOP / 8] |= 1 << (S_CMD_NOP % 8);
+		cmdmap[S_CMD_Q_IFACE / 8] |= 1 << (S_CMD_Q_IFACE % 8);
+		cmdmap[S_CMD_Q_CMDMAP / 8] |= 1 << (S_CMD_Q_CMDMAP % 8);
+		cmdmap[S_CMD_Q_PGMNAME / 8] |= 1 << (S_CMD_Q_PGMNAME % 8);
+		cmdmap[S_CMD_Q_SERBUF / 8] |= 1 << (S_CMD_Q_SERBUF % 8);
+		cmdmap[S_CMD_Q_BUSTYPE / 8] |= 1 << (S_CMD_Q_BUSTYPE % 8);
+		cmdmap[S_CMD_Q_WRNMAXLEN / 8] |= 1 << (S_CMD_Q_WRNMAXLEN % 8);
+		cmdmap[S_CMD_SYNCNOP / 8] |= 1 << (S_CMD_SYNCNOP % 8);
+		cmdmap[S_CMD_Q_RDNMAXLEN / 8] |= 1 << (S_CMD_Q_RDNMAXLEN % 8);
+		cmdmap[S_CMD_S_BUSTYPE / 8] |= 1 << (S_CMD_S_BUSTYPE % 8);
+		cmdmap[S_CMD_O_SPIOP / 8] |= 1 << (S_CMD_O_SPIOP % 8);
+		cmdmap[S_CMD_S_SPI_CS / 8] |= 1 << (S_CMD_S_SPI_CS % 8);
+
+		SerprogPutByte(s, S_ACK);
+		SerprogPut(s, cmdmap, sizeof (cmdmap));
+		break;
+
+	case S_CMD_Q_PGMNAME:
+		memset(name, 0, sizeof (name));
+		memcpy(name, SERPROG_PGMNAME, strlen(SERPROG_PGMNAME));
+
+		SerprogPutByte(s, S_ACK);
+		SerprogPut(s, name, sizeof (name));
+		break;
+
+	case S_CMD_Q_SERBUF:
+		SerprogPutByte(s, S_ACK);
+		SerprogPutLE(s, SERPROG_BUFFER_SIZE > 0xffff ? 0xffff : SERPROG_BUFFER_SIZE, 2);
+		break;
+
+	case S_CMD_Q_BUSTYPE:
+		SerprogPutByte(s, S_ACK);
+		SerprogPutByte(s, SERPROG_BUS_SPI);
+		break;
+
+	case S_CMD_Q_WRNMAXLEN:
+	case S_CMD_Q_RDNMAXLEN:
+		SerprogPutByte(s, S_ACK);
+		SerprogPutLE(s, SERPROG_MAX_LENGTH, 3);
+		break;
+
+	case S_CMD_SYNCNOP:
+		SerprogPutByte(s, S_NAK);
+		SerprogPutByte(s, S_ACK);
+		break;
+
+	case S_CMD_S_BUSTYPE:
+		SerprogPutByte(s, (p[1] & SERPROG_BUS_SPI) && !(p[1] & ~SERPROG_BUS_SPI) ? S_ACK : S_NAK);
+		break;
+
+	case S_CMD_S_SPI_CS:
+		if (p[1] > 3)
+		{
+			SerprogPutByte(s, S_NAK);
+			break;
+		}
+
+		s->cs = p[1];
+		SerprogPutByte(s, S_ACK);
+		break;
+
+	case S_CMD_O_SPIOP:
+		SerprogSpiOp(s, p);
+		break;
+
+	default:
+		SerprogPutByte(s, S_NAK);
+		break;
+	}
+}
+
+/* Waits for more bytes from the client, false once it is gone or the server stops */
+static bool SerprogReceive(serprog_session *s)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	/* Keep what is left of a partial command at the start of the buffer */
+	memmove(s->in, s->in + s->in_pos, s->in_len - s->in_pos);
+	s->in_len -= s->in_pos;
+	s->in_pos = 0;
+
+	pfd.fd = s->fd;
+	pfd.events = POLLIN;
+
+	while (!serprog_stop)
+	{
+		if (poll(&pfd, 1, SERPROG_POLL_MS) <= 0)
+			continue;
+
+		n = recv(s->fd, s->in + s->in_len, sizeof (s->in) - s->in_len, 0);
+		if (n <= 0)
+			return false;
+
+		s->in_len += n;
+		return true;
+	}
+
+	return false;
+}
+
+static void SerprogSession(serprog_session *s)
+{
+	unsigned char *p;
+	unsigned int len;
+
+	s->in_len = s->in_pos = s->out_len = 0;
+	s->ops = s->batched = 0;
+
+	while (1)
+	{
+		p = s->in + s->in_pos;
+		len = SerprogCommandLength(p, s->in_len - s->in_pos);
+
+		if (!len)
+		{
+			/* Everything that arrived is answered, send it before waiting */
+			if (!SerprogFlush(s) || !SerprogReceive(s))
+				break;
+
+			continue;
+		}
+
+		if (!SerprogReserve(s, SPIOP_HEADER_LENGTH + 32))
+			break;
+
+		if (p[0] == S_CMD_O_SPIOP && SerprogBatchable(p))
+		{
+			SerprogSpiOpBatch(s);
+			continue;
+		}
+
+		/* There is no way to skip a payload larger than the buffer and stay in sync */
+		if (p[0] == S_CMD_O_SPIOP && SerprogGet24(p + 1) > SERPROG_MAX_LENGTH)
+		{
+			fprintf(stderr, "Error: O_SPIOP of %u bytes exceeds the %u bytes limit\n", SerprogGet24(p + 1),
+				SERPROG_MAX_LENGTH);
+			SerprogPutByte(s, S_NAK);
+			SerprogFlush(s);
+			break;
+		}
+
+		SerprogCommand(s, p);
+		s->in_pos += len;
+	}
+}
+
+static int SerprogListen(const char *address, char *unix_path, unsigned int size)
+{
+	struct sockaddr_un su;
+	struct sockaddr_in si;
+	int fd, on = 1;
+
+	unix_path[0] = 0;
+
+	if (!strncmp(address, "tcp:", 4))
+	{
+		memset(&si, 0, sizeof (si));
+		si.sin_family = AF_INET;
+		si.sin_port = htons((unsigned short) strtoul(address + 4, NULL, 10));
+		si.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
+		if (bind(fd, (struct sockaddr *) &si, sizeof (si)) || listen(fd, 1))
+		{
+			fprintf(stderr, "Error: unable to listen on %s, error %d\n", address, errno);
+			close(fd);
+			return -1;
+		}
+
+		return fd;
+	}
+
+	if (!strncmp(address, "unix:", 5))
+		address += 5;
+
+	if (strlen(address) >= sizeof (su.sun_path) || strlen(address) >= size)
+	{
+		fprintf(stderr, "Error: socket path %s is too long\n", address);
+		return -1;
+	}
+
+	memset(&su, 0, sizeof (su));
+	su.sun_family = AF_UNIX;
+	strcpy(su.sun_path, address);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	unlink(address);
+
+	if (bind(fd, (struct sockaddr *) &su, sizeof (su)) || listen(fd, 1))
+	{
+		fprintf(stderr, "Error: unable to listen on %s, error %d\n", address, errno);
+		close(fd);
+		return -1;
+	}
+
+	strcpy(unix_path, address);
+
+	return fd;
+}
+
+int SerprogServe(ch341_device *dev, const char *address)
+{
+	char unix_path[sizeof (((struct sockaddr_un *) 0)->sun_path)];
+	serprog_session *s;
+	struct pollfd pfd;
+	int fd, on = 1;
+
+	fd = SerprogListen(address, unix_path, sizeof (unix_path));
+	if (fd < 0)
+		return -EIO;
+
+	signal(SIGINT, SerprogSignal);
+	signal(SIGTERM, SerprogSignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	s = new serprog_session;
+	s->dev = dev;
+
+	printf("serprog server listening on %s\n", address);
+	fflush(stdout);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (!serprog_stop)
+	{
+		if (poll(&pfd, 1, SERPROG_POLL_MS) <= 0)
+			continue;
+
+		s->fd = accept(fd, NULL, NULL);
+		if (s->fd < 0)
+			continue;
+
+		/* Replies are latency bound, small ones must not wait for Nagle */
+		setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+
+		/* Each client starts out like a freshly plugged in programmer */
+		s->cs = 0;
+
+		printf("Client connected\n");
+		SerprogSession(s);
+		close(s->fd);
+
+		printf("Client disconnected, %llu SPI ops, %llu of them batched\n", s->ops, s->batched);
+		fflush(stdout);
+	}
+
+	delete s;
+	close(fd);
+
+	if (unix_path[0])
+		unlink(unix_path);
+
+	return 0;
+}
+
+#endif
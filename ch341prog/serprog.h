@@ -0,0 +1,34 @@
+#ifndef _SERPROG_H_
+#define _SERPROG_H_
+
+#include "ch341.h"
+
+#define SERPROG_IFACE_VERSION		1
+#define SERPROG_BUFFER_SIZE			0x10000
+
+#define S_ACK						0x06
+#define S_NAK						0x15
+
+#define S_CMD_NOP					0x00
+#define S_CMD_Q_IFACE				0x01
+#define S_CMD_Q_CMDMAP				0x02
+#define S_CMD_Q_PGMNAME				0x03
+#define S_CMD_Q_SERBUF				0x04
+#define S_CMD_Q_BUSTYPE				0x05
+#define S_CMD_SYNCNOP				0x10
+#define S_CMD_Q_WRNMAXLEN			0x08
+#define S_CMD_Q_RDNMAXLEN			0x11
+#define S_CMD_S_BUSTYPE				0x12
+#define S_CMD_O_SPIOP				0x13
+#define S_CMD_S_SPI_CS				0x16
+
+#define SERPROG_BUS_SPI				0x08
+
+/*
+ * Serves the flashrom serprog protocol for the chips on dev, one client at
+ * a time, until SIGINT/SIGTERM. address is unix:<path>, tcp:<port> (bound
+ * to localhost only) or a bare socket path.
+ */
+int SerprogServe(ch341_device *dev, const char *address);
+
+#endif /* _SERPROG_H_ */
@@ -0,0 +1,356 @@
+#include "stdafx.h"
+
+#include <string.h>
+
+#include <mutex>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "sfdp.h"
+
+#define SFDP_HEADER_LENGTH			8
+#define SFDP_PARAM_HEADER_LENGTH	8
+#define SFDP_BFPT_MAX_DWORDS		20
+#define SFDP_MAX_PARAM_HEADERS		16
+
+#define SFDP_CACHE_ENTRIES			16
+
+#define BFPT_DW(_n)					(bfpt[(_n) - 1])
+#define BITS(_v, _hi, _lo)			(((_v) >> (_lo)) & ((1u << ((_hi) - (_lo) + 1)) - 1))
+
+typedef struct _sfdp_cache_entry
+{
+	unsigned int jedec_id;
+	unsigned int ext_id;
+	bool present;
+	sfdp_info info;
+} sfdp_cache_entry;
+
+static sfdp_cache_entry sfdp_cache[SFDP_CACHE_ENTRIES];
+static unsigned int sfdp_cache_count;
+static std::mutex sfdp_cache_lock;
+
+static bool SfdpRead(ch341_device *dev, unsigned int cs, unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	unsigned char op[5];
+
+	op[0] = SPI_CMD_READ_SFDP;
+	op[1] = (addr >> 16) & 0xff;
+	op[2] = (addr >> 8) & 0xff;
+	op[3] = addr & 0xff;
+	op[4] = 0;	/* 8 dummy clocks */
+
+	return SPIDevWriteThenRead(dev, cs, op, sizeof (op), buf, len);
+}
+
+static bool SfdpReadDwords(ch341_device *dev, unsigned int cs, unsigned int addr, unsigned int *dw, unsigned int count)
+{
+	unsigned char buf[SFDP_BFPT_MAX_DWORDS * 4];
+	unsigned int i;
+
+	if (!SfdpRead(dev, cs, addr, buf, count * 4))
+		return false;
+
+	for (i = 0; i < count; i++)
+		dw[i] = buf[i * 4] | (buf[i * 4 + 1] << 8) | (buf[i * 4 + 2] << 16) | ((unsigned int) buf[i * 4 + 3] << 24);
+
+	return true;
+}
+
+/* Typical erase time, BFPT DWORD 10 */
+static unsigned int SfdpEraseTime(unsigned int count, unsigned int units)
+{
+	static const unsigned int unit_ms[4] = { 1, 16, 128, 1000 };
+
+	return (count + 1) * unit_ms[units];
+}
+
+static void SfdpParseBfpt(sfdp_info *info, const unsigned int *bfpt, unsigned int dwords)
+{
+	unsigned int i, j, density, mult, units;
+	sfdp_erase_type tmp;
+
+	/* DWORD 1: address bytes and fast read support */
+	info->addr_mode = BITS(BFPT_DW(1), 18, 17);
+
+	if (BFPT_DW(1) & (1 << 16))
+		info->read_modes |= SFDP_READ_1_1_2;
+	if (BFPT_DW(1) & (1 << 20))
+		info->read_modes |= SFDP_READ_1_2_2;
+	if (BFPT_DW(1) & (1 << 21))
+		info->read_modes |= SFDP_READ_1_4_4;
+	if (BFPT_DW(1) & (1 << 22))
+		info->read_modes |= SFDP_READ_1_1_4;
+
+	/* DWORD 2: density in bits */
+	density = BFPT_DW(2);
+	if (density & 0x80000000)
+	{
+		density &= 0x7fffffff;
+		info->size = (density >= 3 && density < 35) ? 1u << (density - 3) : 0;
+	}
+	else
+	{
+		info->size = (density >> 3) + 1;
+	}
+
+	/* DWORD 5: 2-2-2 and 4-4-4 */
+	if (BFPT_DW(5) & (1 << 0))
+		info->read_modes |= SFDP_READ_2_2_2;
+	if (BFPT_DW(5) & (1 << 4))
+		info->read_modes |= SFDP_READ_4_4_4;
+
+	/* DWORD 8/9: erase types */
+	for (i = 0; i < SFDP_MAX_ERASE_TYPES; i++)
+	{
+		unsigned int dw = BFPT_DW(8 + i / 2) >> ((i % 2) * 16);
+		unsigned int exp = dw & 0xff;
+
+		info->erase[i].size = exp ? 1u << exp : 0;
+		info->erase[i].opcode = (dw >> 8) & 0xff;
+	}
+
+	/* DWORD 10 (JESD216A): typical erase time per type */
+	if (dwords >= 10)
+	{
+		mult = 2 * (BITS(BFPT_DW(10), 3, 0) + 1);
+
+		for (i = 0; i < SFDP_MAX_ERASE_TYPES; i++)
+		{
+			units = BITS(BFPT_DW(10), 10 + i * 7, 9 + i * 7);
+			info->erase[i].typ_ms = SfdpEraseTime(BITS(BFPT_DW(10), 8 + i * 7, 4 + i * 7), units);
+			info->erase[i].max_ms = info->erase[i].typ_ms * mult;
+		}
+	}
+
+	/* DWORD 11: page size, page program and chip erase time */
+	if (dwords >= 11)
+	{
+		static const unsigned int chip_unit_ms[4] = { 16, 256, 4000, 64000 };
+
+		info->page_size = 1u << BITS(BFPT_DW(11), 7, 4);
+		info->page_prog_typ_us = (BITS(BFPT_DW(11), 12, 8) + 1) * ((BFPT_DW(11) & (1 << 13)) ? 64 : 8);
+		info->chip_erase_typ_ms = (BITS(BFPT_DW(11), 28, 24) + 1) * chip_unit_ms[BITS(BFPT_DW(11), 30, 29)];
+	}
+
+	/* DWORD 16 (JESD216B): how to enter 4-byte address mode */
+	if (dwords >= 16)
+	{
+		unsigned int enter = BITS(BFPT_DW(16), 31, 24);
+
+		if (enter & 0x01)
+			info->addr4b_enter |= SFDP_4B_ENTER_B7;
+		if (enter & 0x02)
+			info->addr4b_enter |= SFDP_4B_ENTER_WREN_B7;
+		if (enter & 0x04)
+			info->addr4b_enter |= SFDP_4B_ENTER_EAR;
+		if (enter & 0x08)
+			info->addr4b_enter |= SFDP_4B_ENTER_BANK;
+		if (enter & 0x10)
+			info->addr4b_enter |= SFDP_4B_ENTER_NVCR;
+		if (enter & 0x20)
+			info->addr4b_enter |= SFDP_4B_OPCODES;
+		if (enter & 0x40)
+			info->addr4b_enter |= SFDP_4B_ALWAYS;
+	}
+
+	/* Sort erase types by size, unused types go last */
+	for (i = 0; i < SFDP_MAX_ERASE_TYPES; i++)
+	{
+		for (j = i + 1; j < SFDP_MAX_ERASE_TYPES; j++)
+		{
+			if (info->erase[j].size && (!info->erase[i].size || info->erase[j].size < info->erase[i].size))
+			{
+				tmp = info->erase[i];
+				info->erase[i] = info->erase[j];
+				info->erase[j] = tmp;
+			}
+		}
+
+		if (info->erase[i].size)
+			info->num_erase_types = i + 1;
+	}
+}
+
+static void SfdpParse4bait(sfdp_info *info, const unsigned int *dw, const unsigned int *bfpt_erase_ops)
+{
+	unsigned int i, n, op;
+
+	if (dw[0] & (1 << 0))
+		info->read_4b_op = SPI_CMD_READ_4B;
+
+	if (dw[0] & (1 << 6))
+		info->program_4b_op = SPI_CMD_PAGE_PROG_4B;
+
+	/* Erase opcodes are listed in BFPT order, map them onto the sorted types */
+	for (i = 0; i < SFDP_MAX_ERASE_TYPES; i++)
+	{
+		if (!(dw[0] & (1 << (9 + i))))
+			continue;
+
+		op = (dw[1] >> (i * 8)) & 0xff;
+
+		/* Blank table entries read back as 00h or ffh */
+		if (!op || op == 0xff)
+			continue;
+
+		for (n = 0; n < info->num_erase_types; n++)
+			if (info->erase[n].opcode == bfpt_erase_ops[i])
+				info->erase[n].opcode_4b = op;
+	}
+}
+
+static bool SfdpParse(ch341_device *dev, unsigned int cs, sfdp_info *info)
+{
+	unsigned char hdr[SFDP_HEADER_LENGTH + SFDP_PARAM_HEADER_LENGTH * SFDP_MAX_PARAM_HEADERS];
+	unsigned int bfpt[SFDP_BFPT_MAX_DWORDS], bait[2], bfpt_erase_ops[SFDP_MAX_ERASE_TYPES];
+	unsigned int nph, i, id, ptr, len, bfpt_ptr = 0, bfpt_len = 0, bait_ptr = 0;
+	unsigned char *ph;
+
+	if (!SfdpRead(dev, cs, 0, hdr, SFDP_HEADER_LENGTH))
+		return false;
+
+	if ((hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((unsigned int) hdr[3] << 24)) != SFDP_SIGNATURE)
+		return false;
+
+	info->rev_minor = hdr[4];
+	info->rev_major = hdr[5];
+
+	nph = hdr[6] + 1;
+	if (nph > SFDP_MAX_PARAM_HEADERS)
+		nph = SFDP_MAX_PARAM_HEADERS;
+
+	if (!SfdpRead(dev, cs, SFDP_HEADER_LENGTH, hdr + SFDP_HEADER_LENGTH, nph * SFDP_PARAM_HEADER_LENGTH))
+		return false;
+
+	for (i = 0; i < nph; i++)
+	{
+		ph = hdr + SFDP_HEADER_LENGTH + i * SFDP_PARAM_HEADER_LENGTH;
+
+		id = (ph[7] << 8) | ph[0];
+		len = ph[3];
+		ptr = ph[4] | (ph[5] << 8) | (ph[6] << 16);
+
+		/* The mandatory BFPT comes first, later revisions of it may follow */
+		if (id == SFDP_PARAM_BFPT && len >= 9)
+		{
+			bfpt_ptr = ptr;
+			bfpt_len = len;
+		}
+		else if (id == SFDP_PARAM_4BAIT && len >= 2)
+		{
+			bait_ptr = ptr;
+		}
+	}
+
+	if (!bfpt_len)
+		return false;
+
+	if (bfpt_len > SFDP_BFPT_MAX_DWORDS)
+		bfpt_len = SFDP_BFPT_MAX_DWORDS;
+
+	memset(bfpt, 0, sizeof (bfpt));
+
+	if (!SfdpReadDwords(dev, cs, bfpt_ptr, bfpt, bfpt_len))
+		return false;
+
+	SfdpParseBfpt(info, bfpt, bfpt_len);
+
+	if (!info->size || !info->num_erase_types)
+		return false;
+
+	if (bait_ptr)
+	{
+		for (i = 0; i < SFDP_MAX_ERASE_TYPES; i++)
+			bfpt_erase_ops[i] = (bfpt[7 + i / 2] >> ((i % 2) * 16 + 8)) & 0xff;
+
+		if (SfdpReadDwords(dev, cs, bait_ptr, bait, 2))
+			SfdpParse4bait(info, bait, bfpt_erase_ops);
+	}
+
+	return true;
+}
+
+/* Parsed tables are cached per JEDEC ID, they never differ between parts of one model */
+bool SfdpProbe(ch341_device *dev, unsigned int cs, unsigned int jedec_id, unsigned int ext_id, sfdp_info *info)
+{
+	sfdp_cache_entry *entry;
+	unsigned int i;
+	bool present;
+
+	sfdp_cache_lock.lock();
+
+	for (i = 0; i < sfdp_cache_count; i++)
+	{
+		entry = &sfdp_cache[i];
+
+		if (entry->jedec_id == jedec_id && entry->ext_id == ext_id)
+		{
+			if (entry->present)
+				*info = entry->info;
+
+			sfdp_cache_lock.unlock();
+			return entry->present;
+		}
+	}
+
+	sfdp_cache_lock.unlock();
+
+	memset(info, 0, sizeof (*info));
+	info->jedec_id = jedec_id;
+	info->ext_id = ext_id;
+
+	present = SfdpParse(dev, cs, info);
+
+	sfdp_cache_lock.lock();
+
+	/* Recycle the oldest slot when full, parts rarely change within a run */
+	entry = &sfdp_cache[sfdp_cache_count < SFDP_CACHE_ENTRIES ? sfdp_cache_count++ : 0];
+
+	entry->jedec_id = jedec_id;
+	entry->ext_id = ext_id;
+	entry->present = present;
+	entry->info = *info;
+
+	sfdp_cache_lock.unlock();
+
+	return present;
+}
+
+void SfdpShowInfo(const sfdp_info *info)
+{
+	static const char *addr_modes[4] = { "3-byte", "3/4-byte", "4-byte", "reserved" };
+	static const char *read_modes[6] = { "1-1-2", "1-2-2", "1-1-4", "1-4-4", "2-2-2", "4-4-4" };
+	unsigned int i;
+
+	printf("SFDP: rev %u.%u, %s address", info->rev_major, info->rev_minor, addr_modes[info->addr_mode & 3]);
+
+	if (info->read_4b_op)
+		printf(", 4-byte opcodes");
+
+	printf("\n");
+
+	printf("Erase types:");
+	for (i = 0; i < info->num_erase_types; i++)
+	{
+		printf(" %uKiB(%02xh", info->erase[i].size >> 10, info->erase[i].opcode);
+
+		if (info->erase[i].typ_ms)
+			printf(", %ums", info->erase[i].typ_ms);
+
+		printf(")");
+	}
+	printf("\n");
+
+	if (info->page_size)
+		printf("Page size: %u bytes\n", info->page_size);
+
+	if (info->read_modes)
+	{
+		printf("Fast read modes:");
+		for (i = 0; i < 6; i++)
+			if (info->read_modes & (1 << i))
+				printf(" %s", read_modes[i]);
+		printf("\n");
+	}
+}
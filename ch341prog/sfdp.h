@@ -0,0 +1,72 @@
+#ifndef _SFDP_H_
+#define _SFDP_H_
+
+#include "ch341.h"
+
+#define SFDP_SIGNATURE				0x50444653
+
+#define SFDP_PARAM_BFPT				0xff00
+#define SFDP_PARAM_4BAIT			0xff84
+
+#define SFDP_MAX_ERASE_TYPES		4
+
+/* Address bytes, BFPT DWORD 1 bits 18:17 */
+#define SFDP_ADDR_3B				0
+#define SFDP_ADDR_3B_4B				1
+#define SFDP_ADDR_4B				2
+
+/* Fast read modes, informational only as CH341 is single I/O */
+#define SFDP_READ_1_1_2				0x1
+#define SFDP_READ_1_2_2				0x2
+#define SFDP_READ_1_1_4				0x4
+#define SFDP_READ_1_4_4				0x8
+#define SFDP_READ_2_2_2				0x10
+#define SFDP_READ_4_4_4				0x20
+
+/* 4-byte address mode entry methods, BFPT DWORD 16 bits 31:24 */
+#define SFDP_4B_ENTER_B7			0x1
+#define SFDP_4B_ENTER_WREN_B7		0x2
+#define SFDP_4B_ENTER_EAR			0x4
+#define SFDP_4B_ENTER_BANK			0x8
+#define SFDP_4B_ENTER_NVCR			0x10
+#define SFDP_4B_OPCODES				0x20
+#define SFDP_4B_ALWAYS				0x40
+
+typedef struct _sfdp_erase_type
+{
+	unsigned int size;
+	unsigned char opcode;
+	unsigned char opcode_4b;
+	unsigned int typ_ms;
+	unsigned int max_ms;
+} sfdp_erase_type;
+
+typedef struct _sfdp_info
+{
+	unsigned int jedec_id;
+	unsigned int ext_id;
+
+	unsigned char rev_major;
+	unsigned char rev_minor;
+
+	unsigned int size;
+	unsigned int page_size;
+
+	unsigned int addr_mode;
+	unsigned int addr4b_enter;
+
+	unsigned int read_modes;
+	unsigned char read_4b_op;
+	unsigned char program_4b_op;
+
+	unsigned int num_erase_types;
+	sfdp_erase_type erase[SFDP_MAX_ERASE_TYPES];
+
+	unsigned int page_prog_typ_us;
+	unsigned int chip_erase_typ_ms;
+} sfdp_info;
+
+bool SfdpProbe(ch341_device *dev, unsigned int cs, unsigned int jedec_id, unsigned int ext_id, sfdp_info *info);
+void SfdpShowInfo(const sfdp_info *info);
+
+#endif /* _SFDP_H_ */
@@ -1,624 +1,1644 @@
-#include "stdafx.h"
-
-#include <time.h>
-
-#include "ch341.h"
-#include "spi_flash.h"
-
-#define FLASH_SIZE_INCREASEMENT		(32 << 10)
-#define FLASH_SIZE_SAMPLE_INTERVAL	(4 << 10)
-
-#define DATA_READ_LENGTH			0x1000
-
-#define min(a, b) (((a) > (b)) ? (b) : (a))
-
-static int flash_probed;
-static const spi_flash_id *flash_id;
-static unsigned int erase_size;
-static unsigned char erase_op;
-static unsigned char addr_width;
-static unsigned char sst_write;
-
-static inline void AddrToCmd3(unsigned int addr, unsigned char *cmd)
-{
-	cmd[0] = (addr >> 16) & 0xff;
-	cmd[1] = (addr >> 8) & 0xff;
-	cmd[2] = (addr) & 0xff;
-}
-
-static inline void AddrToCmd4(unsigned int addr, unsigned char *cmd)
-{
-	cmd[0] = (addr >> 24) & 0xff;
-	cmd[1] = (addr >> 16) & 0xff;
-	cmd[2] = (addr >> 8) & 0xff;
-	cmd[3] = (addr) & 0xff;
-}
-
-static inline void AddrToCmd(unsigned int addr, unsigned char *cmd)
-{
-	if (addr_width == 4)
-		AddrToCmd4(addr, cmd);
-	else
-		AddrToCmd3(addr, cmd);
-}
-
-static inline unsigned int CmdSize(void)
-{
-	if (flash_id->size > SIZE_16MB)
-		return 5;
-	else
-		return 4;
-}
-
-static bool WriteEnable(void)
-{
-	unsigned char op = SPI_CMD_WREN;
-
-	return SPIWrite(&op, 1);
-}
-
-static bool WriteDisable(void)
-{
-	unsigned char op = SPI_CMD_WRDI;
-
-	return SPIWrite(&op, 1);
-}
-
-static bool ReadStatusRegister(unsigned int &sr)
-{
-	unsigned char op = SPI_CMD_RDSR;
-	unsigned char val;
-
-	if (!SPIWriteThenRead(&op, 1, &val, 1))
-		return false;
-
-	sr = val;
-	return true;
-}
-
-static bool WriteStatusRegister(unsigned char sr)
-{
-	unsigned char op[2];
-
-	op[0] = SPI_CMD_WRSR;
-	op[1] = sr & 0xff;
-
-	return SPIWrite(op, 2);
-}
-
-static bool SetAddressMode(int enable4b)
-{
-	unsigned char op[2];
-	int need_wren = 0;
-
-	if (addr_width != 4)
-		return true;
-
-	/* ͨ */
-	switch (JEDEC_MFR(flash_id->jedec_id))
-	{
-	case MFR_MICROM:
-		need_wren = 1;
-	case MFR_EON:
-	case MFR_MACRONIX:
-	case MFR_WINBOND:
-	case MFR_GIGADEVICE:
-		if (need_wren)
-			if (!WriteEnable())
-				return false;
-
-		op[0] = enable4b ? SPI_CMD_ENTER_4B_MODE : SPI_CMD_EXIT_4B_MODE;
-		if (!SPIWrite(op, 1))
-			return false;
-
-		if (need_wren)
-			if (!WriteDisable())
-				return false;
-
-		break;
-	case MFR_ISSI:
-	case MFR_SPANSION:
-		op[0] = SPI_CMD_WRBR;
-		op[1] = (!!enable4b) << 7;
-		if (!SPIWrite(op, 2))
-			return false;
-		break;
-	}
-
-	if (enable4b)
-		return true;
-
-	/* ʼʹ 3 ֽڵַģʽ 16MB  */
-	switch (JEDEC_MFR(flash_id->jedec_id))
-	{
-	case MFR_EON:
-		op[0] = SPI_CMD_EXIT_HBL_MODE;
-		if (!SPIWrite(op, 1))
-			return false;
-		break;
-	case MFR_MACRONIX:
-		/* MX25L25655E ֧ */
-		if (flash_id->jedec_id == 0xc22619)
-			break;
-	case MFR_MICROM:
-	case MFR_WINBOND:
-	case MFR_GIGADEVICE:
-		if (!WriteEnable())
-			return false;
-		op[0] = SPI_CMD_WREAR;
-		op[1] = 0;
-		if (!SPIWrite(op, 2))
-			return false;
-		if (!WriteDisable())
-			return false;
-		break;
-	case MFR_ISSI:
-	case MFR_SPANSION:
-		/* Ҫ˲ */
-		break;
-	}
-
-	return true;
-}
-
-static bool FlashPoll(void)
-{
-	unsigned int sr;
-
-	do
-	{
-		if (!ReadStatusRegister(sr))
-			return false;
-	} while (sr & 1);
-
-	return true;
-}
-
-bool FlashProbe(void)
-{
-	unsigned char op = SPI_CMD_RDID;
-	unsigned char id[5], mask = 0;
-	unsigned int jedec_id, ext_id, sr;
-	int pre_unlock = 0;
-
-	if (flash_probed)
-		return true;
-
-	if (!CH341ChipSelect(0, false))
-		return false;
-
-	SPIWriteThenRead(&op, 1, id, 5);
-
-	jedec_id = id[0];
-	jedec_id = jedec_id << 8;
-	jedec_id |= id[1];
-	jedec_id = jedec_id << 8;
-	jedec_id |= id[2];
-
-	ext_id = id[3] << 8 | id[4];
-
-	if (!jedec_id || (jedec_id == 0xffffff))
-	{
-		fprintf(stderr, "Error: no valid flash found.\n");
-		return false;
-	}
-
-	flash_id = spi_flash_id_lookup(jedec_id, ext_id);
-
-	if (flash_id)
-	{
-		if (flash_id->flags & SF_4K_SECTOR)
-		{
-			if (flash_id->flags & SF_4K_PMC)
-				erase_op = SPI_CMD_4KB_PMC_ERASE;
-			else
-				erase_op = SPI_CMD_SECTOR_ERASE;
-			erase_size = SECTOR_4KB;
-		}
-		else if (flash_id->flags & SF_32K_BLOCK)
-		{
-			erase_op = SPI_CMD_32KB_BLOCK_ERASE;
-			erase_size = SECTOR_32KB;
-		}
-		else if (flash_id->flags & SF_64K_BLOCK)
-		{
-			erase_op = SPI_CMD_64KB_BLOCK_ERASE;
-			erase_size = SECTOR_64KB;
-		}
-		else if (flash_id->flags & SF_256K_BLOCK)
-		{
-			erase_op = SPI_CMD_64KB_BLOCK_ERASE;
-			erase_size = SECTOR_256KB;
-		}
-
-		if (flash_id->flags & SF_INIT_SR)
-			pre_unlock = 1;
-
-		if (flash_id->flags & SF_SST)
-			sst_write = 1;
-
-		addr_width = flash_id->size > SIZE_16MB ? 4 : 3;
-	}
-	else
-	{
-		fprintf(stderr, "Error: unrecognised flash found.\n");
-		return false;
-	}
-
-	if (pre_unlock)
-	{
-		if (!WriteEnable())
-			return false;
-		if (!WriteStatusRegister(0))
-			return false;
-	}
-	else if (flash_id && flash_id->flags & SF_BP_ALL)
-	{
-		if (!ReadStatusRegister(sr))
-			return false;
-
-		if (flash_id->flags & SF_BP0_2)
-			mask |= SR_BP0_2_MASK;
-
-		if (flash_id->flags & SF_BP3)
-			mask |= SR_BP3_MASK;
-
-		if (flash_id->flags & SF_BP4)
-			mask |= SR_BP4_MASK;
-
-		if (sr & mask)
-		{
-			sr &= ~mask;
-			if (!WriteEnable())
-				return false;
-			if (!WriteStatusRegister(sr))
-				return false;
-			if (!FlashPoll())
-				return false;
-		}
-	}
-
-	printf("Flash: %s\n", flash_id->model);
-	printf("Capacity: %dKiB\n", flash_id->size >> 10);
-	printf("Sector size: %dKiB\n", erase_size >> 10);
-	printf("\n");
-
-	flash_probed = 1;
-
-	return true;
-}
-
-unsigned int FlashGetSize(void)
-{
-	return flash_id->size;
-}
-
-bool FlashRead(unsigned int addr, unsigned int len, unsigned char *buf)
-{
-	unsigned char op[5];
-	unsigned int flash_offset, len_read, len_to_read, len_left;
-	clock_t start_clock, time_used;
-
-	if (!len)
-		return true;
-
-	if (!buf)
-		return false;
-
-	flash_offset = addr % flash_id->size;
-
-	if (!SetAddressMode(1))
-		return false;
-
-	op[0] = SPI_CMD_READ;
-	AddrToCmd(flash_offset, &op[1]);
-
-	if (!CH341ChipSelect(0, true))
-		return false;
-
-	if (!CH341WriteSPI(op, CmdSize()))
-		return false;
-
-	ProgressInit();
-	start_clock = clock();
-
-	len_read = 0;
-	len_left = len;
-
-	while (len_left)
-	{
-		len_to_read = len_left > DATA_READ_LENGTH ? DATA_READ_LENGTH : len_left;
-		CH341ReadSPI(buf + len_read, len_to_read);
-
-		len_read += len_to_read;
-		len_left -= len_to_read;
-
-		ProgressShow(len_read * 100 / len);
-	}
-
-	time_used = clock() - start_clock;
-
-	ProgressDone();
-
-	printf("Time used: %.2fs\n", ((double) time_used) / 1000);
-	printf("Speed: %.2fKiB/s\n", (double) len / (double) time_used);
-
-	if (!CH341ChipSelect(0, false))
-		return false;
-
-	if (!SetAddressMode(0))
-		return false;
-
-	return true;
-}
-
-static bool FlashEraseSector(unsigned int addr)
-{
-	unsigned char cmd[5];
-
-	cmd[0] = erase_op;
-	AddrToCmd(addr, &cmd[1]);
-
-	if (!WriteEnable())
-		return false;
-
-	if (!SPIWrite(cmd, CmdSize()))
-		return false;
-
-	return FlashPoll();
-}
-
-bool FlashErase(unsigned int addr, unsigned int len)
-{
-	unsigned int num_sectors, sector_left, size_erased;
-	clock_t start_clock, time_used;
-
-	if (addr % erase_size)
-	{
-		fprintf(stderr, "Error: start address is not on erase boundary.\n");
-		return false;
-	}
-
-	if ((addr + len) % erase_size)
-	{
-		fprintf(stderr, "Error: end address is not on erase boundary.\n");
-		return false;
-	}
-
-	if ((addr > flash_id->size) || (addr + len > flash_id->size))
-	{
-		fprintf(stderr, "Error: end address exceeds flash capacity.\n");
-		return false;
-	}
-
-	if (!SetAddressMode(1))
-		return false;
-
-	ProgressInit();
-	start_clock = clock();
-
-	size_erased = 0;
-
-	/* Բ */
-	num_sectors = len / erase_size;
-
-	sector_left = num_sectors;
-	while (sector_left)
-	{
-		if (!FlashEraseSector(addr))
-			return false;
-		addr += erase_size;
-		size_erased += erase_size;
-		sector_left--;
-
-		ProgressShow(size_erased * 100 / len);
-	}
-
-	time_used = clock() - start_clock;
-
-	ProgressDone();
-
-	printf("Time used: %.2fs\n", ((double) time_used) / 1000);
-	printf("Speed: %.2fKiB/s, %.2fsec/s\n", (double) len / (double) time_used, (double) (num_sectors * 1000) / (double) time_used);
-
-	if (!SetAddressMode(0))
-		return false;
-
-	return true;
-}
-
-bool FlashChipErase(void)
-{
-	unsigned char cmd;
-	bool ret;
-	clock_t start_clock, time_used;
-
-	cmd = SPI_CMD_CHIP_ERASE;
-
-	if (!WriteEnable())
-		return false;
-
-	if (!SPIWrite(&cmd, 1))
-		return false;
-
-	start_clock = clock();
-
-	ret = FlashPoll();
-
-	time_used = clock() - start_clock;
-
-	printf("Time used: %.2fs\n", ((double) time_used) / 1000);
-
-	return ret;
-}
-
-static bool FlashSinglePageProgram(unsigned int addr, unsigned char *buff, unsigned int len)
-{
-	unsigned char op[5];
-
-	op[0] = SPI_CMD_PAGE_PROG;
-	AddrToCmd(addr, &op[1]);
-
-	if (!CH341ChipSelect(0, true))
-		return false;
-
-	if (!CH341WriteSPI(op, CmdSize()))
-		return false;
-
-	if (!CH341WriteSPI(buff, len))
-		return false;
-
-	if (!CH341ChipSelect(0, false))
-		return false;
-
-	return FlashPoll();
-}
-
-static bool FlashPageProgram(unsigned int addr, unsigned char *buff, unsigned int len)
-{
-	unsigned int bytes_written = 0, bytes_to_write, bytes_left;
-	unsigned int dst;
-	unsigned char *src;
-	clock_t start_clock, time_used;
-
-	if (!SetAddressMode(1))
-		return false;
-
-	ProgressInit();
-	start_clock = clock();
-
-	bytes_left = len;
-	while (bytes_written < len)
-	{
-		src = buff + bytes_written;
-		dst = addr + bytes_written;
-		bytes_to_write = min(bytes_left, PAGE_SIZE - (dst % PAGE_SIZE));
-
-		if (!WriteEnable())
-			return false;
-
-		if (!FlashSinglePageProgram(dst, src, bytes_to_write))
-			return false;
-
-		bytes_left -= bytes_to_write;
-		bytes_written += bytes_to_write;
-
-		ProgressShow(bytes_written * 100 / len);
-	}
-
-	time_used = clock() - start_clock;
-
-	ProgressDone();
-
-	printf("Time used: %.2fs\n", ((double) time_used) / 1000);
-	printf("Speed: %.2fKiB/s\n", (double) len / (double) time_used);
-
-	if (!SetAddressMode(0))
-		return false;
-
-	return true;
-}
-
-static bool FlashSSTAAIProgram(unsigned int addr, unsigned char *buff, unsigned int len)
-{
-	unsigned char op[6];
-	unsigned int dst = 0, bytes_written = 0;
-	int addr_sent = 0;
-	clock_t start_clock, time_used;
-
-	ProgressInit();
-	start_clock = clock();
-
-	if (addr % 2)
-	{
-		if (!WriteEnable())
-			return false;
-
-		if (!FlashSinglePageProgram(addr, buff, 1))
-			return false;
-
-		dst++;
-	}
-
-	if (!WriteEnable())
-		return false;
-
-	op[0] = SPI_CMD_AAI_WP;
-	AddrToCmd3(addr + dst, &op[1]);
-
-	while (len - dst >= 2)
-	{
-		if (!addr_sent)
-		{
-			op[4] = buff[dst++];
-			op[5] = buff[dst++];
-
-			if (!SPIWrite(op, 6))
-				return false;
-
-			addr_sent = 1;
-		}
-		else
-		{
-			op[1] = buff[dst++];
-			op[2] = buff[dst++];
-
-			if (!SPIWrite(op, 3))
-				return false;
-		}
-
-		if (!FlashPoll())
-			return false;
-
-		bytes_written += 2;
-
-		if (bytes_written % 256 == 0)
-			ProgressShow(bytes_written * 100 / len);
-	}
-
-	if (!WriteDisable())
-		return false;
-
-	if (!FlashPoll())
-		return false;
-
-	if (dst < len)
-	{
-		if (!WriteEnable())
-			return false;
-
-		if (!FlashSinglePageProgram(addr + dst, buff + dst, 1))
-			return false;
-
-		dst++;
-	}
-
-	time_used = clock() - start_clock;
-
-	ProgressDone();
-
-	printf("Time used: %.2fs\n", ((double) time_used) / 1000);
-	printf("Speed: %.2fKiB/s\n", (double) len / (double) time_used);
-
-	if (!WriteDisable())
-		return false;
-
-	return true;
-}
-
-bool FlashWrite(unsigned int addr, unsigned char *buff, unsigned int len)
-{
-	if (!buff)
-		return false;
-
-	if ((addr > flash_id->size) || (addr + len > flash_id->size))
-	{
-		fprintf(stderr, "Error: write address exceeds flash capacity.\n");
-		return false;
-	}
-
-	if (sst_write)
-		return FlashSSTAAIProgram(addr, buff, len);
-	else
-		return FlashPageProgram(addr, buff, len);
-}
+#include "stdafx.h"
+
+#include <string.h>
+
+#include "ch341.h"
+#include "spi_flash.h"
+#include "sfdp.h"
+#include "probe_cache.h"
+#include "checksum.h"
+#include "profile.h"
+#include "metrics.h"
+#include "probes.h"
+
+#define FLASH_SIZE_INCREASEMENT		(32 << 10)
+#define FLASH_SIZE_SAMPLE_INTERVAL	(4 << 10)
+
+#define FLASH_SIZE_SAMPLES			(FLASH_SIZE_INCREASEMENT / FLASH_SIZE_SAMPLE_INTERVAL)
+#define FLASH_SIZE_SAMPLE_LENGTH	16
+
+#define DATA_READ_LENGTH			0x1000
+
+#define FLASH_NO_ADDR				0xffffffff	/* for retry messages not about a flash address */
+
+#define min(a, b) (((a) > (b)) ? (b) : (a))
+
+static spi_flash default_flash;
+
+/* Sessions driven in parallel report through their callback instead of the shared progress bar */
+static bool FlashProgressInit(spi_flash *flash)
+{
+	flash->progress_last = 0;
+
+	if (CH341Cancelled())
+	{
+		flash->cancelled = true;
+		return false;
+	}
+
+	if (!flash->quiet)
+		ProgressInit();
+
+	if (flash->progress && !flash->progress(0, flash->progress_arg))
+	{
+		flash->cancelled = true;
+		return false;
+	}
+
+	return true;
+}
+
+/* Returns false if the callback or an interrupt cancelled the operation */
+static bool FlashProgressShow(spi_flash *flash, unsigned int done, unsigned int total)
+{
+	int percentage = (int) ((unsigned long long) done * 100 / total);
+
+	if (CH341Cancelled())
+	{
+		flash->cancelled = true;
+		return false;
+	}
+
+	/* Chunks are far smaller than 1% on most parts, only report actual changes */
+	if (percentage == flash->progress_last)
+		return true;
+
+	flash->progress_last = percentage;
+
+	if (!flash->quiet)
+		ProgressShow(percentage);
+
+	if (flash->progress && !flash->progress(percentage, flash->progress_arg))
+	{
+		flash->cancelled = true;
+		return false;
+	}
+
+	return true;
+}
+
+static unsigned long long FlashMetricsBegin(spi_flash *flash, unsigned int op)
+{
+	flash->cancelled = false;
+
+	return MetricsOperationBegin(op);
+}
+
+static void FlashMetricsEnd(spi_flash *flash, unsigned int op, unsigned long long start_us, bool ret)
+{
+	MetricsOperationEnd(op, start_us, ret ? METRIC_RESULT_OK :
+		flash->cancelled ? METRIC_RESULT_CANCELLED : METRIC_RESULT_FAILED);
+}
+
+static void FlashProgressDone(spi_flash *flash)
+{
+	if (!flash->quiet)
+		ProgressDone();
+}
+
+/* Wall time since start_us, in seconds, never 0 so that speeds can be worked out */
+static double FlashElapsed(unsigned long long start_us)
+{
+	unsigned long long us = ProfileNowUs() - start_us;
+
+	return (us ? us : 1) / 1e6;
+}
+
+static inline void AddrToCmd3(unsigned int addr, unsigned char *cmd)
+{
+	cmd[0] = (addr >> 16) & 0xff;
+	cmd[1] = (addr >> 8) & 0xff;
+	cmd[2] = (addr) & 0xff;
+}
+
+static inline void AddrToCmd4(unsigned int addr, unsigned char *cmd)
+{
+	cmd[0] = (addr >> 24) & 0xff;
+	cmd[1] = (addr >> 16) & 0xff;
+	cmd[2] = (addr >> 8) & 0xff;
+	cmd[3] = (addr) & 0xff;
+}
+
+static inline void AddrToCmd(spi_flash *flash, unsigned int addr, unsigned char *cmd)
+{
+	if (flash->addr_width == 4)
+		AddrToCmd4(addr, cmd);
+	else
+		AddrToCmd3(addr, cmd);
+}
+
+static inline unsigned int CmdSize(spi_flash *flash)
+{
+	return 1 + flash->addr_width;
+}
+
+static bool WriteEnable(spi_flash *flash)
+{
+	unsigned char op = SPI_CMD_WREN;
+
+	return SPIDevWrite(flash->dev, flash->cs, &op, 1);
+}
+
+static bool WriteDisable(spi_flash *flash)
+{
+	unsigned char op = SPI_CMD_WRDI;
+
+	return SPIDevWrite(flash->dev, flash->cs, &op, 1);
+}
+
+static bool ReadStatusRegister(spi_flash *flash, unsigned int &sr)
+{
+	unsigned char op = SPI_CMD_RDSR;
+	unsigned char val;
+
+	if (!SPIDevWriteThenRead(flash->dev, flash->cs, &op, 1, &val, 1))
+		return false;
+
+	sr = val;
+	return true;
+}
+
+static bool WriteStatusRegister(spi_flash *flash, unsigned char sr)
+{
+	unsigned char op[2];
+
+	op[0] = SPI_CMD_WRSR;
+	op[1] = sr & 0xff;
+
+	return SPIDevWrite(flash->dev, flash->cs, op, 2);
+}
+
+static bool SetAddressMode(spi_flash *flash, int enable4b)
+{
+	unsigned char op[2];
+	int need_wren = 0;
+
+	/* Dedicated 4-byte opcodes need no mode switch at all */
+	if (flash->addr_width != 4 || flash->use_4b_opcodes)
+		return true;
+
+	/* Held in 4-byte mode between SpiFlashBegin and SpiFlashEnd */
+	if (flash->addr_mode_hold)
+		return true;
+
+	profile_scope scope(PROF_ADDR_MODE);
+
+	/* 通用命令 */
+	switch (JEDEC_MFR(flash->id->jedec_id))
+	{
+	case MFR_MICROM:
+		need_wren = 1;
+	case MFR_EON:
+	case MFR_MACRONIX:
+	case MFR_WINBOND:
+	case MFR_GIGADEVICE:
+		if (need_wren)
+			if (!WriteEnable(flash))
+				return false;
+
+		op[0] = enable4b ? SPI_CMD_ENTER_4B_MODE : SPI_CMD_EXIT_4B_MODE;
+		if (!SPIDevWrite(flash->dev, flash->cs, op, 1))
+			return false;
+
+		if (need_wren)
+			if (!WriteDisable(flash))
+				return false;
+
+		break;
+	case MFR_ISSI:
+	case MFR_SPANSION:
+		op[0] = SPI_CMD_WRBR;
+		op[1] = (!!enable4b) << 7;
+		if (!SPIDevWrite(flash->dev, flash->cs, op, 2))
+			return false;
+		break;
+	default:
+		/* Unlisted vendors, follow what SFDP says */
+		if (!(flash->addr4b_enter & (SFDP_4B_ENTER_B7 | SFDP_4B_ENTER_WREN_B7)))
+			break;
+
+		if (!(flash->addr4b_enter & SFDP_4B_ENTER_B7))
+			if (!WriteEnable(flash))
+				return false;
+
+		op[0] = enable4b ? SPI_CMD_ENTER_4B_MODE : SPI_CMD_EXIT_4B_MODE;
+		if (!SPIDevWrite(flash->dev, flash->cs, op, 1))
+			return false;
+
+		break;
+	}
+
+	if (enable4b)
+		return true;
+
+	/* 始终使 3 字节地址模式访问最低 16MB 数据 */
+	switch (JEDEC_MFR(flash->id->jedec_id))
+	{
+	case MFR_EON:
+		op[0] = SPI_CMD_EXIT_HBL_MODE;
+		if (!SPIDevWrite(flash->dev, flash->cs, op, 1))
+			return false;
+		break;
+	case MFR_MACRONIX:
+		/* MX25L25655E 不支持 */
+		if (flash->id->jedec_id == 0xc22619)
+			break;
+	case MFR_MICROM:
+	case MFR_WINBOND:
+	case MFR_GIGADEVICE:
+		if (!WriteEnable(flash))
+			return false;
+		op[0] = SPI_CMD_WREAR;
+		op[1] = 0;
+		if (!SPIDevWrite(flash->dev, flash->cs, op, 2))
+			return false;
+		if (!WriteDisable(flash))
+			return false;
+		break;
+	case MFR_ISSI:
+	case MFR_SPANSION:
+		/* 不需要此操作 */
+		break;
+	}
+
+	return true;
+}
+
+static bool FlashPoll(spi_flash *flash);
+
+/* Reads, writes and erases run in 4-byte mode, enter it again in case a reset came in between */
+static bool FlashRestoreAddressMode(spi_flash *flash)
+{
+	unsigned int hold = flash->addr_mode_hold;
+	bool ret;
+
+	if (!flash->id)
+		return true;
+
+	flash->addr_mode_hold = 0;
+	ret = SetAddressMode(flash, 1);
+	flash->addr_mode_hold = hold;
+
+	return ret;
+}
+
+/*
+ * Called after a transaction failed, for its attempt-th retry: gets the
+ * programmer going again, releases CS and, if the failed attempt may have
+ * started a program or erase, waits for the chip to finish it, so that the
+ * transaction can be issued again. Returns false once retries are used up.
+ */
+static bool FlashRetry(spi_flash *flash, unsigned int *attempt, unsigned int addr, const char *what, bool busy)
+{
+	/* An interrupted run only cleans up, it does not wait for the programmer to come back */
+	if (CH341Cancelled())
+		return false;
+
+	while (++*attempt <= CH341_RETRY_MAX)
+	{
+		if (!CH341DeviceRecover(flash->dev, *attempt))
+			continue;
+
+		if (!CH341DeviceChipSelect(flash->dev, flash->cs, false))
+			continue;
+
+		if (busy && !FlashPoll(flash))
+			continue;
+
+		if (!FlashRestoreAddressMode(flash))
+			continue;
+
+		return true;
+	}
+
+	flash->dev->stats.given_up++;
+
+	if (addr == FLASH_NO_ADDR)
+		Message(MSG_ERROR, "Error: %s failed %u times in a row (%s), giving up.\n", what, CH341_RETRY_MAX,
+			CH341DeviceLastError(flash->dev));
+	else
+		Message(MSG_ERROR, "Error: %s at %xh failed %u times in a row (%s), giving up.\n", what, addr, CH341_RETRY_MAX,
+			CH341DeviceLastError(flash->dev));
+
+	return false;
+}
+
+/* Mode switches are harmless to repeat, a failed one is simply done again */
+static bool FlashSwitchAddressMode(spi_flash *flash, int enable4b)
+{
+	unsigned int attempt = 0;
+	bool ret;
+
+	flash->dev->retry_depth++;
+
+	while (!(ret = SetAddressMode(flash, enable4b)) &&
+		FlashRetry(flash, &attempt, FLASH_NO_ADDR, "address mode switch", false))
+		;
+
+	flash->dev->retry_depth--;
+	return ret;
+}
+
+/* Status reads are harmless to repeat, a failed one is simply done again */
+static bool FlashPoll(spi_flash *flash)
+{
+	profile_scope scope(PROF_POLL);
+	unsigned int sr, attempt = 0, polls = 0;
+
+	do
+	{
+		while (!ReadStatusRegister(flash, sr))
+		{
+			if (!FlashRetry(flash, &attempt, FLASH_NO_ADDR, "status read", false))
+				return false;
+		}
+
+		PROBE2(flash_poll, sr, ++polls);
+		attempt = 0;
+	} while (sr & 1);
+
+	return true;
+}
+
+/* WRDI ends AAI mode, until then the part takes no other command */
+static bool FlashAAIExit(spi_flash *flash)
+{
+	return WriteDisable(flash) && FlashPoll(flash);
+}
+
+static bool FlashPollErase(spi_flash *flash, unsigned int typ_ms)
+{
+	/* Nothing can finish much earlier than half the typical time, don't load the bus meanwhile */
+	if (typ_ms > 2)
+	{
+		profile_scope scope(PROF_POLL);
+		SleepMs(typ_ms / 2);
+	}
+
+	return FlashPoll(flash);
+}
+
+/*
+ * Flash addresses wrap around at the chip size, so the first block shows up
+ * again at every multiple of it. Fingerprint a few small windows of the first
+ * FLASH_SIZE_INCREASEMENT bytes and look for them at each power-of-two offset.
+ * Returns 0 if the size cannot be told, e.g. on a blank chip.
+ */
+static unsigned int FlashDetectSize(spi_flash *flash)
+{
+	ch341_spi_batch ops[FLASH_SIZE_SAMPLES];
+	unsigned char cmd[FLASH_SIZE_SAMPLES][5];
+	unsigned char data[FLASH_SIZE_SAMPLES][FLASH_SIZE_SAMPLE_LENGTH];
+	unsigned int i, j, base, limit, ref_crc = 0, crc, size = 0;
+	bool uniform = true;
+
+	limit = flash->addr_width == 4 ? SIZE_256MB : SIZE_16MB;
+
+	if (!SetAddressMode(flash, 1))
+		return 0;
+
+	for (base = 0; base <= limit; base = base ? base << 1 : FLASH_SIZE_INCREASEMENT)
+	{
+		for (i = 0; i < FLASH_SIZE_SAMPLES; i++)
+		{
+			cmd[i][0] = flash->read_op;
+			AddrToCmd(flash, (base + i * FLASH_SIZE_SAMPLE_INTERVAL) % limit, &cmd[i][1]);
+
+			ops[i].cmd = cmd[i];
+			ops[i].cmd_len = CmdSize(flash);
+			ops[i].data = data[i];
+			ops[i].data_len = FLASH_SIZE_SAMPLE_LENGTH;
+		}
+
+		if (!CH341DeviceBatchSPI(flash->dev, flash->cs, ops, FLASH_SIZE_SAMPLES))
+			break;
+
+		crc = Crc32Update(0, &data[0][0], sizeof (data));
+
+		if (!base)
+		{
+			for (i = 0; i < FLASH_SIZE_SAMPLES; i++)
+				for (j = 0; j < FLASH_SIZE_SAMPLE_LENGTH; j++)
+					if (data[i][j] != data[0][0])
+						uniform = false;
+
+			if (uniform)
+				break;
+
+			ref_crc = crc;
+			continue;
+		}
+
+		/* Offset limit itself wraps to 0 in any case, seeing it means the whole address space */
+		if (crc == ref_crc)
+		{
+			size = base;
+			break;
+		}
+	}
+
+	if (!SetAddressMode(flash, 0))
+		return 0;
+
+	return size;
+}
+
+static const spi_flash_id *FlashIdFromSfdp(spi_flash *flash, unsigned int jedec_id, const sfdp_info *sfdp)
+{
+	unsigned int i;
+
+	snprintf(flash->probed_model, sizeof (flash->probed_model), "Unknown %06X (SFDP)", jedec_id);
+
+	flash->probed_id.model = flash->probed_model;
+	flash->probed_id.jedec_id = jedec_id;
+	flash->probed_id.ext_id = 0;
+	flash->probed_id.size = sfdp->size;
+	flash->probed_id.flags = SF_BP0_2;
+
+	for (i = 0; i < sfdp->num_erase_types; i++)
+	{
+		switch (sfdp->erase[i].size)
+		{
+		case SECTOR_4KB:
+			flash->probed_id.flags |= SF_4K_SECTOR;
+			break;
+		case SECTOR_32KB:
+			flash->probed_id.flags |= SF_32K_BLOCK;
+			break;
+		case SECTOR_64KB:
+			flash->probed_id.flags |= SF_64K_BLOCK;
+			break;
+		case SECTOR_256KB:
+			flash->probed_id.flags |= SF_256K_BLOCK;
+			break;
+		}
+	}
+
+	return &flash->probed_id;
+}
+
+/* Last resort for parts without table entry or SFDP: size by wraparound, 64KiB erase only */
+static const spi_flash_id *FlashIdFromWraparound(spi_flash *flash, unsigned int jedec_id)
+{
+	unsigned int size;
+
+	flash->addr_width = 3;
+	flash->use_4b_opcodes = 0;
+	flash->read_op = SPI_CMD_READ;
+
+	size = FlashDetectSize(flash);
+	if (size < SECTOR_64KB)
+		return NULL;
+
+	if (JEDEC_SIZE(jedec_id) < 32 && (1u << JEDEC_SIZE(jedec_id)) != size)
+		Message(MSG_WARNING, "Warning: JEDEC ID suggests %uKiB, using detected size.\n", (1u << JEDEC_SIZE(jedec_id)) >> 10);
+
+	if (size == SIZE_16MB)
+		Message(MSG_WARNING, "Warning: 3-byte addressing limits detection to 16MiB, larger parts need a chip database entry.\n");
+
+	snprintf(flash->probed_model, sizeof (flash->probed_model), "Unknown %06X", jedec_id);
+
+	flash->probed_id.model = flash->probed_model;
+	flash->probed_id.jedec_id = jedec_id;
+	flash->probed_id.ext_id = 0;
+	flash->probed_id.size = size;
+	flash->probed_id.flags = SF_64K_BLOCK | SF_BP0_2;
+
+	return &flash->probed_id;
+}
+
+/* 4-byte address variant of a 3-byte opcode, for parts flagged with SF_4B_OPCODES */
+static unsigned char FlashOpcode4B(unsigned char opcode)
+{
+	switch (opcode)
+	{
+	case SPI_CMD_SECTOR_ERASE:
+		return SPI_CMD_SECTOR_ERASE_4B;
+	case SPI_CMD_64KB_BLOCK_ERASE:
+		return SPI_CMD_64KB_BLOCK_ERASE_4B;
+	}
+
+	return 0;
+}
+
+static void FlashAddEraseType(spi_flash *flash, unsigned int size, unsigned char opcode, unsigned char opcode_4b, unsigned int typ_ms)
+{
+	if (flash->num_erase_types >= MAX_ERASE_TYPES)
+		return;
+
+	if (!opcode_4b && (flash->id->flags & SF_4B_OPCODES))
+		opcode_4b = FlashOpcode4B(opcode);
+
+	flash->erase_types[flash->num_erase_types].size = size;
+	flash->erase_types[flash->num_erase_types].opcode = opcode;
+	flash->erase_types[flash->num_erase_types].opcode_4b = opcode_4b;
+	flash->erase_types[flash->num_erase_types].typ_ms = typ_ms;
+	flash->num_erase_types++;
+}
+
+/* Typical erase time from the chip table, 0 if not listed */
+static unsigned int FlashTableEraseTime(spi_flash *flash, unsigned int size)
+{
+	switch (size)
+	{
+	case SECTOR_4KB:
+		return flash->id->erase_4k_ms;
+	case SECTOR_32KB:
+		return flash->id->erase_32k_ms;
+	case SECTOR_64KB:
+	case SECTOR_256KB:
+		return flash->id->erase_64k_ms;
+	}
+
+	return 0;
+}
+
+static void FlashSetupGeometry(spi_flash *flash)
+{
+	unsigned int i, n;
+	bool have_4b_rw;
+
+	flash->addr_width = flash->id->size > SIZE_16MB ? 4 : 3;
+	flash->addr4b_enter = flash->sfdp ? flash->sfdp->addr4b_enter : 0;
+
+	/* Erase types, smallest first */
+	flash->num_erase_types = 0;
+
+	if (flash->sfdp)
+	{
+		for (i = 0; i < flash->sfdp->num_erase_types; i++)
+		{
+			FlashAddEraseType(flash, flash->sfdp->erase[i].size, flash->sfdp->erase[i].opcode, flash->sfdp->erase[i].opcode_4b,
+				flash->sfdp->erase[i].typ_ms);
+		}
+	}
+	else
+	{
+		if (flash->id->flags & SF_4K_SECTOR)
+			FlashAddEraseType(flash, SECTOR_4KB, (flash->id->flags & SF_4K_PMC) ? SPI_CMD_4KB_PMC_ERASE : SPI_CMD_SECTOR_ERASE, 0, 0);
+
+		if (flash->id->flags & SF_32K_BLOCK)
+			FlashAddEraseType(flash, SECTOR_32KB, SPI_CMD_32KB_BLOCK_ERASE, 0, 0);
+
+		if (flash->id->flags & SF_64K_BLOCK)
+			FlashAddEraseType(flash, SECTOR_64KB, SPI_CMD_64KB_BLOCK_ERASE, 0, 0);
+		else if (flash->id->flags & SF_256K_BLOCK)
+			FlashAddEraseType(flash, SECTOR_256KB, SPI_CMD_64KB_BLOCK_ERASE, 0, 0);
+	}
+
+	/* Timings listed in the chip table win over SFDP */
+	for (i = 0; i < flash->num_erase_types; i++)
+		if (FlashTableEraseTime(flash, flash->erase_types[i].size))
+			flash->erase_types[i].typ_ms = FlashTableEraseTime(flash, flash->erase_types[i].size);
+
+	/* Prefer dedicated 4-byte opcodes, the chip then never leaves 3-byte mode */
+	have_4b_rw = (flash->id->flags & SF_4B_OPCODES) || (flash->sfdp && flash->sfdp->read_4b_op && flash->sfdp->program_4b_op);
+	flash->use_4b_opcodes = 0;
+
+	if (flash->addr_width == 4 && have_4b_rw)
+	{
+		/* Drop erase types without a 4-byte opcode, as long as one remains */
+		for (i = 0, n = 0; i < flash->num_erase_types; i++)
+		{
+			if (flash->erase_types[i].opcode_4b)
+			{
+				flash->erase_types[n] = flash->erase_types[i];
+				flash->erase_types[n].opcode = flash->erase_types[n].opcode_4b;
+				n++;
+			}
+		}
+
+		if (n)
+		{
+			flash->num_erase_types = n;
+			flash->use_4b_opcodes = 1;
+		}
+	}
+
+	flash->read_op = flash->use_4b_opcodes ? SPI_CMD_READ_4B : SPI_CMD_READ;
+	flash->program_op = flash->use_4b_opcodes ? SPI_CMD_PAGE_PROG_4B : SPI_CMD_PAGE_PROG;
+
+	flash->page_size = PAGE_SIZE;
+	if (flash->id->page_size)
+		flash->page_size = flash->id->page_size;
+	else if (flash->sfdp && flash->sfdp->page_size)
+		flash->page_size = flash->sfdp->page_size;
+
+	flash->page_prog_us = flash->id->page_prog_us;
+	if (!flash->page_prog_us && flash->sfdp)
+		flash->page_prog_us = flash->sfdp->page_prog_typ_us;
+	if (!flash->page_prog_us)
+		flash->page_prog_us = PAGE_PROG_DEFAULT_US;
+
+	flash->chip_erase_ms = flash->id->chip_erase_ms;
+	if (!flash->chip_erase_ms && flash->sfdp)
+		flash->chip_erase_ms = flash->sfdp->chip_erase_typ_ms;
+
+	if (flash->num_erase_types)
+	{
+		flash->erase_size = flash->erase_types[0].size;
+		flash->erase_op = flash->erase_types[0].opcode;
+	}
+}
+
+/* 4Bh factory unique ID, only issued to vendors known to implement it */
+static bool FlashReadUniqueId(spi_flash *flash, unsigned int jedec_id, unsigned char *uid, unsigned int *len)
+{
+	unsigned char op[5] = { SPI_CMD_READ_UID, 0, 0, 0, 0 };
+	unsigned int i;
+
+	*len = 0;
+
+	switch (jedec_id >> 16)
+	{
+	case 0xc8:	/* GigaDevice */
+	case 0xef:	/* Winbond */
+		break;
+	default:
+		return false;
+	}
+
+	if (!SPIDevWriteThenRead(flash->dev, flash->cs, op, sizeof (op), uid, UNIQUE_ID_LENGTH))
+		return false;
+
+	/* Unprogrammed or unsupported */
+	for (i = 0; i < UNIQUE_ID_LENGTH; i++)
+		if (uid[i] != 0xff && uid[i] != 0x00)
+			break;
+
+	if (i == UNIQUE_ID_LENGTH)
+		return false;
+
+	*len = UNIQUE_ID_LENGTH;
+
+	return true;
+}
+
+static void FlashSaveProbe(spi_flash *flash, probe_cache_entry *cache)
+{
+	unsigned int i;
+
+	cache->id = *flash->id;
+	strncpy(cache->model, flash->id->model, sizeof (cache->model) - 1);
+	cache->id.model = cache->model;
+
+	cache->sfdp = flash->sfdp ? 1 : 0;
+	cache->page_size = flash->page_size;
+	cache->id.page_prog_us = flash->page_prog_us;
+	cache->chip_erase_ms = flash->chip_erase_ms;
+	cache->addr_width = flash->addr_width;
+	cache->use_4b_opcodes = flash->use_4b_opcodes;
+	cache->read_op = flash->read_op;
+	cache->program_op = flash->program_op;
+	cache->addr4b_enter = flash->addr4b_enter;
+
+	cache->num_erase_types = flash->num_erase_types;
+	for (i = 0; i < flash->num_erase_types; i++)
+	{
+		cache->erase[i].size = flash->erase_types[i].size;
+		cache->erase[i].opcode = flash->erase_types[i].opcode;
+		cache->erase[i].typ_ms = flash->erase_types[i].typ_ms;
+	}
+
+	ProbeCacheStore(cache);
+}
+
+static void FlashRestoreProbe(spi_flash *flash, const probe_cache_entry *cache)
+{
+	unsigned int i;
+
+	flash->probed_id = cache->id;
+	strcpy(flash->probed_model, cache->model);
+	flash->probed_id.model = flash->probed_model;
+	flash->id = &flash->probed_id;
+	flash->sfdp = NULL;
+
+	flash->page_size = cache->page_size;
+	flash->page_prog_us = cache->id.page_prog_us ? cache->id.page_prog_us : PAGE_PROG_DEFAULT_US;
+	flash->chip_erase_ms = cache->chip_erase_ms;
+	flash->addr_width = cache->addr_width;
+	flash->use_4b_opcodes = cache->use_4b_opcodes;
+	flash->read_op = cache->read_op;
+	flash->program_op = cache->program_op;
+	flash->addr4b_enter = cache->addr4b_enter;
+
+	flash->num_erase_types = cache->num_erase_types;
+	for (i = 0; i < flash->num_erase_types; i++)
+	{
+		flash->erase_types[i].size = cache->erase[i].size;
+		flash->erase_types[i].opcode = cache->erase[i].opcode;
+		flash->erase_types[i].opcode_4b = flash->use_4b_opcodes ? cache->erase[i].opcode : 0;
+		flash->erase_types[i].typ_ms = cache->erase[i].typ_ms;
+	}
+
+	flash->erase_size = flash->erase_types[0].size;
+	flash->erase_op = flash->erase_types[0].opcode;
+}
+
+static bool FlashProbeOnce(spi_flash *flash, unsigned int errors)
+{
+	unsigned char op = SPI_CMD_RDID;
+	unsigned char id[5], mask = 0;
+	unsigned int jedec_id, ext_id, sr;
+	unsigned int detected_size;
+	probe_cache_entry cache;
+	int pre_unlock = 0, cached = 0;
+
+	if (flash->probed)
+		return true;
+
+	if (!CH341DeviceChipSelect(flash->dev, flash->cs, false))
+		return false;
+
+	if (!SPIDevWriteThenRead(flash->dev, flash->cs, &op, 1, id, 5))
+		return false;
+
+	jedec_id = id[0];
+	jedec_id = jedec_id << 8;
+	jedec_id |= id[1];
+	jedec_id = jedec_id << 8;
+	jedec_id |= id[2];
+
+	ext_id = id[3] << 8 | id[4];
+
+	if (!jedec_id || (jedec_id == 0xffffff))
+	{
+		Message(MSG_ERROR, "Error: no valid flash found.\n");
+		return false;
+	}
+
+	/*
+	 * RDID, the unique ID and the chip definitions loaded validate a cached
+	 * probe of the same programmer, one made before a --chipdb entry for the
+	 * part was added does not hide it. The unique ID is only read when the
+	 * cache is in use. Captured and replayed runs leave the cache alone,
+	 * their transfers must not depend on what some earlier run left in it,
+	 * and so do emulated chips, which are not worth a place in the user's
+	 * cache.
+	 */
+	memset(&cache, 0, sizeof (cache));
+	if (ProbeCacheEnabled() && !flash->dev->emu && !flash->dev->capture && !flash->dev->replay &&
+		CH341DeviceGetLocation(flash->dev, cache.location, sizeof (cache.location)) && flash->cs)
+		snprintf(cache.location + strlen(cache.location), sizeof (cache.location) - strlen(cache.location),
+			"/cs%u", flash->cs);
+
+	if (cache.location[0])
+	{
+		cache.jedec_id = jedec_id;
+		cache.ext_id = ext_id;
+		cache.db_hash = spi_flash_db_hash();
+		FlashReadUniqueId(flash, jedec_id, cache.uid, &cache.uid_len);
+
+		if (ProbeCacheLookup(&cache))
+		{
+			cached = 1;
+			FlashRestoreProbe(flash, &cache);
+			goto probed;
+		}
+	}
+
+	flash->id = spi_flash_id_lookup(jedec_id, ext_id);
+
+	/* SST AAI parts predate SFDP, and their tables are not trustworthy unless listed with SFDP */
+	if (flash->id && ((flash->id->flags & SF_NO_SFDP) || (flash->id->flags & (SF_SST | SF_SFDP)) == SF_SST))
+		flash->sfdp = NULL;
+	else
+		flash->sfdp = SfdpProbe(flash->dev, flash->cs, jedec_id, ext_id, &flash->sfdp_buf) ? &flash->sfdp_buf : NULL;
+
+	if (flash->id && (flash->id->flags & SF_SFDP) && !flash->sfdp)
+		Message(MSG_WARNING, "Warning: %s is listed with SFDP but no valid tables were read.\n", flash->id->model);
+
+	if (!flash->id && flash->sfdp)
+		flash->id = FlashIdFromSfdp(flash, jedec_id, flash->sfdp);
+
+	if (!flash->id)
+		flash->id = FlashIdFromWraparound(flash, jedec_id);
+
+	if (flash->id)
+	{
+		if (flash->sfdp && flash->sfdp->size != flash->id->size)
+		{
+			Message(MSG_WARNING, "Warning: SFDP reports %uKiB but %s is listed as %uKiB, ignoring SFDP.\n",
+				flash->sfdp->size >> 10, flash->id->model, flash->id->size >> 10);
+			flash->sfdp = NULL;
+		}
+
+		FlashSetupGeometry(flash);
+
+		/* Catch relabeled parts and wrong table entries */
+		detected_size = FlashDetectSize(flash);
+		if (detected_size && detected_size != flash->id->size)
+		{
+			Message(MSG_WARNING, "Warning: %s is listed as %uKiB but addresses wrap around at %uKiB.\n",
+				flash->id->model, flash->id->size >> 10, detected_size >> 10);
+		}
+	}
+	else
+	{
+		Message(MSG_ERROR, "Error: unrecognised flash found.\n");
+		return false;
+	}
+
+	if (!flash->num_erase_types)
+	{
+		Message(MSG_ERROR, "Error: no erase type known for %s.\n", flash->id->model);
+		return false;
+	}
+
+probed:
+	if (flash->id->flags & SF_INIT_SR)
+		pre_unlock = 1;
+
+	if (flash->id->flags & SF_SST)
+		flash->sst_write = 1;
+
+	/* A cached part was unlocked before, skip the write if it still is */
+	if (pre_unlock && cached)
+	{
+		if (!ReadStatusRegister(flash, sr))
+			return false;
+
+		pre_unlock = sr != 0;
+	}
+
+	if (pre_unlock)
+	{
+		if (!WriteEnable(flash))
+			return false;
+		if (!WriteStatusRegister(flash, 0))
+			return false;
+	}
+	else if (flash->id && flash->id->flags & SF_BP_ALL)
+	{
+		if (!ReadStatusRegister(flash, sr))
+			return false;
+
+		if (flash->id->flags & SF_BP0_2)
+			mask |= SR_BP0_2_MASK;
+
+		if (flash->id->flags & SF_BP3)
+			mask |= SR_BP3_MASK;
+
+		if (flash->id->flags & SF_BP4)
+			mask |= SR_BP4_MASK;
+
+		if (sr & mask)
+		{
+			sr &= ~mask;
+			if (!WriteEnable(flash))
+				return false;
+			if (!WriteStatusRegister(flash, sr))
+				return false;
+			if (!FlashPoll(flash))
+				return false;
+		}
+	}
+
+	/* This one saw transfers fail and is done over, keep quiet about it */
+	if (CH341DeviceErrorCount(flash->dev) != errors)
+		return false;
+
+	if (!flash->quiet)
+	{
+		printf("Flash: %s\n", flash->id->model);
+		printf("Capacity: %dKiB\n", flash->id->size >> 10);
+		printf("Sector size: %dKiB\n", flash->erase_size >> 10);
+
+		if (flash->sfdp)
+			SfdpShowInfo(flash->sfdp);
+
+		if (cached)
+			printf("Geometry: cached%s\n", cache.sfdp ? " (from SFDP)" : "");
+
+		printf("\n");
+	}
+
+	if (!cached && cache.location[0])
+		FlashSaveProbe(flash, &cache);
+
+	flash->probed = 1;
+
+	return true;
+}
+
+/*
+ * A probe which saw failed transfers may have misread the chip, it is done
+ * over from scratch then. Without transfer errors its outcome stands.
+ */
+bool SpiFlashProbe(spi_flash *flash)
+{
+	unsigned int attempt = 0, errors;
+	unsigned long long metric_start;
+	bool ret;
+
+	if (flash->probed)
+		return true;
+
+	profile_scope scope(PROF_PROBE);
+
+	metric_start = FlashMetricsBegin(flash, METRIC_OP_PROBE);
+	flash->dev->retry_depth++;
+
+	while (true)
+	{
+		errors = CH341DeviceErrorCount(flash->dev);
+		ret = FlashProbeOnce(flash, errors);
+
+		if (errors == CH341DeviceErrorCount(flash->dev))
+			break;
+
+		flash->probed = 0;
+		flash->id = NULL;
+		flash->sfdp = NULL;
+		ret = false;
+
+		if (!FlashRetry(flash, &attempt, FLASH_NO_ADDR, "probe", false))
+			break;
+	}
+
+	flash->dev->retry_depth--;
+	FlashMetricsEnd(flash, METRIC_OP_PROBE, metric_start, ret);
+	return ret;
+}
+
+unsigned int SpiFlashGetSize(spi_flash *flash)
+{
+	return flash->id->size;
+}
+
+/* Selects the chip and sends the read command, the data then follows with CH341DeviceReadSPI */
+static bool FlashReadCommand(spi_flash *flash, unsigned int addr)
+{
+	unsigned char op[5];
+
+	op[0] = flash->read_op;
+	AddrToCmd(flash, addr % flash->id->size, &op[1]);
+
+	return CH341DeviceSelectWrite(flash->dev, flash->cs, op, CmdSize(flash));
+}
+
+bool SpiFlashReadEx(spi_flash *flash, unsigned int addr, unsigned int len, unsigned char *buf, FlashReadCallback cb, void *arg)
+{
+	unsigned char *chunk_buf = NULL, *chunk;
+	unsigned int len_read, len_to_read, got, n, attempt = 0;
+	unsigned long long start_us, metric_start, chunk_start = 0;
+	double secs;
+	bool streaming = false, ret = false;
+
+	if (!len)
+		return true;
+
+	if (!buf && !cb)
+		return false;
+
+	metric_start = FlashMetricsBegin(flash, METRIC_OP_READ);
+
+	/* Without a caller buffer, chunks are only handed to the callback */
+	if (!buf)
+		chunk_buf = new unsigned char[DATA_READ_LENGTH];
+
+	flash->dev->retry_depth++;
+
+	if (!FlashSwitchAddressMode(flash, 1))
+		goto _out;
+
+	if (!FlashProgressInit(flash))
+		goto _cancelled;
+
+	start_us = ProfileNowUs();
+
+	len_read = 0;
+	got = 0;
+
+	while (len_read < len)
+	{
+		profile_scope scope(PROF_READ);
+
+		CH341DeviceOpBegin(flash->dev, CH341_OP_READ);
+
+		/* A retried chunk counts from its first attempt */
+		if (!got && !attempt)
+			chunk_start = PROBE_START(read_chunk);
+
+		len_to_read = len - len_read > DATA_READ_LENGTH ? DATA_READ_LENGTH : len - len_read;
+		chunk = buf ? buf + len_read : chunk_buf;
+
+		/* After a failure the read is started again where the data stopped arriving */
+		if (!streaming)
+			streaming = FlashReadCommand(flash, addr + len_read + got);
+
+		if (streaming)
+		{
+			streaming = CH341DeviceReadSPIPartial(flash->dev, chunk + got, len_to_read - got, &n);
+			got += n;
+
+			/* Only failures without any data coming in between count as in a row */
+			if (n)
+				attempt = 0;
+		}
+
+		if (!streaming)
+		{
+			if (!FlashRetry(flash, &attempt, addr + len_read + got, "read", false))
+				goto _release;
+
+			continue;
+		}
+
+		attempt = 0;
+		got = 0;
+
+		CH341DeviceOpEnd(flash->dev, len_to_read);
+		MetricsAddBytes(METRIC_OP_READ, len_to_read);
+		PROBE3(read_chunk, addr + len_read, len_to_read, PROBE_SINCE(chunk_start));
+
+		if (cb && !cb(addr + len_read, chunk, len_to_read, arg))
+			goto _release;
+
+		len_read += len_to_read;
+
+		if (!FlashProgressShow(flash, len_read, len))
+			goto _cancelled;
+	}
+
+	secs = FlashElapsed(start_us);
+
+	FlashProgressDone(flash);
+
+	if (!flash->quiet)
+	{
+		printf("Time used: %.2fs\n", secs);
+		printf("Speed: %.2fKiB/s\n", len / 1024.0 / secs);
+	}
+
+	if (!CH341DeviceChipSelect(flash->dev, flash->cs, false) && !FlashRetry(flash, &attempt, addr + len, "read", false))
+		goto _out;
+
+	ret = FlashSwitchAddressMode(flash, 0);
+	goto _out;
+
+_cancelled:
+	Message(MSG_ERROR, "Error: operation cancelled.\n");
+
+_release:
+	CH341DeviceChipSelect(flash->dev, flash->cs, false);
+	FlashSwitchAddressMode(flash, 0);
+
+_out:
+	CH341DeviceOpBegin(flash->dev, CH341_OP_OTHER);
+	flash->dev->retry_depth--;
+	delete[] chunk_buf;
+	FlashMetricsEnd(flash, METRIC_OP_READ, metric_start, ret);
+	return ret;
+}
+
+bool SpiFlashRead(spi_flash *flash, unsigned int addr, unsigned int len, unsigned char *buf)
+{
+	if (!buf)
+		return false;
+
+	return SpiFlashReadEx(flash, addr, len, buf, NULL, NULL);
+}
+
+bool SpiFlashBegin(spi_flash *flash)
+{
+	if (!FlashSwitchAddressMode(flash, 1))
+		return false;
+
+	flash->addr_mode_hold++;
+	return true;
+}
+
+/* Also usable without a matching Begin, to get a chip back to 3-byte mode after a failure */
+bool SpiFlashEnd(spi_flash *flash)
+{
+	if (flash->addr_mode_hold && --flash->addr_mode_hold)
+		return true;
+
+	return FlashSwitchAddressMode(flash, 0);
+}
+
+/*
+ * Puts the chip back the way a boot ROM expects it, whatever an interrupted
+ * or failed operation left behind: deselected, done with any program or
+ * erase, write disabled and so out of SST AAI mode, in 3-byte mode. Any
+ * SpiFlashBegin is dropped.
+ */
+bool SpiFlashRelease(spi_flash *flash)
+{
+	bool ret;
+
+	if (!flash->probed)
+		return CH341DeviceChipSelect(flash->dev, flash->cs, false);
+
+	flash->dev->retry_depth++;
+
+	ret = CH341DeviceChipSelect(flash->dev, flash->cs, false) && FlashPoll(flash) &&
+		(flash->sst_write ? FlashAAIExit(flash) : WriteDisable(flash));
+
+	flash->addr_mode_hold = 0;
+	ret = FlashSwitchAddressMode(flash, 0) && ret;
+
+	flash->dev->retry_depth--;
+	return ret;
+}
+
+bool SpiFlashIsBusy(spi_flash *flash, bool *busy)
+{
+	unsigned int sr;
+
+	if (!ReadStatusRegister(flash, sr))
+		return false;
+
+	*busy = !!(sr & 1);
+	return true;
+}
+
+bool SpiFlashEraseStart(spi_flash *flash, unsigned int addr, const flash_erase_type *et)
+{
+	unsigned char cmd[5];
+
+	cmd[0] = et->opcode;
+	AddrToCmd(flash, addr, &cmd[1]);
+
+	if (!WriteEnable(flash))
+		return false;
+
+	return SPIDevWrite(flash->dev, flash->cs, cmd, CmdSize(flash));
+}
+
+static bool FlashEraseBlock(spi_flash *flash, unsigned int addr, const flash_erase_type *et)
+{
+	if (!SpiFlashEraseStart(flash, addr, et))
+		return false;
+
+	return FlashPollErase(flash, et->typ_ms);
+}
+
+/* Largest erase type which is aligned at addr and does not overrun end */
+const flash_erase_type *SpiFlashPlanErase(spi_flash *flash, unsigned int addr, unsigned int end)
+{
+	unsigned int i;
+
+	for (i = flash->num_erase_types; i > 1; i--)
+	{
+		if (!(addr % flash->erase_types[i - 1].size) && end - addr >= flash->erase_types[i - 1].size)
+			return &flash->erase_types[i - 1];
+	}
+
+	return &flash->erase_types[0];
+}
+
+bool SpiFlashErase(spi_flash *flash, unsigned int addr, unsigned int len)
+{
+	unsigned int num_sectors, size_erased, end, attempt = 0;
+	const flash_erase_type *et;
+	unsigned long long start_us, metric_start, block_start;
+	double secs;
+	bool ret = false, ok;
+
+	if (addr % flash->erase_size)
+	{
+		Message(MSG_ERROR, "Error: start address is not on erase boundary.\n");
+		return false;
+	}
+
+	if ((addr + len) % flash->erase_size)
+	{
+		Message(MSG_ERROR, "Error: end address is not on erase boundary.\n");
+		return false;
+	}
+
+	if ((addr > flash->id->size) || (addr + len > flash->id->size))
+	{
+		Message(MSG_ERROR, "Error: end address exceeds flash capacity.\n");
+		return false;
+	}
+
+	metric_start = FlashMetricsBegin(flash, METRIC_OP_ERASE);
+	flash->dev->retry_depth++;
+
+	if (!FlashSwitchAddressMode(flash, 1))
+		goto _out;
+
+	if (!FlashProgressInit(flash))
+		goto _cancelled;
+
+	start_us = ProfileNowUs();
+
+	size_erased = 0;
+	num_sectors = 0;
+	end = addr + len;
+
+	/* 每次选用对齐且不越界的最大擦除块 */
+	while (addr < end)
+	{
+		profile_scope scope(PROF_ERASE);
+
+		CH341DeviceOpBegin(flash->dev, CH341_OP_ERASE);
+
+		et = SpiFlashPlanErase(flash, addr, end);
+
+		PROBE2(erase_start, addr, et->size);
+		block_start = PROBE_START(erase_end);
+
+		ok = FlashEraseBlock(flash, addr, et);
+
+		PROBE4(erase_end, addr, et->size, ok, PROBE_SINCE(block_start));
+
+		/* Erasing a block once more does no harm */
+		if (!ok)
+		{
+			if (!FlashRetry(flash, &attempt, addr, "erase", true))
+				goto _failed;
+
+			continue;
+		}
+
+		CH341DeviceOpEnd(flash->dev, et->size);
+		MetricsAddBytes(METRIC_OP_ERASE, et->size);
+
+		attempt = 0;
+		addr += et->size;
+		size_erased += et->size;
+		num_sectors++;
+
+		if (!FlashProgressShow(flash, size_erased, len))
+			goto _cancelled;
+	}
+
+	secs = FlashElapsed(start_us);
+
+	FlashProgressDone(flash);
+
+	if (!flash->quiet)
+	{
+		printf("Time used: %.2fs\n", secs);
+		printf("Speed: %.2fKiB/s, %.2fsec/s\n", len / 1024.0 / secs, num_sectors / secs);
+	}
+
+	ret = FlashSwitchAddressMode(flash, 0);
+	goto _out;
+
+_cancelled:
+	Message(MSG_ERROR, "Error: operation cancelled.\n");
+
+_failed:
+	/* Never leave the chip in 4-byte mode, a 3-byte-only boot ROM could not read it */
+	FlashSwitchAddressMode(flash, 0);
+
+_out:
+	CH341DeviceOpBegin(flash->dev, CH341_OP_OTHER);
+	flash->dev->retry_depth--;
+	FlashMetricsEnd(flash, METRIC_OP_ERASE, metric_start, ret);
+	return ret;
+}
+
+bool SpiFlashChipErase(spi_flash *flash)
+{
+	profile_scope scope(PROF_ERASE);
+	unsigned char cmd;
+	unsigned long long start_us, metric_start;
+	bool ret;
+
+	cmd = SPI_CMD_CHIP_ERASE;
+
+	metric_start = FlashMetricsBegin(flash, METRIC_OP_ERASE);
+	CH341DeviceOpBegin(flash->dev, CH341_OP_ERASE);
+
+	if (!WriteEnable(flash) || !SPIDevWrite(flash->dev, flash->cs, &cmd, 1))
+	{
+		CH341DeviceOpBegin(flash->dev, CH341_OP_OTHER);
+		FlashMetricsEnd(flash, METRIC_OP_ERASE, metric_start, false);
+		return false;
+	}
+
+	start_us = ProfileNowUs();
+
+	ret = FlashPollErase(flash, flash->chip_erase_ms);
+
+	if (ret)
+	{
+		CH341DeviceOpEnd(flash->dev, SpiFlashGetSize(flash));
+		MetricsAddBytes(METRIC_OP_ERASE, SpiFlashGetSize(flash));
+	}
+	else
+	{
+		CH341DeviceOpBegin(flash->dev, CH341_OP_OTHER);
+	}
+
+	FlashMetricsEnd(flash, METRIC_OP_ERASE, metric_start, ret);
+
+	if (!flash->quiet)
+	{
+		printf("Time used: %.2fs\n", FlashElapsed(start_us));
+	}
+
+	return ret;
+}
+
+/* len must not cross a page boundary */
+bool SpiFlashProgramStart(spi_flash *flash, unsigned int addr, const unsigned char *buff, const unsigned char *encoded,
+	unsigned int len)
+{
+	unsigned char op[5];
+
+	op[0] = flash->program_op;
+	AddrToCmd(flash, addr, &op[1]);
+
+	if (!WriteEnable(flash))
+		return false;
+
+	if (!CH341DeviceChipSelect(flash->dev, flash->cs, true))
+		return false;
+
+	if (!CH341DeviceWriteSPI(flash->dev, op, CmdSize(flash)))
+		return false;
+
+	if (encoded)
+	{
+		if (!CH341DeviceWriteSPIEncoded(flash->dev, encoded, len))
+			return false;
+	}
+	else if (!CH341DeviceWriteSPI(flash->dev, buff, len))
+	{
+		return false;
+	}
+
+	return CH341DeviceChipSelect(flash->dev, flash->cs, false);
+}
+
+static bool FlashPageProgram(spi_flash *flash, unsigned int addr, const unsigned char *buff, const unsigned char *encoded,
+	unsigned int len)
+{
+	unsigned int bytes_written = 0, bytes_to_write, bytes_left;
+	unsigned int dst, attempt = 0;
+	unsigned long long start_us, page_start;
+	double secs;
+	bool ret = false, ok;
+
+	flash->dev->retry_depth++;
+
+	if (!FlashSwitchAddressMode(flash, 1))
+		goto _out;
+
+	if (!FlashProgressInit(flash))
+		goto _cancelled;
+
+	start_us = ProfileNowUs();
+
+	bytes_left = len;
+	while (bytes_written < len)
+	{
+		profile_scope scope(PROF_PROGRAM);
+
+		CH341DeviceOpBegin(flash->dev, CH341_OP_PROGRAM);
+
+		dst = addr + bytes_written;
+		bytes_to_write = min(bytes_left, flash->page_size - (dst % flash->page_size));
+
+		PROBE2(program_start, dst, bytes_to_write);
+		page_start = PROBE_START(program_end);
+
+		/*
+		 * A failed attempt may have programmed part of the page already,
+		 * programming the same data over it again leaves it as it is.
+		 */
+		ok = SpiFlashProgramStart(flash, dst, buff + bytes_written, encoded ? encoded + bytes_written : NULL, bytes_to_write) &&
+			FlashPoll(flash);
+
+		PROBE4(program_end, dst, bytes_to_write, ok, PROBE_SINCE(page_start));
+
+		if (!ok)
+		{
+			if (!FlashRetry(flash, &attempt, dst, "page program", true))
+				goto _failed;
+
+			continue;
+		}
+
+		CH341DeviceOpEnd(flash->dev, bytes_to_write);
+		MetricsAddBytes(METRIC_OP_WRITE, bytes_to_write);
+
+		attempt = 0;
+		bytes_left -= bytes_to_write;
+		bytes_written += bytes_to_write;
+
+		if (!FlashProgressShow(flash, bytes_written, len))
+			goto _cancelled;
+	}
+
+	secs = FlashElapsed(start_us);
+
+	FlashProgressDone(flash);
+
+	if (!flash->quiet)
+	{
+		printf("Time used: %.2fs\n", secs);
+		printf("Speed: %.2fKiB/s\n", len / 1024.0 / secs);
+	}
+
+	ret = FlashSwitchAddressMode(flash, 0);
+	goto _out;
+
+_cancelled:
+	Message(MSG_ERROR, "Error: operation cancelled.\n");
+
+_failed:
+	FlashSwitchAddressMode(flash, 0);
+
+_out:
+	CH341DeviceOpBegin(flash->dev, CH341_OP_OTHER);
+	flash->dev->retry_depth--;
+	return ret;
+}
+
+static bool FlashSSTAAIProgram(spi_flash *flash, unsigned int addr, const unsigned char *buff, unsigned int len)
+{
+	unsigned char op[6];
+	unsigned int dst = 0, bytes_written = 0;
+	int addr_sent = 0;
+	bool cancelled = false;
+	unsigned long long start_us;
+	double secs;
+
+	if (!FlashProgressInit(flash))
+		goto _cancelled;
+
+	start_us = ProfileNowUs();
+
+	if (addr % 2)
+	{
+		if (!SpiFlashProgramStart(flash, addr, buff, NULL, 1))
+			return false;
+
+		if (!FlashPoll(flash))
+			return false;
+
+		dst++;
+		MetricsAddBytes(METRIC_OP_WRITE, 1);
+	}
+
+	if (!WriteEnable(flash))
+		return false;
+
+	op[0] = SPI_CMD_AAI_WP;
+	AddrToCmd3(addr + dst, &op[1]);
+
+	/* Once AAI_WP went out every way out of the loop has to end AAI mode */
+	while (len - dst >= 2)
+	{
+		if (!addr_sent)
+		{
+			op[4] = buff[dst++];
+			op[5] = buff[dst++];
+
+			if (!SPIDevWrite(flash->dev, flash->cs, op, 6))
+				goto _aai_failed;
+
+			addr_sent = 1;
+		}
+		else
+		{
+			op[1] = buff[dst++];
+			op[2] = buff[dst++];
+
+			if (!SPIDevWrite(flash->dev, flash->cs, op, 3))
+				goto _aai_failed;
+		}
+
+		if (!FlashPoll(flash))
+			goto _aai_failed;
+
+		bytes_written += 2;
+		MetricsAddBytes(METRIC_OP_WRITE, 2);
+
+		if (bytes_written % 256 == 0 && !FlashProgressShow(flash, bytes_written, len))
+		{
+			cancelled = true;
+			goto _aai_failed;
+		}
+	}
+
+	if (!FlashAAIExit(flash))
+		return false;
+
+	if (dst < len)
+	{
+		if (!SpiFlashProgramStart(flash, addr + dst, buff + dst, NULL, 1))
+			return false;
+
+		if (!FlashPoll(flash))
+			return false;
+
+		dst++;
+		MetricsAddBytes(METRIC_OP_WRITE, 1);
+	}
+
+	secs = FlashElapsed(start_us);
+
+	FlashProgressDone(flash);
+
+	if (!flash->quiet)
+	{
+		printf("Time used: %.2fs\n", secs);
+		printf("Speed: %.2fKiB/s\n", len / 1024.0 / secs);
+	}
+
+	if (!WriteDisable(flash))
+		return false;
+
+	return true;
+
+_aai_failed:
+	FlashAAIExit(flash);
+
+	if (!cancelled)
+		return false;
+
+_cancelled:
+	Message(MSG_ERROR, "Error: operation cancelled.\n");
+	return false;
+}
+
+/* encoded, if given, is buff already passed through CH341EncodeSPI and is sent as is */
+bool SpiFlashWriteEx(spi_flash *flash, unsigned int addr, const unsigned char *buff, const unsigned char *encoded, unsigned int len)
+{
+	unsigned long long metric_start;
+	bool ret;
+
+	if (!buff)
+		return false;
+
+	if ((addr > flash->id->size) || (addr + len > flash->id->size))
+	{
+		Message(MSG_ERROR, "Error: write address exceeds flash capacity.\n");
+		return false;
+	}
+
+	metric_start = FlashMetricsBegin(flash, METRIC_OP_WRITE);
+
+	if (flash->sst_write)
+		ret = FlashSSTAAIProgram(flash, addr, buff, len);
+	else
+		ret = FlashPageProgram(flash, addr, buff, encoded, len);
+
+	FlashMetricsEnd(flash, METRIC_OP_WRITE, metric_start, ret);
+
+	return ret;
+}
+
+bool SpiFlashWrite(spi_flash *flash, unsigned int addr, unsigned char *buff, unsigned int len)
+{
+	return SpiFlashWriteEx(flash, addr, buff, NULL, len);
+}
+
+void SpiFlashInit(spi_flash *flash, ch341_device *dev, unsigned int cs)
+{
+	memset(flash, 0, sizeof (*flash));
+	flash->dev = dev;
+	flash->cs = cs;
+}
+
+spi_flash *FlashDefault(void)
+{
+	if (!default_flash.dev)
+		SpiFlashInit(&default_flash, CH341DefaultDevice(), 0);
+
+	return &default_flash;
+}
+
+bool FlashProbe(void)
+{
+	return SpiFlashProbe(FlashDefault());
+}
+
+unsigned int FlashGetSize(void)
+{
+	return SpiFlashGetSize(FlashDefault());
+}
+
+bool FlashRead(unsigned int addr, unsigned int len, unsigned char *buf)
+{
+	return SpiFlashRead(FlashDefault(), addr, len, buf);
+}
+
+bool FlashReadEx(unsigned int addr, unsigned int len, unsigned char *buf, FlashReadCallback cb, void *arg)
+{
+	return SpiFlashReadEx(FlashDefault(), addr, len, buf, cb, arg);
+}
+
+bool FlashErase(unsigned int addr, unsigned int len)
+{
+	return SpiFlashErase(FlashDefault(), addr, len);
+}
+
+bool FlashChipErase(void)
+{
+	return SpiFlashChipErase(FlashDefault());
+}
+
+bool FlashWrite(unsigned int addr, unsigned char *buff, unsigned int len)
+{
+	return SpiFlashWrite(FlashDefault(), addr, buff, len);
+}
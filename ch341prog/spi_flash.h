@@ -1,105 +1,215 @@
-#ifndef _SPI_FLASH_H_
-#define _SPI_FLASH_H_
-
-typedef struct _spi_flash_id
-{
-	const char *model;
-	unsigned int jedec_id;
-	unsigned int ext_id;
-	unsigned int size;
-	unsigned int flags;
-} spi_flash_id;
-
-const spi_flash_id *spi_flash_id_lookup(unsigned int jedec_id, unsigned int ext_id);
-
-bool FlashProbe(void);
-unsigned int FlashGetSize(void);
-bool FlashRead(unsigned int addr, unsigned int len, unsigned char *buf);
-bool FlashErase(unsigned int addr, unsigned int len);
-bool FlashChipErase(void);
-bool FlashWrite(unsigned int addr, unsigned char *buff, unsigned int len);
-
-#define SECTOR_4KB		(4 << 10)
-#define SECTOR_32KB		(32 << 10)
-#define SECTOR_64KB		(64 << 10)
-#define SECTOR_256KB	(256 << 10)
-
-#define SIZE_1MB		(1 << 20)
-#define SIZE_2MB		(2 << 20)
-#define SIZE_4MB		(4 << 20)
-#define SIZE_8MB		(8 << 20)
-#define SIZE_16MB		(16 << 20)
-#define SIZE_32MB		(32 << 20)
-#define SIZE_64MB		(64 << 20)
-#define SIZE_128MB		(128 << 20)
-#define SIZE_256MB		(256 << 20)
-
-#define SF_64K_BLOCK	0x1
-#define SF_32K_BLOCK	0x2
-#define SF_256K_BLOCK	0x4
-#define SF_4K_SECTOR	0x8
-#define SF_4K_PMC		0x10
-#define SF_SST			0x20
-#define SF_INIT_SR		0x40
-#define SF_BP0_2		0x80
-#define SF_BP3			0x100
-#define SF_BP4			0x200
-
-#define SF_BP0_3		(SF_BP0_2 | SF_BP3)
-#define SF_BP0_4		(SF_BP0_2 | SF_BP3 | SF_BP4)
-#define SF_BP_ALL		SF_BP0_4
-
-#define SR_BP0_2_MASK	0x1c
-#define SR_BP3_MASK		0x20
-#define SR_BP4_MASK		0x40
-
-
-#define SPI_CMD_WRSR				0x01
-#define SPI_CMD_RDSR				0x05
-
-#define SPI_CMD_WRBR				0x17
-
-#define SPI_CMD_WRDI				0x04
-#define SPI_CMD_WREN				0x06
-
-#define SPI_CMD_PAGE_PROG			0x02
-#define SPI_CMD_READ				0x03
-
-#define	SPI_CMD_AAI_WP				0xad
-
-#define SPI_CMD_4KB_PMC_ERASE		0xd7
-#define SPI_CMD_SECTOR_ERASE		0x20
-#define SPI_CMD_32KB_BLOCK_ERASE	0x52
-#define SPI_CMD_64KB_BLOCK_ERASE	0xd8
-#define SPI_CMD_CHIP_ERASE			0xc7
-
-#define SPI_CMD_RDID				0x9f
-
-#define SPI_CMD_RESET_ENABLE		0x66
-#define SPI_CMD_RESET_DEVICE		0x99
-
-#define SPI_CMD_ENTER_4B_MODE		0xb7
-#define SPI_CMD_EXIT_4B_MODE		0xe9
-
-/* EON */
-#define SPI_CMD_EXIT_HBL_MODE		0x98
-
-/* Winbond */
-#define SPI_CMD_WREAR				0xc5
-
-#define JEDEC_MFR(_id)				(((_id) >> 16) & 0xff)
-#define JEDEC_SIZE(_id)				((_id) & 0xff)
-
-#define MFR_SST						0xbf
-#define MFR_EON						0x1c
-#define MFR_ISSI					0x9d
-#define MFR_ATMEL					0x1f
-#define MFR_MICROM					0x20
-#define MFR_WINBOND					0xef
-#define MFR_MACRONIX				0xc2
-#define MFR_SPANSION				0x01
-#define MFR_GIGADEVICE				0xc8
-
-#define PAGE_SIZE					0x100
-
-#endif /* _SPI_FLASH_H_ */
+#ifndef _SPI_FLASH_H_
+#define _SPI_FLASH_H_
+
+#include "ch341.h"
+#include "sfdp.h"
+
+typedef struct _spi_flash_id
+{
+	const char *model;
+	unsigned int jedec_id;
+	unsigned int ext_id;
+	unsigned int size;
+	unsigned int flags;
+
+	/* Optional, 0 means unknown and SFDP or defaults are used */
+	unsigned int page_size;
+	unsigned int page_prog_us;
+	unsigned int erase_4k_ms;
+	unsigned int erase_32k_ms;
+	unsigned int erase_64k_ms;	/* D8h block erase, whatever its size */
+	unsigned int chip_erase_ms;
+} spi_flash_id;
+
+const spi_flash_id *spi_flash_id_lookup(unsigned int jedec_id, unsigned int ext_id);
+int spi_flash_db_load(const char *filename);
+/* Tells apart the sets of chip definitions loaded on top of the built-in table, 0 if none were */
+unsigned int spi_flash_db_hash(void);
+
+/* Called for every chunk as it arrives from the chip, return false to abort */
+typedef bool (*FlashReadCallback)(unsigned int addr, const unsigned char *data, unsigned int len, void *arg);
+
+#define MAX_ERASE_TYPES				4
+
+typedef struct _flash_erase_type
+{
+	unsigned int size;
+	unsigned char opcode;
+	unsigned char opcode_4b;
+	unsigned int typ_ms;
+} flash_erase_type;
+
+/* Percentage of the running erase/write/read, return false to cancel it */
+typedef bool (*FlashProgressCallback)(int percentage, void *arg);
+
+/* A chip on one CS line of a programmer, with everything learned by probing it */
+typedef struct _spi_flash
+{
+	ch341_device *dev;
+	unsigned int cs;
+
+	/* quiet keeps the session off stdout, for sessions running in parallel */
+	bool quiet;
+	FlashProgressCallback progress;
+	void *progress_arg;
+	int progress_last;
+
+	/* The last read, erase or write was stopped by the callback or an interrupt */
+	bool cancelled;
+
+	int probed;
+	const spi_flash_id *id;
+	const sfdp_info *sfdp;
+	sfdp_info sfdp_buf;
+	spi_flash_id probed_id;
+	char probed_model[32];
+
+	unsigned int erase_size;
+	unsigned char erase_op;
+	flash_erase_type erase_types[MAX_ERASE_TYPES];
+	unsigned int num_erase_types;
+	unsigned int page_size;
+	unsigned int page_prog_us;
+	unsigned int chip_erase_ms;
+	unsigned char read_op;
+	unsigned char program_op;
+	unsigned char addr_width;
+	unsigned char use_4b_opcodes;
+	unsigned char sst_write;
+	unsigned int addr4b_enter;	/* SFDP_4B_ENTER_* of the chip, also when probed from the cache */
+
+	/* Nesting of SpiFlashBegin, the address mode is left alone while non-zero */
+	unsigned int addr_mode_hold;
+} spi_flash;
+
+void SpiFlashInit(spi_flash *flash, ch341_device *dev, unsigned int cs);
+bool SpiFlashProbe(spi_flash *flash);
+unsigned int SpiFlashGetSize(spi_flash *flash);
+bool SpiFlashRead(spi_flash *flash, unsigned int addr, unsigned int len, unsigned char *buf);
+bool SpiFlashReadEx(spi_flash *flash, unsigned int addr, unsigned int len, unsigned char *buf, FlashReadCallback cb, void *arg);
+bool SpiFlashErase(spi_flash *flash, unsigned int addr, unsigned int len);
+bool SpiFlashChipErase(spi_flash *flash);
+bool SpiFlashWrite(spi_flash *flash, unsigned int addr, unsigned char *buff, unsigned int len);
+bool SpiFlashWriteEx(spi_flash *flash, unsigned int addr, const unsigned char *buff, const unsigned char *encoded, unsigned int len);
+
+/*
+ * Single steps which return while the chip is still busy, so that chips on
+ * other CS lines can be served meanwhile. Begin/End bracket a sequence of
+ * them with the address mode set up, completion is polled with IsBusy.
+ * Any operation between Begin and End keeps the address mode as it is.
+ */
+bool SpiFlashBegin(spi_flash *flash);
+bool SpiFlashEnd(spi_flash *flash);
+bool SpiFlashRelease(spi_flash *flash);
+const flash_erase_type *SpiFlashPlanErase(spi_flash *flash, unsigned int addr, unsigned int end);
+bool SpiFlashEraseStart(spi_flash *flash, unsigned int addr, const flash_erase_type *et);
+bool SpiFlashProgramStart(spi_flash *flash, unsigned int addr, const unsigned char *buff, const unsigned char *encoded,
+	unsigned int len);
+bool SpiFlashIsBusy(spi_flash *flash, bool *busy);
+
+/* Chip on CS0 of the default programmer */
+spi_flash *FlashDefault(void);
+
+bool FlashProbe(void);
+unsigned int FlashGetSize(void);
+bool FlashRead(unsigned int addr, unsigned int len, unsigned char *buf);
+bool FlashReadEx(unsigned int addr, unsigned int len, unsigned char *buf, FlashReadCallback cb, void *arg);
+bool FlashErase(unsigned int addr, unsigned int len);
+bool FlashChipErase(void);
+bool FlashWrite(unsigned int addr, unsigned char *buff, unsigned int len);
+
+#define SECTOR_4KB		(4 << 10)
+#define SECTOR_32KB		(32 << 10)
+#define SECTOR_64KB		(64 << 10)
+#define SECTOR_256KB	(256 << 10)
+
+#define SIZE_1MB		(1 << 20)
+#define SIZE_2MB		(2 << 20)
+#define SIZE_4MB		(4 << 20)
+#define SIZE_8MB		(8 << 20)
+#define SIZE_16MB		(16 << 20)
+#define SIZE_32MB		(32 << 20)
+#define SIZE_64MB		(64 << 20)
+#define SIZE_128MB		(128 << 20)
+#define SIZE_256MB		(256 << 20)
+
+#define SF_64K_BLOCK	0x1
+#define SF_32K_BLOCK	0x2
+#define SF_256K_BLOCK	0x4
+#define SF_4K_SECTOR	0x8
+#define SF_4K_PMC		0x10
+#define SF_SST			0x20
+#define SF_INIT_SR		0x40
+#define SF_BP0_2		0x80
+#define SF_BP3			0x100
+#define SF_BP4			0x200
+#define SF_4B_OPCODES	0x400	/* 13h/12h/21h/DCh with 4-byte address */
+#define SF_SFDP			0x800	/* SFDP tables are present, read them even on SST parts */
+#define SF_NO_SFDP		0x1000	/* SFDP is known to be absent, don't probe */
+
+#define SF_BP0_3		(SF_BP0_2 | SF_BP3)
+#define SF_BP0_4		(SF_BP0_2 | SF_BP3 | SF_BP4)
+#define SF_BP_ALL		SF_BP0_4
+
+#define SR_BP0_2_MASK	0x1c
+#define SR_BP3_MASK		0x20
+#define SR_BP4_MASK		0x40
+
+
+#define SPI_CMD_WRSR				0x01
+#define SPI_CMD_RDSR				0x05
+
+#define SPI_CMD_WRBR				0x17
+
+#define SPI_CMD_WRDI				0x04
+#define SPI_CMD_WREN				0x06
+
+#define SPI_CMD_PAGE_PROG			0x02
+#define SPI_CMD_READ				0x03
+
+#define SPI_CMD_PAGE_PROG_4B		0x12
+#define SPI_CMD_READ_4B				0x13
+#define SPI_CMD_SECTOR_ERASE_4B		0x21
+#define SPI_CMD_64KB_BLOCK_ERASE_4B	0xdc
+
+#define	SPI_CMD_AAI_WP				0xad
+
+#define SPI_CMD_4KB_PMC_ERASE		0xd7
+#define SPI_CMD_SECTOR_ERASE		0x20
+#define SPI_CMD_32KB_BLOCK_ERASE	0x52
+#define SPI_CMD_64KB_BLOCK_ERASE	0xd8
+#define SPI_CMD_CHIP_ERASE			0xc7
+
+#define SPI_CMD_RDID				0x9f
+#define SPI_CMD_READ_SFDP			0x5a
+#define SPI_CMD_READ_UID			0x4b
+
+#define SPI_CMD_RESET_ENABLE		0x66
+#define SPI_CMD_RESET_DEVICE		0x99
+
+#define SPI_CMD_ENTER_4B_MODE		0xb7
+#define SPI_CMD_EXIT_4B_MODE		0xe9
+
+/* EON */
+#define SPI_CMD_EXIT_HBL_MODE		0x98
+
+/* Winbond */
+#define SPI_CMD_WREAR				0xc5
+
+#define JEDEC_MFR(_id)				(((_id) >> 16) & 0xff)
+#define JEDEC_SIZE(_id)				((_id) & 0xff)
+
+#define MFR_SST						0xbf
+#define MFR_EON						0x1c
+#define MFR_ISSI					0x9d
+#define MFR_ATMEL					0x1f
+#define MFR_MICROM					0x20
+#define MFR_WINBOND					0xef
+#define MFR_MACRONIX				0xc2
+#define MFR_SPANSION				0x01
+#define MFR_GIGADEVICE				0xc8
+
+#define PAGE_SIZE					0x100
+#define PAGE_PROG_DEFAULT_US		400		/* typical page program time, when neither the table nor SFDP give one */
+
+#endif /* _SPI_FLASH_H_ */
@@ -1,167 +1,532 @@
-#include "stdafx.h"
-
-#include "spi_flash.h"
-
-const static spi_flash_id flash_ids[] = 
-{
-	{"Atmel AT25DF321A", 0x1f4701, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_INIT_SR | SF_BP0_3},
-	{"Atmel AT25DF641",  0x1f4800, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_INIT_SR | SF_BP0_3},
-
-	{"Atmel AT26DF081A", 0x1f4501, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_INIT_SR | SF_BP0_3},
-	{"Atmel AT26DF161A", 0x1f4601, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_INIT_SR | SF_BP0_3},
-	{"Atmel AT26DF321",  0x1f4700, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_INIT_SR | SF_BP0_3},
-
-	{"Atmel AT45DB081D", 0x1f2500, 0, SIZE_1MB, SF_64K_BLOCK | SF_INIT_SR},
-
-	{"EON EN25Q80A",  0x1c3014, 0, SIZE_1MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"EON EN25F80",   0x1c3114, 0, SIZE_1MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"EON EN25F16",   0x1c3115, 0, SIZE_2MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"EON EN25Q16",   0x1c3015, 0, SIZE_2MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"EON EN25QH16",  0x1c7015, 0, SIZE_2MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"EON EN25F32",   0x1c3116, 0, SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"EON EN25P32",   0x1c2016, 0, SIZE_4MB, SF_64K_BLOCK | SF_BP0_2},
-	{"EON EN25Q32",   0x1c3016, 0, SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"EON EN25QH32",  0x1c7016, 0, SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"EON EN25P64",   0x1c2017, 0, SIZE_8MB, SF_64K_BLOCK | SF_BP0_2},
-	{"EON EN25Q64",   0x1c3017, 0, SIZE_8MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"EON EN25QH64",  0x1c7017, 0, SIZE_8MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"EON EN25Q128",  0x1c3018, 0, SIZE_16MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"EON EN25QH128", 0x1c7018, 0, SIZE_16MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"EON EN25QH256", 0x1c7019, 0, SIZE_32MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-
-	{"ESMT F25L08QA", 0x8c4014, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"ESMT F25L16PA", 0x8c2115, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"ESMT F25L32PA", 0x8c2016, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"ESMT F25L32QA", 0x8c4116, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"ESMT F25L64QA", 0x8c4117, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"ESMT F25L128QA", 0x8c4118, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-
-	{"GigaDevice GD25Q80B", 0xc84014, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_4},
-	{"GigaDevice GD25Q16B", 0xc84015, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_4},
-	{"GigaDevice GD25Q32",  0xc84016, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_4},
-	{"GigaDevice GD25Q64",  0xc84017, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_4},
-	{"GigaDevice GD25Q128", 0xc84018, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_4},
-	{"GigaDevice GD25Q256", 0xc84019, 0, SIZE_32MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"GigaDevice GD25Q512", 0xc84020, 0, SIZE_64MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-
-	{"Intel 25F160S33B", 0x898911, 0, SIZE_2MB, SF_64K_BLOCK | SF_BP0_2},
-	{"Intel 25F320S33B", 0x898912, 0, SIZE_4MB, SF_64K_BLOCK | SF_BP0_2},
-	{"Intel 25F640S33B", 0x898913, 0, SIZE_8MB, SF_64K_BLOCK | SF_BP0_2},
-
-	{"Intel 25F160S33T", 0x898915, 0, SIZE_2MB, SF_64K_BLOCK | SF_BP0_2},
-	{"Intel 25F320S33T", 0x898916, 0, SIZE_4MB, SF_64K_BLOCK | SF_BP0_2},
-	{"Intel 25F640S33T", 0x898917, 0, SIZE_8MB, SF_64K_BLOCK | SF_BP0_2},
-
-	{"ISSI IS25LP080", 0x9d6014, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"ISSI IS25LP016", 0x9d6015, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"ISSI IS25LP032", 0x9d6016, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"ISSI IS25LP064", 0x9d6017, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"ISSI IS25LP128", 0x9d6018, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"ISSI IS25LP256", 0x9d6019, 0, SIZE_32MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-
-	{"Macronix MX25L8005",   0xc22014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Macronix MX25L1605D",  0xc22015, 0, SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Macronix MX25L3235E",  0xc22016, 0, SIZE_4MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Macronix MX25L3255E",  0xc29e16, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Macronix MX25L6435E",  0xc22017, 0, SIZE_8MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Macronix MX25L6455E",  0xc22617, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Macronix MX25L12835E", 0xc22018, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Macronix MX25L12855E", 0xc22618, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Macronix MX25L25635E", 0xc22019, 0, SIZE_32MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Macronix MX25L25655E", 0xc22619, 0, SIZE_32MB,  SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Macronix MX66L51235F", 0xc2201a, 0, SIZE_64MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Macronix MX66L1G54G",  0xc2201b, 0, SIZE_128MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-
-	{"Micron M25P80",     0x202014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_BP0_2},
-	{"Micron M25PE80",    0x208014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Micron M25PX80",    0x207114, 0, SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Micron M45PE80",    0x204014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR},
-	{"Micron M25P16",     0x202015, 0, SIZE_2MB,  SF_64K_BLOCK | SF_BP0_2},
-	{"Micron M25PE16",    0x208015, 0, SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Micron M25PX16",    0x207115, 0, SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Micron M45PE16",    0x204015, 0, SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR},
-	{"Micron M25P32",     0x202016, 0, SIZE_4MB,  SF_64K_BLOCK | SF_BP0_2},
-	{"Micron M25PX32",    0x207116, 0, SIZE_4MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Micron M25PX32-S0", 0x207316, 0, SIZE_4MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Micron M25PX32-S1", 0x206316, 0, SIZE_4MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Micron N25Q032A",   0x20ba16, 0, SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Micron M25P64",     0x202017, 0, SIZE_8MB,  SF_64K_BLOCK | SF_BP0_2},
-	{"Micron M25PX64",    0x207117, 0, SIZE_8MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Micron N25Q064A",   0x20ba17, 0, SIZE_8MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
-	{"Micron M25P128",    0x202018, 0, SIZE_16MB,  SF_256K_BLOCK | SF_BP0_2},
-	{"Micron N25Q128A13", 0x20ba18, 0, SIZE_16MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
-	{"Micron N25Q128A11", 0x20bb18, 0, SIZE_16MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
-	{"Micron N25Q256A",   0x20ba19, 0, SIZE_32MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
-	{"Micron N25Q512A",   0x20ba20, 0, SIZE_64MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
-	{"Micron N25Q00AA",   0x20ba21, 0, SIZE_128MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
-	{"Micron MT25QL02GC", 0x20ba21, 0, SIZE_256MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
-
-	{"PMC PM25LQ080", 0x7f9d44, 0, SIZE_1MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_4K_PMC | SF_BP0_3},
-	{"PMC PM25LQ016", 0x7f9d45, 0, SIZE_2MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_4K_PMC | SF_BP0_3},
-	{"PMC PM25LQ032", 0x7f9d46, 0, SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-
-	{"Spansion S25FL008A",  0x010213, 0,      SIZE_1MB,  SF_64K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL208K",  0x014014, 0,      SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Spansion S25FL016A",  0x010214, 0,      SIZE_2MB,  SF_64K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL216K",  0x014015, 0,      SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-	{"Spansion S25FL032P",  0x010215, 0x4d00, SIZE_4MB, SF_64K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL032A",  0x010215, 0,      SIZE_4MB,  SF_64K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL132K",  0x014016, 0,      SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Spansion S25FL064P",  0x010216, 0x4d00, SIZE_8MB, SF_64K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL064A",  0x010216, 0,      SIZE_8MB,  SF_64K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL164K",  0x014017, 0,      SIZE_8MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Spansion S25FL128P0", 0x012018, 0x0300, SIZE_16MB, SF_256K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL128P1", 0x012018, 0x0301, SIZE_16MB, SF_64K_BLOCK | SF_BP0_3},
-	{"Spansion S25FL128S0", 0x012018, 0x4d00, SIZE_16MB, SF_256K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL128S1", 0x012018, 0x4d01, SIZE_16MB, SF_64K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL256S0", 0x010219, 0x4d00, SIZE_32MB, SF_256K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL256S1", 0x010219, 0x4d01, SIZE_32MB, SF_64K_BLOCK | SF_BP0_2},
-	{"Spansion S25FL512S",  0x010220, 0x4d00, SIZE_64MB, SF_256K_BLOCK | SF_BP0_2},
-	{"Spansion S70FL01GS",  0x010221, 0x4d00, SIZE_128MB, SF_256K_BLOCK},
-
-	{"SST SST25VF080B", 0xbf258e, 0, SIZE_1MB,  SF_4K_SECTOR | SF_SST | SF_INIT_SR},
-	{"SST SST25VF016B", 0xbf2541, 0, SIZE_2MB,  SF_4K_SECTOR | SF_SST | SF_INIT_SR},
-	{"SST SST26VF016",  0xbf2601, 0, SIZE_2MB,  SF_4K_SECTOR | SF_SST | SF_INIT_SR},
-	{"SST SST26VF016B", 0xbf2641, 0, SIZE_2MB, SF_4K_SECTOR | SF_SST | SF_INIT_SR},
-	{"SST SST25VF032B", 0xbf254a, 0, SIZE_4MB,  SF_4K_SECTOR | SF_SST | SF_INIT_SR},
-	{"SST SST26VF032",  0xbf2602, 0, SIZE_4MB,  SF_4K_SECTOR | SF_SST | SF_INIT_SR},
-	{"SST SST26VF032B", 0xbf2642, 0, SIZE_4MB, SF_4K_SECTOR | SF_SST | SF_INIT_SR},
-	{"SST SST25VF064C", 0xbf254b, 0, SIZE_8MB,  SF_4K_SECTOR | SF_INIT_SR},
-	{"SST SST26VF064B", 0xbf2643, 0, SIZE_8MB, SF_4K_SECTOR | SF_INIT_SR},
-
-	{"Winbond W25X80",  0xef3014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q80",  0xef5014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q80",  0xef4014, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25X16",  0xef3015, 0, SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q16",  0xef4015, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25X32",  0xef3016, 0, SIZE_4MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q32",  0xef4016, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25X64",  0xef3017, 0, SIZE_8MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q64",  0xef4017, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q128", 0xef4018, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q256", 0xef4019, 0, SIZE_32MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
-
-	{"Winbond W25Q80*W",  0xef6014, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q16*W",  0xef6015, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q32FW",  0xef6016, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q64FW",  0xef6017, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-	{"Winbond W25Q128FW", 0xef6018, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
-};
-
-const spi_flash_id *spi_flash_id_lookup(unsigned int jedec_id, unsigned int ext_id)
-{
-	int i;
-
-	for (i = 0; i < sizeof (flash_ids) / sizeof (spi_flash_id) - 1; i++)
-	{
-		if (flash_ids[i].jedec_id == jedec_id)
-		{
-			if (flash_ids[i].ext_id != 0 && flash_ids[i].ext_id != ext_id)
-				continue;
-
-			return &flash_ids[i];
-		}
-	}
-
-	return NULL;
-}
+#include "stdafx.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <mutex>
+
+#include "spi_flash.h"
+
+const static spi_flash_id flash_ids[] = 
+{
+	{"Atmel AT25DF321A", 0x1f4701, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_INIT_SR | SF_BP0_3},
+	{"Atmel AT25DF641",  0x1f4800, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_INIT_SR | SF_BP0_3},
+
+	{"Atmel AT26DF081A", 0x1f4501, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_INIT_SR | SF_BP0_3},
+	{"Atmel AT26DF161A", 0x1f4601, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_INIT_SR | SF_BP0_3},
+	{"Atmel AT26DF321",  0x1f4700, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_INIT_SR | SF_BP0_3},
+
+	{"Atmel AT45DB081D", 0x1f2500, 0, SIZE_1MB, SF_64K_BLOCK | SF_INIT_SR},
+
+	{"EON EN25Q80A",  0x1c3014, 0, SIZE_1MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"EON EN25F80",   0x1c3114, 0, SIZE_1MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"EON EN25F16",   0x1c3115, 0, SIZE_2MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"EON EN25Q16",   0x1c3015, 0, SIZE_2MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"EON EN25QH16",  0x1c7015, 0, SIZE_2MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"EON EN25F32",   0x1c3116, 0, SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"EON EN25P32",   0x1c2016, 0, SIZE_4MB, SF_64K_BLOCK | SF_BP0_2},
+	{"EON EN25Q32",   0x1c3016, 0, SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"EON EN25QH32",  0x1c7016, 0, SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"EON EN25P64",   0x1c2017, 0, SIZE_8MB, SF_64K_BLOCK | SF_BP0_2},
+	{"EON EN25Q64",   0x1c3017, 0, SIZE_8MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"EON EN25QH64",  0x1c7017, 0, SIZE_8MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"EON EN25Q128",  0x1c3018, 0, SIZE_16MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"EON EN25QH128", 0x1c7018, 0, SIZE_16MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"EON EN25QH256", 0x1c7019, 0, SIZE_32MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+
+	{"ESMT F25L08QA", 0x8c4014, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"ESMT F25L16PA", 0x8c2115, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"ESMT F25L32PA", 0x8c2016, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"ESMT F25L32QA", 0x8c4116, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"ESMT F25L64QA", 0x8c4117, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"ESMT F25L128QA", 0x8c4118, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+
+	{"GigaDevice GD25Q80B", 0xc84014, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_4},
+	{"GigaDevice GD25Q16B", 0xc84015, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_4},
+	{"GigaDevice GD25Q32",  0xc84016, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_4},
+	{"GigaDevice GD25Q64",  0xc84017, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_4},
+	{"GigaDevice GD25Q128", 0xc84018, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_4},
+	{"GigaDevice GD25Q256", 0xc84019, 0, SIZE_32MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"GigaDevice GD25Q512", 0xc84020, 0, SIZE_64MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+
+	{"Intel 25F160S33B", 0x898911, 0, SIZE_2MB, SF_64K_BLOCK | SF_BP0_2},
+	{"Intel 25F320S33B", 0x898912, 0, SIZE_4MB, SF_64K_BLOCK | SF_BP0_2},
+	{"Intel 25F640S33B", 0x898913, 0, SIZE_8MB, SF_64K_BLOCK | SF_BP0_2},
+
+	{"Intel 25F160S33T", 0x898915, 0, SIZE_2MB, SF_64K_BLOCK | SF_BP0_2},
+	{"Intel 25F320S33T", 0x898916, 0, SIZE_4MB, SF_64K_BLOCK | SF_BP0_2},
+	{"Intel 25F640S33T", 0x898917, 0, SIZE_8MB, SF_64K_BLOCK | SF_BP0_2},
+
+	{"ISSI IS25LP080", 0x9d6014, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"ISSI IS25LP016", 0x9d6015, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"ISSI IS25LP032", 0x9d6016, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"ISSI IS25LP064", 0x9d6017, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"ISSI IS25LP128", 0x9d6018, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"ISSI IS25LP256", 0x9d6019, 0, SIZE_32MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+
+	{"Macronix MX25L8005",   0xc22014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Macronix MX25L1605D",  0xc22015, 0, SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Macronix MX25L3235E",  0xc22016, 0, SIZE_4MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Macronix MX25L3255E",  0xc29e16, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Macronix MX25L6435E",  0xc22017, 0, SIZE_8MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Macronix MX25L6455E",  0xc22617, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Macronix MX25L12835E", 0xc22018, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Macronix MX25L12855E", 0xc22618, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Macronix MX25L25635E", 0xc22019, 0, SIZE_32MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Macronix MX25L25655E", 0xc22619, 0, SIZE_32MB,  SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Macronix MX66L51235F", 0xc2201a, 0, SIZE_64MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Macronix MX66L1G54G",  0xc2201b, 0, SIZE_128MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+
+	{"Micron M25P80",     0x202014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_BP0_2},
+	{"Micron M25PE80",    0x208014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Micron M25PX80",    0x207114, 0, SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Micron M45PE80",    0x204014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR},
+	{"Micron M25P16",     0x202015, 0, SIZE_2MB,  SF_64K_BLOCK | SF_BP0_2},
+	{"Micron M25PE16",    0x208015, 0, SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Micron M25PX16",    0x207115, 0, SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Micron M45PE16",    0x204015, 0, SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR},
+	{"Micron M25P32",     0x202016, 0, SIZE_4MB,  SF_64K_BLOCK | SF_BP0_2},
+	{"Micron M25PX32",    0x207116, 0, SIZE_4MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Micron M25PX32-S0", 0x207316, 0, SIZE_4MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Micron M25PX32-S1", 0x206316, 0, SIZE_4MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Micron N25Q032A",   0x20ba16, 0, SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Micron M25P64",     0x202017, 0, SIZE_8MB,  SF_64K_BLOCK | SF_BP0_2},
+	{"Micron M25PX64",    0x207117, 0, SIZE_8MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Micron N25Q064A",   0x20ba17, 0, SIZE_8MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
+	{"Micron M25P128",    0x202018, 0, SIZE_16MB,  SF_256K_BLOCK | SF_BP0_2},
+	{"Micron N25Q128A13", 0x20ba18, 0, SIZE_16MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
+	{"Micron N25Q128A11", 0x20bb18, 0, SIZE_16MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
+	{"Micron N25Q256A",   0x20ba19, 0, SIZE_32MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
+	{"Micron N25Q512A",   0x20ba20, 0, SIZE_64MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
+	{"Micron N25Q00AA",   0x20ba21, 0, SIZE_128MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
+	{"Micron MT25QL02GC", 0x20ba21, 0, SIZE_256MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2 | SF_BP4},
+
+	{"PMC PM25LQ080", 0x7f9d44, 0, SIZE_1MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_4K_PMC | SF_BP0_3},
+	{"PMC PM25LQ016", 0x7f9d45, 0, SIZE_2MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_4K_PMC | SF_BP0_3},
+	{"PMC PM25LQ032", 0x7f9d46, 0, SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+
+	{"Spansion S25FL008A",  0x010213, 0,      SIZE_1MB,  SF_64K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL208K",  0x014014, 0,      SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Spansion S25FL016A",  0x010214, 0,      SIZE_2MB,  SF_64K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL216K",  0x014015, 0,      SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+	{"Spansion S25FL032P",  0x010215, 0x4d00, SIZE_4MB, SF_64K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL032A",  0x010215, 0,      SIZE_4MB,  SF_64K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL132K",  0x014016, 0,      SIZE_4MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Spansion S25FL064P",  0x010216, 0x4d00, SIZE_8MB, SF_64K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL064A",  0x010216, 0,      SIZE_8MB,  SF_64K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL164K",  0x014017, 0,      SIZE_8MB, SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Spansion S25FL128P0", 0x012018, 0x0300, SIZE_16MB, SF_256K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL128P1", 0x012018, 0x0301, SIZE_16MB, SF_64K_BLOCK | SF_BP0_3},
+	{"Spansion S25FL128S0", 0x012018, 0x4d00, SIZE_16MB, SF_256K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL128S1", 0x012018, 0x4d01, SIZE_16MB, SF_64K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL256S0", 0x010219, 0x4d00, SIZE_32MB, SF_256K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL256S1", 0x010219, 0x4d01, SIZE_32MB, SF_64K_BLOCK | SF_BP0_2},
+	{"Spansion S25FL512S",  0x010220, 0x4d00, SIZE_64MB, SF_256K_BLOCK | SF_BP0_2},
+	{"Spansion S70FL01GS",  0x010221, 0x4d00, SIZE_128MB, SF_256K_BLOCK},
+
+	{"SST SST25VF080B", 0xbf258e, 0, SIZE_1MB,  SF_4K_SECTOR | SF_SST | SF_INIT_SR},
+	{"SST SST25VF016B", 0xbf2541, 0, SIZE_2MB,  SF_4K_SECTOR | SF_SST | SF_INIT_SR},
+	{"SST SST26VF016",  0xbf2601, 0, SIZE_2MB,  SF_4K_SECTOR | SF_SST | SF_INIT_SR},
+	{"SST SST26VF016B", 0xbf2641, 0, SIZE_2MB, SF_4K_SECTOR | SF_SST | SF_INIT_SR},
+	{"SST SST25VF032B", 0xbf254a, 0, SIZE_4MB,  SF_4K_SECTOR | SF_SST | SF_INIT_SR},
+	{"SST SST26VF032",  0xbf2602, 0, SIZE_4MB,  SF_4K_SECTOR | SF_SST | SF_INIT_SR},
+	{"SST SST26VF032B", 0xbf2642, 0, SIZE_4MB, SF_4K_SECTOR | SF_SST | SF_INIT_SR},
+	{"SST SST25VF064C", 0xbf254b, 0, SIZE_8MB,  SF_4K_SECTOR | SF_INIT_SR},
+	{"SST SST26VF064B", 0xbf2643, 0, SIZE_8MB, SF_4K_SECTOR | SF_INIT_SR},
+
+	{"Winbond W25X80",  0xef3014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q80",  0xef5014, 0, SIZE_1MB,  SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q80",  0xef4014, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25X16",  0xef3015, 0, SIZE_2MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q16",  0xef4015, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25X32",  0xef3016, 0, SIZE_4MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q32",  0xef4016, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25X64",  0xef3017, 0, SIZE_8MB,  SF_64K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q64",  0xef4017, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q128", 0xef4018, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q256", 0xef4019, 0, SIZE_32MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_3},
+
+	{"Winbond W25Q80*W",  0xef6014, 0, SIZE_1MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q16*W",  0xef6015, 0, SIZE_2MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q32FW",  0xef6016, 0, SIZE_4MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q64FW",  0xef6017, 0, SIZE_8MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+	{"Winbond W25Q128FW", 0xef6018, 0, SIZE_16MB, SF_64K_BLOCK | SF_32K_BLOCK | SF_4K_SECTOR | SF_BP0_2},
+};
+
+/*
+ * Chips are found through an open-addressing hash index keyed on (JEDEC ID, ext ID),
+ * built on first use from flash_ids[] plus any entries loaded from a database file.
+ * Entries with ext_id 0 match any extended ID.
+ */
+#define DB_LINE_LENGTH		512
+
+static const spi_flash_id **flash_index;
+static unsigned int flash_index_mask;
+
+static spi_flash_id *db_ids;
+static unsigned int db_count, db_capacity;
+static unsigned int db_hash;
+
+static inline unsigned int spi_flash_id_hash(unsigned int jedec_id, unsigned int ext_id)
+{
+	unsigned int h = jedec_id * 0x9e3779b1 ^ ext_id * 0x85ebca6b;
+
+	return h ^ (h >> 15);
+}
+
+static void spi_flash_index_insert(const spi_flash_id *id, bool replace)
+{
+	unsigned int i = spi_flash_id_hash(id->jedec_id, id->ext_id) & flash_index_mask;
+
+	while (flash_index[i])
+	{
+		if (flash_index[i]->jedec_id == id->jedec_id && flash_index[i]->ext_id == id->ext_id)
+		{
+			/* Built-in entries keep table order, database entries override */
+			if (replace)
+				flash_index[i] = id;
+			return;
+		}
+
+		i = (i + 1) & flash_index_mask;
+	}
+
+	flash_index[i] = id;
+}
+
+static void spi_flash_index_build(void)
+{
+	unsigned int i, count, size;
+
+	count = sizeof (flash_ids) / sizeof (flash_ids[0]) + db_count;
+
+	for (size = 64; size < count * 2; size <<= 1)
+		;
+
+	delete[] flash_index;
+	flash_index = new const spi_flash_id *[size];
+	flash_index_mask = size - 1;
+
+	for (i = 0; i < size; i++)
+		flash_index[i] = NULL;
+
+	for (i = 0; i < sizeof (flash_ids) / sizeof (flash_ids[0]); i++)
+		spi_flash_index_insert(&flash_ids[i], false);
+
+	for (i = 0; i < db_count; i++)
+		spi_flash_index_insert(&db_ids[i], true);
+}
+
+static const spi_flash_id *spi_flash_index_find(unsigned int jedec_id, unsigned int ext_id)
+{
+	unsigned int i = spi_flash_id_hash(jedec_id, ext_id) & flash_index_mask;
+
+	while (flash_index[i])
+	{
+		if (flash_index[i]->jedec_id == jedec_id && flash_index[i]->ext_id == ext_id)
+			return flash_index[i];
+
+		i = (i + 1) & flash_index_mask;
+	}
+
+	return NULL;
+}
+
+/* Sessions may probe from several threads at once, and a database load rebuilds the index */
+static std::mutex flash_index_lock;
+
+const spi_flash_id *spi_flash_id_lookup(unsigned int jedec_id, unsigned int ext_id)
+{
+	const spi_flash_id *id = NULL;
+
+	flash_index_lock.lock();
+
+	if (!flash_index)
+		spi_flash_index_build();
+
+	if (ext_id)
+		id = spi_flash_index_find(jedec_id, ext_id);
+
+	if (!id)
+		id = spi_flash_index_find(jedec_id, 0);
+
+	flash_index_lock.unlock();
+
+	return id;
+}
+
+static const struct
+{
+	const char *name;
+	unsigned int flags;
+} flag_names[] =
+{
+	{"64K", SF_64K_BLOCK},
+	{"32K", SF_32K_BLOCK},
+	{"256K", SF_256K_BLOCK},
+	{"4K", SF_4K_SECTOR},
+	{"4K_PMC", SF_4K_PMC},
+	{"SST", SF_SST},
+	{"INIT_SR", SF_INIT_SR},
+	{"BP0_2", SF_BP0_2},
+	{"BP3", SF_BP3},
+	{"BP4", SF_BP4},
+	{"BP0_3", SF_BP0_3},
+	{"BP0_4", SF_BP0_4},
+	{"4B", SF_4B_OPCODES},
+	{"SFDP", SF_SFDP},
+	{"NO_SFDP", SF_NO_SFDP},
+};
+
+static bool spi_flash_db_parse_number(const char *str, unsigned int *val)
+{
+	char *end;
+
+	*val = strtoul(str, &end, 0);
+
+	if (end == str)
+		return false;
+
+	if (*end == 'K' || *end == 'k')
+	{
+		*val <<= 10;
+		end++;
+	}
+	else if (*end == 'M' || *end == 'm')
+	{
+		*val <<= 20;
+		end++;
+	}
+
+	return *end == 0;
+}
+
+static bool spi_flash_db_parse_flags(char *str, unsigned int *flags)
+{
+	unsigned int i, val;
+	char *tok;
+
+	*flags = 0;
+
+	for (tok = strtok(str, ",|"); tok; tok = strtok(NULL, ",|"))
+	{
+		for (i = 0; i < sizeof (flag_names) / sizeof (flag_names[0]); i++)
+		{
+			if (!strcmp(tok, flag_names[i].name))
+				break;
+		}
+
+		if (i < sizeof (flag_names) / sizeof (flag_names[0]))
+			*flags |= flag_names[i].flags;
+		else if (spi_flash_db_parse_number(tok, &val))
+			*flags |= val;
+		else
+			return false;
+	}
+
+	return true;
+}
+
+/* key=value fields after the flags column */
+static bool spi_flash_db_parse_field(char *str, spi_flash_id *id)
+{
+	static const struct
+	{
+		const char *name;
+		size_t offset;
+	} fields[] =
+	{
+		{"page", offsetof(spi_flash_id, page_size)},
+		{"pp", offsetof(spi_flash_id, page_prog_us)},
+		{"se", offsetof(spi_flash_id, erase_4k_ms)},
+		{"be32", offsetof(spi_flash_id, erase_32k_ms)},
+		{"be64", offsetof(spi_flash_id, erase_64k_ms)},
+		{"ce", offsetof(spi_flash_id, chip_erase_ms)},
+	};
+	unsigned int i;
+	char *val;
+
+	val = strchr(str, '=');
+	if (!val)
+		return false;
+
+	*val++ = 0;
+
+	for (i = 0; i < sizeof (fields) / sizeof (fields[0]); i++)
+	{
+		if (!strcmp(str, fields[i].name))
+			return spi_flash_db_parse_number(val, (unsigned int *) ((char *) id + fields[i].offset));
+	}
+
+	return false;
+}
+
+static char *spi_flash_db_next_token(char **line)
+{
+	char *p = *line, *tok;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+
+	if (!*p)
+		return NULL;
+
+	if (*p == '"')
+	{
+		tok = ++p;
+		while (*p && *p != '"')
+			p++;
+	}
+	else
+	{
+		tok = p;
+		while (*p && *p != ' ' && *p != '\t')
+			p++;
+	}
+
+	if (*p)
+		*p++ = 0;
+
+	*line = p;
+
+	return tok;
+}
+
+static bool spi_flash_db_parse_line(char *line, spi_flash_id *id)
+{
+	char *tok[5], *field, *model;
+	unsigned int i;
+
+	memset(id, 0, sizeof (*id));
+
+	for (i = 0; i < 5; i++)
+	{
+		tok[i] = spi_flash_db_next_token(&line);
+		if (!tok[i])
+			return false;
+	}
+
+	if (!spi_flash_db_parse_number(tok[1], &id->jedec_id) ||
+		!spi_flash_db_parse_number(tok[2], &id->ext_id) ||
+		!spi_flash_db_parse_number(tok[3], &id->size) ||
+		!spi_flash_db_parse_flags(tok[4], &id->flags))
+		return false;
+
+	while ((field = spi_flash_db_next_token(&line)))
+	{
+		if (!spi_flash_db_parse_field(field, id))
+			return false;
+	}
+
+	model = new char[strlen(tok[0]) + 1];
+	strcpy(model, tok[0]);
+	id->model = model;
+
+	return true;
+}
+
+/* FNV-1a over what an entry says, a reformatted or commented file hashes the same */
+static unsigned int spi_flash_db_hash_add(unsigned int hash, const spi_flash_id *id)
+{
+	const unsigned int fields[] = { id->jedec_id, id->ext_id, id->size, id->flags, id->page_size, id->page_prog_us,
+		id->erase_4k_ms, id->erase_32k_ms, id->erase_64k_ms, id->chip_erase_ms };
+	const unsigned char *p;
+	unsigned int i;
+
+	if (!hash)
+		hash = 2166136261u;
+
+	for (p = (const unsigned char *) id->model; *p; p++)
+		hash = (hash ^ *p) * 16777619u;
+
+	for (i = 0; i < sizeof (fields) / sizeof (fields[0]); i++)
+		hash = (hash ^ fields[i]) * 16777619u;
+
+	return hash ? hash : 1;
+}
+
+unsigned int spi_flash_db_hash(void)
+{
+	std::lock_guard<std::mutex> lk(flash_index_lock);
+
+	return db_hash;
+}
+
+/*
+ * Database file format, one chip per line, '#' starts a comment:
+ *   "<model>" <jedec_id> <ext_id> <size> <flags> [page=N] [pp=us] [se=ms] [be32=ms] [be64=ms] [ce=ms]
+ * flags are names such as 64K,32K,4K,BP0_3,4B,SFDP joined by ',' or '|'. SFDP has the
+ * tables read even where they are skipped by default (SST parts), NO_SFDP never.
+ * Returns the number of entries loaded, or -1 on error.
+ */
+int spi_flash_db_load(const char *filename)
+{
+	char line[DB_LINE_LENGTH], *p;
+	unsigned int lineno = 0, loaded = 0;
+	spi_flash_id id, *grown;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f)
+	{
+		Message(MSG_ERROR, "Error: unable to open chip database %s! error %d\n", filename, errno);
+		return -1;
+	}
+
+	/* Lookups would follow index entries into db_ids while it is reallocated */
+	flash_index_lock.lock();
+
+	while (fgets(line, sizeof (line), f))
+	{
+		lineno++;
+
+		if ((p = strchr(line, '#')))
+			*p = 0;
+
+		p = line + strlen(line);
+		while (p > line && (p[-1] == '\n' || p[-1] == '\r' || p[-1] == ' ' || p[-1] == '\t'))
+			*--p = 0;
+
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+
+		if (!*p)
+			continue;
+
+		if (!spi_flash_db_parse_line(p, &id))
+		{
+			Message(MSG_ERROR, "Error: %s:%u: invalid chip definition.\n", filename, lineno);
+			if (flash_index)
+				spi_flash_index_build();
+			flash_index_lock.unlock();
+			fclose(f);
+			return -1;
+		}
+
+		if (db_count == db_capacity)
+		{
+			db_capacity = db_capacity ? db_capacity * 2 : 64;
+			grown = new spi_flash_id[db_capacity];
+			if (db_count)
+				memcpy(grown, db_ids, db_count * sizeof (spi_flash_id));
+			delete[] db_ids;
+			db_ids = grown;
+		}
+
+		db_ids[db_count++] = id;
+		db_hash = spi_flash_db_hash_add(db_hash, &id);
+		loaded++;
+	}
+
+	fclose(f);
+
+	/* Entries moved when the array grew, rebuild the index from scratch */
+	if (flash_index)
+		spi_flash_index_build();
+
+	flash_index_lock.unlock();
+
+	return loaded;
+}
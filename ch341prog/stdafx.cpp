@@ -1,8 +1,8 @@
-// stdafx.cpp : ֻ׼ļԴļ
-// ch341prog.pch ΪԤͷ
-// stdafx.obj ԤϢ
-
-#include "stdafx.h"
-
-// TODO:  STDAFX.H κĸͷļ
-//ڴļ
+// stdafx.cpp : 只包括标准包含文件的源文件
+// ch341prog.pch 将作为预编译头
+// stdafx.obj 将包含预编译类型信息
+
+#include "stdafx.h"
+
+// TODO: 在 STDAFX.H 中引用任何所需的附加头文件，
+//而不是在此文件中引用
@@ -1,26 +1,40 @@
-// stdafx.h : ׼ϵͳļİļ
-// Ǿʹõĵ
-// ضĿİļ
-//
-
-#pragma once
-
-#if defined(_MSC_VER)
-#define _CRT_SECURE_NO_WARNINGS
-#include "targetver.h"
-#include <tchar.h>
-#endif
-
-#include <stdio.h>
-#include <stdbool.h>
-
-
-
-// TODO:  ڴ˴óҪͷļ
-
-
-extern const unsigned char BitSwapTable[256];
-
-void ProgressInit(void);
-void ProgressShow(int percentage);
-void ProgressDone(void);
+// stdafx.h : 标准系统包含文件的包含文件，
+// 或是经常使用但不常更改的
+// 特定于项目的包含文件
+//
+
+#pragma once
+
+#if defined(_MSC_VER)
+#define _CRT_SECURE_NO_WARNINGS
+#include "targetver.h"
+#include <tchar.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+
+
+
+// TODO:  在此处引用程序需要的其他头文件
+
+
+extern const unsigned char BitSwapTable[256];
+
+void ProgressInit(void);
+void ProgressShow(int percentage);
+void ProgressDone(void);
+
+void SleepMs(unsigned int ms);
+
+#define MSG_ERROR		0
+#define MSG_WARNING		1
+#define MSG_INFO		2
+
+/* Errors and warnings go to stderr, info to stdout, unless a handler takes them */
+typedef void (*MessageHandler)(int level, const char *msg, void *arg);
+
+void MessageSetHandler(MessageHandler handler, void *arg);
+void Message(int level, const char *fmt, ...);
+
+unsigned char *LoadImageFile(const char *filename, unsigned int *size);
@@ -1,13 +1,13 @@
-#pragma once
-
-//  SDKDDKVer.h õ߰汾 Windows ƽ̨
-
-// ҪΪǰ Windows ƽ̨Ӧó WinSDKVer.h
-//  _WIN32_WINNT ΪҪֵ֧ƽ̨Ȼٰ SDKDDKVer.h
-
-#include <WinSDKVer.h>
-
-#define _WIN32_WINNT 0x0501
-#define WIN32_WINNT _WIN32_WINNT
-
-#include <SDKDDKVer.h>
+#pragma once
+
+// 包括 SDKDDKVer.h 将定义可用的最高版本的 Windows 平台。
+
+// 如果要为以前的 Windows 平台生成应用程序，请包括 WinSDKVer.h，并将
+// 将 _WIN32_WINNT 宏设置为要支持的平台，然后再包括 SDKDDKVer.h。
+
+#include <WinSDKVer.h>
+
+#define _WIN32_WINNT 0x0501
+#define WIN32_WINNT _WIN32_WINNT
+
+#include <SDKDDKVer.h>